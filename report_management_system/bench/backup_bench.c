@@ -0,0 +1,221 @@
+/**
+ * @file backup_bench.c
+ * @brief Compare raw and compressed backup copies
+ *
+ * Creates a directory of synthetic XML reports and backs it up once as a
+ * verified raw copy and once per zlib level as compressed copies, timing
+ * each pass and measuring the space the copies take.
+ *
+ * Usage: backup_bench [work_dir] [file_count] [workers]
+ */
+
+#include "report_system.h"
+
+#define DEFAULT_WORK_DIR   "/tmp/report_backup_bench"
+#define DEFAULT_FILE_COUNT 20000
+
+/**
+ * Current monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Create the source reports: repetitive markup around varying figures,
+ * a few KiB each, like the departments' daily uploads
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int create_reports(int dirfd, char (*names)[NAME_MAX + 1], int count) {
+    static const char *departments[] = { "Warehouse", "Manufacturing", "Sales", "Distribution" };
+    char body[16384];
+    unsigned int seed = 12345;
+
+    for (int i = 0; i < count; i++) {
+        const char *department = departments[i % 4];
+        int rows = 20 + (i % 60);
+        int length;
+        int fd;
+
+        length = snprintf(body, sizeof(body),
+                          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                          "<report department=\"%s\" date=\"2025-03-08\" id=\"%d\">\n"
+                          "  <items>\n", department, i);
+        for (int row = 0; row < rows && length < (int)sizeof(body) - 256; row++) {
+            seed = seed * 1103515245 + 12345;
+            length += snprintf(body + length, sizeof(body) - length,
+                               "    <item sku=\"%s-%05u\" quantity=\"%u\" unit_price=\"%u.%02u\" "
+                               "status=\"%s\"/>\n", department, (seed >> 8) % 100000,
+                               (seed >> 4) % 500, (seed >> 12) % 1000, (seed >> 3) % 100,
+                               (seed & 1) ? "shipped" : "pending");
+        }
+        length += snprintf(body + length, sizeof(body) - length, "  </items>\n</report>\n");
+
+        fd = openat(dirfd, names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, body, length) != length) {
+            perror("create report");
+            if (fd != -1) {
+                close(fd);
+            }
+            return FAILURE;
+        }
+        close(fd);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Back up every report into dst_dirfd, raw (level 0) or compressed
+ * @return Elapsed seconds
+ */
+static double run_pass(FileOps* ops, int level, int workers, int src_dirfd, int dst_dirfd,
+                       char (*names)[NAME_MAX + 1], int count, int* failures) {
+    FileOp *batch = (FileOp*)malloc(FILEOPS_BATCH_SIZE * sizeof(FileOp));
+    double start;
+
+    syncfs(src_dirfd);
+    start = now_seconds();
+
+    *failures = 0;
+    for (int base = 0; base < count; base += FILEOPS_BATCH_SIZE) {
+        int n = (count - base < FILEOPS_BATCH_SIZE) ? count - base : FILEOPS_BATCH_SIZE;
+
+        for (int i = 0; i < n; i++) {
+            memset(&batch[i], 0, sizeof(FileOp));
+            batch[i].type = FILE_OP_COPY;
+            batch[i].flags = FILEOPS_COPY_VERIFY;
+            batch[i].src_dirfd = src_dirfd;
+            batch[i].src_name = names[base + i];
+            batch[i].dst_dirfd = dst_dirfd;
+            batch[i].dst_name = names[base + i];
+            batch[i].size = -1;
+        }
+
+        if (level == 0) {
+            *failures += fileops_submit(ops, batch, n);
+        } else {
+            *failures += compress_batch(batch, n, level, workers);
+        }
+    }
+
+    /* Include writeback, which is where the smaller output pays off */
+    syncfs(dst_dirfd);
+
+    free(batch);
+    return now_seconds() - start;
+}
+
+/**
+ * Sum the apparent and allocated size of a directory's files, then remove them
+ */
+static void measure_and_clear(int dirfd, uint64_t* bytes, uint64_t* allocated) {
+    DirEnumerator iter;
+    DirEntry entry;
+
+    *bytes = 0;
+    *allocated = 0;
+    for (;;) {
+        char (*batch)[NAME_MAX + 1] = malloc(FILEOPS_BATCH_SIZE * sizeof(*batch));
+        int n = 0;
+
+        dir_enum_open(&iter, dirfd);
+        while (n < FILEOPS_BATCH_SIZE && dir_enum_next(&iter, &entry)) {
+            snprintf(batch[n++], NAME_MAX + 1, "%s", entry.name);
+        }
+        dir_enum_close(&iter);
+
+        for (int i = 0; i < n; i++) {
+            struct stat st;
+            if (fstatat(dirfd, batch[i], &st, 0) == 0) {
+                *bytes += (uint64_t)st.st_size;
+                *allocated += (uint64_t)st.st_blocks * 512;
+            }
+            unlinkat(dirfd, batch[i], 0);
+        }
+        free(batch);
+        if (n == 0) {
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *work_dir = (argc > 1) ? argv[1] : DEFAULT_WORK_DIR;
+    int count = (argc > 2) ? atoi(argv[2]) : DEFAULT_FILE_COUNT;
+    int workers = (argc > 3) ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    static const int levels[] = { 0, 1, 6, 9 };
+    char (*names)[NAME_MAX + 1];
+    uint64_t raw_bytes = 0;
+    FileOps ops;
+    int root_fd, src_fd, dst_fd;
+
+    if (count <= 0 || workers <= 0) {
+        fprintf(stderr, "Usage: %s [work_dir] [file_count] [workers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    names = malloc((size_t)count * sizeof(*names));
+    if (names == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(names[i], sizeof(names[i]), "report_Bench%d_2025-03-08.xml", i);
+    }
+
+    mkdir(work_dir, 0755);
+    root_fd = open(work_dir, O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) {
+        perror(work_dir);
+        return EXIT_FAILURE;
+    }
+    mkdirat(root_fd, "src", 0755);
+    mkdirat(root_fd, "backup", 0755);
+    src_fd = openat(root_fd, "src", O_RDONLY | O_DIRECTORY);
+    dst_fd = openat(root_fd, "backup", O_RDONLY | O_DIRECTORY);
+    if (src_fd == -1 || dst_fd == -1 || create_reports(src_fd, names, count) != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    fileops_init(&ops, FILEOPS_DEFAULT_BACKEND);
+    printf("%d reports, %d compression workers, raw copies via %s\n",
+           count, workers, fileops_backend_name(&ops));
+    printf("%-8s %10s %12s %12s %12s %8s %9s\n", "format", "seconds", "files/s",
+           "stored MiB", "on disk MiB", "ratio", "failures");
+
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        char label[16];
+        uint64_t bytes, allocated;
+        double elapsed;
+        int failures;
+
+        elapsed = run_pass(&ops, levels[l], workers, src_fd, dst_fd, names, count, &failures);
+        measure_and_clear(dst_fd, &bytes, &allocated);
+        if (levels[l] == 0) {
+            raw_bytes = bytes;
+            snprintf(label, sizeof(label), "raw");
+        } else {
+            snprintf(label, sizeof(label), "zlib-%d", levels[l]);
+        }
+        printf("%-8s %10.3f %12.0f %12.2f %12.2f %8.1f %9d\n", label, elapsed, count / elapsed,
+               bytes / 1048576.0, allocated / 1048576.0,
+               bytes ? (double)raw_bytes / bytes : 0.0, failures);
+    }
+    fileops_destroy(&ops);
+
+    /* Remove the source reports */
+    for (int i = 0; i < count; i++) {
+        unlinkat(src_fd, names[i], 0);
+    }
+    close(src_fd);
+    close(dst_fd);
+    unlinkat(root_fd, "src", AT_REMOVEDIR);
+    unlinkat(root_fd, "backup", AT_REMOVEDIR);
+    close(root_fd);
+
+    free(names);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,628 @@
+/**
+ * @file daemon_bench.c
+ * @brief End-to-end benchmark of the daemon's work on synthetic uploads
+ *
+ * Builds a sandbox under REPORT_ROOT, which the Makefile points at a
+ * scratch directory by compiling a separate copy of the library for this
+ * program. The upload directory is filled with generated reports, and the
+ * daemon's own functions are run over them: monitor passes with churn
+ * between them, scans, transfers, missing report checks, backups and
+ * logging. Each phase prints one JSON line with its throughput, latency
+ * percentiles and memory use, so runs on two commits can be compared
+ * line by line. With the same options and seed the same files are made.
+ *
+ * Usage: daemon_bench [-d departments] [-f files] [-s bytes] [-S distribution]
+ *                     [-c churn] [-r rounds] [-n log_lines] [-x seed]
+ *                     [-l label] [-k]
+ */
+
+#include "report_system.h"
+#include <ftw.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_ROOT "/var/report_system"
+
+#define SIZE_FIXED         0
+#define SIZE_UNIFORM       1
+#define SIZE_LOGNORMAL     2
+
+/**
+ * @struct BenchConfig
+ * @brief Shape of the synthetic workload
+ */
+typedef struct {
+    int departments;            /* The first four are the real departments */
+    int files;                  /* Uploads per round */
+    int size;                   /* Mean report size in bytes */
+    int distribution;           /* SIZE_* */
+    double churn;               /* Fraction of uploads changed between monitor passes */
+    int rounds;                 /* Timed runs of each phase */
+    int log_lines;              /* Lines written by the logging phases */
+    uint64_t seed;
+    const char *label;          /* Copied into every result, e.g. the commit */
+    int keep;                   /* Leave the sandbox in place */
+} BenchConfig;
+
+/**
+ * @struct Samples
+ * @brief Latencies of one phase, in seconds
+ */
+typedef struct {
+    double *values;
+    int count;
+    int capacity;
+} Samples;
+
+/**
+ * @struct Uploads
+ * @brief Names of the reports currently in the upload directory
+ */
+typedef struct {
+    char (*names)[NAME_MAX + 1];
+    int count;
+    int capacity;
+} Uploads;
+
+static const char *const real_departments[] = {
+    DEPT_WAREHOUSE, DEPT_MANUFACTURING, DEPT_SALES, DEPT_DISTRIBUTION
+};
+
+static uint64_t random_state;
+static unsigned int name_sequence = 0;
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d N        Departments uploading reports (default 4)\n"
+            "  -f N        Reports uploaded per round (default 2000)\n"
+            "  -s BYTES    Mean report size (default 8192)\n"
+            "  -S DIST     Size distribution: fixed, uniform or lognormal (default)\n"
+            "  -c FRACTION Uploads created, changed, renamed or deleted between\n"
+            "              monitor passes (default 0.1)\n"
+            "  -r N        Timed runs of each phase (default 5)\n"
+            "  -n N        Lines written by the logging phases (default 100000)\n"
+            "  -x SEED     Seed of the generator (default 1)\n"
+            "  -l LABEL    Label copied into every result line\n"
+            "  -k          Keep the sandbox %s afterwards\n",
+            program, REPORT_ROOT);
+}
+
+/**
+ * Current monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/**
+ * Uniform random number in [0, 1)
+ */
+static double next_unit(void) {
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+/**
+ * Draw a report size from the configured distribution
+ */
+static int next_size(const BenchConfig* config) {
+    double size = config->size;
+
+    if (config->distribution == SIZE_UNIFORM) {
+        size = config->size * (0.5 + next_unit());
+    } else if (config->distribution == SIZE_LOGNORMAL) {
+        /* sigma 1, with mu chosen so the mean is config->size */
+        double u1 = next_unit() + 1e-12;
+        double u2 = next_unit();
+        double normal = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        size = exp(log((double)config->size) - 0.5 + normal);
+    }
+    if (size < 128) {
+        size = 128;
+    }
+    if (size > 16 * 1024 * 1024) {
+        size = 16 * 1024 * 1024;
+    }
+    return (int)size;
+}
+
+static void samples_add(Samples* samples, double value) {
+    if (samples->count == samples->capacity) {
+        int capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        double *grown = (double*)realloc(samples->values, capacity * sizeof(double));
+        if (grown == NULL) {
+            return;
+        }
+        samples->values = grown;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * Nearest-rank percentile; sorts the samples
+ */
+static double samples_percentile(Samples* samples, double quantile) {
+    int rank;
+
+    if (samples->count == 0) {
+        return 0.0;
+    }
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    rank = (int)ceil(quantile * samples->count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return samples->values[rank - 1];
+}
+
+/**
+ * Print one result line and reset the samples
+ * @param ops Items the phase processed (files, lines)
+ * @param bytes Bytes the phase processed
+ * @param elapsed Seconds spent in the timed calls
+ */
+static void report(const BenchConfig* config, const char* phase, Samples* samples,
+                   uint64_t ops, uint64_t bytes, double elapsed) {
+    struct rusage usage;
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"phase\":\"%s\",\"label\":\"", phase);
+    for (const char *c = config->label; *c != '\0'; c++) {
+        if (*c != '"' && *c != '\\' && (unsigned char)*c >= 0x20) {
+            putchar(*c);
+        }
+    }
+    printf("\",\"runs\":%d,\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+           "\"ops_per_s\":%.1f,\"bytes_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"rss_kb\":%ld,\"max_rss_kb\":%ld}\n",
+           samples->count, (unsigned long long)ops, (unsigned long long)bytes, elapsed,
+           elapsed > 0 ? ops / elapsed : 0.0, elapsed > 0 ? bytes / elapsed : 0.0,
+           samples_percentile(samples, 0.50) * 1e6, samples_percentile(samples, 0.99) * 1e6,
+           resident * (sysconf(_SC_PAGESIZE) / 1024), usage.ru_maxrss);
+    fflush(stdout);
+    samples->count = 0;
+}
+
+/**
+ * Write a report of the given size for a department
+ * @return Bytes written, or -1 on error
+ */
+static int write_report(int dirfd, const char* name, const char* department, int size) {
+    static char body[16 * 1024 * 1024 + 256];
+    int length;
+    int fd;
+
+    length = snprintf(body, sizeof(body),
+                      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<report department=\"%s\" date=\"2025-03-08\">\n  <items>\n", department);
+    while (length < size - 32) {
+        uint64_t r = next_random();
+        length += snprintf(body + length, sizeof(body) - length,
+                           "    <item sku=\"%s-%05u\" quantity=\"%u\" status=\"%s\"/>\n",
+                           department, (unsigned int)(r % 100000), (unsigned int)((r >> 20) % 500),
+                           (r & 1) ? "shipped" : "pending");
+    }
+    length += snprintf(body + length, sizeof(body) - length, "  </items>\n</report>\n");
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, body, length) != length) {
+        perror(name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return length;
+}
+
+/**
+ * Department of the i-th uploader
+ */
+static const char* department_name(int index, char* buffer, size_t size) {
+    if (index < 4) {
+        return real_departments[index];
+    }
+    snprintf(buffer, size, "Department%d", index + 1);
+    return buffer;
+}
+
+/**
+ * Make up a fresh report name for a department
+ */
+static void next_name(char* name, const char* department) {
+    name_sequence++;
+    snprintf(name, NAME_MAX + 1, REPORT_PREFIX "%.200s_2025-03-%02u_%07u" REPORT_EXTENSION,
+             department, 1 + name_sequence % 28, name_sequence);
+}
+
+static int uploads_add(Uploads* uploads, const char* name) {
+    if (uploads->count == uploads->capacity) {
+        int capacity = uploads->capacity ? uploads->capacity * 2 : 1024;
+        char (*grown)[NAME_MAX + 1] = realloc(uploads->names, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        uploads->names = grown;
+        uploads->capacity = capacity;
+    }
+    snprintf(uploads->names[uploads->count++], NAME_MAX + 1, "%s", name);
+    return SUCCESS;
+}
+
+/**
+ * Upload a round of reports, spread over the departments
+ * @return Bytes written, or 0 on error
+ */
+static uint64_t upload_round(const BenchConfig* config, Uploads* uploads, Samples* samples) {
+    int upload_fd = report_dir_fd(REPORT_DIR_UPLOAD);
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < config->files; i++) {
+        char buffer[MAX_USER_LENGTH];
+        char name[NAME_MAX + 1];
+        const char *department = department_name(i % config->departments, buffer, sizeof(buffer));
+        double start = now_seconds();
+        int written;
+
+        next_name(name, department);
+        written = write_report(upload_fd, name, department, next_size(config));
+        if (written < 0 || uploads_add(uploads, name) != SUCCESS) {
+            return 0;
+        }
+        if (samples != NULL) {
+            samples_add(samples, now_seconds() - start);
+        }
+        bytes += (uint64_t)written;
+    }
+    return bytes;
+}
+
+/**
+ * Change a fraction of the uploads as users would between two scans:
+ * new reports, rewritten reports, renames and deletions in equal parts
+ */
+static void churn_uploads(const BenchConfig* config, Uploads* uploads) {
+    int upload_fd = report_dir_fd(REPORT_DIR_UPLOAD);
+    int changes = (int)(config->churn * uploads->count + 0.5);
+
+    for (int i = 0; i < changes && uploads->count > 0; i++) {
+        int victim = (int)(next_random() % (uint64_t)uploads->count);
+        char buffer[MAX_USER_LENGTH];
+        char department[MAX_USER_LENGTH];
+        char name[NAME_MAX + 1];
+
+        if (extract_department_from_filename(uploads->names[victim], department,
+                                             sizeof(department)) == NULL) {
+            snprintf(department, sizeof(department), "%s",
+                     department_name(victim % config->departments, buffer, sizeof(buffer)));
+        }
+
+        switch (next_random() % 4) {
+            case 0:
+                next_name(name, department);
+                if (write_report(upload_fd, name, department, next_size(config)) >= 0) {
+                    uploads_add(uploads, name);
+                }
+                break;
+            case 1:
+                write_report(upload_fd, uploads->names[victim], department, next_size(config));
+                break;
+            case 2:
+                next_name(name, department);
+                if (renameat(upload_fd, uploads->names[victim], upload_fd, name) == 0) {
+                    snprintf(uploads->names[victim], NAME_MAX + 1, "%s", name);
+                }
+                break;
+            default:
+                unlinkat(upload_fd, uploads->names[victim], 0);
+                memcpy(uploads->names[victim], uploads->names[--uploads->count], NAME_MAX + 1);
+                break;
+        }
+    }
+}
+
+/**
+ * Count the files in a directory and their bytes
+ */
+static void directory_totals(int dirfd, uint64_t* files, uint64_t* bytes) {
+    DirEnumerator iter;
+    DirEntry entry;
+
+    *files = 0;
+    *bytes = 0;
+    if (dir_enum_open(&iter, dirfd) != SUCCESS) {
+        return;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        struct stat st;
+
+        if (fstatat(dirfd, entry.name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            (*files)++;
+            *bytes += (uint64_t)st.st_size;
+        }
+    }
+    dir_enum_close(&iter);
+}
+
+/**
+ * Backups are named by the second they start in, so wait for a new one
+ */
+static void wait_next_second(void) {
+    time_t start = time(NULL);
+
+    while (time(NULL) == start) {
+        usleep(10000);
+    }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void remove_sandbox(void) {
+    nftw(REPORT_ROOT, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+}
+
+static int create_sandbox(void) {
+    static const char *const paths[] = { REPORT_ROOT, UPLOAD_DIR, DASHBOARD_DIR, BACKUP_DIR, LOG_DIR };
+
+    remove_sandbox();
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (mkdir(paths[i], 0755) != 0) {
+            fprintf(stderr, "Cannot create %s: %s\n", paths[i], strerror(errno));
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Run every phase once
+ * @return SUCCESS on success, FAILURE if a phase could not run
+ */
+static int run_phases(const BenchConfig* config) {
+    Uploads uploads = { NULL, 0, 0 };
+    Samples samples = { NULL, 0, 0 };
+    uint64_t ops, bytes, files;
+    double elapsed, start;
+    char owner[MAX_USER_LENGTH];
+    int result = SUCCESS;
+
+    /* Uploads, timed per file */
+    start = now_seconds();
+    bytes = upload_round(config, &uploads, &samples);
+    elapsed = now_seconds() - start;
+    if (bytes == 0) {
+        free(uploads.names);
+        free(samples.values);
+        return FAILURE;
+    }
+    report(config, "generate", &samples, (uint64_t)config->files, bytes, elapsed);
+
+    /* Scans of the upload directory */
+    ops = 0;
+    elapsed = 0;
+    for (int round = 0; round < config->rounds; round++) {
+        ReportFile *scanned = NULL;
+        int count = 0;
+
+        start = now_seconds();
+        if (scan_directory(UPLOAD_DIR, &scanned, &count) != SUCCESS) {
+            result = FAILURE;
+            break;
+        }
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+        ops += (uint64_t)count;
+        free_report_files(scanned, count);
+    }
+    report(config, "scan", &samples, ops, 0, elapsed);
+
+    /* Monitor passes (scan and diff) with churn in between; the first pass only takes a snapshot */
+    monitor_directory_changes();
+    ops = 0;
+    elapsed = 0;
+    for (int round = 0; round < config->rounds; round++) {
+        churn_uploads(config, &uploads);
+        start = now_seconds();
+        if (monitor_directory_changes() != SUCCESS) {
+            result = FAILURE;
+            break;
+        }
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+        ops += (uint64_t)uploads.count;
+    }
+    report(config, "monitor", &samples, ops, 0, elapsed);
+
+    /* Transfers into the empty dashboard, with a fresh round of uploads before each but the first */
+    elapsed = 0;
+    for (int round = 0; round < config->rounds; round++) {
+        if (round > 0 && upload_round(config, &uploads, NULL) == 0) {
+            result = FAILURE;
+            break;
+        }
+        start = now_seconds();
+        if (transfer_reports() != SUCCESS) {
+            result = FAILURE;
+        }
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+        uploads.count = 0;
+    }
+    directory_totals(report_dir_fd(REPORT_DIR_DASHBOARD), &files, &bytes);
+    report(config, "transfer", &samples, files, bytes, elapsed);
+
+    /* Missing report checks over the filled dashboard */
+    elapsed = 0;
+    for (int round = 0; round < config->rounds; round++) {
+        start = now_seconds();
+        check_missing_reports();
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+    }
+    report(config, "missing", &samples, files * (uint64_t)config->rounds, 0, elapsed);
+
+    /* Backups of the dashboard */
+    elapsed = 0;
+    for (int round = 0; round < config->rounds; round++) {
+        wait_next_second();
+        start = now_seconds();
+        if (backup_dashboard() != SUCCESS) {
+            result = FAILURE;
+        }
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+    }
+    report(config, "backup", &samples, files * (uint64_t)config->rounds,
+           bytes * (uint64_t)config->rounds, elapsed);
+
+    /* Logging: the operation log and the change log, one call per sample */
+    elapsed = 0;
+    for (int i = 0; i < config->log_lines; i++) {
+        start = now_seconds();
+        log_operation("Benchmark line %d of %d", i, config->log_lines);
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+    }
+    report(config, "log", &samples, (uint64_t)config->log_lines, 0, elapsed);
+
+    get_owner_name(getuid(), owner, sizeof(owner));
+    elapsed = 0;
+    for (int i = 0; i < config->log_lines; i++) {
+        char name[NAME_MAX + 1];
+
+        snprintf(name, sizeof(name), REPORT_PREFIX "Sales_2025-03-08_%07d" REPORT_EXTENSION,
+                 i % 1000);
+        start = now_seconds();
+        log_file_change(owner, name, "modify");
+        samples_add(&samples, now_seconds() - start);
+        elapsed += now_seconds() - start;
+    }
+    report(config, "changelog", &samples, (uint64_t)config->log_lines, 0, elapsed);
+
+    free(uploads.names);
+    free(samples.values);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = { 4, 2000, 8192, SIZE_LOGNORMAL, 0.1, 5, 100000, 1, "", FALSE };
+    int result;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:s:S:c:r:n:x:l:kh")) != -1) {
+        switch (opt) {
+            case 'd':
+                config.departments = atoi(optarg);
+                break;
+            case 'f':
+                config.files = atoi(optarg);
+                break;
+            case 's':
+                config.size = atoi(optarg);
+                break;
+            case 'S':
+                if (strcmp(optarg, "fixed") == 0) {
+                    config.distribution = SIZE_FIXED;
+                } else if (strcmp(optarg, "uniform") == 0) {
+                    config.distribution = SIZE_UNIFORM;
+                } else if (strcmp(optarg, "lognormal") == 0) {
+                    config.distribution = SIZE_LOGNORMAL;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                config.churn = atof(optarg);
+                break;
+            case 'r':
+                config.rounds = atoi(optarg);
+                break;
+            case 'n':
+                config.log_lines = atoi(optarg);
+                break;
+            case 'x':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.label = optarg;
+                break;
+            case 'k':
+                config.keep = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || config.departments <= 0 || config.files <= 0 || config.size <= 0 ||
+        config.churn < 0 || config.rounds <= 0 || config.log_lines < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The sandbox is wiped, so never run against the live tree */
+    if (strcmp(REPORT_ROOT, BENCH_DEFAULT_ROOT) == 0) {
+        fprintf(stderr, "%s was built against %s; build it with \"make bench\"\n",
+                argv[0], REPORT_ROOT);
+        return EXIT_FAILURE;
+    }
+    if (create_sandbox() != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    random_state = config.seed ? config.seed : 1;
+
+    printf("{\"phase\":\"config\",\"root\":\"%s\",\"departments\":%d,\"files\":%d,\"size\":%d,"
+           "\"distribution\":\"%s\",\"churn\":%.3f,\"rounds\":%d,\"log_lines\":%d,\"seed\":%llu}\n",
+           REPORT_ROOT, config.departments, config.files, config.size,
+           (config.distribution == SIZE_FIXED) ? "fixed" :
+           (config.distribution == SIZE_UNIFORM) ? "uniform" : "lognormal",
+           config.churn, config.rounds, config.log_lines, (unsigned long long)config.seed);
+
+    result = run_phases(&config);
+
+    changelog_close();
+    log_close();
+    close_report_dirs();
+    if (!config.keep) {
+        remove_sandbox();
+    }
+
+    if (result != SUCCESS) {
+        fprintf(stderr, "A phase failed; run with -k and see %s\n", ERROR_LOG);
+    }
+    return (result == SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
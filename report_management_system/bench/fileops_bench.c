@@ -0,0 +1,187 @@
+/**
+ * @file fileops_bench.c
+ * @brief Compare the sync and io_uring file operation backends
+ *
+ * Creates a directory of small XML reports and times batched statx, copy,
+ * rename and unlink passes over it with each backend.
+ *
+ * Usage: fileops_bench [work_dir] [file_count]
+ */
+
+#include "report_system.h"
+
+#define DEFAULT_WORK_DIR   "/tmp/report_fileops_bench"
+#define DEFAULT_FILE_COUNT 100000
+
+/**
+ * Current monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Create the source reports
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int create_reports(int dirfd, int count) {
+    char name[NAME_MAX + 1];
+    char body[2048];
+    int length;
+
+    for (int i = 0; i < count; i++) {
+        int fd;
+
+        snprintf(name, sizeof(name), "report_Bench%d_2025-03-08.xml", i);
+        length = snprintf(body, sizeof(body),
+                          "<?xml version=\"1.0\"?>\n<report id=\"%d\">%0*d</report>\n",
+                          i, 1024 + (i % 512), i);
+
+        fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, body, length) != length) {
+            perror("create report");
+            if (fd != -1) {
+                close(fd);
+            }
+            return FAILURE;
+        }
+        close(fd);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Run one pass of a single operation type over all files
+ * @return Elapsed seconds
+ */
+static double run_pass(FileOps* ops, int type, int src_dirfd, int dst_dirfd,
+                       char (*names)[NAME_MAX + 1], off_t* sizes, int count, int* failures) {
+    FileOp *batch = (FileOp*)malloc(FILEOPS_BATCH_SIZE * sizeof(FileOp));
+    double start;
+
+    /* Keep writeback from earlier passes out of this one's timing */
+    syncfs(src_dirfd);
+    start = now_seconds();
+
+    *failures = 0;
+    for (int base = 0; base < count; base += FILEOPS_BATCH_SIZE) {
+        int n = (count - base < FILEOPS_BATCH_SIZE) ? count - base : FILEOPS_BATCH_SIZE;
+
+        for (int i = 0; i < n; i++) {
+            memset(&batch[i], 0, sizeof(FileOp));
+            batch[i].type = type;
+            batch[i].src_dirfd = src_dirfd;
+            batch[i].src_name = names[base + i];
+            batch[i].dst_dirfd = dst_dirfd;
+            batch[i].dst_name = names[base + i];
+            batch[i].size = sizes[base + i];
+        }
+
+        *failures += fileops_submit(ops, batch, n);
+
+        if (type == FILE_OP_STATX) {
+            for (int i = 0; i < n; i++) {
+                sizes[base + i] = (off_t)batch[i].stx.stx_size;
+            }
+        }
+    }
+
+    free(batch);
+    return now_seconds() - start;
+}
+
+int main(int argc, char *argv[]) {
+    const char *work_dir = (argc > 1) ? argv[1] : DEFAULT_WORK_DIR;
+    int count = (argc > 2) ? atoi(argv[2]) : DEFAULT_FILE_COUNT;
+    static const int backends[] = { FILEOPS_BACKEND_SYNC, FILEOPS_BACKEND_URING };
+    char (*names)[NAME_MAX + 1];
+    off_t *sizes;
+    int root_fd, src_fd;
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [work_dir] [file_count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    names = malloc((size_t)count * sizeof(*names));
+    sizes = malloc((size_t)count * sizeof(off_t));
+    if (names == NULL || sizes == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(names[i], sizeof(names[i]), "report_Bench%d_2025-03-08.xml", i);
+    }
+
+    mkdir(work_dir, 0755);
+    root_fd = open(work_dir, O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) {
+        perror(work_dir);
+        return EXIT_FAILURE;
+    }
+    mkdirat(root_fd, "src", 0755);
+    src_fd = openat(root_fd, "src", O_RDONLY | O_DIRECTORY);
+    if (src_fd == -1 || create_reports(src_fd, count) != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%-9s %-7s %10s %12s %9s\n", "backend", "pass", "seconds", "files/s", "failures");
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        FileOps ops;
+        char copy_dir[64], moved_dir[64];
+        int copy_fd, moved_fd, failures;
+        double elapsed;
+
+        fileops_init(&ops, backends[b]);
+        if (ops.backend != backends[b]) {
+            printf("%-9s unavailable, skipped\n", "io_uring");
+            fileops_destroy(&ops);
+            continue;
+        }
+
+        snprintf(copy_dir, sizeof(copy_dir), "copy_%s", fileops_backend_name(&ops));
+        snprintf(moved_dir, sizeof(moved_dir), "moved_%s", fileops_backend_name(&ops));
+        mkdirat(root_fd, copy_dir, 0755);
+        mkdirat(root_fd, moved_dir, 0755);
+        copy_fd = openat(root_fd, copy_dir, O_RDONLY | O_DIRECTORY);
+        moved_fd = openat(root_fd, moved_dir, O_RDONLY | O_DIRECTORY);
+
+        elapsed = run_pass(&ops, FILE_OP_STATX, src_fd, src_fd, names, sizes, count, &failures);
+        printf("%-9s %-7s %10.3f %12.0f %9d\n", fileops_backend_name(&ops), "statx",
+               elapsed, count / elapsed, failures);
+
+        elapsed = run_pass(&ops, FILE_OP_COPY, src_fd, copy_fd, names, sizes, count, &failures);
+        printf("%-9s %-7s %10.3f %12.0f %9d\n", fileops_backend_name(&ops), "copy",
+               elapsed, count / elapsed, failures);
+
+        elapsed = run_pass(&ops, FILE_OP_RENAME, copy_fd, moved_fd, names, sizes, count, &failures);
+        printf("%-9s %-7s %10.3f %12.0f %9d\n", fileops_backend_name(&ops), "rename",
+               elapsed, count / elapsed, failures);
+
+        elapsed = run_pass(&ops, FILE_OP_UNLINK, moved_fd, moved_fd, names, sizes, count, &failures);
+        printf("%-9s %-7s %10.3f %12.0f %9d\n", fileops_backend_name(&ops), "unlink",
+               elapsed, count / elapsed, failures);
+
+        close(copy_fd);
+        close(moved_fd);
+        unlinkat(root_fd, copy_dir, AT_REMOVEDIR);
+        unlinkat(root_fd, moved_dir, AT_REMOVEDIR);
+        fileops_destroy(&ops);
+    }
+
+    /* Remove the source reports */
+    for (int i = 0; i < count; i++) {
+        unlinkat(src_fd, names[i], 0);
+    }
+    close(src_fd);
+    unlinkat(root_fd, "src", AT_REMOVEDIR);
+    close(root_fd);
+
+    free(names);
+    free(sizes);
+    return EXIT_SUCCESS;
+}
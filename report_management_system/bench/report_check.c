@@ -0,0 +1,1081 @@
+/**
+ * @file report_check.c
+ * @brief Behavioural checks of the backup formats and the change log
+ *
+ * Like the end-to-end benchmark this links a copy of the library built
+ * against a scratch REPORT_ROOT, which it creates and removes, here with
+ * small change log segments so a few thousand records cover sealed and
+ * unsealed ones. Each check runs the real functions on generated data and
+ * compares the result with what it has to be:
+ *
+ *   pack       delta chains rebuilt byte for byte, keyframes where due,
+ *              damage to a keyframe caught in the deltas built on it
+ *   erasure    Reed-Solomon round trip, degraded reads with a shard lost
+ *              or a chunk damaged, failure once too much is gone
+ *   retention  retention_select on day, ISO week and month boundaries and
+ *              against a plain recount of a long series
+ *   merkle     merkle_diff reporting exactly the added, removed and
+ *              changed files, also against a tree loaded from a MANIFEST
+ *   reportlog  the query tool run as a program, counting and printing
+ *              over sealed and unsealed segments, with every filter
+ *
+ * Every failed expectation is printed; the exit status is non-zero if any
+ * failed.
+ *
+ * Usage: report_check [-r reportlog] [-k]
+ */
+
+#include "report_system.h"
+#include <fnmatch.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+#define CHECK_DEFAULT_ROOT   "/var/report_system"
+#define CHECK_ARCHIVE        "backup_2025-03-08_02-00-00" BACKUP_ARCHIVE_SUFFIX
+#define CHECK_PACKED         "backup_2025-03-09_02-00-00" BACKUP_ARCHIVE_SUFFIX
+#define CHECK_REPORTS        12          /* Reports per department */
+#define CHECK_KEYFRAME       4
+#define CHECK_REPORT_SIZE    (24 * 1024)
+#define CHECK_ATTACHMENTS    3
+#define CHECK_ATTACHMENT_SIZE (150 * 1024)
+#define CHECK_MANIFEST_FILES 3000
+#define CHECK_LOG_RECORDS    (CHANGELOG_SEGMENT_RECORDS * 5 + CHANGELOG_SEGMENT_RECORDS / 2)
+#define CHECK_LOG_START      1741392000  /* 2025-03-08 00:00:00 UTC */
+
+#if CHANGELOG_SEGMENT_RECORDS > 65536
+#error "report_check needs small change log segments; build it with \"make check\""
+#endif
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            check_failed(__LINE__, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * @struct CheckFile
+ * @brief A generated file and the content it must come back with
+ */
+typedef struct {
+    char name[NAME_MAX + 1];
+    char *data;
+    size_t length;
+} CheckFile;
+
+/**
+ * @struct CheckRecord
+ * @brief A change appended to the log, as a query must see it
+ */
+typedef struct {
+    time_t when;
+    const char *user;
+    char name[NAME_MAX + 1];
+    uint32_t action;
+} CheckRecord;
+
+/**
+ * @struct MerkleChange
+ * @brief A difference, expected or reported
+ */
+typedef struct {
+    char name[NAME_MAX + 1];
+    int change;
+} MerkleChange;
+
+/**
+ * @struct MerkleReported
+ * @brief Differences collected from merkle_diff
+ */
+typedef struct {
+    MerkleChange *changes;
+    int count;
+    int capacity;
+} MerkleReported;
+
+static const char *const departments[] = { DEPT_SALES, DEPT_WAREHOUSE };
+static const char *const actions[] = { "create", "modify", "delete", "rename", "replace", "transfer" };
+static const char *const log_users[] = { "1001", "1002", "no_such_report_user" };
+
+static uint64_t random_state = 1;
+static int failures = 0;
+static const char *reportlog = "bin/reportlog";
+
+static void check_failed(int line, const char* format, ...) {
+    va_list args;
+
+    fprintf(stderr, "FAIL report_check.c:%d: ", line);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    failures++;
+}
+
+static uint64_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void random_text(char* out, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = (i % 64 == 63) ? '\n' : (char)('a' + next_random() % 26);
+    }
+}
+
+static int write_file(int dirfd, const char* name, const void* data, size_t length) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1 || write(fd, data, length) != (ssize_t)length) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+    return (close(fd) == 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Read a whole file into a malloc'd buffer
+ */
+static char* read_file(int dirfd, const char* name, size_t* length) {
+    struct stat st;
+    char *data;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    data = (char*)malloc((size_t)st.st_size + 1);
+    if (data != NULL && pread(fd, data, (size_t)st.st_size, 0) != st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    close(fd);
+    *length = (size_t)st.st_size;
+    return data;
+}
+
+static int same_content(const char* data, size_t length, const CheckFile* file) {
+    return data != NULL && length == file->length && memcmp(data, file->data, length) == 0;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void remove_sandbox(void) {
+    nftw(REPORT_ROOT, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+}
+
+static int create_sandbox(void) {
+    static const char *const paths[] = { REPORT_ROOT, UPLOAD_DIR, DASHBOARD_DIR, BACKUP_DIR, LOG_DIR };
+
+    remove_sandbox();
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (mkdir(paths[i], 0755) != 0) {
+            fprintf(stderr, "Cannot create %s: %s\n", paths[i], strerror(errno));
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+static int compare_files(const void* a, const void* b) {
+    return strcmp(((const CheckFile*)a)->name, ((const CheckFile*)b)->name);
+}
+
+/**
+ * Write a dashboard of reports that change a little from day to day, plus
+ * attachments without a department that are always stored in full
+ * @return Number of files, sorted by name as pack_add_file wants them
+ */
+static int generate_dashboard(int dashboard_fd, CheckFile* files) {
+    int count = 0;
+
+    for (size_t d = 0; d < sizeof(departments) / sizeof(departments[0]); d++) {
+        char body[CHECK_REPORT_SIZE + CHECK_REPORTS * 64];
+        size_t length = CHECK_REPORT_SIZE;
+
+        random_text(body, length);
+        for (int day = 1; day <= CHECK_REPORTS; day++) {
+            CheckFile *file = &files[count++];
+
+            /* A few edits and one new line a day */
+            for (int edit = 0; edit < 4; edit++) {
+                random_text(body + next_random() % (length - 20), 20);
+            }
+            random_text(body + length, 64);
+            length += 64;
+
+            snprintf(file->name, sizeof(file->name), REPORT_PREFIX "%s_2025-03-%02d" REPORT_EXTENSION,
+                     departments[d], day);
+            file->data = (char*)malloc(length);
+            memcpy(file->data, body, length);
+            file->length = length;
+        }
+    }
+    for (int i = 0; i < CHECK_ATTACHMENTS; i++) {
+        CheckFile *file = &files[count++];
+
+        snprintf(file->name, sizeof(file->name), "attachment_%d.bin", i);
+        file->length = CHECK_ATTACHMENT_SIZE + (size_t)i * 777;
+        file->data = (char*)malloc(file->length);
+        for (size_t j = 0; j < file->length; j++) {
+            file->data[j] = (char)next_random();
+        }
+    }
+
+    qsort(files, count, sizeof(CheckFile), compare_files);
+    for (int i = 0; i < count; i++) {
+        if (write_file(dashboard_fd, files[i].name, files[i].data, files[i].length) != SUCCESS) {
+            fprintf(stderr, "Cannot write %s: %s\n", files[i].name, strerror(errno));
+            return -1;
+        }
+    }
+    return count;
+}
+
+static int write_pack(int backup_fd, const char* name, int level, int dashboard_fd,
+                      const CheckFile* files, int count) {
+    PackWriter writer;
+
+    if (pack_create(&writer, backup_fd, name, level, CHECK_KEYFRAME) != SUCCESS) {
+        return FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pack_add_file(&writer, dashboard_fd, files[i].name, NULL) != SUCCESS) {
+            pack_abort(&writer);
+            return FAILURE;
+        }
+    }
+    return pack_finish(&writer);
+}
+
+/**
+ * Check that every file of an archive reads back as written
+ * @return Number of delta entries
+ */
+static int check_pack_contents(int backup_fd, const char* name, const CheckFile* files, int count) {
+    PackReader reader;
+    int deltas = 0;
+
+    if (pack_open(&reader, backup_fd, name) != SUCCESS) {
+        CHECK(FALSE, "pack_open %s: %s", name, strerror(errno));
+        return 0;
+    }
+    CHECK(reader.count == (uint32_t)count, "%s holds %u files, %d added", name, reader.count, count);
+    for (int i = 0; i < count; i++) {
+        const PackEntry *entry = pack_find(&reader, files[i].name);
+        char *data = NULL;
+        size_t length = 0;
+
+        if (entry == NULL) {
+            CHECK(FALSE, "%s missing from %s", files[i].name, name);
+            continue;
+        }
+        deltas += (entry->flags & PACK_ENTRY_DELTA) != 0;
+        CHECK(pack_read_entry(&reader, entry, &data, &length) == SUCCESS &&
+              same_content(data, length, &files[i]),
+              "%s in %s does not read back as written", files[i].name, name);
+        free(data);
+    }
+    pack_close(&reader);
+    return deltas;
+}
+
+static void check_pack(int dashboard_fd, int backup_fd, const CheckFile* files, int count) {
+    const int expected_deltas = (int)(sizeof(departments) / sizeof(departments[0])) *
+                                (CHECK_REPORTS - (CHECK_REPORTS + CHECK_KEYFRAME - 1) / CHECK_KEYFRAME);
+    PackReader reader;
+    const PackEntry *keyframe, *entry;
+    char name[NAME_MAX + 1];
+    int restore_fd;
+    int deltas;
+
+    CHECK(write_pack(backup_fd, CHECK_ARCHIVE, 0, dashboard_fd, files, count) == SUCCESS &&
+          write_pack(backup_fd, CHECK_PACKED, 6, dashboard_fd, files, count) == SUCCESS,
+          "writing delta archives: %s", strerror(errno));
+
+    /* Every keyframe_interval-th report of a department is stored in full */
+    deltas = check_pack_contents(backup_fd, CHECK_ARCHIVE, files, count);
+    CHECK(deltas == expected_deltas, "raw archive has %d deltas, expected %d", deltas, expected_deltas);
+    deltas = check_pack_contents(backup_fd, CHECK_PACKED, files, count);
+    CHECK(deltas == expected_deltas, "compressed archive has %d deltas, expected %d", deltas, expected_deltas);
+
+    /* Extraction follows the chain and checks the result */
+    mkdirat(backup_fd, "restore", 0755);
+    restore_fd = openat(backup_fd, "restore", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (restore_fd == -1 || pack_open(&reader, backup_fd, CHECK_PACKED) != SUCCESS) {
+        CHECK(FALSE, "cannot open %s for extraction: %s", CHECK_PACKED, strerror(errno));
+        if (restore_fd != -1) {
+            close(restore_fd);
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        char *data;
+        size_t length = 0;
+
+        entry = pack_find(&reader, files[i].name);
+        CHECK(entry != NULL && pack_extract(&reader, entry, restore_fd, files[i].name) == SUCCESS,
+              "extracting %s: %s", files[i].name, strerror(errno));
+        data = read_file(restore_fd, files[i].name, &length);
+        CHECK(same_content(data, length, &files[i]), "extracted %s differs", files[i].name);
+        free(data);
+    }
+    pack_close(&reader);
+
+    /* Damage the first keyframe: every delta built on it must fail, the next keyframe not */
+    snprintf(name, sizeof(name), REPORT_PREFIX "%s_2025-03-01" REPORT_EXTENSION, DEPT_SALES);
+    if (pack_open(&reader, backup_fd, CHECK_PACKED) == SUCCESS &&
+        (keyframe = pack_find(&reader, name)) != NULL) {
+        int fd = openat(backup_fd, CHECK_PACKED, O_RDWR | O_CLOEXEC);
+        char byte;
+        off_t offset = (off_t)(keyframe->offset + keyframe->stored_length / 2);
+
+        CHECK(!(keyframe->flags & PACK_ENTRY_DELTA), "%s should be a keyframe", name);
+        pack_close(&reader);
+        if (fd != -1 && pread(fd, &byte, 1, offset) == 1) {
+            byte ^= 0x5a;
+            pwrite(fd, &byte, 1, offset);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+
+        if (pack_open(&reader, backup_fd, CHECK_PACKED) == SUCCESS) {
+            for (int day = 1; day <= CHECK_REPORTS; day++) {
+                int in_chain = (day <= CHECK_KEYFRAME);
+
+                snprintf(name, sizeof(name), REPORT_PREFIX "%s_2025-03-%02d" REPORT_EXTENSION,
+                         DEPT_SALES, day);
+                entry = pack_find(&reader, name);
+                CHECK(entry != NULL && (pack_extract(&reader, entry, restore_fd, name) == SUCCESS) != in_chain,
+                      "%s %s after its keyframe was damaged", name,
+                      in_chain ? "extracted" : "failed to extract");
+            }
+            pack_close(&reader);
+        }
+    } else {
+        CHECK(FALSE, "cannot find %s in %s", name, CHECK_PACKED);
+    }
+    close(restore_fd);
+}
+
+/**
+ * Replace a shard in another backup root by nothing, or flip a byte in one
+ * of its chunks. Shard 0 is in BACKUP_DIR, shard i in REPORT_ROOT/backup.i.
+ * @param stripe Chunk to damage, or -1 to remove the shard
+ */
+static void damage_shard(int shard, int stripe, uint32_t stripes) {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    int fd;
+
+    if (shard == 0) {
+        snprintf(path, sizeof(path), BACKUP_DIR "/%s", CHECK_ARCHIVE);
+    } else {
+        snprintf(path, sizeof(path), REPORT_ROOT "/backup.%d/%s", shard, CHECK_ARCHIVE);
+    }
+    if (stripe < 0) {
+        unlink(path);
+        return;
+    }
+
+    /* The chunks fill the end of the shard, one per stripe */
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        off_t offset = st.st_size - (off_t)(stripes - stripe) * ERASURE_CHUNK_SIZE + 100;
+        char byte;
+
+        if (pread(fd, &byte, 1, offset) == 1) {
+            byte ^= 0x01;
+            pwrite(fd, &byte, 1, offset);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Erasure code the archive again from its original bytes
+ */
+static int encode_archive(int backup_fd, const CheckFile* archive) {
+    erasure_remove(CHECK_ARCHIVE, NULL);
+    if (write_file(backup_fd, CHECK_ARCHIVE, archive->data, archive->length) != SUCCESS) {
+        return FAILURE;
+    }
+    return erasure_write(backup_fd, CHECK_ARCHIVE);
+}
+
+static int read_intact(int backup_fd, const CheckFile* archive) {
+    char *data;
+    size_t size;
+    int same;
+
+    if (erasure_read(backup_fd, CHECK_ARCHIVE, &data, &size) != SUCCESS) {
+        return FALSE;
+    }
+    same = (size == archive->length && memcmp(data, archive->data, size) == 0);
+    munmap(data, size);
+    return same;
+}
+
+static void check_erasure(int backup_fd, const CheckFile* files, int count) {
+    CheckFile archive;
+    PackReader reader;
+    uint32_t stripe_count;
+    int damaged;
+
+    memset(&archive, 0, sizeof(archive));
+    archive.data = read_file(backup_fd, CHECK_ARCHIVE, &archive.length);
+    if (archive.data == NULL) {
+        CHECK(FALSE, "cannot read %s: %s", CHECK_ARCHIVE, strerror(errno));
+        return;
+    }
+    stripe_count = (uint32_t)((archive.length + (size_t)ERASURE_DATA_SHARDS * ERASURE_CHUNK_SIZE - 1) /
+                              ((size_t)ERASURE_DATA_SHARDS * ERASURE_CHUNK_SIZE));
+    CHECK(stripe_count > 1, "archive of %zu bytes fits one stripe", archive.length);
+
+    CHECK(encode_archive(backup_fd, &archive) == SUCCESS, "erasure_write: %s", strerror(errno));
+    CHECK(read_intact(backup_fd, &archive), "intact shards do not read back as the archive");
+    damaged = erasure_check(backup_fd, CHECK_ARCHIVE, NULL);
+    CHECK(damaged == 0, "erasure_check finds %d damaged chunks in intact shards", damaged);
+
+    /* Any one shard may go: a data shard, the parity shard, or a chunk of shard 0 */
+    for (int shard = 1; shard < ERASURE_DATA_SHARDS + ERASURE_PARITY_SHARDS; shard++) {
+        CHECK(encode_archive(backup_fd, &archive) == SUCCESS, "erasure_write: %s", strerror(errno));
+        damage_shard(shard, -1, stripe_count);
+        CHECK(read_intact(backup_fd, &archive), "degraded read without shard %d failed", shard);
+        damaged = erasure_check(backup_fd, CHECK_ARCHIVE, NULL);
+        CHECK(damaged == (int)stripe_count, "erasure_check finds %d damaged chunks without shard %d, "
+              "expected %u", damaged, shard, stripe_count);
+    }
+    CHECK(encode_archive(backup_fd, &archive) == SUCCESS, "erasure_write: %s", strerror(errno));
+    damage_shard(0, 1, stripe_count);
+    CHECK(read_intact(backup_fd, &archive), "degraded read with a damaged chunk of shard 0 failed");
+    damaged = erasure_check(backup_fd, CHECK_ARCHIVE, NULL);
+    CHECK(damaged == 1, "erasure_check finds %d damaged chunks, expected 1", damaged);
+
+    /* A damaged chunk and a lost shard in the same stripe are one too many */
+    damage_shard(ERASURE_DATA_SHARDS - 1, -1, stripe_count);
+    errno = 0;
+    CHECK(!read_intact(backup_fd, &archive) && errno == EIO,
+          "erasure_read with two chunks of a stripe lost should fail with EIO (%s)", strerror(errno));
+
+    /* Archives read through the shards transparently, deltas included */
+    CHECK(encode_archive(backup_fd, &archive) == SUCCESS, "erasure_write: %s", strerror(errno));
+    damage_shard(1, -1, stripe_count);
+    if (pack_open(&reader, backup_fd, CHECK_ARCHIVE) == SUCCESS) {
+        for (int i = 0; i < count; i++) {
+            const PackEntry *entry = pack_find(&reader, files[i].name);
+            char *data = NULL;
+            size_t length = 0;
+
+            CHECK(entry != NULL && pack_read_entry(&reader, entry, &data, &length) == SUCCESS &&
+                  same_content(data, length, &files[i]),
+                  "%s differs in the degraded archive", files[i].name);
+            free(data);
+        }
+        pack_close(&reader);
+    } else {
+        CHECK(FALSE, "pack_open of the degraded archive: %s", strerror(errno));
+    }
+
+    /* One parity shard cannot make up for two lost ones */
+    damage_shard(2, -1, stripe_count);
+    errno = 0;
+    CHECK(!read_intact(backup_fd, &archive) && errno == EIO,
+          "erasure_read with two shards lost should fail with EIO (%s)", strerror(errno));
+
+    free(archive.data);
+}
+
+static time_t utc(int year, int month, int day, int hour) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    return timegm(&tm);
+}
+
+/**
+ * Check the kept set against a list of kept indexes
+ */
+static void check_kept(const char* label, const time_t* created, int count, const RetentionPolicy* policy,
+                       const int* expected, int expected_count) {
+    int keep[64];
+    int kept = retention_select(created, count, policy, keep);
+
+    CHECK(kept == expected_count, "%s: %d backups kept, expected %d", label, kept, expected_count);
+    for (int i = 0, e = 0; i < count; i++) {
+        int wanted = (e < expected_count && expected[e] == i);
+
+        CHECK(keep[i] == wanted, "%s: backup %d %s", label, i, wanted ? "dropped" : "kept");
+        e += wanted;
+    }
+}
+
+/**
+ * Period keys computed without localtime or strftime: the check runs in UTC,
+ * days since the epoch, weeks from Monday 1969-12-29, months from gmtime
+ */
+static long period_key(time_t when, int period) {
+    long day = (long)(when / 86400);
+    struct tm tm;
+
+    if (period == 0) {
+        return day;
+    }
+    if (period == 1) {
+        return (day + 3) / 7;
+    }
+    gmtime_r(&when, &tm);
+    return (tm.tm_year + 1900L) * 12 + tm.tm_mon;
+}
+
+static void check_retention(void) {
+    const RetentionPolicy last_three_days = { 3, 0, 0 }, two_days = { 2, 0, 0 }, none = { 0, 0, 0 };
+    const RetentionPolicy two_weeks = { 0, 2, 0 }, three_months = { 0, 0, 3 };
+    const RetentionPolicy mixed = { 7, 4, 6 };
+    time_t created[64];
+    time_t *series;
+    int *keep;
+    int count, kept, expected;
+
+    /* One backup a day: the newest of the last three days */
+    for (count = 0; count < 10; count++) {
+        created[count] = utc(2025, 3, 1 + count, 12);
+    }
+    check_kept("daily", created, count, &last_three_days, (const int[]){ 7, 8, 9 }, 3);
+    check_kept("empty policy", created, count, &none, (const int[]){ 9 }, 1);
+
+    /* Four a day: only the last of each day counts */
+    for (count = 0; count < 12; count++) {
+        created[count] = utc(2025, 3, 1 + count / 4, (count % 4) * 6);
+    }
+    check_kept("several a day", created, count, &two_days, (const int[]){ 7, 11 }, 2);
+
+    /* Sunday 2024-12-29 ends ISO week 2024-W52, Monday 2024-12-30 starts 2025-W01 */
+    for (count = 0; count < 5; count++) {
+        created[count] = utc(2024, 12, 27 + count, 12);
+    }
+    check_kept("ISO weeks over new year", created, count, &two_weeks, (const int[]){ 2, 4 }, 2);
+
+    /* The 15th and the last day of every month of a half year */
+    for (count = 0; count < 12; count++) {
+        int month = 1 + count / 2;
+        int day = (count % 2 == 0) ? 15 : (int)(utc(2025, month + 1, 1, 0) - utc(2025, month, 1, 0)) / 86400;
+
+        created[count] = utc(2025, month, day, 12);
+    }
+    check_kept("months", created, count, &three_months, (const int[]){ 7, 9, 11 }, 3);
+
+    /* Every five hours for 200 days, against a recount from the period keys */
+    count = 200 * 24 / 5;
+    series = (time_t*)malloc(count * sizeof(time_t));
+    keep = (int*)malloc(count * sizeof(int));
+    if (series == NULL || keep == NULL) {
+        CHECK(FALSE, "out of memory");
+        free(series);
+        free(keep);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        series[i] = utc(2024, 11, 20, 1) + (time_t)i * 5 * 3600;
+    }
+    kept = retention_select(series, count, &mixed, keep);
+
+    expected = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        const int limits[3] = { mixed.daily, mixed.weekly, mixed.monthly };
+        int wanted = (i == count - 1);
+
+        for (int period = 0; period < 3; period++) {
+            long key = period_key(series[i], period);
+            int periods_between = 0;
+
+            /* Newest of its period, and its period among the last limits[period] */
+            if (i < count - 1 && period_key(series[i + 1], period) == key) {
+                continue;
+            }
+            for (int j = count - 1; j > i; j--) {
+                if (period_key(series[j], period) != period_key(series[j - 1], period)) {
+                    periods_between++;
+                }
+            }
+            if (periods_between < limits[period]) {
+                wanted = TRUE;
+            }
+        }
+        CHECK(keep[i] == wanted, "series: backup %d %s", i, wanted ? "dropped" : "kept");
+        expected += wanted;
+    }
+    CHECK(kept == expected, "series: %d backups kept, expected %d", kept, expected);
+
+    free(series);
+    free(keep);
+}
+
+static int compare_manifest_entries(const void* a, const void* b) {
+    return strcmp(((const ManifestEntry*)a)->filename, ((const ManifestEntry*)b)->filename);
+}
+
+static int compare_changes(const void* a, const void* b) {
+    return strcmp(((const MerkleChange*)a)->name, ((const MerkleChange*)b)->name);
+}
+
+static void collect_change(const char* filename, int change, void* context) {
+    MerkleReported *reported = (MerkleReported*)context;
+
+    if (reported->count == reported->capacity) {
+        reported->capacity = reported->capacity ? reported->capacity * 2 : 64;
+        reported->changes = (MerkleChange*)realloc(reported->changes,
+                                                   reported->capacity * sizeof(MerkleChange));
+    }
+    snprintf(reported->changes[reported->count].name, NAME_MAX + 1, "%s", filename);
+    reported->changes[reported->count++].change = change;
+}
+
+static void manifest_entry(ManifestEntry* entry, const char* name, const char* version) {
+    char content[NAME_MAX + 32];
+    int length = snprintf(content, sizeof(content), "%s %s", name, version);
+
+    memset(entry, 0, sizeof(ManifestEntry));
+    snprintf(entry->filename, sizeof(entry->filename), "%s", name);
+    fingerprint_buffer(content, (size_t)length, &entry->fingerprint);
+}
+
+/**
+ * Diff two manifests and compare what is reported with what was changed
+ */
+static void check_diff(const char* label, const ManifestEntry* old_entries, int old_count,
+                       const MerkleTree* old_tree, const ManifestEntry* new_entries, int new_count,
+                       const MerkleTree* new_tree, MerkleChange* expected, int expected_count) {
+    MerkleReported reported = { NULL, 0, 0 };
+    int differences;
+
+    differences = merkle_diff(old_entries, old_count, old_tree, new_entries, new_count, new_tree,
+                              collect_change, &reported);
+    CHECK(differences == expected_count && reported.count == expected_count,
+          "%s: %d differences, %d reported, expected %d", label, differences, reported.count,
+          expected_count);
+
+    if (reported.count == expected_count) {
+        qsort(reported.changes, reported.count, sizeof(MerkleChange), compare_changes);
+        qsort(expected, expected_count, sizeof(MerkleChange), compare_changes);
+        for (int i = 0; i < expected_count; i++) {
+            CHECK(strcmp(reported.changes[i].name, expected[i].name) == 0 &&
+                  reported.changes[i].change == expected[i].change,
+                  "%s: reported %s as %d, expected %s as %d", label, reported.changes[i].name,
+                  reported.changes[i].change, expected[i].name, expected[i].change);
+        }
+    }
+    free(reported.changes);
+}
+
+static void check_merkle(int backup_fd) {
+    ManifestEntry *old_entries, *new_entries;
+    MerkleChange *expected, *reversed;
+    MerkleTree old_tree, new_tree, loaded;
+    int old_count = CHECK_MANIFEST_FILES, new_count = 0, expected_count = 0;
+    int manifest_fd;
+
+    old_entries = (ManifestEntry*)malloc(CHECK_MANIFEST_FILES * sizeof(ManifestEntry));
+    new_entries = (ManifestEntry*)malloc((CHECK_MANIFEST_FILES + 16) * sizeof(ManifestEntry));
+    expected = (MerkleChange*)malloc((CHECK_MANIFEST_FILES + 16) * sizeof(MerkleChange));
+    reversed = (MerkleChange*)malloc((CHECK_MANIFEST_FILES + 16) * sizeof(MerkleChange));
+    if (old_entries == NULL || new_entries == NULL || expected == NULL || reversed == NULL) {
+        CHECK(FALSE, "out of memory");
+        goto cleanup;
+    }
+
+    for (int i = 0; i < old_count; i++) {
+        char name[NAME_MAX + 1];
+
+        snprintf(name, sizeof(name), REPORT_PREFIX "%s_2025-03-%02d_%05d" REPORT_EXTENSION,
+                 departments[i % 2], 1 + i % 28, i);
+        manifest_entry(&old_entries[i], name, "v1");
+    }
+    qsort(old_entries, old_count, sizeof(ManifestEntry), compare_manifest_entries);
+
+    /* Change every 97th file, drop every 211th, add a few */
+    for (int i = 0; i < old_count; i++) {
+        MerkleChange *change = &expected[expected_count];
+
+        if (i % 211 == 5) {
+            snprintf(change->name, sizeof(change->name), "%s", old_entries[i].filename);
+            change->change = MERKLE_REMOVED;
+            expected_count++;
+            continue;
+        }
+        new_entries[new_count] = old_entries[i];
+        if (i % 97 == 3) {
+            manifest_entry(&new_entries[new_count], old_entries[i].filename, "v2");
+            snprintf(change->name, sizeof(change->name), "%s", old_entries[i].filename);
+            change->change = MERKLE_CHANGED;
+            expected_count++;
+        }
+        new_count++;
+    }
+    /* Same content hash, different size: still a change */
+    new_entries[0].fingerprint.size++;
+    snprintf(expected[expected_count].name, NAME_MAX + 1, "%s", new_entries[0].filename);
+    expected[expected_count++].change = MERKLE_CHANGED;
+    for (int i = 0; i < 7; i++) {
+        char name[NAME_MAX + 1];
+
+        snprintf(name, sizeof(name), REPORT_PREFIX "%s_2025-04-01_%05d" REPORT_EXTENSION, DEPT_SALES, i);
+        manifest_entry(&new_entries[new_count++], name, "v1");
+        snprintf(expected[expected_count].name, NAME_MAX + 1, "%s", name);
+        expected[expected_count++].change = MERKLE_ADDED;
+    }
+    qsort(new_entries, new_count, sizeof(ManifestEntry), compare_manifest_entries);
+
+    CHECK(merkle_build(old_entries, old_count, &old_tree) == SUCCESS &&
+          merkle_build(new_entries, new_count, &new_tree) == SUCCESS, "merkle_build failed");
+    CHECK(old_tree.nodes[0] != new_tree.nodes[0], "different manifests have equal roots");
+
+    check_diff("identical", old_entries, old_count, &old_tree, old_entries, old_count, &old_tree,
+               expected, 0);
+    check_diff("forward", old_entries, old_count, &old_tree, new_entries, new_count, &new_tree,
+               expected, expected_count);
+
+    /* The other way round additions become removals */
+    for (int i = 0; i < expected_count; i++) {
+        reversed[i] = expected[i];
+        if (expected[i].change != MERKLE_CHANGED) {
+            reversed[i].change = (expected[i].change == MERKLE_ADDED) ? MERKLE_REMOVED : MERKLE_ADDED;
+        }
+    }
+    check_diff("backward", new_entries, new_count, &new_tree, old_entries, old_count, &old_tree,
+               reversed, expected_count);
+
+    /* A tree read back from a MANIFEST diffs like the one built in memory */
+    mkdirat(backup_fd, "merkle", 0755);
+    manifest_fd = openat(backup_fd, "merkle", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (manifest_fd != -1 && manifest_write(manifest_fd, new_entries, new_count) == SUCCESS &&
+        merkle_load(manifest_fd, &loaded) == SUCCESS) {
+        CHECK(memcmp(&loaded, &new_tree, sizeof(MerkleTree)) == 0, "loaded tree differs from the built one");
+        check_diff("loaded", old_entries, old_count, &old_tree, new_entries, new_count, &loaded,
+                   expected, expected_count);
+    } else {
+        CHECK(FALSE, "cannot write and load a MANIFEST tree: %s", strerror(errno));
+    }
+    if (manifest_fd != -1) {
+        close(manifest_fd);
+    }
+
+cleanup:
+    free(old_entries);
+    free(new_entries);
+    free(expected);
+    free(reversed);
+}
+
+/**
+ * Run reportlog over the sandbox's change log
+ * @return Its output in a malloc'd string, NULL if it failed
+ */
+static char* run_reportlog(const char* arguments) {
+    char command[MAX_PATH_LENGTH * 2];
+    char *output = NULL;
+    size_t length = 0, capacity = 0;
+    char buffer[4096];
+    size_t bytes_read;
+    FILE *pipe;
+
+    snprintf(command, sizeof(command), "'%s' -D '%s' %s", reportlog, CHANGELOG_DIR, arguments);
+    pipe = popen(command, "r");
+    if (pipe == NULL) {
+        return NULL;
+    }
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        if (length + bytes_read + 1 > capacity) {
+            capacity = (length + bytes_read + 1) * 2;
+            output = (char*)realloc(output, capacity);
+        }
+        memcpy(output + length, buffer, bytes_read);
+        length += bytes_read;
+    }
+    if (pclose(pipe) != 0) {
+        free(output);
+        return NULL;
+    }
+    if (output == NULL) {
+        output = strdup("");
+    } else {
+        output[length] = '\0';
+    }
+    return output;
+}
+
+/**
+ * Count the records a query has to match
+ */
+static long expected_matches(const CheckRecord* records, int count, time_t from, time_t until,
+                             const char* user, const char* pattern, int action) {
+    long matched = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (records[i].when >= from && records[i].when <= until &&
+            (user == NULL || strcmp(records[i].user, user) == 0) &&
+            (pattern == NULL || fnmatch(pattern, records[i].name, 0) == 0) &&
+            (action < 0 || records[i].action == (uint32_t)action)) {
+            matched++;
+        }
+    }
+    return matched;
+}
+
+static void check_count(const CheckRecord* records, int count, time_t from, time_t until,
+                        const char* user, const char* pattern, const char* action) {
+    char arguments[MAX_PATH_LENGTH];
+    long expected = expected_matches(records, count, from, until, user, pattern,
+                                     action ? changelog_action_code(action) : -1);
+    char *output;
+    int length;
+
+    length = snprintf(arguments, sizeof(arguments), "-c -f @%lld -t @%lld", (long long)from,
+                      (long long)until);
+    if (user != NULL) {
+        length += snprintf(arguments + length, sizeof(arguments) - length, " -u '%s'", user);
+    }
+    if (pattern != NULL) {
+        length += snprintf(arguments + length, sizeof(arguments) - length, " -n '%s'", pattern);
+    }
+    if (action != NULL) {
+        snprintf(arguments + length, sizeof(arguments) - length, " -a %s", action);
+    }
+
+    output = run_reportlog(arguments);
+    CHECK(output != NULL && atol(output) == expected, "reportlog %s: %ld, expected %ld", arguments,
+          output ? atol(output) : -1L, expected);
+    free(output);
+}
+
+static void check_reportlog(void) {
+    const int segment = CHANGELOG_SEGMENT_RECORDS;
+    CheckRecord *records;
+    DirEnumerator iter;
+    DirEntry entry;
+    int sealed = 0, unsealed = 0;
+    uint64_t stored = 0;
+    int dirfd;
+
+    records = (CheckRecord*)malloc(CHECK_LOG_RECORDS * sizeof(CheckRecord));
+    if (records == NULL) {
+        CHECK(FALSE, "out of memory");
+        return;
+    }
+
+    /* Three changes a second apart ten, so equal times straddle segment ends */
+    for (int i = 0; i < CHECK_LOG_RECORDS; i++) {
+        CheckRecord *record = &records[i];
+
+        record->when = CHECK_LOG_START + (time_t)(i / 3) * 10;
+        record->user = log_users[(i / 2 + i / 7) % 3];
+        snprintf(record->name, sizeof(record->name), REPORT_PREFIX "%s_%03d" REPORT_EXTENSION,
+                 departments[i % 2], (i * 13) % 61);
+        record->action = (uint32_t)changelog_action_code(actions[(i / 4) % 6]);
+        if (changelog_append(record->when, record->user, record->name, actions[(i / 4) % 6]) != SUCCESS) {
+            CHECK(FALSE, "changelog_append: %s", strerror(errno));
+            free(records);
+            return;
+        }
+    }
+    changelog_close();
+
+    /* Five full segments sealed with their index, the last one still open */
+    dirfd = open_directory(CHANGELOG_DIR);
+    if (dirfd != -1 && dir_enum_open(&iter, dirfd) == SUCCESS) {
+        while (dir_enum_next(&iter, &entry)) {
+            ChangeLogSegment log_segment;
+            size_t length = strlen(entry.name);
+
+            if (length <= strlen(CHANGELOG_SEGMENT_SUFFIX) ||
+                strcmp(entry.name + length - strlen(CHANGELOG_SEGMENT_SUFFIX), CHANGELOG_SEGMENT_SUFFIX) != 0) {
+                continue;
+            }
+            if (changelog_segment_open(&log_segment, dirfd, entry.name) != SUCCESS) {
+                CHECK(FALSE, "cannot open segment %s: %s", entry.name, strerror(errno));
+                continue;
+            }
+            sealed += log_segment.sealed;
+            unsealed += !log_segment.sealed;
+            stored += log_segment.count;
+            changelog_segment_close(&log_segment);
+        }
+        dir_enum_close(&iter);
+    }
+    if (dirfd != -1) {
+        close(dirfd);
+    }
+    CHECK(sealed == 5 && unsealed == 1 && stored == CHECK_LOG_RECORDS,
+          "change log has %d sealed and %d open segments holding %llu records", sealed, unsealed,
+          (unsigned long long)stored);
+
+    check_count(records, CHECK_LOG_RECORDS, 0, (time_t)UINT32_MAX, NULL, NULL, NULL);
+    check_count(records, CHECK_LOG_RECORDS, records[2 * segment + 5].when,
+                records[3 * segment + segment / 3].when, NULL, NULL, NULL);
+    /* From a sealed segment's postings into the open segment's records */
+    check_count(records, CHECK_LOG_RECORDS, records[segment - 7].when,
+                records[5 * segment + segment / 4].when, "1001", NULL, NULL);
+    check_count(records, CHECK_LOG_RECORDS, records[5 * segment + 3].when,
+                records[5 * segment + 20].when, "1002", NULL, NULL);
+    check_count(records, CHECK_LOG_RECORDS, 0, (time_t)UINT32_MAX, "1002", NULL, "delete");
+    check_count(records, CHECK_LOG_RECORDS, records[segment / 2].when,
+                records[4 * segment].when, NULL, REPORT_PREFIX DEPT_SALES "_*", "modify");
+    check_count(records, CHECK_LOG_RECORDS, records[3 * segment].when,
+                records[CHECK_LOG_RECORDS - 1].when, "1001", "*_01?" REPORT_EXTENSION, "rename");
+    check_count(records, CHECK_LOG_RECORDS, 0, CHECK_LOG_START - 1, NULL, NULL, NULL);
+    check_count(records, CHECK_LOG_RECORDS, records[CHECK_LOG_RECORDS - 1].when + 1,
+                (time_t)UINT32_MAX, "1001", NULL, NULL);
+
+    /* The changes of one second across the last seal, printed like the text log */
+    {
+        time_t when = records[5 * segment - 1].when;
+        char arguments[128];
+        char expected[MAX_LINE_LENGTH * 8] = "";
+        size_t length = 0;
+        char *output;
+
+        for (int i = 0; i < CHECK_LOG_RECORDS; i++) {
+            char timestamp[MAX_TIME_LENGTH];
+            char owner[MAX_USER_LENGTH] = "unknown";
+
+            if (records[i].when != when) {
+                continue;
+            }
+            if (records[i].user[0] >= '0' && records[i].user[0] <= '9') {
+                get_owner_name((uid_t)atoi(records[i].user), owner, sizeof(owner));
+            }
+            get_timestamp_string(when, timestamp, sizeof(timestamp));
+            length += snprintf(expected + length, sizeof(expected) - length,
+                               "[%s] User: %s, File: %s, Action: %s\n", timestamp, owner,
+                               records[i].name, changelog_action_name(records[i].action));
+        }
+        snprintf(arguments, sizeof(arguments), "-f @%lld -t @%lld", (long long)when, (long long)when);
+        output = run_reportlog(arguments);
+        CHECK(output != NULL && strcmp(output, expected) == 0,
+              "reportlog %s printed\n%sexpected\n%s", arguments, output ? output : "nothing\n", expected);
+        free(output);
+    }
+
+    free(records);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -r PATH     reportlog binary to query with (default %s)\n"
+            "  -k          Keep the sandbox %s afterwards\n",
+            program, reportlog, REPORT_ROOT);
+}
+
+/**
+ * Say how one group of checks went
+ */
+static void run_check(const char* name, int before) {
+    printf("%-4s %s\n", (failures == before) ? "ok" : "FAIL", name);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    CheckFile files[2 * CHECK_REPORTS + CHECK_ATTACHMENTS];
+    int dashboard_fd, backup_fd;
+    int count;
+    int keep = FALSE;
+    int before;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:kh")) != -1) {
+        switch (opt) {
+            case 'r':
+                reportlog = optarg;
+                break;
+            case 'k':
+                keep = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The sandbox is wiped, so never run against the live tree */
+    if (strcmp(REPORT_ROOT, CHECK_DEFAULT_ROOT) == 0) {
+        fprintf(stderr, "%s was built against %s; build it with \"make check\"\n",
+                argv[0], REPORT_ROOT);
+        return EXIT_FAILURE;
+    }
+    /* Period boundaries and printed times are checked in UTC; reportlog inherits it */
+    setenv("TZ", "UTC", 1);
+    tzset();
+    if (create_sandbox() != SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    dashboard_fd = report_dir_fd(REPORT_DIR_DASHBOARD);
+    backup_fd = report_dir_fd(REPORT_DIR_BACKUP);
+    count = (dashboard_fd != -1 && backup_fd != -1) ? generate_dashboard(dashboard_fd, files) : -1;
+    if (count < 0) {
+        remove_sandbox();
+        return EXIT_FAILURE;
+    }
+
+    before = failures;
+    check_pack(dashboard_fd, backup_fd, files, count);
+    run_check("pack delta chains", before);
+
+    before = failures;
+    check_erasure(backup_fd, files, count);
+    run_check("erasure coding", before);
+
+    before = failures;
+    check_retention();
+    run_check("retention_select", before);
+
+    before = failures;
+    check_merkle(backup_fd);
+    run_check("merkle_diff", before);
+
+    before = failures;
+    check_reportlog();
+    run_check("reportlog queries", before);
+
+    for (int i = 0; i < count; i++) {
+        free(files[i].data);
+    }
+    log_close();
+    close_report_dirs();
+    if (!keep) {
+        remove_sandbox();
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed; run with -k and see %s\n", failures, ERROR_LOG);
+    }
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,66 +3,405 @@
  * @brief Implementation of backup and directory management functions
  */
 
+ #define LOG_MODULE LOG_MODULE_BACKUP
  #include "report_system.h"
 
+ /* When lock_directories last locked, for the lock hold histogram */
+ static uint64_t lock_started = 0;
+
+ /**
+  * Add the new backup, and any the catalog missed, to the backup catalog
+  * @param backup_root_fd Descriptor of BACKUP_DIR
+  */
+ static void catalog_new_backups(int backup_root_fd) {
+     BackupCatalog catalog;
+     
+     if (catalog_open(&catalog, backup_root_fd, TRUE) == SUCCESS) {
+         catalog_sync(&catalog);
+         catalog_close(&catalog);
+     }
+ }
+ 
+ /**
+  * Count a backup that was written, in the backup metrics
+  * @param bytes Report bytes it holds
+  */
+ static void backup_counted(uint64_t bytes) {
+     metrics_count(METRIC_BACKUPS, 1);
+     metrics_count(METRIC_BACKUP_BYTES, bytes);
+     metrics_gauge(GAUGE_LAST_BACKUP_BYTES, (int64_t)bytes);
+     REPORT_PROBE1(backup__written, bytes);
+ }
+ 
+ static int compare_names(const void* a, const void* b) {
+     return strcmp(*(char* const*)a, *(char* const*)b);
+ }
+ 
+ static void free_names(char** names, int count) {
+     for (int i = 0; i < count; i++) {
+         free(names[i]);
+     }
+     free(names);
+ }
+ 
+ /**
+  * Backup the dashboard into a single archive file
+  * 
+  * Files are appended one after the other, so the backup is written as a
+  * single sequential stream; the archive's index doubles as the manifest.
+  * They go in in name order, which puts each department's reports in date
+  * order for delta storage.
+  * 
+  * @param config Storage settings
+  * @param dashboard_fd Descriptor of DASHBOARD_DIR
+  * @param backup_root_fd Descriptor of BACKUP_DIR
+  * @param backup_name Backup name without the archive suffix
+  * @return SUCCESS on success, FAILURE on error
+  */
+ static int backup_to_archive(const BackupConfig* config, int dashboard_fd, 
+                              int backup_root_fd, const char* backup_name) {
+     char archive_name[NAME_MAX + 1];
+     PackWriter writer;
+     DirEnumerator iter;
+     DirEntry entry;
+     char **names = NULL;
+     int capacity = 0;
+     int level = (config->compression == BACKUP_COMPRESSION_ZLIB) ? config->level : 0;
+     int success_count = 0;
+     int file_count = 0;
+     uint64_t backed_up = 0;
+     
+     if (snprintf(archive_name, sizeof(archive_name), "%s" BACKUP_ARCHIVE_SUFFIX, 
+                  backup_name) >= (int)sizeof(archive_name)) {
+         log_error("Backup name too long: %s", backup_name);
+         return FAILURE;
+     }
+     if (dir_enum_open(&iter, dashboard_fd) != SUCCESS) {
+         log_error("Failed to open dashboard directory: %s", strerror(errno));
+         return FAILURE;
+     }
+     while (dir_enum_next(&iter, &entry)) {
+         if (entry.type == DT_DIR || 
+             (entry.type != DT_REG && entry.type != DT_UNKNOWN)) {
+             continue;
+         }
+         if (file_count == capacity) {
+             int new_capacity = capacity ? capacity * 2 : 256;
+             char **grown = (char**)realloc(names, new_capacity * sizeof(char*));
+             if (grown == NULL) {
+                 break;
+             }
+             names = grown;
+             capacity = new_capacity;
+         }
+         names[file_count] = strdup(entry.name);
+         if (names[file_count] != NULL) {
+             file_count++;
+         }
+     }
+     dir_enum_close(&iter);
+     if (file_count > 1) {
+         qsort(names, file_count, sizeof(char*), compare_names);
+     }
+     
+     if (pack_create(&writer, backup_root_fd, archive_name, level, 
+                     config->keyframe_interval) != SUCCESS) {
+         free_names(names, file_count);
+         return FAILURE;
+     }
+     for (int i = 0; i < file_count; i++) {
+         FileFingerprint added;
+         int result = pack_add_file(&writer, dashboard_fd, names[i], &added);
+         
+         /* A vanished file is not worth retrying; anything else may be transient */
+         for (int attempt = 1; attempt <= COPY_VERIFY_RETRIES && 
+              result != SUCCESS && errno != ENOENT; attempt++) {
+             log_error("Retrying backup of %s (attempt %d): %s", names[i], 
+                       attempt + 1, strerror(errno));
+             result = pack_add_file(&writer, dashboard_fd, names[i], &added);
+         }
+         if (result != SUCCESS) {
+             log_error("Failed to backup file: %s (%s)", names[i], strerror(errno));
+             continue;
+         }
+         success_count++;
+         backed_up += added.size;
+     }
+     free_names(names, file_count);
+     
+     if (pack_finish(&writer) != SUCCESS) {
+         return FAILURE;
+     }
+     
+     /* Spread the archive over the backup roots; if that fails it stays whole */
+     if (config->format == BACKUP_FORMAT_ERASURE && erasure_write(backup_root_fd, archive_name) != SUCCESS) {
+         log_error("Backup %s is stored unsharded", archive_name);
+     }
+     if (success_count > 0) {
+         catalog_new_backups(backup_root_fd);
+         backup_counted(backed_up);
+     }
+     
+     if (success_count == file_count) {
+         log_operation("Backup completed successfully: %d files in %s", success_count, archive_name);
+         return SUCCESS;
+     }
+     log_error("Backup partially completed: %d/%d files", success_count, file_count);
+     return (success_count > 0) ? SUCCESS : FAILURE;
+ }
+ 
  /**
   * Backup the dashboard directory
+  * 
+  * Files are stat'ed and then copied in batches through the file operation
+  * backend, relative to the dashboard and backup directory descriptors; with
+  * io_uring each batch of small reports is a single linked
+  * open-read-write-close submission. Every copy is fingerprinted while the
+  * data moves and verified against a read-back of the destination; failed
+  * copies are retried, and the fingerprints are recorded in the backup's
+  * MANIFEST once all files are in place. The backup is then added to the
+  * backup catalog.
+  * 
   * @return SUCCESS on success, FAILURE on error
   */
  int backup_dashboard(void) {
-     char backup_path[MAX_PATH_LENGTH];
+     uint64_t started = metrics_clock();
+     int result;
+     
+     REPORT_PROBE2(backup__start, DASHBOARD_DIR, BACKUP_DIR);
+     result = backup_dashboard_with_config(NULL);
+     REPORT_PROBE1(backup__done, result);
+     
+     metrics_latency(LATENCY_BACKUP, started);
+     return result;
+ }
+ 
+ /**
+  * Backup the dashboard directory with explicit storage settings
+  * 
+  * With BACKUP_COMPRESSION_ZLIB each batch is compressed by a pool of
+  * threads into <name>.gz files instead of being copied; the manifest is
+  * the same for both formats. With BACKUP_FORMAT_ARCHIVE the files go
+  * into one archive file, backup_<time>.pack, instead of a directory, and
+  * with keyframe_interval set reports are stored there as deltas against
+  * the same department's previous report. BACKUP_FORMAT_ERASURE writes the
+  * same archive and then splits it into Reed-Solomon shards across the
+  * backup roots. With BACKUP_FORMAT_CONTINUOUS the backup is a checkpoint
+  * of versions already in the continuous log.
+  * 
+  * @param config Storage settings, or NULL for the compiled-in defaults
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int backup_dashboard_with_config(const BackupConfig* config) {
+     BackupConfig defaults = {
+         BACKUP_FORMAT,
+         BACKUP_COMPRESSION,
+         BACKUP_COMPRESSION_LEVEL,
+         BACKUP_COMPRESS_WORKERS,
+         BACKUP_DELTA ? BACKUP_DELTA_KEYFRAME : 0
+     };
+     char backup_name[MAX_PATH_LENGTH];
      char timestamp[MAX_TIME_LENGTH];
      time_t now;
-     struct tm *tm_info;
-     DIR *dir;
-     struct dirent *entry;
-     char src_path[MAX_PATH_LENGTH];
-     char dest_path[MAX_PATH_LENGTH];
+     struct tm tm_info;
+     int dashboard_fd, backup_root_fd, backup_fd;
+     DirEnumerator iter;
+     DirEntry entry;
+     char (*names)[NAME_MAX + 1];
+     FileOp *batch;
+     FileOps fileops;
+     ManifestEntry *manifest = NULL;
+     int manifest_capacity = 0;
+     int manifest_count = 0;
+     int pending = 0;
      int success_count = 0;
      int file_count = 0;
+     int done = FALSE;
+     uint64_t backed_up = 0;
+     
+     if (config == NULL) {
+         config = &defaults;
+     }
      
-     log_operation("Starting dashboard backup");
+     log_operation("Starting dashboard backup%s", 
+                   (config->compression == BACKUP_COMPRESSION_ZLIB) ? " (compressed)" : "");
      
      /* Get current time for backup folder name */
      now = time(NULL);
-     tm_info = localtime(&now);
-     strftime(timestamp, MAX_TIME_LENGTH, "%Y-%m-%d_%H-%M-%S", tm_info);
+     localtime_r(&now, &tm_info);
+     strftime(timestamp, MAX_TIME_LENGTH, "%Y-%m-%d_%H-%M-%S", &tm_info);
+     
+     dashboard_fd = report_dir_fd(REPORT_DIR_DASHBOARD);
+     backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+     if (dashboard_fd == -1 || backup_root_fd == -1) {
+         return FAILURE;
+     }
      
      /* Create backup directory with timestamp */
-     snprintf(backup_path, MAX_PATH_LENGTH, "%s/backup_%s", BACKUP_DIR, timestamp);
-     if (mkdir(backup_path, 0755) != 0) {
+     snprintf(backup_name, MAX_PATH_LENGTH, "backup_%s", timestamp);
+     if (config->format == BACKUP_FORMAT_ARCHIVE || config->format == BACKUP_FORMAT_ERASURE) {
+         return backup_to_archive(config, dashboard_fd, backup_root_fd, backup_name);
+     }
+     if (config->format == BACKUP_FORMAT_CONTINUOUS) {
+         /* The data is already in the continuous log; only mark the point */
+         if (cdp_checkpoint(dashboard_fd, backup_root_fd, backup_name) != SUCCESS) {
+             return FAILURE;
+         }
+         catalog_new_backups(backup_root_fd);
+         return SUCCESS;
+     }
+     if (mkdirat(backup_root_fd, backup_name, 0755) != 0) {
          log_error("Failed to create backup directory: %s", strerror(errno));
          return FAILURE;
      }
+     backup_fd = openat(backup_root_fd, backup_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (backup_fd == -1) {
+         log_error("Failed to open backup directory: %s", strerror(errno));
+         return FAILURE;
+     }
      
      /* Open dashboard directory */
-     dir = opendir(DASHBOARD_DIR);
-     if (dir == NULL) {
+     if (dir_enum_open(&iter, dashboard_fd) != SUCCESS) {
          log_error("Failed to open dashboard directory: %s", strerror(errno));
+         close(backup_fd);
          return FAILURE;
      }
      
-     /* Process each file in the directory */
-     while ((entry = readdir(dir)) != NULL) {
-         /* Skip directory entries */
-         if (entry->d_type == DT_DIR) {
-             continue;
+     names = malloc(FILEOPS_BATCH_SIZE * sizeof(*names));
+     batch = (FileOp*)malloc(FILEOPS_BATCH_SIZE * sizeof(FileOp));
+     if (names == NULL || batch == NULL) {
+         log_error("Memory allocation failed for backup batch");
+         free(names);
+         free(batch);
+         dir_enum_close(&iter);
+         close(backup_fd);
+         return FAILURE;
+     }
+     
+     fileops_init(&fileops, FILEOPS_DEFAULT_BACKEND);
+     
+     /* Process the directory one batch at a time */
+     while (!done) {
+         int copies = 0;
+         
+         /* Gather the next batch of names */
+         pending = 0;
+         while (pending < FILEOPS_BATCH_SIZE) {
+             if (!dir_enum_next(&iter, &entry)) {
+                 done = TRUE;
+                 break;
+             }
+             
+             /* Skip directory entries */
+             if (entry.type == DT_DIR) {
+                 continue;
+             }
+             
+             snprintf(names[pending], NAME_MAX + 1, "%s", entry.name);
+             memset(&batch[pending], 0, sizeof(FileOp));
+             batch[pending].type = FILE_OP_STATX;
+             batch[pending].src_dirfd = dashboard_fd;
+             batch[pending].src_name = names[pending];
+             pending++;
+         }
+         
+         if (pending == 0) {
+             break;
          }
          
-         /* Construct source and destination paths */
-         snprintf(src_path, MAX_PATH_LENGTH, "%s/%s", DASHBOARD_DIR, entry->d_name);
-         snprintf(dest_path, MAX_PATH_LENGTH, "%s/%s", backup_path, entry->d_name);
+         /* Sizes first, so the copies can be submitted as fixed-length chains */
+         fileops_submit(&fileops, batch, pending);
          
-         /* Copy the file */
-         file_count++;
-         if (copy_file(src_path, dest_path) == SUCCESS) {
-             success_count++;
+         for (int i = 0; i < pending; i++) {
+             if (batch[i].result != 0) {
+                 file_count++;
+                 log_error("Failed to backup file: %s", names[i]);
+                 continue;
+             }
+             if (!S_ISREG(batch[i].stx.stx_mode)) {
+                 continue;
+             }
+             
+             FileOp *copy = &batch[copies];
+             off_t size = (off_t)batch[i].stx.stx_size;
+             
+             memmove(names[copies], names[i], NAME_MAX + 1);
+             memset(copy, 0, sizeof(FileOp));
+             copy->type = FILE_OP_COPY;
+             copy->src_dirfd = dashboard_fd;
+             copy->src_name = names[copies];
+             copy->dst_dirfd = backup_fd;
+             copy->dst_name = names[copies];
+             copy->size = size;
+             copy->flags = FILEOPS_COPY_VERIFY;
+             copies++;
+         }
+         
+         /* Copy or compress the files */
+         if (config->compression == BACKUP_COMPRESSION_ZLIB) {
+             compress_batch(batch, copies, config->level, config->workers);
          } else {
-             log_error("Failed to backup file: %s", entry->d_name);
+             fileops_submit(&fileops, batch, copies);
+         }
+         
+         for (int i = 0; i < copies; i++) {
+             /* A vanished file is not worth retrying; anything else may be transient */
+             for (int attempt = 1; attempt <= COPY_VERIFY_RETRIES &&
+                  batch[i].result != 0 && batch[i].result != -ENOENT; attempt++) {
+                 log_error("Retrying backup of %s (attempt %d): %s", names[i], 
+                           attempt + 1, strerror(-batch[i].result));
+                 if (config->compression == BACKUP_COMPRESSION_ZLIB) {
+                     compress_file_op(&batch[i], config->level);
+                 } else {
+                     fileops_execute_sync(&batch[i]);
+                 }
+             }
+             
+             file_count++;
+             if (batch[i].result != 0) {
+                 log_error("Failed to backup file: %s (%s)", names[i], 
+                           strerror(-batch[i].result));
+                 continue;
+             }
+             success_count++;
+             backed_up += batch[i].fingerprint.size;
+             
+             if (manifest_count == manifest_capacity) {
+                 int new_capacity = manifest_capacity ? manifest_capacity * 2 : FILEOPS_BATCH_SIZE;
+                 ManifestEntry *grown = (ManifestEntry*)realloc(manifest, 
+                                                                new_capacity * sizeof(ManifestEntry));
+                 if (grown == NULL) {
+                     log_error("Memory allocation failed for backup manifest");
+                     continue;
+                 }
+                 manifest = grown;
+                 manifest_capacity = new_capacity;
+             }
+             snprintf(manifest[manifest_count].filename, NAME_MAX + 1, "%s", names[i]);
+             manifest[manifest_count].fingerprint = batch[i].fingerprint;
+             manifest_count++;
          }
      }
      
-     closedir(dir);
+     dir_enum_close(&iter);
+     fileops_destroy(&fileops);
+     free(names);
+     free(batch);
+     
+     /* Without a manifest the backup cannot be verified or restored safely */
+     if (manifest_count < success_count || 
+         manifest_write(backup_fd, manifest, manifest_count) != SUCCESS) {
+         log_error("Failed to write manifest for %s", backup_name);
+         success_count = 0;
+     }
+     free(manifest);
+     close(backup_fd);
+     
+     /* Index the new backup (and any the catalog missed) for lookups */
+     if (success_count > 0) {
+         catalog_new_backups(backup_root_fd);
+         backup_counted(backed_up);
+     }
      
      /* Log result */
      if (success_count == file_count) {
@@ -82,6 +421,12 @@
      int result = SUCCESS;
      
      log_operation("Locking directories for backup/transfer");
+     REPORT_PROBE2(lock__start, UPLOAD_DIR, DASHBOARD_DIR);
+     lock_started = metrics_clock();
+     
+     /* Backup pruning and scrubbing yield until the directories are unlocked */
+     retention_pause();
+     scrub_pause();
      
      /* Change permissions to prevent modifications */
      if (set_directory_permissions(UPLOAD_DIR, LOCKED_PERMISSIONS) != SUCCESS) {
@@ -94,6 +439,7 @@
          result = FAILURE;
      }
      
+     REPORT_PROBE1(lock__done, result);
      return result;
  }
  
@@ -105,6 +451,7 @@
      int result = SUCCESS;
      
      log_operation("Unlocking directories after backup/transfer");
+     REPORT_PROBE2(unlock__start, UPLOAD_DIR, DASHBOARD_DIR);
      
      /* Restore normal permissions */
      if (set_directory_permissions(UPLOAD_DIR, UPLOAD_PERMISSIONS) != SUCCESS) {
@@ -117,6 +464,14 @@
          result = FAILURE;
      }
      
+     scrub_resume();
+     retention_resume();
+     
+     if (lock_started != 0) {
+         metrics_latency(LATENCY_LOCK_HOLD, lock_started);
+         lock_started = 0;
+     }
+     REPORT_PROBE1(unlock__done, result);
      return result;
  }
  
@@ -169,25 +524,25 @@
   * @return TRUE if empty, FALSE if not empty or error
   */
  int is_directory_empty(const char* path) {
-     DIR *dir;
-     struct dirent *entry;
-     int is_empty = TRUE;
+     DirEnumerator iter;
+     DirEntry entry;
+     int dirfd;
+     int is_empty;
      
      /* Open the directory */
-     dir = opendir(path);
-     if (dir == NULL) {
+     dirfd = open_directory(path);
+     if (dirfd == -1 || dir_enum_open(&iter, dirfd) != SUCCESS) {
          log_error("Failed to open directory %s: %s", path, strerror(errno));
+         if (dirfd != -1) {
+             close(dirfd);
+         }
          return FALSE;
      }
      
-     /* Check for entries other than . and .. */
-     while ((entry = readdir(dir)) != NULL) {
-         if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-             is_empty = FALSE;
-             break;
-         }
-     }
+     /* The enumerator already skips . and .. */
+     is_empty = !dir_enum_next(&iter, &entry);
      
-     closedir(dir);
-     return is_empty;
+     dir_enum_close(&iter);
+     close(dirfd);
+     return is_empty ? TRUE : FALSE;
  }
\ No newline at end of file
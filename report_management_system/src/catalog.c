@@ -0,0 +1,1012 @@
+/**
+ * @file catalog.c
+ * @brief Catalog of all backups and the file versions each one holds
+ *
+ * The catalog lives next to the backups in BACKUP_DIR as four files:
+ *
+ *   catalog.backups  CatalogBackup table, appended in creation order, so it
+ *                    is sorted by time and backup N is entry N-1.
+ *   catalog.records  CatalogRecord table: "this version of this file is in
+ *                    backups first..last". A file that stays unchanged over
+ *                    many nightly backups only extends its record's range,
+ *                    so the table grows with changes, not with backups.
+ *   catalog.names    NUL-terminated file names, each stored once.
+ *   catalog.index    Open-addressing hash table over the records, keyed by
+ *                    (name, content hash) and by name alone. It is derived
+ *                    data and is rebuilt whenever it is missing or stale.
+ *
+ * All files are memory-mapped. Adding a backup appends records and names
+ * and commits by appending the backup entry, which stores the record and
+ * name counts at that point. Readers only trust what the last committed
+ * entry covers; a writer opening after a crash drops anything beyond it.
+ *
+ * Backups deleted by the retention policy keep their entry and records but
+ * are flagged CATALOG_BACKUP_PRUNED, so ids stay stable and lookups skip them.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define CATALOG_INDEX_MAGIC   "RPTCIDX1"
+#define CATALOG_INDEX_TEMP    ".catalog.index.tmp"
+#define CATALOG_SLOT_VERSION  1
+#define CATALOG_SLOT_NAME     2
+#define CATALOG_MAP_MIN       (1ULL << 20)   /* Smallest reserve tried when mapping fails */
+
+/**
+ * @struct CatalogIndexHeader
+ * @brief Start of catalog.index, followed by capacity slots
+ */
+typedef struct {
+    char magic[8];
+    uint32_t capacity;        /* Slots, a power of two */
+    uint32_t used;            /* Occupied slots */
+    uint64_t record_count;    /* Records reflected in the slots */
+    uint32_t dirty;           /* Set while a backup is being added */
+    uint32_t reserved;
+} CatalogIndexHeader;
+
+/**
+ * @struct CatalogSlot
+ * @brief Hash index entry pointing at the newest record for its key
+ */
+typedef struct {
+    uint64_t name_hash;
+    uint64_t content_hash;    /* Unused for CATALOG_SLOT_NAME */
+    uint32_t record;          /* 1-based record number, 0 for an empty slot */
+    uint32_t kind;            /* CATALOG_SLOT_VERSION or CATALOG_SLOT_NAME */
+} CatalogSlot;
+
+static CatalogIndexHeader* index_header(const BackupCatalog* catalog) {
+    return (CatalogIndexHeader*)catalog->index;
+}
+
+static CatalogSlot* index_slots(const BackupCatalog* catalog) {
+    return (CatalogSlot*)((char*)catalog->index + sizeof(CatalogIndexHeader));
+}
+
+static uint64_t hash_name(const char* name) {
+    FingerprintState state;
+    FileFingerprint fingerprint;
+
+    fingerprint_init(&state, FALSE);
+    fingerprint_update(&state, name, strlen(name));
+    fingerprint_final(&state, &fingerprint);
+    return fingerprint.hash;
+}
+
+static uint32_t slot_start(const BackupCatalog* catalog, uint64_t name_hash,
+                           uint64_t content_hash, int kind) {
+    uint64_t h = name_hash ^ (content_hash * 0x9E3779B185EBCA87ULL) ^ (uint64_t)kind;
+    h ^= h >> 29;
+    return (uint32_t)h & (index_header(catalog)->capacity - 1);
+}
+
+static off_t file_size(int fd) {
+    struct stat st;
+    return (fstat(fd, &st) == 0) ? st.st_size : -1;
+}
+
+/**
+ * Map a growing catalog file; the mapping is larger than the file so
+ * appended data becomes visible without remapping
+ */
+static void* map_growing_file(int fd, int writable, uint64_t reserve) {
+    void *map = mmap(NULL, (size_t)reserve, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    return (map == MAP_FAILED) ? NULL : map;
+}
+
+static void unmap_growing_files(BackupCatalog* catalog) {
+    if (catalog->backups != NULL) {
+        munmap(catalog->backups, (size_t)catalog->map_reserve);
+    }
+    if (catalog->records != NULL) {
+        munmap(catalog->records, (size_t)catalog->map_reserve);
+    }
+    if (catalog->names != NULL) {
+        munmap(catalog->names, (size_t)catalog->map_reserve);
+    }
+    catalog->backups = NULL;
+    catalog->records = NULL;
+    catalog->names = NULL;
+}
+
+/**
+ * Map the backups, records and names files
+ * CATALOG_MAP_RESERVE is tried first. Where the address space is smaller
+ * (32-bit hosts, ulimit -v) the reserve is halved until the mappings fit,
+ * as long as it still covers the files. Appends never grow a file past
+ * the reserve (see catalog_has_room).
+ * @param catalog Catalog with its files open
+ * @param needed Size of the largest file
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+static int map_growing_files(BackupCatalog* catalog, uint64_t needed) {
+    uint64_t reserve = CATALOG_MAP_RESERVE;
+
+    if (reserve > (uint64_t)(SIZE_MAX / 4) + 1) {
+        reserve = (uint64_t)(SIZE_MAX / 4) + 1;
+    }
+    if (needed > reserve) {
+        errno = EFBIG;
+        return FAILURE;
+    }
+
+    for (;;) {
+        catalog->map_reserve = reserve;
+        catalog->backups = (CatalogBackup*)map_growing_file(catalog->backups_fd, catalog->writable, reserve);
+        catalog->records = (CatalogRecord*)map_growing_file(catalog->records_fd, catalog->writable, reserve);
+        catalog->names = (char*)map_growing_file(catalog->names_fd, catalog->writable, reserve);
+        if (catalog->backups != NULL && catalog->records != NULL && catalog->names != NULL) {
+            return SUCCESS;
+        }
+        unmap_growing_files(catalog);
+        if (reserve / 2 < needed || reserve / 2 < CATALOG_MAP_MIN) {
+            errno = ENOMEM;
+            return FAILURE;
+        }
+        reserve /= 2;
+    }
+}
+
+/**
+ * Check that a file can grow to end bytes without leaving its mapping
+ * @return TRUE if it can, FALSE otherwise (errno set to ENOSPC)
+ */
+static int catalog_has_room(const BackupCatalog* catalog, uint64_t end) {
+    if (end > catalog->map_reserve) {
+        log_error("Backup catalog is full: a file would outgrow its %llu byte mapping",
+                  (unsigned long long)catalog->map_reserve);
+        errno = ENOSPC;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Get a record that may not be committed yet, if it is safe to read
+ * A reader's records_available is only a snapshot: a writer recovering
+ * from a failed update truncates the records and names past its commit
+ * point, and touching those pages would raise SIGBUS. Uncommitted
+ * records are therefore checked against the current file sizes.
+ * @return The record, or NULL if it is no longer there
+ */
+static const CatalogRecord* readable_record(const BackupCatalog* catalog, uint64_t number) {
+    const CatalogRecord *record;
+    off_t records_size, names_size;
+
+    if (number == 0 || number > catalog->records_available) {
+        return NULL;
+    }
+    record = &catalog->records[number - 1];
+    if (number <= catalog->record_count || catalog->writable) {
+        return record;
+    }
+
+    records_size = file_size(catalog->records_fd);
+    if (records_size < 0 || number > (uint64_t)records_size / sizeof(CatalogRecord)) {
+        return NULL;
+    }
+    names_size = file_size(catalog->names_fd);
+    if (names_size < 0 || record->name_offset + record->name_length >= (uint64_t)names_size) {
+        return NULL;
+    }
+    return record;
+}
+
+/**
+ * Find the slot for a key
+ * @return The slot's record number, 0 if the key is absent (slot is then
+ *         the empty slot where it would go)
+ */
+static uint32_t index_find(const BackupCatalog* catalog, int kind, uint64_t name_hash,
+                           uint64_t content_hash, const char* name, CatalogSlot** slot) {
+    CatalogSlot *slots = index_slots(catalog);
+    uint32_t mask = index_header(catalog)->capacity - 1;
+    uint32_t i = slot_start(catalog, name_hash, content_hash, kind);
+
+    for (;; i = (i + 1) & mask) {
+        CatalogSlot *candidate = &slots[i];
+
+        if (candidate->record == 0) {
+            *slot = candidate;
+            return 0;
+        }
+        if (candidate->kind == (uint32_t)kind && candidate->name_hash == name_hash &&
+            (kind == CATALOG_SLOT_NAME || candidate->content_hash == content_hash)) {
+            const CatalogRecord *record = readable_record(catalog, candidate->record);
+            if (record != NULL && strcmp(catalog->names + record->name_offset, name) == 0) {
+                *slot = candidate;
+                return candidate->record;
+            }
+        }
+    }
+}
+
+/**
+ * Point the index entries of a record's name and version at it
+ */
+static void index_insert(BackupCatalog* catalog, uint32_t number) {
+    const CatalogRecord *record = &catalog->records[number - 1];
+    const char *name = catalog->names + record->name_offset;
+    CatalogSlot *slot;
+
+    if (index_find(catalog, CATALOG_SLOT_VERSION, record->name_hash,
+                   record->content_hash, name, &slot) == 0) {
+        slot->name_hash = record->name_hash;
+        slot->content_hash = record->content_hash;
+        slot->kind = CATALOG_SLOT_VERSION;
+        index_header(catalog)->used++;
+    }
+    slot->record = number;
+
+    if (index_find(catalog, CATALOG_SLOT_NAME, record->name_hash, 0, name, &slot) == 0) {
+        slot->name_hash = record->name_hash;
+        slot->content_hash = 0;
+        slot->kind = CATALOG_SLOT_NAME;
+        index_header(catalog)->used++;
+    }
+    slot->record = number;
+}
+
+/**
+ * Build a fresh index over the first record_count records
+ * Writers replace catalog.index atomically; readers build it in memory.
+ * @param catalog Open catalog
+ * @param record_count Records to index
+ * @param dirty Value of the header's dirty flag
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int catalog_rebuild_index(BackupCatalog* catalog, uint64_t record_count, int dirty) {
+    void *old_index = catalog->index;
+    size_t old_size = catalog->index_size;
+    int old_fd = catalog->index_fd;
+    uint64_t capacity = CATALOG_INDEX_MIN_SLOTS;
+    CatalogIndexHeader *header;
+    size_t size;
+    void *map;
+    int fd = -1;
+
+    /* Two slots per record at most; keep the load factor under 70% */
+    while (capacity * 7 < (record_count * 2 + 2) * 10) {
+        capacity <<= 1;
+    }
+    if (capacity > UINT32_MAX / 2) {
+        log_error("Backup catalog index too large");
+        return FAILURE;
+    }
+    size = sizeof(CatalogIndexHeader) + capacity * sizeof(CatalogSlot);
+
+    if (catalog->writable) {
+        fd = openat(catalog->dirfd, CATALOG_INDEX_TEMP, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || ftruncate(fd, (off_t)size) != 0) {
+            log_error("Failed to create catalog index: %s", strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            return FAILURE;
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        log_error("Failed to map catalog index: %s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    header = (CatalogIndexHeader*)map;
+    memcpy(header->magic, CATALOG_INDEX_MAGIC, sizeof(header->magic));
+    header->capacity = (uint32_t)capacity;
+    header->used = 0;
+
+    catalog->index = map;
+    catalog->index_size = size;
+    catalog->index_fd = fd;
+
+    /* Later records of a key overwrite earlier ones: slots end up newest */
+    for (uint64_t i = 1; i <= record_count; i++) {
+        index_insert(catalog, (uint32_t)i);
+    }
+    header->record_count = record_count;
+    header->dirty = (uint32_t)dirty;
+
+    if (fd != -1 && (fdatasync(fd) != 0 ||
+        renameat(catalog->dirfd, CATALOG_INDEX_TEMP, catalog->dirfd, CATALOG_INDEX_FILE) != 0)) {
+        log_error("Failed to install catalog index: %s", strerror(errno));
+    }
+
+    if (old_index != NULL) {
+        munmap(old_index, old_size);
+    }
+    if (old_fd != -1) {
+        close(old_fd);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Map catalog.index if it matches the committed records, else rebuild it
+ */
+static int catalog_load_index(BackupCatalog* catalog) {
+    int fd = openat(catalog->dirfd, CATALOG_INDEX_FILE,
+                    (catalog->writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    off_t size = (fd != -1) ? file_size(fd) : -1;
+
+    if (size >= (off_t)sizeof(CatalogIndexHeader)) {
+        void *map = mmap(NULL, (size_t)size,
+                         catalog->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            const CatalogIndexHeader *header = (const CatalogIndexHeader*)map;
+            uint32_t capacity = header->capacity;
+
+            if (memcmp(header->magic, CATALOG_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+                (size_t)size == sizeof(CatalogIndexHeader) + (size_t)capacity * sizeof(CatalogSlot) &&
+                header->record_count == catalog->record_count && !header->dirty) {
+                catalog->index = map;
+                catalog->index_size = (size_t)size;
+                catalog->index_fd = fd;
+                return SUCCESS;
+            }
+            munmap(map, (size_t)size);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return catalog_rebuild_index(catalog, catalog->record_count, FALSE);
+}
+
+/**
+ * Drop everything a writer left behind after the last committed backup
+ */
+static int catalog_recover(BackupCatalog* catalog) {
+    if (catalog->records_available > catalog->record_count ||
+        file_size(catalog->names_fd) > (off_t)catalog->names_length) {
+        log_operation("Discarding incomplete backup catalog update");
+        if (ftruncate(catalog->records_fd, (off_t)(catalog->record_count * sizeof(CatalogRecord))) != 0 ||
+            ftruncate(catalog->names_fd, (off_t)catalog->names_length) != 0) {
+            log_error("Failed to truncate backup catalog: %s", strerror(errno));
+            return FAILURE;
+        }
+        catalog->records_available = catalog->record_count;
+    }
+
+    /* Ranges may have been extended to a backup that never committed */
+    for (uint64_t i = 0; i < catalog->record_count; i++) {
+        if (catalog->records[i].last_backup > catalog->backup_count) {
+            catalog->records[i].last_backup = catalog->backup_count;
+        }
+    }
+
+    return catalog_rebuild_index(catalog, catalog->record_count, FALSE);
+}
+
+/**
+ * Open the backup catalog
+ * Only one writer is allowed at a time; readers never block.
+ * @param catalog Catalog to initialize
+ * @param dirfd Directory holding the catalog (normally BACKUP_DIR)
+ * @param writable TRUE to create the catalog if needed and add backups
+ * @return SUCCESS on success, FAILURE on error (no catalog yet for readers)
+ */
+int catalog_open(BackupCatalog* catalog, int dirfd, int writable) {
+    int flags = (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC;
+    off_t backups_size, records_size, names_size, largest;
+
+    memset(catalog, 0, sizeof(BackupCatalog));
+    catalog->dirfd = dirfd;
+    catalog->writable = writable;
+    catalog->index_fd = -1;
+
+    catalog->backups_fd = openat(dirfd, CATALOG_BACKUPS_FILE, flags, 0644);
+    catalog->records_fd = openat(dirfd, CATALOG_RECORDS_FILE, flags, 0644);
+    catalog->names_fd = openat(dirfd, CATALOG_NAMES_FILE, flags, 0644);
+    if (catalog->backups_fd == -1 || catalog->records_fd == -1 || catalog->names_fd == -1) {
+        if (writable || errno != ENOENT) {
+            log_error("Failed to open backup catalog: %s", strerror(errno));
+        }
+        catalog_close(catalog);
+        return FAILURE;
+    }
+
+    if (writable && flock(catalog->backups_fd, LOCK_EX) != 0) {
+        log_error("Failed to lock backup catalog: %s", strerror(errno));
+        catalog_close(catalog);
+        return FAILURE;
+    }
+
+    backups_size = file_size(catalog->backups_fd);
+    records_size = file_size(catalog->records_fd);
+    names_size = file_size(catalog->names_fd);
+    largest = backups_size;
+    if (records_size > largest) {
+        largest = records_size;
+    }
+    if (names_size > largest) {
+        largest = names_size;
+    }
+    if (backups_size < 0 || records_size < 0 || names_size < 0 ||
+        map_growing_files(catalog, (uint64_t)largest) != SUCCESS) {
+        log_error("Failed to map backup catalog: %s", strerror(errno));
+        catalog_close(catalog);
+        return FAILURE;
+    }
+
+    /* The last complete backup entry is the commit point */
+    catalog->backup_count = (uint32_t)(backups_size / sizeof(CatalogBackup));
+    if (catalog->backup_count > 0) {
+        const CatalogBackup *last = &catalog->backups[catalog->backup_count - 1];
+        catalog->record_count = last->record_count;
+        catalog->names_length = last->names_length;
+    }
+    catalog->records_available = (uint64_t)records_size / sizeof(CatalogRecord);
+
+    if (catalog->records_available < catalog->record_count ||
+        (uint64_t)names_size < catalog->names_length) {
+        log_error("Backup catalog is truncated");
+        catalog_close(catalog);
+        return FAILURE;
+    }
+
+    if (writable) {
+        int result;
+
+        if ((off_t)(catalog->backup_count * sizeof(CatalogBackup)) != backups_size &&
+            ftruncate(catalog->backups_fd, (off_t)(catalog->backup_count * sizeof(CatalogBackup))) != 0) {
+            log_error("Failed to truncate backup catalog: %s", strerror(errno));
+        }
+        if (catalog->records_available > catalog->record_count ||
+            (uint64_t)names_size > catalog->names_length) {
+            result = catalog_recover(catalog);
+        } else {
+            result = catalog_load_index(catalog);
+            if (result == SUCCESS && index_header(catalog)->dirty) {
+                result = catalog_recover(catalog);
+            }
+        }
+        if (result != SUCCESS) {
+            catalog_close(catalog);
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    if (catalog_load_index(catalog) != SUCCESS) {
+        catalog_close(catalog);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close a catalog opened with catalog_open
+ * @param catalog Catalog to close
+ */
+void catalog_close(BackupCatalog* catalog) {
+    if (catalog->index != NULL) {
+        munmap(catalog->index, catalog->index_size);
+    }
+    unmap_growing_files(catalog);
+    if (catalog->index_fd != -1) {
+        close(catalog->index_fd);
+    }
+    if (catalog->backups_fd != -1) {
+        close(catalog->backups_fd);
+    }
+    if (catalog->records_fd != -1) {
+        close(catalog->records_fd);
+    }
+    if (catalog->names_fd != -1) {
+        close(catalog->names_fd);
+    }
+    memset(catalog, 0, sizeof(BackupCatalog));
+    catalog->backups_fd = catalog->records_fd = catalog->names_fd = catalog->index_fd = -1;
+}
+
+/**
+ * Add a completed backup and the files it holds
+ * Backups must be added in creation order.
+ * @param catalog Catalog opened for writing
+ * @param backup_name Directory name of the backup
+ * @param created Creation time of the backup
+ * @param entries Files in the backup (from its manifest)
+ * @param count Number of entries
+ * @return SUCCESS on success, FAILURE on error
+ */
+int catalog_add_backup(BackupCatalog* catalog, const char* backup_name, time_t created,
+                       const ManifestEntry* entries, int count) {
+    CatalogBackup backup;
+    uint32_t id = catalog->backup_count + 1;
+    uint64_t names_end = catalog->names_length;
+    int saved_errno;
+
+    if (!catalog->writable || strlen(backup_name) >= sizeof(backup.name)) {
+        errno = EINVAL;
+        return FAILURE;
+    }
+    if (catalog->backup_count > 0 &&
+        strcmp(catalog->backups[catalog->backup_count - 1].name, backup_name) >= 0) {
+        log_error("Backup %s is older than the newest catalogued backup", backup_name);
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    index_header(catalog)->dirty = TRUE;
+
+    for (int i = 0; i < count; i++) {
+        const ManifestEntry *entry = &entries[i];
+        uint64_t name_hash = hash_name(entry->filename);
+        CatalogIndexHeader *header = index_header(catalog);
+        CatalogSlot *slot;
+        CatalogRecord record;
+        uint32_t version, latest;
+
+        /* Keep headroom for the two slots this entry may take */
+        if ((uint64_t)(header->used + 2) * 10 >= (uint64_t)header->capacity * 7 &&
+            catalog_rebuild_index(catalog, catalog->records_available, TRUE) != SUCCESS) {
+            goto failed;
+        }
+
+        version = index_find(catalog, CATALOG_SLOT_VERSION, name_hash,
+                             entry->fingerprint.hash, entry->filename, &slot);
+        if (version != 0) {
+            CatalogRecord *existing = &catalog->records[version - 1];
+            if (existing->last_backup + 1 == id && existing->size == entry->fingerprint.size) {
+                /* Unchanged since the previous backup */
+                existing->last_backup = id;
+                continue;
+            }
+        }
+
+        memset(&record, 0, sizeof(record));
+        latest = index_find(catalog, CATALOG_SLOT_NAME, name_hash, 0, entry->filename, &slot);
+        if (latest != 0) {
+            record.name_offset = catalog->records[latest - 1].name_offset;
+            record.name_length = catalog->records[latest - 1].name_length;
+        } else {
+            size_t length = strlen(entry->filename);
+            if (!catalog_has_room(catalog, names_end + length + 1)) {
+                goto failed;
+            }
+            if (pwrite(catalog->names_fd, entry->filename, length + 1, (off_t)names_end) != (ssize_t)(length + 1)) {
+                log_error("Failed to append to backup catalog: %s", strerror(errno));
+                goto failed;
+            }
+            record.name_offset = names_end;
+            record.name_length = (uint32_t)length;
+            names_end += length + 1;
+        }
+        record.name_hash = name_hash;
+        record.content_hash = entry->fingerprint.hash;
+        record.size = entry->fingerprint.size;
+        record.crc32c = entry->fingerprint.has_crc ? entry->fingerprint.crc32c : 0;
+        record.first_backup = id;
+        record.last_backup = id;
+        record.prev_version = version;
+        record.prev_name = latest;
+
+        if (!catalog_has_room(catalog, (catalog->records_available + 1) * sizeof(CatalogRecord))) {
+            goto failed;
+        }
+        if (pwrite(catalog->records_fd, &record, sizeof(record),
+                   (off_t)(catalog->records_available * sizeof(CatalogRecord))) != (ssize_t)sizeof(record)) {
+            log_error("Failed to append to backup catalog: %s", strerror(errno));
+            goto failed;
+        }
+        catalog->records_available++;
+        index_insert(catalog, (uint32_t)catalog->records_available);
+    }
+
+    /* Records and names must be durable before the entry that commits them */
+    if (fdatasync(catalog->records_fd) != 0 || fdatasync(catalog->names_fd) != 0) {
+        log_error("Failed to sync backup catalog: %s", strerror(errno));
+        goto failed;
+    }
+
+    memset(&backup, 0, sizeof(backup));
+    backup.id = id;
+    backup.file_count = (uint32_t)count;
+    backup.created = (int64_t)created;
+    backup.record_count = catalog->records_available;
+    backup.names_length = names_end;
+    snprintf(backup.name, sizeof(backup.name), "%s", backup_name);
+
+    if (!catalog_has_room(catalog, (uint64_t)(catalog->backup_count + 1) * sizeof(CatalogBackup))) {
+        goto failed;
+    }
+    if (pwrite(catalog->backups_fd, &backup, sizeof(backup),
+               (off_t)(catalog->backup_count * sizeof(CatalogBackup))) != (ssize_t)sizeof(backup) ||
+        fdatasync(catalog->backups_fd) != 0) {
+        log_error("Failed to commit backup catalog entry: %s", strerror(errno));
+        ftruncate(catalog->backups_fd, (off_t)(catalog->backup_count * sizeof(CatalogBackup)));
+        goto failed;
+    }
+
+    catalog->backup_count++;
+    catalog->record_count = catalog->records_available;
+    catalog->names_length = names_end;
+    index_header(catalog)->record_count = catalog->record_count;
+    index_header(catalog)->dirty = FALSE;
+    return SUCCESS;
+
+failed:
+    saved_errno = errno;
+    catalog_recover(catalog);
+    errno = saved_errno;
+    return FAILURE;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Add every backup directory newer than the newest catalogued backup
+ * Backups are found with one pass over BACKUP_DIR and read from their
+ * manifests; directories without a manifest are skipped.
+ * @param catalog Catalog opened for writing
+ * @return Number of backups added, or FAILURE on error
+ */
+int catalog_sync(BackupCatalog* catalog) {
+    const char *newest = (catalog->backup_count > 0) ?
+                         catalog->backups[catalog->backup_count - 1].name : "";
+    DirEnumerator iter;
+    DirEntry entry;
+    char **pending = NULL;
+    int pending_count = 0;
+    int pending_capacity = 0;
+    int added = 0;
+
+    if (dir_enum_open(&iter, catalog->dirfd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        char name[NAME_MAX + 1];
+        time_t created;
+
+        if (parse_backup_name(entry.name, &created) != SUCCESS) {
+            continue;
+        }
+        /* Directories, or regular files for archives */
+        if (backup_is_archive(entry.name) ? entry.type == DT_DIR
+                                          : (entry.type != DT_DIR && entry.type != DT_UNKNOWN)) {
+            continue;
+        }
+
+        /* Archives are catalogued under the plain backup name */
+        snprintf(name, sizeof(name), "%s", entry.name);
+        if (backup_is_archive(name)) {
+            name[strlen(name) - strlen(BACKUP_ARCHIVE_SUFFIX)] = '\0';
+        }
+        if (strcmp(name, newest) <= 0) {
+            continue;
+        }
+        if (pending_count == pending_capacity) {
+            int new_capacity = pending_capacity ? pending_capacity * 2 : 16;
+            char **grown = (char**)realloc(pending, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            pending = grown;
+            pending_capacity = new_capacity;
+        }
+        pending[pending_count] = strdup(name);
+        if (pending[pending_count] != NULL) {
+            pending_count++;
+        }
+    }
+    dir_enum_close(&iter);
+
+    /* Timestamped names sort chronologically */
+    if (pending_count > 1) {
+        qsort(pending, pending_count, sizeof(char*), compare_names);
+    }
+
+    for (int i = 0; i < pending_count; i++) {
+        ManifestEntry *entries;
+        int count;
+        time_t created;
+
+        /* The same name twice means a directory and an archive; take the first */
+        if (i > 0 && strcmp(pending[i], pending[i - 1]) == 0) {
+            continue;
+        }
+        parse_backup_name(pending[i], &created);
+        if (backup_load_manifest(catalog->dirfd, pending[i], &entries, &count) != SUCCESS) {
+            log_operation("Backup %s has no manifest, not catalogued", pending[i]);
+        } else {
+            if (catalog_add_backup(catalog, pending[i], created, entries, count) == SUCCESS) {
+                added++;
+            }
+            free(entries);
+        }
+    }
+
+    for (int i = 0; i < pending_count; i++) {
+        free(pending[i]);
+    }
+    free(pending);
+    return added;
+}
+
+/**
+ * Flag a backup as removed by the retention policy
+ * The entry and its records stay, so backup ids remain stable.
+ * @param catalog Catalog opened for writing
+ * @param id Backup id
+ * @return SUCCESS on success, FAILURE on error
+ */
+int catalog_mark_pruned(BackupCatalog* catalog, uint32_t id) {
+    uint32_t flags;
+    off_t offset;
+
+    if (!catalog->writable || id == 0 || id > catalog->backup_count) {
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    flags = catalog->backups[id - 1].flags | CATALOG_BACKUP_PRUNED;
+    offset = (off_t)((id - 1) * sizeof(CatalogBackup) + offsetof(CatalogBackup, flags));
+    if (pwrite(catalog->backups_fd, &flags, sizeof(flags), offset) != (ssize_t)sizeof(flags) ||
+        fdatasync(catalog->backups_fd) != 0) {
+        log_error("Failed to update backup catalog: %s", strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Parse the creation time out of a backup name
+ * @param name Directory or archive name (backup_YYYY-MM-DD_HH-MM-SS[.pack])
+ * @param created Receives the local creation time
+ * @return SUCCESS if name is a backup name, FAILURE otherwise
+ */
+int parse_backup_name(const char* name, time_t* created) {
+    struct tm tm_info;
+    const char *end;
+
+    if (strncmp(name, BACKUP_NAME_PREFIX, strlen(BACKUP_NAME_PREFIX)) != 0) {
+        return FAILURE;
+    }
+
+    memset(&tm_info, 0, sizeof(tm_info));
+    end = strptime(name + strlen(BACKUP_NAME_PREFIX), BACKUP_NAME_FORMAT, &tm_info);
+    if (end == NULL || (*end != '\0' && strcmp(end, BACKUP_ARCHIVE_SUFFIX) != 0)) {
+        return FAILURE;
+    }
+    tm_info.tm_isdst = -1;
+    *created = mktime(&tm_info);
+    return SUCCESS;
+}
+
+/**
+ * Check whether a backup name refers to an archive file
+ */
+int backup_is_archive(const char* name) {
+    size_t length = strlen(name);
+    size_t suffix = strlen(BACKUP_ARCHIVE_SUFFIX);
+
+    return length > suffix && strcmp(name + length - suffix, BACKUP_ARCHIVE_SUFFIX) == 0;
+}
+
+/**
+ * Load the manifest of a backup in either layout
+ * A plain backup name is looked up as a directory first, then as an archive.
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param name Backup name, with or without the archive suffix
+ * @param entries Receives a malloc'd array sorted by name (caller frees)
+ * @param count Receives the number of entries
+ * @return SUCCESS on success, FAILURE if there is no such backup or no manifest
+ */
+int backup_load_manifest(int backup_root_fd, const char* name, ManifestEntry** entries, int* count) {
+    char archive[NAME_MAX + 1];
+    PackReader reader;
+    int result;
+
+    if (!backup_is_archive(name)) {
+        int backup_fd = openat(backup_root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (backup_fd != -1) {
+            result = manifest_load(backup_fd, entries, count);
+            close(backup_fd);
+            return result;
+        }
+        snprintf(archive, sizeof(archive), "%s" BACKUP_ARCHIVE_SUFFIX, name);
+        name = archive;
+    }
+
+    if (pack_open(&reader, backup_root_fd, name) != SUCCESS) {
+        return FAILURE;
+    }
+    result = pack_manifest(&reader, entries, count);
+    pack_close(&reader);
+    return result;
+}
+
+/**
+ * Get the Merkle tree of a backup
+ * Directory backups have it stored in the manifest; for archives and older
+ * manifests it is built from the entries.
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param name Backup name
+ * @param entries The backup's entries from backup_load_manifest
+ * @param count Number of entries
+ * @param tree Receives the tree
+ * @return SUCCESS on success, FAILURE on error
+ */
+int backup_load_tree(int backup_root_fd, const char* name, const ManifestEntry* entries, int count,
+                     MerkleTree* tree) {
+    if (!backup_is_archive(name)) {
+        int backup_fd = openat(backup_root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (backup_fd != -1) {
+            int result = merkle_load(backup_fd, tree);
+            close(backup_fd);
+            if (result == SUCCESS) {
+                return SUCCESS;
+            }
+        }
+    }
+    return merkle_build(entries, count, tree);
+}
+
+/**
+ * Get a backup by its catalog id
+ * @return The backup, or NULL if there is no such backup
+ */
+const CatalogBackup* catalog_backup_by_id(const BackupCatalog* catalog, uint32_t id) {
+    if (id == 0 || id > catalog->backup_count) {
+        return NULL;
+    }
+    return &catalog->backups[id - 1];
+}
+
+/**
+ * Get a backup by its directory name
+ * @return The backup, or NULL if it is not catalogued
+ */
+const CatalogBackup* catalog_backup_by_name(const BackupCatalog* catalog, const char* name) {
+    uint32_t low = 0, high = catalog->backup_count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int order = strcmp(catalog->backups[mid].name, name);
+        if (order == 0) {
+            return &catalog->backups[mid];
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the newest backup created at or before a point in time
+ * Pruned backups are skipped.
+ * @return The backup, or NULL if no remaining backup is old enough
+ */
+const CatalogBackup* catalog_backup_at(const BackupCatalog* catalog, time_t when) {
+    uint32_t low = 0, high = catalog->backup_count;
+
+    /* First backup created after when */
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (catalog->backups[mid].created <= (int64_t)when) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    while (low > 0 && (catalog->backups[low - 1].flags & CATALOG_BACKUP_PRUNED)) {
+        low--;
+    }
+    return (low > 0) ? &catalog->backups[low - 1] : NULL;
+}
+
+/**
+ * Get a committed record by number, e.g. to follow prev_version/prev_name
+ * @return The record, or NULL for 0 and uncommitted numbers
+ */
+const CatalogRecord* catalog_record(const BackupCatalog* catalog, uint32_t number) {
+    if (number == 0 || number > catalog->record_count) {
+        return NULL;
+    }
+    return &catalog->records[number - 1];
+}
+
+/**
+ * Get the file name of a record
+ */
+const char* catalog_record_name(const BackupCatalog* catalog, const CatalogRecord* record) {
+    return catalog->names + record->name_offset;
+}
+
+/**
+ * Step back from a record that a concurrent writer has not committed yet
+ */
+static const CatalogRecord* committed_record(const BackupCatalog* catalog, uint32_t number, int kind) {
+    while (number > catalog->record_count) {
+        const CatalogRecord *record = readable_record(catalog, number);
+        if (record == NULL) {
+            return NULL;
+        }
+        number = (kind == CATALOG_SLOT_VERSION) ? record->prev_version : record->prev_name;
+    }
+    return catalog_record(catalog, number);
+}
+
+/**
+ * Find the newest record of a file version
+ * Older ranges of the same version follow through prev_version.
+ * @param catalog Open catalog
+ * @param filename File name
+ * @param content_hash Content fingerprint hash
+ * @return The record, or NULL if no backup holds this version
+ */
+const CatalogRecord* catalog_lookup(const BackupCatalog* catalog, const char* filename,
+                                    uint64_t content_hash) {
+    CatalogSlot *slot;
+    uint32_t number = index_find(catalog, CATALOG_SLOT_VERSION, hash_name(filename),
+                                 content_hash, filename, &slot);
+    return committed_record(catalog, number, CATALOG_SLOT_VERSION);
+}
+
+/**
+ * Find the newest record of a file name
+ * Every older version follows through prev_name.
+ * @param catalog Open catalog
+ * @param filename File name
+ * @return The record, or NULL if the file was never backed up
+ */
+const CatalogRecord* catalog_lookup_name(const BackupCatalog* catalog, const char* filename) {
+    CatalogSlot *slot;
+    uint32_t number = index_find(catalog, CATALOG_SLOT_NAME, hash_name(filename),
+                                 0, filename, &slot);
+    return committed_record(catalog, number, CATALOG_SLOT_NAME);
+}
+
+/**
+ * List the backups that hold a file version
+ * Pruned backups are not counted.
+ * @param catalog Open catalog
+ * @param filename File name
+ * @param content_hash Content fingerprint hash
+ * @param ids Receives backup ids, newest range first (may be NULL)
+ * @param max_ids Capacity of ids
+ * @return Total number of backups holding the version (may exceed max_ids)
+ */
+int catalog_backups_holding(const BackupCatalog* catalog, const char* filename,
+                            uint64_t content_hash, uint32_t* ids, int max_ids) {
+    const CatalogRecord *record = catalog_lookup(catalog, filename, content_hash);
+    int total = 0;
+
+    while (record != NULL) {
+        uint32_t last = record->last_backup;
+
+        if (last > catalog->backup_count) {
+            last = catalog->backup_count;
+        }
+        for (uint32_t id = record->first_backup; id <= last; id++) {
+            if (catalog->backups[id - 1].flags & CATALOG_BACKUP_PRUNED) {
+                continue;
+            }
+            if (ids != NULL && total < max_ids) {
+                ids[total] = id;
+            }
+            total++;
+        }
+        record = catalog_record(catalog, record->prev_version);
+    }
+    return total;
+}
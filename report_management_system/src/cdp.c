@@ -0,0 +1,696 @@
+/**
+ * @file cdp.c
+ * @brief Continuous data protection: every change captured as it happens
+ *
+ * With BACKUP_FORMAT_CONTINUOUS each report the monitor sees created or
+ * modified is copied into BACKUP_DIR/continuous within the same monitor
+ * pass, as an immutable version file objects/<sequence>, and recorded by
+ * one line appended to the journal:
+ *
+ *     <sequence> <captured> <hash, 16 hex> <crc32c, 8 hex or -> <size> <name>
+ *
+ * Versions are only ever added, so the journal is the full history of
+ * every report. The nightly backup becomes a checkpoint: a backup
+ * directory of hard links to versions already in the log, plus the usual
+ * MANIFEST. Only files the log does not hold yet are copied. The catalog,
+ * restore and retention treat a checkpoint like any other backup; the
+ * retention pass also removes versions that no checkpoint links to once
+ * they are older than CDP_KEEP_DAYS, keeping the latest version of every
+ * file.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+
+#define CDP_OBJECT_FORMAT "%012llu"
+
+/**
+ * @struct CdpLatest
+ * @brief Newest captured version of one file name
+ */
+typedef struct {
+    char *name;                /* NULL for a free slot */
+    uint64_t sequence;
+    FileFingerprint fingerprint;
+} CdpLatest;
+
+/* Log state, protected by cdp_lock */
+static pthread_mutex_t cdp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cdp_is_open = FALSE;
+static int cdp_dir_fd = -1;
+static int cdp_objects_fd = -1;
+static int cdp_journal_fd = -1;
+static off_t cdp_journal_size = 0;      /* End of the last complete line */
+static int cdp_journal_torn = FALSE;    /* Partial line past cdp_journal_size */
+static uint64_t cdp_next_sequence = 1;
+static int cdp_pending = 0;             /* Journal lines not yet synced */
+static CdpLatest *cdp_latest = NULL;    /* Open-addressed by name */
+static size_t cdp_slots = 0;
+static size_t cdp_used = 0;
+
+static size_t name_hash(const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * Find the slot of a name, or the free slot where it belongs
+ */
+static CdpLatest* cdp_slot(CdpLatest* table, size_t slots, const char* name) {
+    size_t i = name_hash(name) & (slots - 1);
+
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (slots - 1);
+    }
+    return &table[i];
+}
+
+static CdpLatest* cdp_lookup(const char* name) {
+    CdpLatest *slot;
+
+    if (cdp_slots == 0) {
+        return NULL;
+    }
+    slot = cdp_slot(cdp_latest, cdp_slots, name);
+    return (slot->name != NULL) ? slot : NULL;
+}
+
+/**
+ * Record a version as the newest of its name
+ */
+static int cdp_remember(const char* name, uint64_t sequence, const FileFingerprint* fingerprint) {
+    CdpLatest *slot;
+
+    if ((cdp_used + 1) * 2 > cdp_slots) {
+        size_t new_slots = cdp_slots ? cdp_slots * 2 : 1024;
+        CdpLatest *grown = (CdpLatest*)calloc(new_slots, sizeof(CdpLatest));
+
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        for (size_t i = 0; i < cdp_slots; i++) {
+            if (cdp_latest[i].name != NULL) {
+                *cdp_slot(grown, new_slots, cdp_latest[i].name) = cdp_latest[i];
+            }
+        }
+        free(cdp_latest);
+        cdp_latest = grown;
+        cdp_slots = new_slots;
+    }
+
+    slot = cdp_slot(cdp_latest, cdp_slots, name);
+    if (slot->name == NULL) {
+        slot->name = strdup(name);
+        if (slot->name == NULL) {
+            return FAILURE;
+        }
+        cdp_used++;
+    }
+    if (sequence >= slot->sequence) {
+        slot->sequence = sequence;
+        slot->fingerprint = *fingerprint;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Parse one journal line
+ * @return SUCCESS if the line is a complete version record
+ */
+static int parse_journal_line(const char* line, CdpVersion* version) {
+    unsigned long long sequence, hash, size;
+    long long captured;
+    char crc[16];
+    int name_offset = 0;
+    size_t length;
+
+    if (sscanf(line, "%llu %lld %16llx %15s %llu %n", &sequence, &captured, &hash, crc,
+               &size, &name_offset) != 5 || name_offset == 0) {
+        return FAILURE;
+    }
+    length = strcspn(line + name_offset, "\n");
+    if (length == 0 || length > NAME_MAX || line[name_offset + length] != '\n') {
+        return FAILURE;
+    }
+
+    memset(version, 0, sizeof(CdpVersion));
+    version->sequence = sequence;
+    version->captured = (time_t)captured;
+    memcpy(version->filename, line + name_offset, length);
+    version->fingerprint.hash = hash;
+    version->fingerprint.size = size;
+    if (strcmp(crc, "-") != 0) {
+        version->fingerprint.crc32c = (uint32_t)strtoul(crc, NULL, 16);
+        version->fingerprint.has_crc = TRUE;
+    }
+    version->fingerprint.valid = TRUE;
+    return SUCCESS;
+}
+
+/**
+ * Read every version recorded in a journal
+ * @param dir_fd Descriptor of the continuous log directory
+ * @param filename Only versions of this file, or NULL for all
+ * @return SUCCESS on success, FAILURE if the journal cannot be read
+ */
+static int read_journal(int dir_fd, const char* filename, CdpVersion** versions, int* count) {
+    char line[MAX_LINE_LENGTH];
+    CdpVersion *list = NULL;
+    int used = 0, capacity = 0;
+    FILE *file;
+    int fd;
+
+    *versions = NULL;
+    *count = 0;
+    fd = openat(dir_fd, CDP_JOURNAL_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (file = fdopen(fd, "r")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        CdpVersion version;
+
+        if (parse_journal_line(line, &version) != SUCCESS ||
+            (filename != NULL && strcmp(version.filename, filename) != 0)) {
+            continue;
+        }
+        if (used == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            CdpVersion *grown = (CdpVersion*)realloc(list, new_capacity * sizeof(CdpVersion));
+            if (grown == NULL) {
+                log_error("Memory allocation failed for the continuous log");
+                free(list);
+                fclose(file);
+                return FAILURE;
+            }
+            list = grown;
+            capacity = new_capacity;
+        }
+        list[used++] = version;
+    }
+    fclose(file);
+
+    *versions = list;
+    *count = used;
+    return SUCCESS;
+}
+
+/**
+ * Cut a journal back to its last complete line
+ * A crash while appending can leave half a line at the end.
+ */
+static void repair_journal(int fd) {
+    struct stat st;
+    char tail[MAX_LINE_LENGTH];
+    off_t end, start;
+    ssize_t bytes_read;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return;
+    }
+    end = st.st_size;
+    start = (end > (off_t)sizeof(tail)) ? end - (off_t)sizeof(tail) : 0;
+    bytes_read = pread(fd, tail, (size_t)(end - start), start);
+    if (bytes_read <= 0 || tail[bytes_read - 1] == '\n') {
+        return;
+    }
+    while (bytes_read > 0 && tail[bytes_read - 1] != '\n') {
+        bytes_read--;
+    }
+    log_error("Continuous log journal ends in a partial record, truncating it");
+    if (ftruncate(fd, start + bytes_read) != 0) {
+        log_error("Failed to repair the continuous log journal: %s", strerror(errno));
+    }
+}
+
+/**
+ * Open the continuous log, creating it if needed
+ * Loads the newest version of every file from the journal. Calling it
+ * again while open does nothing.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cdp_open(void) {
+    int backup_root_fd;
+    CdpVersion *versions = NULL;
+    int count = 0;
+
+    pthread_mutex_lock(&cdp_lock);
+    if (cdp_is_open) {
+        pthread_mutex_unlock(&cdp_lock);
+        return SUCCESS;
+    }
+
+    backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+    if (backup_root_fd == -1) {
+        pthread_mutex_unlock(&cdp_lock);
+        return FAILURE;
+    }
+    mkdirat(backup_root_fd, CDP_DIR_NAME, 0755);
+    cdp_dir_fd = openat(backup_root_fd, CDP_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cdp_dir_fd != -1) {
+        mkdirat(cdp_dir_fd, CDP_OBJECTS_NAME, 0755);
+        cdp_objects_fd = openat(cdp_dir_fd, CDP_OBJECTS_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        cdp_journal_fd = openat(cdp_dir_fd, CDP_JOURNAL_NAME,
+                                O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (cdp_dir_fd == -1 || cdp_objects_fd == -1 || cdp_journal_fd == -1) {
+        log_error("Failed to open the continuous log: %s", strerror(errno));
+        goto failed;
+    }
+
+    repair_journal(cdp_journal_fd);
+    cdp_journal_size = lseek(cdp_journal_fd, 0, SEEK_END);
+    if (cdp_journal_size == -1) {
+        log_error("Failed to open the continuous log: %s", strerror(errno));
+        goto failed;
+    }
+    if (read_journal(cdp_dir_fd, NULL, &versions, &count) != SUCCESS) {
+        goto failed;
+    }
+    for (int i = 0; i < count; i++) {
+        if (cdp_remember(versions[i].filename, versions[i].sequence,
+                         &versions[i].fingerprint) != SUCCESS) {
+            log_error("Memory allocation failed for the continuous log");
+            free(versions);
+            goto failed;
+        }
+        if (versions[i].sequence >= cdp_next_sequence) {
+            cdp_next_sequence = versions[i].sequence + 1;
+        }
+    }
+    free(versions);
+
+    cdp_is_open = TRUE;
+    pthread_mutex_unlock(&cdp_lock);
+    log_operation("Continuous log open: %zu files, next version %llu",
+                  cdp_used, (unsigned long long)cdp_next_sequence);
+    return SUCCESS;
+
+failed:
+    pthread_mutex_unlock(&cdp_lock);
+    cdp_close();
+    return FAILURE;
+}
+
+/**
+ * Sync and close the continuous log
+ */
+void cdp_close(void) {
+    cdp_sync();
+
+    pthread_mutex_lock(&cdp_lock);
+    if (cdp_journal_fd != -1) {
+        close(cdp_journal_fd);
+    }
+    if (cdp_objects_fd != -1) {
+        close(cdp_objects_fd);
+    }
+    if (cdp_dir_fd != -1) {
+        close(cdp_dir_fd);
+    }
+    cdp_journal_fd = cdp_objects_fd = cdp_dir_fd = -1;
+    cdp_journal_size = 0;
+    cdp_journal_torn = FALSE;
+    for (size_t i = 0; i < cdp_slots; i++) {
+        free(cdp_latest[i].name);
+    }
+    free(cdp_latest);
+    cdp_latest = NULL;
+    cdp_slots = cdp_used = 0;
+    cdp_next_sequence = 1;
+    cdp_is_open = FALSE;
+    pthread_mutex_unlock(&cdp_lock);
+}
+
+/**
+ * Capture one file as a new version; cdp_lock must be held
+ * @param captured Receives the newest version of the file afterwards
+ */
+static int cdp_capture_locked(int dirfd, const char* filename, const CdpLatest** captured) {
+    char object[32];
+    char line[MAX_LINE_LENGTH];
+    char crc[9] = "-";
+    FileFingerprint fingerprint;
+    const CdpLatest *latest;
+    uint64_t sequence = cdp_next_sequence;
+    int object_fd;
+    int length;
+    ssize_t written;
+
+    /* Appending after half a line would make the next record unreadable too */
+    if (cdp_journal_torn) {
+        if (ftruncate(cdp_journal_fd, cdp_journal_size) != 0) {
+            log_error("Failed to repair the continuous log journal: %s", strerror(errno));
+            return FAILURE;
+        }
+        cdp_journal_torn = FALSE;
+    }
+
+    snprintf(object, sizeof(object), CDP_OBJECT_FORMAT, (unsigned long long)sequence);
+    if (copy_file_verified_at(dirfd, filename, cdp_objects_fd, object, &fingerprint) != SUCCESS) {
+        log_error("Failed to capture %s: %s", filename, strerror(errno));
+        unlinkat(cdp_objects_fd, object, 0);
+        return FAILURE;
+    }
+
+    /* The version must be on disk before the journal refers to it */
+    object_fd = openat(cdp_objects_fd, object, O_RDONLY | O_CLOEXEC);
+    if (object_fd == -1 || fdatasync(object_fd) != 0) {
+        log_error("Failed to sync captured version of %s: %s", filename, strerror(errno));
+        if (object_fd != -1) {
+            close(object_fd);
+        }
+        unlinkat(cdp_objects_fd, object, 0);
+        return FAILURE;
+    }
+    close(object_fd);
+
+    if (fingerprint.has_crc) {
+        snprintf(crc, sizeof(crc), "%08x", fingerprint.crc32c);
+    }
+    length = snprintf(line, sizeof(line), "%llu %lld %016llx %s %llu %s\n",
+                      (unsigned long long)sequence, (long long)time(NULL),
+                      (unsigned long long)fingerprint.hash, crc,
+                      (unsigned long long)fingerprint.size, filename);
+    if (length >= (int)sizeof(line)) {
+        log_error("Failed to record captured version of %s: name too long", filename);
+        unlinkat(cdp_objects_fd, object, 0);
+        return FAILURE;
+    }
+    written = write(cdp_journal_fd, line, (size_t)length);
+    if (written >= 0 && written != length) {
+        errno = EIO;
+    }
+    if (written != length || cdp_remember(filename, sequence, &fingerprint) != SUCCESS) {
+        int saved_errno = errno;
+
+        /* Cut off whatever part of the line got written, so the next one starts clean */
+        cdp_journal_torn = (ftruncate(cdp_journal_fd, cdp_journal_size) != 0);
+        log_error("Failed to record captured version of %s: %s", filename, strerror(saved_errno));
+        unlinkat(cdp_objects_fd, object, 0);
+        errno = saved_errno;
+        return FAILURE;
+    }
+    cdp_journal_size += length;
+
+    cdp_next_sequence++;
+    cdp_pending++;
+    latest = cdp_lookup(filename);
+    if (captured != NULL) {
+        *captured = latest;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Capture the current content of a file into the continuous log
+ * Content identical to the newest captured version of the same name is
+ * not stored again. Does nothing unless cdp_open() was called.
+ * @param dirfd Directory of the file
+ * @param filename File name
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cdp_capture(int dirfd, const char* filename) {
+    FileFingerprint current;
+    const CdpLatest *latest;
+    int result = SUCCESS;
+
+    /* Usually answered by the fingerprint cache the monitor just filled */
+    if (fingerprint_file_at(dirfd, filename, &current) != SUCCESS) {
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+
+    pthread_mutex_lock(&cdp_lock);
+    if (cdp_is_open) {
+        latest = cdp_lookup(filename);
+        if (latest == NULL || !fingerprint_equal(&latest->fingerprint, &current)) {
+            result = cdp_capture_locked(dirfd, filename, NULL);
+        }
+    }
+    pthread_mutex_unlock(&cdp_lock);
+
+    return result;
+}
+
+/**
+ * Make every capture so far durable
+ * Called once per monitor pass, so a burst of uploads costs one sync.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cdp_sync(void) {
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&cdp_lock);
+    if (cdp_is_open && cdp_pending > 0) {
+        if (fdatasync(cdp_journal_fd) != 0) {
+            log_error("Failed to sync the continuous log journal: %s", strerror(errno));
+            result = FAILURE;
+        } else {
+            cdp_pending = 0;
+        }
+    }
+    pthread_mutex_unlock(&cdp_lock);
+
+    return result;
+}
+
+/**
+ * Remove a checkpoint that failed, so no unusable backup is left behind
+ * Only the links it made and its MANIFEST are removed; the versions they
+ * point to stay in the log.
+ */
+static void discard_checkpoint(int backup_root_fd, int backup_fd, const char* backup_name,
+                               const ManifestEntry* manifest, int count) {
+    int saved_errno = errno;
+
+    if (backup_fd != -1) {
+        for (int i = 0; i < count; i++) {
+            unlinkat(backup_fd, manifest[i].filename, 0);
+        }
+        unlinkat(backup_fd, BACKUP_MANIFEST_NAME, 0);
+    }
+    if (unlinkat(backup_root_fd, backup_name, AT_REMOVEDIR) != 0) {
+        log_error("Failed to remove incomplete checkpoint %s: %s", backup_name, strerror(errno));
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Write a checkpoint backup of the dashboard
+ *
+ * The backup directory is filled with hard links to the captured versions
+ * of the dashboard's files; a file whose current content is not in the log
+ * yet is captured first. The MANIFEST records what each link holds, so the
+ * checkpoint is an ordinary backup to everything that reads backups.
+ *
+ * @param dashboard_fd Descriptor of DASHBOARD_DIR
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param backup_name Name of the backup directory to create
+ * @return SUCCESS if every file is in the checkpoint, FAILURE otherwise
+ */
+int cdp_checkpoint(int dashboard_fd, int backup_root_fd, const char* backup_name) {
+    DirEnumerator iter;
+    DirEntry entry;
+    ManifestEntry *manifest = NULL;
+    int capacity = 0, count = 0;
+    int linked = 0, captured = 0, failed = 0;
+    int backup_fd;
+    int result = SUCCESS;
+
+    if (cdp_open() != SUCCESS) {
+        return FAILURE;
+    }
+    if (mkdirat(backup_root_fd, backup_name, 0755) != 0) {
+        log_error("Failed to create backup directory: %s", strerror(errno));
+        return FAILURE;
+    }
+    backup_fd = openat(backup_root_fd, backup_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (backup_fd == -1 || dir_enum_open(&iter, dashboard_fd) != SUCCESS) {
+        log_error("Failed to open directories for checkpoint: %s", strerror(errno));
+        discard_checkpoint(backup_root_fd, backup_fd, backup_name, NULL, 0);
+        if (backup_fd != -1) {
+            close(backup_fd);
+        }
+        return FAILURE;
+    }
+
+    while (dir_enum_next(&iter, &entry)) {
+        FileFingerprint current;
+        const CdpLatest *latest;
+        char object[32];
+        int done = FALSE;
+
+        if (entry.type != DT_REG && entry.type != DT_UNKNOWN) {
+            continue;
+        }
+        if (count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            ManifestEntry *grown = (ManifestEntry*)realloc(manifest, new_capacity * sizeof(ManifestEntry));
+            if (grown == NULL) {
+                log_error("Memory allocation failed for checkpoint");
+                failed++;
+                break;
+            }
+            manifest = grown;
+            capacity = new_capacity;
+        }
+        if (fingerprint_file_at(dashboard_fd, entry.name, &current) != SUCCESS) {
+            log_error("Failed to read %s for checkpoint: %s", entry.name, strerror(errno));
+            failed++;
+            continue;
+        }
+
+        pthread_mutex_lock(&cdp_lock);
+        latest = cdp_lookup(entry.name);
+        if (latest != NULL && fingerprint_equal(&latest->fingerprint, &current)) {
+            snprintf(object, sizeof(object), CDP_OBJECT_FORMAT, (unsigned long long)latest->sequence);
+            done = (linkat(cdp_objects_fd, object, backup_fd, entry.name, 0) == 0);
+            linked += done;
+        }
+        /* Not captured yet, or the version cannot take another link */
+        if (!done && cdp_capture_locked(dashboard_fd, entry.name, &latest) == SUCCESS) {
+            snprintf(object, sizeof(object), CDP_OBJECT_FORMAT, (unsigned long long)latest->sequence);
+            done = (linkat(cdp_objects_fd, object, backup_fd, entry.name, 0) == 0);
+            captured += done;
+        }
+        if (done) {
+            memset(&manifest[count], 0, sizeof(ManifestEntry));
+            snprintf(manifest[count].filename, sizeof(manifest[count].filename), "%s", entry.name);
+            manifest[count].fingerprint = latest->fingerprint;
+            count++;
+        } else {
+            log_error("Failed to add %s to checkpoint: %s", entry.name, strerror(errno));
+            failed++;
+        }
+        pthread_mutex_unlock(&cdp_lock);
+    }
+    dir_enum_close(&iter);
+
+    if (cdp_sync() != SUCCESS || manifest_write(backup_fd, manifest, count) != SUCCESS) {
+        result = FAILURE;
+    }
+
+    if (result == SUCCESS && failed == 0) {
+        log_operation("Checkpoint %s: %d files, %d already in the continuous log, %d captured now",
+                      backup_name, count, linked, captured);
+    } else {
+        log_error("Checkpoint %s incomplete: %d files, %d failed", backup_name, count, failed);
+        /* A partial checkpoint is kept; one with nothing usable in it is not */
+        if (count == 0 || result != SUCCESS) {
+            discard_checkpoint(backup_root_fd, backup_fd, backup_name, manifest, count);
+            result = FAILURE;
+        }
+    }
+    close(backup_fd);
+    free(manifest);
+    return result;
+}
+
+/**
+ * List captured versions from the journal, oldest first
+ * Works without cdp_open(), e.g. from the restore tool.
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param filename Only versions of this file, or NULL for all
+ * @param versions Receives a malloc'd array (caller frees)
+ * @param count Receives the number of versions
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cdp_history(int backup_root_fd, const char* filename, CdpVersion** versions, int* count) {
+    int dir_fd;
+    int result;
+
+    *versions = NULL;
+    *count = 0;
+    dir_fd = openat(backup_root_fd, CDP_DIR_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+    result = read_journal(dir_fd, filename, versions, count);
+    close(dir_fd);
+    return result;
+}
+
+/**
+ * Copy a captured version out of the log, checking it against the journal
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param version Version from cdp_history()
+ * @param dst_dirfd Directory to write to
+ * @param destination File to create or replace
+ * @return SUCCESS on success, FAILURE if missing, pruned or damaged
+ */
+int cdp_extract(int backup_root_fd, const CdpVersion* version, int dst_dirfd, const char* destination) {
+    char object[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    FileFingerprint copied;
+    int result = SUCCESS;
+
+    snprintf(object, sizeof(object), CDP_DIR_NAME "/" CDP_OBJECTS_NAME "/" CDP_OBJECT_FORMAT,
+             (unsigned long long)version->sequence);
+    snprintf(temp, sizeof(temp), ".cdp.%ld.tmp", (long)getpid());
+
+    if (copy_file_verified_at(backup_root_fd, object, dst_dirfd, temp, &copied) != SUCCESS) {
+        log_error("Failed to read version %llu of %s: %s", (unsigned long long)version->sequence,
+                  version->filename, strerror(errno));
+        result = FAILURE;
+    } else if (!fingerprint_equal(&copied, &version->fingerprint)) {
+        log_error("Version %llu of %s does not match the journal",
+                  (unsigned long long)version->sequence, version->filename);
+        result = FAILURE;
+    } else if (renameat(dst_dirfd, temp, dst_dirfd, destination) != 0) {
+        log_error("Failed to restore %s: %s", destination, strerror(errno));
+        result = FAILURE;
+    }
+
+    if (result != SUCCESS) {
+        unlinkat(dst_dirfd, temp, 0);
+    }
+    return result;
+}
+
+static int compare_sequences(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get the sequence numbers of the newest version of every file
+ * These must survive pruning whatever their age.
+ * @param sequences Receives a malloc'd sorted array (caller frees)
+ * @param count Receives the number of entries
+ * @return SUCCESS on success, FAILURE if the log is not open in this process
+ */
+int cdp_latest_versions(uint64_t** sequences, int* count) {
+    uint64_t *list;
+    int used = 0;
+
+    *sequences = NULL;
+    *count = 0;
+    pthread_mutex_lock(&cdp_lock);
+    if (!cdp_is_open) {
+        pthread_mutex_unlock(&cdp_lock);
+        return FAILURE;
+    }
+    list = (uint64_t*)malloc((cdp_used + 1) * sizeof(uint64_t));
+    if (list == NULL) {
+        pthread_mutex_unlock(&cdp_lock);
+        return FAILURE;
+    }
+    for (size_t i = 0; i < cdp_slots; i++) {
+        if (cdp_latest[i].name != NULL) {
+            list[used++] = cdp_latest[i].sequence;
+        }
+    }
+    pthread_mutex_unlock(&cdp_lock);
+
+    qsort(list, used, sizeof(uint64_t), compare_sequences);
+    *sequences = list;
+    *count = used;
+    return SUCCESS;
+}
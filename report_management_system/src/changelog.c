@@ -0,0 +1,994 @@
+/**
+ * @file changelog.c
+ * @brief Binary change log with a time index and per-user postings
+ *
+ * Every change is a fixed 16-byte record (ChangeLogRecord): time, owner
+ * uid, file name id and action code. File names are interned once in
+ * CHANGELOG_DIR/names, one NUL-terminated string each, and a record
+ * refers to a name by its offset in that file. Records are appended to
+ * numbered segments, <number>.seg:
+ *
+ *     header    "RPTCLOG1", version, record size
+ *     records   in time order; times never go backwards
+ *
+ * Once a segment holds CHANGELOG_SEGMENT_RECORDS records it is sealed by
+ * appending its index:
+ *
+ *     time index    time of every CHANGELOG_INDEX_STRIDE-th record
+ *     users         ChangeLogUser entries, sorted by uid
+ *     postings      record numbers of each user, ascending
+ *     trailer       "RPTCIDX1", counts and a fingerprint of the index
+ *
+ * A time range is found by binary search, first in the time index and
+ * then among at most CHANGELOG_INDEX_STRIDE records; a user's changes
+ * are read straight from their postings. The segment being written has
+ * no index and is searched on its records alone. Names and records are
+ * only appended, and names are written before the records that use them,
+ * so readers can map the files while the daemon writes.
+ */
+
+#define LOG_MODULE LOG_MODULE_FILES
+#include "report_system.h"
+#include <sys/mman.h>
+
+#define CHANGELOG_MAGIC         "RPTCLOG1"
+#define CHANGELOG_INDEX_MAGIC   "RPTCIDX1"
+#define CHANGELOG_VERSION       1
+#define CHANGELOG_SEGMENT_FORMAT "%08u" CHANGELOG_SEGMENT_SUFFIX
+#define CHANGELOG_USER_CACHE    64
+
+/**
+ * @struct ChangeLogHeader
+ * @brief Start of every segment file
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} ChangeLogHeader;
+
+/**
+ * @struct ChangeLogTrailer
+ * @brief End of a sealed segment
+ */
+typedef struct {
+    char magic[8];
+    uint32_t record_count;
+    uint32_t time_index_count;
+    uint32_t user_count;
+    uint32_t reserved;
+    uint64_t index_hash;        /* Fingerprint of time index, users and postings */
+} ChangeLogTrailer;
+
+/**
+ * @struct ChangeLogName
+ * @brief Interned name slot, open-addressed by name
+ */
+typedef struct {
+    uint32_t offset;            /* Offset in the names file */
+    uint32_t used;
+} ChangeLogName;
+
+/**
+ * @struct ChangeLogOwner
+ * @brief Cached owner name to uid lookup
+ */
+typedef struct {
+    char name[MAX_USER_LENGTH]; /* Empty for a free slot */
+    uint32_t uid;
+} ChangeLogOwner;
+
+/* Writer state, protected by changelog_lock */
+static pthread_mutex_t changelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static int changelog_is_open = FALSE;
+static int changelog_dir_fd = -1;
+static int changelog_names_fd = -1;
+static int changelog_segment_fd = -1;
+static uint32_t changelog_segment_number = 0;
+static uint32_t changelog_segment_count = 0;    /* Records in the open segment */
+static int changelog_segment_sealed = FALSE;    /* Open segment has its index */
+static int changelog_segment_torn = FALSE;      /* Bytes past the last record to cut */
+static uint32_t changelog_last_time = 0;
+
+static char *names_data = NULL;             /* Copy of the names file */
+static size_t names_size = 0;
+static size_t names_capacity = 0;
+static size_t names_written = 0;            /* Bytes of names_data in the file */
+static int names_torn = FALSE;              /* Names file holds bytes past names_written */
+static ChangeLogName *names_table = NULL;
+static size_t names_slots = 0;
+static size_t names_used = 0;
+
+static ChangeLogRecord pending[CHANGELOG_BUFFER_RECORDS];
+static int pending_count = 0;
+static ChangeLogOwner owner_cache[CHANGELOG_USER_CACHE];
+
+static const char* const action_names[CHANGE_ACTION_COUNT] = {
+    "other", "create", "modify", "delete", "rename", "replace", "transfer"
+};
+
+static size_t name_hash(const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+    }
+    return (size_t)hash;
+}
+
+static int write_all(int fd, const void* data, size_t length) {
+    const char *bytes = (const char*)data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FAILURE;
+        }
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Map an action string to its code
+ * @return CHANGE_ACTION_*, CHANGE_ACTION_OTHER if the action is unknown
+ */
+int changelog_action_code(const char* action) {
+    for (int code = 1; code < CHANGE_ACTION_COUNT; code++) {
+        if (strcmp(action, action_names[code]) == 0) {
+            return code;
+        }
+    }
+    return CHANGE_ACTION_OTHER;
+}
+
+/**
+ * Map an action code to its string
+ */
+const char* changelog_action_name(uint32_t code) {
+    return (code < CHANGE_ACTION_COUNT) ? action_names[code] : action_names[CHANGE_ACTION_OTHER];
+}
+
+/**
+ * Find the slot of a name, or the free slot where it belongs
+ */
+static ChangeLogName* name_slot(ChangeLogName* table, size_t slots, const char* name) {
+    size_t i = name_hash(name) & (slots - 1);
+
+    while (table[i].used && strcmp(names_data + table[i].offset, name) != 0) {
+        i = (i + 1) & (slots - 1);
+    }
+    return &table[i];
+}
+
+/**
+ * Add the name stored at offset to the table
+ */
+static int name_insert(uint32_t offset) {
+    ChangeLogName *slot;
+
+    if ((names_used + 1) * 2 > names_slots) {
+        size_t new_slots = names_slots ? names_slots * 2 : 1024;
+        ChangeLogName *grown = (ChangeLogName*)calloc(new_slots, sizeof(ChangeLogName));
+
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        for (size_t i = 0; i < names_slots; i++) {
+            if (names_table[i].used) {
+                *name_slot(grown, new_slots, names_data + names_table[i].offset) = names_table[i];
+            }
+        }
+        free(names_table);
+        names_table = grown;
+        names_slots = new_slots;
+    }
+
+    slot = name_slot(names_table, names_slots, names_data + offset);
+    if (!slot->used) {
+        slot->offset = offset;
+        slot->used = TRUE;
+        names_used++;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Get the id of a name, interning it if it is new
+ * @return SUCCESS on success, FAILURE if out of memory or the names file is full
+ */
+static int name_intern(const char* name, uint32_t* name_id) {
+    size_t length = strlen(name) + 1;
+    ChangeLogName *slot;
+
+    if (names_slots > 0) {
+        slot = name_slot(names_table, names_slots, name);
+        if (slot->used) {
+            *name_id = slot->offset;
+            return SUCCESS;
+        }
+    }
+
+    if (names_size + length > UINT32_MAX) {
+        errno = EFBIG;
+        return FAILURE;
+    }
+    if (names_size + length > names_capacity) {
+        size_t capacity = names_capacity ? names_capacity : 65536;
+        char *grown;
+
+        while (capacity < names_size + length) {
+            capacity *= 2;
+        }
+        grown = (char*)realloc(names_data, capacity);
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        names_data = grown;
+        names_capacity = capacity;
+    }
+    memcpy(names_data + names_size, name, length);
+    if (name_insert((uint32_t)names_size) != SUCCESS) {
+        return FAILURE;
+    }
+    *name_id = (uint32_t)names_size;
+    names_size += length;
+    return SUCCESS;
+}
+
+/**
+ * Map an owner name to a uid, through a small cache
+ * Owners that could not be resolved when the change was seen are logged
+ * by number, and are taken as that uid.
+ */
+static uint32_t owner_uid(const char* owner) {
+    ChangeLogOwner *slot = &owner_cache[name_hash(owner) % CHANGELOG_USER_CACHE];
+    struct passwd pwd_entry;
+    struct passwd *pwd = NULL;
+    char pwd_buffer[1024];
+    char *end;
+    uint32_t uid = CHANGELOG_NO_UID;
+
+    if (slot->name[0] != '\0' && strcmp(slot->name, owner) == 0) {
+        return slot->uid;
+    }
+
+    if (getpwnam_r(owner, &pwd_entry, pwd_buffer, sizeof(pwd_buffer), &pwd) == 0 && pwd != NULL) {
+        uid = (uint32_t)pwd->pw_uid;
+    } else if (owner[0] >= '0' && owner[0] <= '9') {
+        unsigned long number = strtoul(owner, &end, 10);
+        if (*end == '\0' && number < CHANGELOG_NO_UID) {
+            uid = (uint32_t)number;
+        }
+    }
+
+    snprintf(slot->name, sizeof(slot->name), "%s", owner);
+    slot->uid = uid;
+    return uid;
+}
+
+/**
+ * Read the names file and intern every complete name
+ * A name cut short by a crash is truncated away.
+ */
+static int load_names(void) {
+    struct stat names_stat;
+    size_t complete;
+
+    if (fstat(changelog_names_fd, &names_stat) != 0) {
+        return FAILURE;
+    }
+    names_capacity = (size_t)names_stat.st_size + 65536;
+    names_data = (char*)malloc(names_capacity);
+    if (names_data == NULL) {
+        return FAILURE;
+    }
+    while (names_size < (size_t)names_stat.st_size) {
+        ssize_t got = pread(changelog_names_fd, names_data + names_size,
+                            (size_t)names_stat.st_size - names_size, (off_t)names_size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return FAILURE;
+        }
+        names_size += (size_t)got;
+    }
+
+    complete = names_size;
+    while (complete > 0 && names_data[complete - 1] != '\0') {
+        complete--;
+    }
+    if (complete != names_size) {
+        if (ftruncate(changelog_names_fd, (off_t)complete) != 0) {
+            return FAILURE;
+        }
+        names_size = complete;
+    }
+
+    for (size_t offset = 0; offset < names_size; offset += strlen(names_data + offset) + 1) {
+        if (name_insert((uint32_t)offset) != SUCCESS) {
+            return FAILURE;
+        }
+    }
+    names_written = names_size;
+    return SUCCESS;
+}
+
+/**
+ * Read a segment's trailer
+ * @return SUCCESS if the segment is sealed and its trailer is consistent
+ */
+static int read_trailer(const char* map, size_t size, ChangeLogTrailer* trailer) {
+    size_t expected;
+
+    if (size < sizeof(ChangeLogHeader) + sizeof(ChangeLogTrailer)) {
+        return FAILURE;
+    }
+    memcpy(trailer, map + size - sizeof(ChangeLogTrailer), sizeof(ChangeLogTrailer));
+    if (memcmp(trailer->magic, CHANGELOG_INDEX_MAGIC, 8) != 0) {
+        return FAILURE;
+    }
+    expected = sizeof(ChangeLogHeader) +
+               (size_t)trailer->record_count * sizeof(ChangeLogRecord) +
+               (size_t)trailer->time_index_count * sizeof(uint32_t) +
+               (size_t)trailer->user_count * sizeof(ChangeLogUser) +
+               (size_t)trailer->record_count * sizeof(uint32_t) +
+               sizeof(ChangeLogTrailer);
+    return (expected == size) ? SUCCESS : FAILURE;
+}
+
+static int compare_posting(const void* a, const void* b) {
+    const uint32_t *pa = (const uint32_t*)a;
+    const uint32_t *pb = (const uint32_t*)b;
+
+    if (pa[0] != pb[0]) {
+        return (pa[0] < pb[0]) ? -1 : 1;
+    }
+    return (pa[1] < pb[1]) ? -1 : (pa[1] > pb[1]);
+}
+
+/**
+ * Append the index to the open segment
+ * Called once the segment holds CHANGELOG_SEGMENT_RECORDS records.
+ */
+static int seal_segment(void) {
+    uint32_t count = changelog_segment_count;
+    uint32_t time_index_count = (count + CHANGELOG_INDEX_STRIDE - 1) / CHANGELOG_INDEX_STRIDE;
+    size_t records_size = (size_t)count * sizeof(ChangeLogRecord);
+    size_t index_size;
+    ChangeLogRecord *records;
+    uint32_t *pairs = NULL;
+    char *index = NULL;
+    uint32_t *time_index, *postings;
+    ChangeLogUser *users;
+    uint32_t user_count = 0;
+    ChangeLogTrailer trailer;
+    FileFingerprint fingerprint;
+    int result = FAILURE;
+
+    records = (ChangeLogRecord*)mmap(NULL, sizeof(ChangeLogHeader) + records_size, PROT_READ,
+                                     MAP_SHARED, changelog_segment_fd, 0);
+    if (records == MAP_FAILED) {
+        return FAILURE;
+    }
+    records = (ChangeLogRecord*)((char*)records + sizeof(ChangeLogHeader));
+
+    /* (uid, record) pairs sorted by uid give every user's postings in order */
+    pairs = (uint32_t*)malloc((size_t)count * 2 * sizeof(uint32_t));
+    index_size = (size_t)time_index_count * sizeof(uint32_t) +
+                 (size_t)count * sizeof(ChangeLogUser) + (size_t)count * sizeof(uint32_t);
+    index = (char*)malloc(index_size);
+    if (pairs == NULL || index == NULL) {
+        goto done;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        pairs[2 * i] = records[i].uid;
+        pairs[2 * i + 1] = i;
+    }
+    qsort(pairs, count, 2 * sizeof(uint32_t), compare_posting);
+
+    time_index = (uint32_t*)index;
+    for (uint32_t i = 0; i < time_index_count; i++) {
+        time_index[i] = records[(size_t)i * CHANGELOG_INDEX_STRIDE].timestamp;
+    }
+    users = (ChangeLogUser*)(index + (size_t)time_index_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        if (i == 0 || pairs[2 * i] != pairs[2 * (i - 1)]) {
+            users[user_count].uid = pairs[2 * i];
+            users[user_count].count = 0;
+            users[user_count].first = i;
+            user_count++;
+        }
+        users[user_count - 1].count++;
+    }
+    /* Postings follow the users actually present */
+    postings = (uint32_t*)(users + user_count);
+    for (uint32_t i = 0; i < count; i++) {
+        postings[i] = pairs[2 * i + 1];
+    }
+    index_size = (size_t)((char*)(postings + count) - index);
+
+    fingerprint_buffer(index, index_size, &fingerprint);
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, CHANGELOG_INDEX_MAGIC, 8);
+    trailer.record_count = count;
+    trailer.time_index_count = time_index_count;
+    trailer.user_count = user_count;
+    trailer.index_hash = fingerprint.hash;
+
+    if (write_all(changelog_segment_fd, index, index_size) == SUCCESS &&
+        write_all(changelog_segment_fd, &trailer, sizeof(trailer)) == SUCCESS &&
+        fdatasync(changelog_segment_fd) == 0) {
+        changelog_segment_sealed = TRUE;
+        result = SUCCESS;
+    }
+
+done:
+    munmap((char*)records - sizeof(ChangeLogHeader), sizeof(ChangeLogHeader) + records_size);
+    free(pairs);
+    free(index);
+    return result;
+}
+
+/**
+ * Create the next segment and make it the open one
+ */
+static int start_segment(uint32_t number) {
+    char name[32];
+    ChangeLogHeader header;
+    int fd;
+
+    snprintf(name, sizeof(name), CHANGELOG_SEGMENT_FORMAT, number);
+    fd = openat(changelog_dir_fd, name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return FAILURE;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHANGELOG_MAGIC, 8);
+    header.version = CHANGELOG_VERSION;
+    header.record_size = sizeof(ChangeLogRecord);
+    if (write_all(fd, &header, sizeof(header)) != SUCCESS) {
+        close(fd);
+        return FAILURE;
+    }
+
+    if (changelog_segment_fd != -1) {
+        close(changelog_segment_fd);
+    }
+    changelog_segment_fd = fd;
+    changelog_segment_number = number;
+    changelog_segment_count = 0;
+    changelog_segment_sealed = FALSE;
+    changelog_segment_torn = FALSE;
+    return SUCCESS;
+}
+
+/**
+ * Cut the open segment back to its last complete record
+ * Drops what a failed write left behind, so the next append lines up.
+ * Until it succeeds nothing more is written to the segment.
+ */
+static int truncate_segment(void) {
+    off_t length = (off_t)(sizeof(ChangeLogHeader) +
+                           (size_t)changelog_segment_count * sizeof(ChangeLogRecord));
+
+    changelog_segment_torn = (ftruncate(changelog_segment_fd, length) != 0);
+    return changelog_segment_torn ? FAILURE : SUCCESS;
+}
+
+/**
+ * Seal the full open segment and start the next one
+ * A segment that fails to seal stays open, without a partial index, and
+ * the seal is tried again on the next flush; resume_segment only ever
+ * looks at the newest segment, so moving on would leave it unindexed.
+ */
+static int finish_segment(void) {
+    if (!changelog_segment_sealed && seal_segment() != SUCCESS) {
+        int saved_errno = errno;
+
+        log_error("Failed to index change log segment %u: %s",
+                  changelog_segment_number, strerror(saved_errno));
+        truncate_segment();
+        errno = saved_errno;
+        return FAILURE;
+    }
+    return start_segment(changelog_segment_number + 1);
+}
+
+/**
+ * Open the newest segment, finishing what a crash left behind
+ * Records cut short are truncated away, and a full segment whose index
+ * was not written is sealed now.
+ */
+static int resume_segment(void) {
+    DirEnumerator iter;
+    DirEntry entry;
+    int found = FALSE;
+    uint32_t newest = 0;
+    char name[32];
+    struct stat segment_stat;
+    ChangeLogHeader header;
+    ChangeLogTrailer trailer;
+    ChangeLogRecord last;
+    char *map;
+    int sealed;
+    size_t count;
+
+    if (dir_enum_open(&iter, changelog_dir_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        unsigned int number;
+        int consumed = 0;
+
+        if (sscanf(entry.name, "%8u" CHANGELOG_SEGMENT_SUFFIX "%n", &number, &consumed) == 1 &&
+            consumed > 0 && entry.name[consumed] == '\0' && (!found || number > newest)) {
+            newest = number;
+            found = TRUE;
+        }
+    }
+    dir_enum_close(&iter);
+
+    if (!found) {
+        return start_segment(0);
+    }
+
+    snprintf(name, sizeof(name), CHANGELOG_SEGMENT_FORMAT, newest);
+    changelog_segment_fd = openat(changelog_dir_fd, name, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (changelog_segment_fd == -1 || fstat(changelog_segment_fd, &segment_stat) != 0) {
+        return FAILURE;
+    }
+    changelog_segment_number = newest;
+    if (segment_stat.st_size < (off_t)sizeof(ChangeLogHeader) ||
+        pread(changelog_segment_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, CHANGELOG_MAGIC, 8) != 0) {
+        /* Never got its header: start it again */
+        return start_segment(newest);
+    }
+
+    map = (char*)mmap(NULL, (size_t)segment_stat.st_size, PROT_READ, MAP_SHARED,
+                      changelog_segment_fd, 0);
+    if (map == MAP_FAILED) {
+        return FAILURE;
+    }
+    sealed = (read_trailer(map, (size_t)segment_stat.st_size, &trailer) == SUCCESS);
+    count = sealed ? trailer.record_count
+                   : ((size_t)segment_stat.st_size - sizeof(ChangeLogHeader)) / sizeof(ChangeLogRecord);
+    if (count > CHANGELOG_SEGMENT_RECORDS) {
+        count = CHANGELOG_SEGMENT_RECORDS;
+    }
+    if (count > 0) {
+        memcpy(&last, map + sizeof(ChangeLogHeader) + (count - 1) * sizeof(ChangeLogRecord),
+               sizeof(last));
+        changelog_last_time = last.timestamp;
+    }
+    munmap(map, (size_t)segment_stat.st_size);
+
+    if (sealed) {
+        return start_segment(newest + 1);
+    }
+    if (ftruncate(changelog_segment_fd, (off_t)(sizeof(ChangeLogHeader) +
+                                                count * sizeof(ChangeLogRecord))) != 0) {
+        return FAILURE;
+    }
+    changelog_segment_count = (uint32_t)count;
+    changelog_segment_sealed = FALSE;
+    changelog_segment_torn = FALSE;
+    if (changelog_segment_count >= CHANGELOG_SEGMENT_RECORDS) {
+        return finish_segment();
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close the writer's files and drop its tables
+ * Called with changelog_lock held.
+ */
+static void release_writer(void) {
+    if (changelog_segment_fd != -1) {
+        close(changelog_segment_fd);
+        changelog_segment_fd = -1;
+    }
+    if (changelog_names_fd != -1) {
+        close(changelog_names_fd);
+        changelog_names_fd = -1;
+    }
+    if (changelog_dir_fd != -1) {
+        close(changelog_dir_fd);
+        changelog_dir_fd = -1;
+    }
+    free(names_data);
+    free(names_table);
+    names_data = NULL;
+    names_table = NULL;
+    names_size = names_capacity = names_written = 0;
+    names_torn = FALSE;
+    names_slots = names_used = 0;
+    memset(owner_cache, 0, sizeof(owner_cache));
+    changelog_segment_count = 0;
+    changelog_segment_sealed = FALSE;
+    changelog_segment_torn = FALSE;
+    pending_count = 0;
+    changelog_is_open = FALSE;
+}
+
+/**
+ * Open the change log directory, names file and newest segment
+ * Called with changelog_lock held.
+ */
+static int changelog_open(void) {
+    if (changelog_is_open) {
+        return SUCCESS;
+    }
+    mkdir(CHANGELOG_DIR, 0755);
+    changelog_dir_fd = open_directory(CHANGELOG_DIR);
+    if (changelog_dir_fd != -1) {
+        changelog_names_fd = openat(changelog_dir_fd, CHANGELOG_NAMES_FILE,
+                                    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (changelog_dir_fd == -1 || changelog_names_fd == -1 ||
+        load_names() != SUCCESS || resume_segment() != SUCCESS) {
+        int saved_errno = errno;
+
+        release_writer();
+        errno = saved_errno;
+        return FAILURE;
+    }
+
+    changelog_is_open = TRUE;
+    return SUCCESS;
+}
+
+/**
+ * Write the pending names and records
+ * Called with changelog_lock held.
+ */
+static int flush_pending(void) {
+    int done = 0;
+
+    if (pending_count == 0 && changelog_segment_count < CHANGELOG_SEGMENT_RECORDS) {
+        return SUCCESS;
+    }
+
+    /*
+     * Names first, so a reader never sees a record whose name is missing.
+     * A partial write is cut off again: names are found by file offset,
+     * so writing them a second time after it would shift every later id.
+     */
+    if (names_torn) {
+        if (ftruncate(changelog_names_fd, (off_t)names_written) != 0) {
+            return FAILURE;
+        }
+        names_torn = FALSE;
+    }
+    if (names_written < names_size) {
+        if (write_all(changelog_names_fd, names_data + names_written,
+                      names_size - names_written) != SUCCESS) {
+            int saved_errno = errno;
+
+            names_torn = (ftruncate(changelog_names_fd, (off_t)names_written) != 0);
+            errno = saved_errno;
+            return FAILURE;
+        }
+        names_written = names_size;
+    }
+
+    /* An earlier failure may have left part of a record behind */
+    if (changelog_segment_torn && truncate_segment() != SUCCESS) {
+        return FAILURE;
+    }
+
+    while (done < pending_count) {
+        uint32_t room, batch;
+
+        /* Also retries a seal or segment start that failed last time */
+        if (changelog_segment_count >= CHANGELOG_SEGMENT_RECORDS && finish_segment() != SUCCESS) {
+            break;
+        }
+        room = CHANGELOG_SEGMENT_RECORDS - changelog_segment_count;
+        batch = (uint32_t)(pending_count - done);
+        if (batch > room) {
+            batch = room;
+        }
+        if (write_all(changelog_segment_fd, &pending[done],
+                      (size_t)batch * sizeof(ChangeLogRecord)) != SUCCESS) {
+            int saved_errno = errno;
+
+            truncate_segment();
+            errno = saved_errno;
+            break;
+        }
+        changelog_segment_count += batch;
+        done += (int)batch;
+    }
+
+    if (done < pending_count) {
+        memmove(pending, &pending[done], (size_t)(pending_count - done) * sizeof(ChangeLogRecord));
+        pending_count -= done;
+        return FAILURE;
+    }
+    pending_count = 0;
+
+    /* Seal a segment as soon as it is full, not on the next change */
+    if (changelog_segment_count >= CHANGELOG_SEGMENT_RECORDS) {
+        return finish_segment();
+    }
+    return SUCCESS;
+}
+
+/**
+ * Add a change to the binary change log
+ * The record is buffered; changelog_flush() writes it.
+ * @param when Time of the change
+ * @param username Owner of the file
+ * @param filename File name, or "old -> new" for a rename
+ * @param action Action string, as in the text change log
+ * @return SUCCESS on success, FAILURE on error
+ */
+int changelog_append(time_t when, const char* username, const char* filename, const char* action) {
+    ChangeLogRecord *record;
+    uint32_t name_id;
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&changelog_lock);
+    if (changelog_open() != SUCCESS || name_intern(filename, &name_id) != SUCCESS) {
+        pthread_mutex_unlock(&changelog_lock);
+        return FAILURE;
+    }
+    if (pending_count == CHANGELOG_BUFFER_RECORDS) {
+        result = flush_pending();
+    }
+    if (pending_count < CHANGELOG_BUFFER_RECORDS) {
+        record = &pending[pending_count++];
+        /* Records stay in time order even if a caller's clock lags */
+        record->timestamp = (when > (time_t)changelog_last_time) ? (uint32_t)when : changelog_last_time;
+        record->uid = owner_uid(username);
+        record->name_id = name_id;
+        record->action = (uint32_t)changelog_action_code(action);
+        changelog_last_time = record->timestamp;
+    }
+    pthread_mutex_unlock(&changelog_lock);
+    return result;
+}
+
+/**
+ * Write the buffered changes to the binary change log
+ * @return SUCCESS on success, FAILURE on error
+ */
+int changelog_flush(void) {
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&changelog_lock);
+    if (changelog_is_open && flush_pending() != SUCCESS) {
+        log_error("Failed to write binary change log: %s", strerror(errno));
+        result = FAILURE;
+    }
+    pthread_mutex_unlock(&changelog_lock);
+    return result;
+}
+
+/**
+ * Flush and close the binary change log
+ */
+void changelog_close(void) {
+    changelog_flush();
+
+    pthread_mutex_lock(&changelog_lock);
+    release_writer();
+    pthread_mutex_unlock(&changelog_lock);
+}
+
+/**
+ * Map a segment for queries
+ * A segment still being written is mapped up to its last whole record.
+ * @param segment Receives the mapping
+ * @param dirfd Change log directory
+ * @param name Segment file name
+ * @return SUCCESS on success, FAILURE on error
+ */
+int changelog_segment_open(ChangeLogSegment* segment, int dirfd, const char* name) {
+    struct stat segment_stat;
+    ChangeLogHeader header;
+    ChangeLogTrailer trailer;
+    FileFingerprint fingerprint;
+
+    memset(segment, 0, sizeof(ChangeLogSegment));
+    segment->fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (segment->fd == -1) {
+        return FAILURE;
+    }
+    if (fstat(segment->fd, &segment_stat) != 0) {
+        goto failed;
+    }
+    if (segment_stat.st_size < (off_t)sizeof(ChangeLogHeader)) {
+        errno = EINVAL;
+        goto failed;
+    }
+    segment->size = (size_t)segment_stat.st_size;
+    segment->map = (const char*)mmap(NULL, segment->size, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED) {
+        segment->map = NULL;
+        goto failed;
+    }
+    memcpy(&header, segment->map, sizeof(header));
+    if (memcmp(header.magic, CHANGELOG_MAGIC, 8) != 0 ||
+        header.record_size != sizeof(ChangeLogRecord)) {
+        errno = EINVAL;
+        goto failed;
+    }
+    segment->records = (const ChangeLogRecord*)(segment->map + sizeof(ChangeLogHeader));
+
+    if (read_trailer(segment->map, segment->size, &trailer) == SUCCESS) {
+        const char *index = (const char*)(segment->records + trailer.record_count);
+        size_t index_size = segment->size - sizeof(ChangeLogHeader) -
+                            (size_t)trailer.record_count * sizeof(ChangeLogRecord) -
+                            sizeof(ChangeLogTrailer);
+
+        fingerprint_buffer(index, index_size, &fingerprint);
+        if (fingerprint.hash != trailer.index_hash) {
+            log_error("Change log segment %s has a damaged index", name);
+        } else {
+            segment->sealed = TRUE;
+            segment->count = trailer.record_count;
+            segment->time_index = (const uint32_t*)index;
+            segment->time_index_count = trailer.time_index_count;
+            segment->users = (const ChangeLogUser*)(segment->time_index + trailer.time_index_count);
+            segment->user_count = trailer.user_count;
+            segment->postings = (const uint32_t*)(segment->users + trailer.user_count);
+            return SUCCESS;
+        }
+    }
+
+    segment->count = (uint32_t)((segment->size - sizeof(ChangeLogHeader)) / sizeof(ChangeLogRecord));
+    if (segment->count > CHANGELOG_SEGMENT_RECORDS) {
+        segment->count = CHANGELOG_SEGMENT_RECORDS;
+    }
+    return SUCCESS;
+
+failed:
+    changelog_segment_close(segment);
+    return FAILURE;
+}
+
+/**
+ * Unmap a segment opened with changelog_segment_open()
+ */
+void changelog_segment_close(ChangeLogSegment* segment) {
+    if (segment->map != NULL) {
+        munmap((void*)segment->map, segment->size);
+        segment->map = NULL;
+    }
+    if (segment->fd != -1) {
+        close(segment->fd);
+        segment->fd = -1;
+    }
+}
+
+/**
+ * Find the first record at or after a time
+ * @return Record number, segment->count if every record is earlier
+ */
+uint32_t changelog_lower_bound(const ChangeLogSegment* segment, time_t when) {
+    uint32_t low = 0, high = segment->count;
+
+    if (when <= 0) {
+        return 0;
+    }
+    if ((uint64_t)when > UINT32_MAX) {
+        return segment->count;
+    }
+
+    /* The time index narrows the search to one stride of records */
+    if (segment->time_index_count > 0) {
+        uint32_t index_low = 0, index_high = segment->time_index_count;
+
+        while (index_low < index_high) {
+            uint32_t middle = index_low + (index_high - index_low) / 2;
+            if (segment->time_index[middle] < (uint32_t)when) {
+                index_low = middle + 1;
+            } else {
+                index_high = middle;
+            }
+        }
+        if (index_low > 0) {
+            low = (index_low - 1) * CHANGELOG_INDEX_STRIDE;
+        }
+        if (index_low < segment->time_index_count) {
+            high = index_low * CHANGELOG_INDEX_STRIDE;
+        }
+    }
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (segment->records[middle].timestamp < (uint32_t)when) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Get the record numbers of one user in a sealed segment
+ * @param count Receives the number of postings
+ * @return Postings in ascending order, NULL if the user has none or the segment is not sealed
+ */
+const uint32_t* changelog_user_postings(const ChangeLogSegment* segment, uint32_t uid, uint32_t* count) {
+    uint32_t low = 0, high = segment->user_count;
+
+    *count = 0;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (segment->users[middle].uid < uid) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == segment->user_count || segment->users[low].uid != uid ||
+        (uint64_t)segment->users[low].first + segment->users[low].count > segment->count) {
+        return NULL;
+    }
+    *count = segment->users[low].count;
+    return segment->postings + segment->users[low].first;
+}
+
+/**
+ * Map the interned file names for queries
+ * @param names Receives the mapping
+ * @param dirfd Change log directory
+ * @return SUCCESS on success, FAILURE on error
+ */
+int changelog_names_open(ChangeLogNames* names, int dirfd) {
+    struct stat names_stat;
+
+    names->map = NULL;
+    names->size = 0;
+    names->fd = openat(dirfd, CHANGELOG_NAMES_FILE, O_RDONLY | O_CLOEXEC);
+    if (names->fd == -1 || fstat(names->fd, &names_stat) != 0) {
+        changelog_names_close(names);
+        return FAILURE;
+    }
+    names->size = (size_t)names_stat.st_size;
+    if (names->size > 0) {
+        names->map = (const char*)mmap(NULL, names->size, PROT_READ, MAP_SHARED, names->fd, 0);
+        if (names->map == MAP_FAILED) {
+            names->map = NULL;
+            changelog_names_close(names);
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Unmap names opened with changelog_names_open()
+ */
+void changelog_names_close(ChangeLogNames* names) {
+    if (names->map != NULL) {
+        munmap((void*)names->map, names->size);
+        names->map = NULL;
+    }
+    if (names->fd != -1) {
+        close(names->fd);
+        names->fd = -1;
+    }
+}
+
+/**
+ * Look up an interned file name
+ * @return The name, or NULL if the id is not a complete name in the mapping
+ */
+const char* changelog_name(const ChangeLogNames* names, uint32_t name_id) {
+    if (names->map == NULL || name_id >= names->size ||
+        memchr(names->map + name_id, '\0', names->size - name_id) == NULL) {
+        return NULL;
+    }
+    return names->map + name_id;
+}
@@ -0,0 +1,347 @@
+/**
+ * @file compress.c
+ * @brief Compressed backup copies
+ *
+ * A compressed backup stores each report as <name>.gz, one gzip member per
+ * file, so any file can be restored on its own (and read with zcat). The
+ * MANIFEST still lists the plain name and the fingerprint of the plain
+ * content, so the catalog and restore compare both formats the same way.
+ * Reports are small, so a batch is spread across threads file by file
+ * rather than splitting any one file.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+#include <zlib.h>
+
+#define COMPRESS_CHUNK  65536
+#define GZIP_WINDOW     (15 + 16)   /* zlib window bits selecting a gzip wrapper */
+#define GZIP_OR_ZLIB    (15 + 32)   /* Inflate either wrapper */
+
+/**
+ * @struct CompressJobs
+ * @brief A batch shared by the compression workers
+ */
+typedef struct {
+    FileOp *batch;
+    int count;
+    int next;                  /* Next operation to claim */
+    int level;
+} CompressJobs;
+
+/**
+ * Write a whole buffer, retrying short writes
+ */
+static int write_all(int fd, const void* data, size_t length) {
+    const char *p = (const char*)data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written == 0) {
+                errno = EIO;
+            }
+            return FAILURE;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Decompress a gzip file, optionally writing the plain content out
+ * @param src_dirfd Directory of the compressed file
+ * @param source Compressed file name
+ * @param dst_dirfd Directory of the destination (ignored if destination is NULL)
+ * @param destination File to create with the plain content, NULL to only fingerprint
+ * @param fingerprint Receives the fingerprint of the plain content (may be NULL)
+ * @return SUCCESS on success, FAILURE on error or corrupt data (errno set)
+ */
+int decompress_file_at(int src_dirfd, const char* source, int dst_dirfd,
+                       const char* destination, FileFingerprint* fingerprint) {
+    static __thread unsigned char in[COMPRESS_CHUNK], out[COMPRESS_CHUNK];
+    FingerprintState state;
+    FileFingerprint plain;
+    z_stream zs;
+    int src_fd, dst_fd = -1;
+    int status = Z_OK;
+    int result = SUCCESS;
+    int saved_errno = 0;
+
+    src_fd = openat(src_dirfd, source, O_RDONLY | O_CLOEXEC);
+    if (src_fd == -1) {
+        return FAILURE;
+    }
+    if (destination != NULL) {
+        dst_fd = openat(dst_dirfd, destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (dst_fd == -1) {
+            saved_errno = errno;
+            close(src_fd);
+            errno = saved_errno;
+            return FAILURE;
+        }
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_OR_ZLIB) != Z_OK) {
+        close(src_fd);
+        if (dst_fd != -1) {
+            close(dst_fd);
+        }
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+
+    while (status != Z_STREAM_END && result == SUCCESS) {
+        ssize_t bytes_read = read(src_fd, in, sizeof(in));
+
+        if (bytes_read <= 0) {
+            /* End of file before the end of the stream: truncated */
+            saved_errno = (bytes_read == -1) ? errno : EIO;
+            result = FAILURE;
+            break;
+        }
+        zs.next_in = in;
+        zs.avail_in = (uInt)bytes_read;
+
+        do {
+            size_t produced;
+
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            status = inflate(&zs, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                saved_errno = EIO;
+                result = FAILURE;
+                break;
+            }
+            produced = sizeof(out) - zs.avail_out;
+            fingerprint_update(&state, out, produced);
+            if (dst_fd != -1 && produced > 0 && write_all(dst_fd, out, produced) != SUCCESS) {
+                saved_errno = errno;
+                result = FAILURE;
+                break;
+            }
+        } while (zs.avail_out == 0 && status != Z_STREAM_END);
+    }
+    inflateEnd(&zs);
+    fingerprint_final(&state, &plain);
+
+    close(src_fd);
+    if (dst_fd != -1 && close(dst_fd) != 0 && result == SUCCESS) {
+        saved_errno = errno;
+        result = FAILURE;
+    }
+    if (result != SUCCESS) {
+        if (dst_fd != -1) {
+            unlinkat(dst_dirfd, destination, 0);
+        }
+        if (saved_errno == EIO) {
+            log_error("Compressed file %s is corrupt or truncated", source);
+        }
+    } else if (fingerprint != NULL) {
+        *fingerprint = plain;
+    }
+
+    errno = saved_errno;
+    return result;
+}
+
+/**
+ * Compress a file into a gzip file and verify it
+ * The plain data is fingerprinted on the way in; once written, the
+ * compressed file is decompressed again and must give the same
+ * fingerprint. On a mismatch errno is EIO and the output is removed.
+ *
+ * @param src_dirfd Directory of the source
+ * @param source Source file name
+ * @param dst_dirfd Directory of the destination
+ * @param destination Compressed file to create
+ * @param level zlib compression level (1-9)
+ * @param fingerprint Receives the fingerprint of the plain content (may be NULL)
+ * @return SUCCESS on success, FAILURE on error or verification mismatch
+ */
+int compress_file_at(int src_dirfd, const char* source, int dst_dirfd,
+                     const char* destination, int level, FileFingerprint* fingerprint) {
+    static __thread unsigned char in[COMPRESS_CHUNK], out[COMPRESS_CHUNK];
+    FingerprintState state;
+    FileFingerprint plain, check;
+    z_stream zs;
+    ssize_t bytes_read;
+    int src_fd, dst_fd;
+    int result = SUCCESS;
+    int saved_errno = 0;
+
+    src_fd = openat(src_dirfd, source, O_RDONLY | O_CLOEXEC);
+    if (src_fd == -1) {
+        saved_errno = errno;
+        log_error("Failed to open source file %s: %s", source, strerror(saved_errno));
+        errno = saved_errno;
+        return FAILURE;
+    }
+    dst_fd = openat(dst_dirfd, destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst_fd == -1) {
+        saved_errno = errno;
+        log_error("Failed to open destination file %s: %s", destination, strerror(saved_errno));
+        close(src_fd);
+        errno = saved_errno;
+        return FAILURE;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        close(src_fd);
+        close(dst_fd);
+        unlinkat(dst_dirfd, destination, 0);
+        errno = EINVAL;
+        return FAILURE;
+    }
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+
+    do {
+        int flush;
+
+        bytes_read = read(src_fd, in, sizeof(in));
+        if (bytes_read == -1) {
+            saved_errno = errno;
+            log_error("Failed to read from source file: %s", strerror(saved_errno));
+            result = FAILURE;
+            break;
+        }
+        fingerprint_update(&state, in, (size_t)bytes_read);
+        flush = (bytes_read == 0) ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in;
+        zs.avail_in = (uInt)bytes_read;
+
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            deflate(&zs, flush);
+            if (write_all(dst_fd, out, sizeof(out) - zs.avail_out) != SUCCESS) {
+                saved_errno = errno;
+                log_error("Failed to write to destination file: %s", strerror(saved_errno));
+                result = FAILURE;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    } while (bytes_read > 0 && result == SUCCESS);
+    deflateEnd(&zs);
+    fingerprint_final(&state, &plain);
+
+    close(src_fd);
+    if (close(dst_fd) != 0 && result == SUCCESS) {
+        saved_errno = errno;
+        log_error("Failed to close destination file %s: %s", destination, strerror(saved_errno));
+        result = FAILURE;
+    }
+
+    /* What was written must decompress to what was read */
+    if (result == SUCCESS &&
+        (decompress_file_at(dst_dirfd, destination, -1, NULL, &check) != SUCCESS ||
+         !fingerprint_equal(&check, &plain))) {
+        saved_errno = EIO;
+        log_error("Verification failed for %s", destination);
+        result = FAILURE;
+    }
+
+    if (result != SUCCESS) {
+        unlinkat(dst_dirfd, destination, 0);
+    } else if (fingerprint != NULL) {
+        *fingerprint = plain;
+    }
+
+    errno = saved_errno;
+    return result;
+}
+
+/**
+ * Execute one copy operation as a compressed copy
+ * The output is named dst_name followed by BACKUP_COMPRESSED_SUFFIX.
+ * @param op FILE_OP_COPY operation; result and fingerprint are updated
+ * @param level zlib compression level
+ * @return 0 on success, negative errno on failure
+ */
+int compress_file_op(FileOp* op, int level) {
+    char destination[NAME_MAX + 1];
+
+    if (snprintf(destination, sizeof(destination), "%s" BACKUP_COMPRESSED_SUFFIX,
+                 op->dst_name) >= (int)sizeof(destination)) {
+        op->result = -ENAMETOOLONG;
+        return op->result;
+    }
+
+    errno = 0;
+    if (compress_file_at(op->src_dirfd, op->src_name, op->dst_dirfd, destination,
+                         level, &op->fingerprint) == SUCCESS) {
+        op->result = 0;
+    } else {
+        op->result = (errno != 0) ? -errno : -EIO;
+    }
+    return op->result;
+}
+
+/**
+ * Compression worker: claim operations until none are left
+ */
+static void* compress_worker(void* arg) {
+    CompressJobs *jobs = (CompressJobs*)arg;
+
+    for (;;) {
+        int index = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+        if (index >= jobs->count) {
+            break;
+        }
+        compress_file_op(&jobs->batch[index], jobs->level);
+    }
+    return NULL;
+}
+
+/**
+ * Execute a batch of copy operations as compressed copies, in parallel
+ * @param batch FILE_OP_COPY operations (see compress_file_op)
+ * @param count Number of operations
+ * @param level zlib compression level
+ * @param workers Threads to use
+ * @return Number of operations that failed
+ */
+int compress_batch(FileOp* batch, int count, int level, int workers) {
+    pthread_t threads[BACKUP_MAX_WORKERS];
+    CompressJobs jobs;
+    int started;
+    int failed = 0;
+
+    jobs.batch = batch;
+    jobs.count = count;
+    jobs.next = 0;
+    jobs.level = level;
+
+    if (workers > count) {
+        workers = count;
+    }
+    if (workers > BACKUP_MAX_WORKERS) {
+        workers = BACKUP_MAX_WORKERS;
+    }
+
+    /* The calling thread works too */
+    for (started = 0; started < workers - 1; started++) {
+        if (pthread_create(&threads[started], NULL, compress_worker, &jobs) != 0) {
+            break;
+        }
+    }
+    compress_worker(&jobs);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (batch[i].result != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -9,6 +9,7 @@
 static volatile sig_atomic_t daemon_exit = 0;
 static volatile sig_atomic_t force_backup = 0;
 static volatile sig_atomic_t force_transfer = 0;
+static volatile sig_atomic_t reopen_logs = 0;
 
 /**
  * Signal handler for the daemon
@@ -27,7 +28,8 @@ void signal_handler(int sig) {
             force_transfer = 1;
             break;
         case SIGHUP:
-            /* Could be used to reload configuration */
+            /* Log files were rotated, or the time zone changed */
+            reopen_logs = 1;
             break;
     }
 }
@@ -170,6 +172,7 @@ int daemon_init(void) {
     /* Setup logging */
     openlog("report_daemon", LOG_PID, LOG_DAEMON);
     syslog(LOG_INFO, "Report daemon started");
+    log_load_config();
     
     /* Create necessary directories if they don't exist */
     create_directory_if_not_exists(UPLOAD_DIR);
@@ -177,6 +180,26 @@ int daemon_init(void) {
     create_directory_if_not_exists(BACKUP_DIR);
     create_directory_if_not_exists(LOG_DIR);
     
+    /* Capture every change as it happens; backups become checkpoints */
+    if (BACKUP_FORMAT == BACKUP_FORMAT_CONTINUOUS && cdp_open() != SUCCESS) {
+        log_error("Continuous backup is not running");
+    }
+    
+    /* Prune expired backups in the background */
+    if (retention_start() != SUCCESS) {
+        log_error("Backup retention is not running");
+    }
+    
+    /* Re-read old backups in the background to find damage early */
+    if (scrub_start() != SUCCESS) {
+        log_error("Backup scrubbing is not running");
+    }
+    
+    /* Rotate and compress the log files in the background */
+    if (log_rotation_start() != SUCCESS) {
+        log_error("Log rotation is not running");
+    }
+    
     /* Setup IPC */
     if (setup_ipc() != SUCCESS) {
         log_error("Failed to setup IPC");
@@ -195,28 +218,52 @@ int daemon_init(void) {
  * Cleanup daemon resources before exit
  */
 void daemon_cleanup(void) {
-    /* Remove PID file */
+    /* Remove PID and status files */
     unlink(PID_FILE);
+    status_remove();
     
     /* Cleanup IPC */
     cleanup_ipc();
     
+    /* Stop pruning and scrubbing; unfinished passes resume on the next start */
+    scrub_stop();
+    retention_stop();
+    
+    /* Sync the continuous log */
+    cdp_close();
+    
+    /* Write out buffered change records */
+    changelog_close();
+    
+    /* Release cached directory descriptors */
+    close_report_dirs();
+    
     /* Close system log */
     closelog();
     
     log_operation("Daemon shutdown complete");
+    
+    /* Flush and close the log files */
+    log_rotation_stop();
+    log_close();
 }
 
 /**
  * Main daemon loop
  */
 void daemon_main_loop(void) {
-    time_t now, last_check = 0;
+    time_t now, last_check = 0, last_status = 0, last_metrics = 0;
     struct tm *tm_now;
     
     log_operation("Entering main daemon loop");
     
     while (!daemon_exit) {
+        if (reopen_logs) {
+            reopen_logs = 0;
+            log_reopen();
+            log_load_config();
+        }
+        
         /* Get current time */
         now = time(NULL);
         tm_now = localtime(&now);
@@ -243,6 +290,7 @@ void daemon_main_loop(void) {
             /* Backup the dashboard directory */
             if (backup_dashboard() == SUCCESS) {
                 log_operation("Backup completed successfully");
+                retention_request();
             } else {
                 log_error("Backup failed");
             }
@@ -269,6 +317,7 @@ void daemon_main_loop(void) {
                 /* Backup the dashboard directory */
                 if (backup_dashboard() == SUCCESS) {
                     log_operation("Manual backup completed successfully");
+                    retention_request();
                 } else {
                     log_error("Manual backup failed");
                 }
@@ -281,6 +330,18 @@ void daemon_main_loop(void) {
             }
         }
         
+        /* Sum up rate-limited errors and refresh the status files */
+        log_summarize_suppressed(FALSE);
+        if (now - last_status >= STATUS_INTERVAL) {
+            status_write();
+            status_write_prometheus();
+            last_status = now;
+        }
+        if (now - last_metrics >= METRICS_INTERVAL) {
+            status_write_metrics();
+            last_metrics = now;
+        }
+        
         /* Sleep for 1 second before next iteration */
         sleep(1);
     }
@@ -0,0 +1,193 @@
+/**
+ * @file directory.c
+ * @brief Directory descriptors and single-pass directory enumeration
+ *
+ * The report directories are opened once and their descriptors reused, so
+ * per-file operations resolve a single name relative to the directory
+ * instead of walking the whole /var/report_system path each time.
+ */
+
+#define LOG_MODULE LOG_MODULE_FILES
+#include "report_system.h"
+#include <sys/syscall.h>
+
+/**
+ * @struct linux_dirent64
+ * @brief Record layout returned by the getdents64 system call
+ */
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Paths behind the REPORT_DIR_* identifiers */
+static const char *report_dir_paths[REPORT_DIR_COUNT] = {
+    UPLOAD_DIR,
+    DASHBOARD_DIR,
+    BACKUP_DIR,
+    LOG_DIR
+};
+
+/* Cached descriptors, -1 until first use */
+static int report_dir_fds[REPORT_DIR_COUNT] = { -1, -1, -1, -1 };
+static pthread_mutex_t report_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open a directory for use as the base of *at() calls
+ * @param path Directory path
+ * @return Directory descriptor, or -1 on error (errno set)
+ */
+int open_directory(const char* path) {
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Get the cached descriptor of one of the report directories
+ * A directory that was removed and recreated is transparently reopened.
+ * @param which REPORT_DIR_UPLOAD, REPORT_DIR_DASHBOARD, REPORT_DIR_BACKUP or REPORT_DIR_LOGS
+ * @return Directory descriptor, or -1 on error
+ */
+int report_dir_fd(int which) {
+    struct stat dir_stat;
+    int fd;
+
+    if (which < 0 || which >= REPORT_DIR_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&report_dir_lock);
+
+    fd = report_dir_fds[which];
+    if (fd != -1 && (fstat(fd, &dir_stat) != 0 || dir_stat.st_nlink == 0)) {
+        /* Directory was deleted underneath us */
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd == -1) {
+        fd = open_directory(report_dir_paths[which]);
+        if (fd == -1) {
+            int saved_errno = errno;
+            pthread_mutex_unlock(&report_dir_lock);
+            log_error("Failed to open directory %s: %s",
+                      report_dir_paths[which], strerror(saved_errno));
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    report_dir_fds[which] = fd;
+    pthread_mutex_unlock(&report_dir_lock);
+
+    return fd;
+}
+
+/**
+ * Close every cached report directory descriptor
+ */
+void close_report_dirs(void) {
+    pthread_mutex_lock(&report_dir_lock);
+    for (int i = 0; i < REPORT_DIR_COUNT; i++) {
+        if (report_dir_fds[i] != -1) {
+            close(report_dir_fds[i]);
+            report_dir_fds[i] = -1;
+        }
+    }
+    pthread_mutex_unlock(&report_dir_lock);
+}
+
+/**
+ * Start enumerating a directory
+ * The walk uses a descriptor of its own, so the caller's descriptor (often
+ * a shared cached one) keeps its offset and several threads can enumerate
+ * the same directory at once.
+ * @param iter Enumerator to initialize
+ * @param dirfd Directory descriptor to enumerate; not modified or owned
+ * @return SUCCESS on success, FAILURE on error
+ */
+int dir_enum_open(DirEnumerator* iter, int dirfd) {
+    iter->pos = 0;
+    iter->length = 0;
+    iter->finished = FALSE;
+    iter->buffer = NULL;
+
+    iter->dirfd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (iter->dirfd == -1) {
+        log_error("Failed to open directory for listing: %s", strerror(errno));
+        return FAILURE;
+    }
+
+    iter->buffer = (char*)malloc(DIR_ENUM_BUFFER_SIZE);
+    if (iter->buffer == NULL) {
+        log_error("Memory allocation failed for directory buffer");
+        close(iter->dirfd);
+        iter->dirfd = -1;
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Fetch the next directory entry, skipping "." and ".."
+ * The returned name stays valid only until the next call.
+ * @param iter Enumerator
+ * @param entry Receives the entry name and type
+ * @return TRUE if an entry was returned, FALSE at the end or on error
+ */
+int dir_enum_next(DirEnumerator* iter, DirEntry* entry) {
+    for (;;) {
+        struct linux_dirent64 *record;
+
+        if (iter->pos >= iter->length) {
+            long bytes;
+
+            if (iter->finished) {
+                return FALSE;
+            }
+
+            /* One system call returns hundreds of entries */
+            bytes = syscall(SYS_getdents64, iter->dirfd, iter->buffer, DIR_ENUM_BUFFER_SIZE);
+            if (bytes <= 0) {
+                if (bytes < 0) {
+                    log_error("Failed to read directory entries: %s", strerror(errno));
+                }
+                iter->finished = TRUE;
+                return FALSE;
+            }
+            iter->length = bytes;
+            iter->pos = 0;
+        }
+
+        record = (struct linux_dirent64*)(iter->buffer + iter->pos);
+        iter->pos += record->d_reclen;
+
+        if (record->d_name[0] == '.' &&
+            (record->d_name[1] == '\0' ||
+             (record->d_name[1] == '.' && record->d_name[2] == '\0'))) {
+            continue;
+        }
+
+        entry->name = record->d_name;
+        entry->type = record->d_type;
+        entry->inode = record->d_ino;
+        return TRUE;
+    }
+}
+
+/**
+ * Release an enumerator's descriptor and buffer
+ * @param iter Enumerator
+ */
+void dir_enum_close(DirEnumerator* iter) {
+    if (iter->dirfd != -1) {
+        close(iter->dirfd);
+        iter->dirfd = -1;
+    }
+    free(iter->buffer);
+    iter->buffer = NULL;
+}
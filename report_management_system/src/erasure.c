@@ -0,0 +1,892 @@
+/**
+ * @file erasure.c
+ * @brief Reed-Solomon erasure coding of backup archives
+ *
+ * With BACKUP_FORMAT_ERASURE a backup is first written as a normal archive
+ * and then striped: every stripe is ERASURE_DATA_SHARDS chunks of the
+ * archive plus ERASURE_PARITY_SHARDS parity chunks, and chunk i of every
+ * stripe goes to shard i. Shard 0 replaces the archive in BACKUP_DIR under
+ * the same name; shard i lives in the i-th directory of ERASURE_ROOTS.
+ * Each shard file is
+ *
+ *   header   "RPTSHRD1", shard counts and index, archive size and hash
+ *   hashes   fingerprint hash of each of the shard's chunks
+ *   chunks   one ERASURE_CHUNK_SIZE chunk per stripe, from a 4 KiB boundary
+ *
+ * Parity is Reed-Solomon over GF(2^8) with a Cauchy matrix below the
+ * identity, so any ERASURE_DATA_SHARDS intact chunks of a stripe rebuild
+ * it. Multiplying a chunk by a constant uses two 16-entry tables, one per
+ * nibble, looked up 16 or 32 bytes at a time with PSHUFB (SSSE3/AVX2).
+ *
+ * pack_open() recognises shard 0 and calls erasure_read(), which reads the
+ * data shards, checks each chunk against its hash and rebuilds missing or
+ * damaged chunks from parity. Restores, the catalog and the scrubber
+ * therefore work on erasure-coded backups without change.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ERASURE_X86 1
+#endif
+
+#define SHARD_MAGIC      "RPTSHRD1"
+#define SHARD_VERSION    1
+#define SHARD_ALIGN      4096
+#define GF_POLYNOMIAL    0x11D      /* x^8 + x^4 + x^3 + x^2 + 1 */
+
+/**
+ * @struct ShardHeader
+ * @brief Start of a shard file
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint8_t data_shards;
+    uint8_t parity_shards;
+    uint8_t shard_index;
+    uint8_t reserved;
+    uint32_t chunk_size;
+    uint32_t stripe_count;
+    uint64_t archive_size;
+    uint64_t archive_hash;    /* Fingerprint hash of the whole archive */
+    uint64_t set_id;          /* Shared by the shards of one backup */
+    uint64_t header_hash;     /* Fingerprint hash of the fields above */
+} ShardHeader;
+
+/**
+ * @struct ShardSet
+ * @brief The shards of one backup, opened for reading
+ */
+typedef struct {
+    int root_fds[ERASURE_MAX_SHARDS];
+    int fds[ERASURE_MAX_SHARDS];      /* -1 for a missing or unusable shard */
+    uint64_t *hashes[ERASURE_MAX_SHARDS];
+    uint64_t bad[ERASURE_MAX_SHARDS]; /* Chunks found damaged */
+    ShardHeader header;               /* Agreed by the shards (index aside) */
+    uint64_t data_offset;             /* First chunk in every shard */
+    int roots;                        /* Roots configured */
+    int shards;                       /* Shards of the set that can be opened */
+} ShardSet;
+
+typedef void (*MulAddFn)(unsigned char* dst, const unsigned char* src, unsigned char c, size_t length);
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_nibble[256][2][16];   /* c * x and c * (x << 4), x < 16 */
+static MulAddFn gf_mul_add;
+static pthread_once_t erasure_once = PTHREAD_ONCE_INIT;
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_inverse(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/**
+ * dst ^= c * src, one byte at a time
+ */
+static void mul_add_scalar(unsigned char* dst, const unsigned char* src, unsigned char c, size_t length) {
+    const unsigned char *lo = gf_nibble[c][0], *hi = gf_nibble[c][1];
+
+    for (size_t i = 0; i < length; i++) {
+        dst[i] ^= lo[src[i] & 0x0F] ^ hi[src[i] >> 4];
+    }
+}
+
+#ifdef ERASURE_X86
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(unsigned char* dst, const unsigned char* src, unsigned char c, size_t length) {
+    const __m128i lo = _mm_loadu_si128((const __m128i*)gf_nibble[c][0]);
+    const __m128i hi = _mm_loadu_si128((const __m128i*)gf_nibble[c][1]);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                                        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, product));
+    }
+    mul_add_scalar(dst + i, src + i, c, length - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(unsigned char* dst, const unsigned char* src, unsigned char c, size_t length) {
+    /* PSHUFB looks up within each 128-bit lane, so both lanes get the tables */
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nibble[c][0]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nibble[c][1]));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i product = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, product));
+    }
+    mul_add_scalar(dst + i, src + i, c, length - i);
+}
+#endif /* ERASURE_X86 */
+
+/**
+ * Build the field tables and pick the fastest implementation for this CPU
+ */
+static void erasure_setup(void) {
+    unsigned int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int c = 0; c < 256; c++) {
+        for (int n = 0; n < 16; n++) {
+            gf_nibble[c][0][n] = gf_mul((unsigned char)c, (unsigned char)n);
+            gf_nibble[c][1][n] = gf_mul((unsigned char)c, (unsigned char)(n << 4));
+        }
+    }
+
+    gf_mul_add = mul_add_scalar;
+#ifdef ERASURE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_add = mul_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_add = mul_add_ssse3;
+    }
+#endif
+}
+
+/**
+ * Name of the GF(2^8) implementation selected for this CPU
+ * @return Static string ("avx2", "ssse3" or "scalar")
+ */
+const char* erasure_implementation(void) {
+    pthread_once(&erasure_once, erasure_setup);
+#ifdef ERASURE_X86
+    if (gf_mul_add == mul_add_avx2) {
+        return "avx2";
+    }
+    if (gf_mul_add == mul_add_ssse3) {
+        return "ssse3";
+    }
+#endif
+    return "scalar";
+}
+
+/**
+ * Coefficient of data shard column in the row of shard row
+ * Rows below the identity form a Cauchy matrix, 1 / (x_i + y_j) with
+ * x_i = data_shards + i and y_j = j, so every square submatrix of the
+ * whole matrix made of distinct rows is invertible.
+ */
+static unsigned char coding_coefficient(int data_shards, int row, int column) {
+    if (row < data_shards) {
+        return (row == column) ? 1 : 0;
+    }
+    return gf_inverse((unsigned char)(row ^ column));
+}
+
+/**
+ * Compute the parity chunks of one stripe
+ * @param data data_shards chunks of length bytes
+ * @param parity parity_shards chunks of length bytes, overwritten
+ */
+void erasure_encode_stripe(const unsigned char* const* data, unsigned char* const* parity,
+                           int data_shards, int parity_shards, size_t length) {
+    pthread_once(&erasure_once, erasure_setup);
+
+    for (int p = 0; p < parity_shards; p++) {
+        memset(parity[p], 0, length);
+        for (int j = 0; j < data_shards; j++) {
+            gf_mul_add(parity[p], data[j], coding_coefficient(data_shards, data_shards + p, j), length);
+        }
+    }
+}
+
+/**
+ * Invert the coding rows of the given shards
+ * @param rows data_shards distinct shard indexes
+ * @param inverse Receives the data_shards x data_shards inverse, row major
+ * @return SUCCESS on success, FAILURE if the rows are not independent
+ */
+static int invert_rows(const int* rows, int data_shards, unsigned char* inverse) {
+    unsigned char matrix[ERASURE_MAX_SHARDS * ERASURE_MAX_SHARDS];
+    int n = data_shards;
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            matrix[i * n + j] = coding_coefficient(data_shards, rows[i], j);
+            inverse[i * n + j] = (i == j) ? 1 : 0;
+        }
+    }
+
+    /* Gauss-Jordan elimination; addition is XOR */
+    for (int column = 0; column < n; column++) {
+        int pivot = column;
+        unsigned char scale;
+
+        while (pivot < n && matrix[pivot * n + column] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return FAILURE;
+        }
+        if (pivot != column) {
+            for (int j = 0; j < n; j++) {
+                unsigned char t = matrix[pivot * n + j];
+                matrix[pivot * n + j] = matrix[column * n + j];
+                matrix[column * n + j] = t;
+                t = inverse[pivot * n + j];
+                inverse[pivot * n + j] = inverse[column * n + j];
+                inverse[column * n + j] = t;
+            }
+        }
+        scale = gf_inverse(matrix[column * n + column]);
+        for (int j = 0; j < n; j++) {
+            matrix[column * n + j] = gf_mul(matrix[column * n + j], scale);
+            inverse[column * n + j] = gf_mul(inverse[column * n + j], scale);
+        }
+        for (int i = 0; i < n; i++) {
+            unsigned char factor = matrix[i * n + column];
+            if (i == column || factor == 0) {
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                matrix[i * n + j] ^= gf_mul(factor, matrix[column * n + j]);
+                inverse[i * n + j] ^= gf_mul(factor, inverse[column * n + j]);
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+static uint64_t chunk_hash(const void* data, size_t length) {
+    FingerprintState state;
+    FileFingerprint fingerprint;
+
+    fingerprint_init(&state, FALSE);
+    fingerprint_update(&state, data, length);
+    fingerprint_final(&state, &fingerprint);
+    return fingerprint.hash;
+}
+
+static uint64_t header_hash(const ShardHeader* header) {
+    return chunk_hash(header, offsetof(ShardHeader, header_hash));
+}
+
+static uint64_t shard_data_offset(uint32_t stripe_count) {
+    uint64_t end = sizeof(ShardHeader) + (uint64_t)stripe_count * sizeof(uint64_t);
+    return (end + SHARD_ALIGN - 1) & ~(uint64_t)(SHARD_ALIGN - 1);
+}
+
+static int pwrite_all(int fd, const void* data, size_t length, uint64_t offset) {
+    const char *p = (const char*)data;
+
+    while (length > 0) {
+        ssize_t written = pwrite(fd, p, length, (off_t)offset);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written == 0) {
+                errno = EIO;
+            }
+            return FAILURE;
+        }
+        p += written;
+        offset += (uint64_t)written;
+        length -= (size_t)written;
+    }
+    return SUCCESS;
+}
+
+static int pread_all(int fd, void* data, size_t length, uint64_t offset) {
+    char *p = (char*)data;
+
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, p, length, (off_t)offset);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read == 0) {
+                errno = EIO;
+            }
+            return FAILURE;
+        }
+        p += bytes_read;
+        offset += (uint64_t)bytes_read;
+        length -= (size_t)bytes_read;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Open the backup roots: BACKUP_DIR for shard 0, then ERASURE_ROOTS in order
+ * @param backup_root_fd Descriptor of BACKUP_DIR, used for shard 0
+ * @param fds Receives one descriptor per root, -1 where a root cannot be opened
+ * @param create TRUE to create missing roots
+ * @return Number of roots configured
+ */
+static int open_roots(int backup_root_fd, int* fds, int create) {
+    const char *p = ERASURE_ROOTS;
+    int count = 1;
+
+    fds[0] = backup_root_fd;
+    while (*p != '\0' && count < ERASURE_MAX_SHARDS) {
+        char path[MAX_PATH_LENGTH];
+        size_t length = strcspn(p, ":");
+
+        if (length > 0 && length < sizeof(path)) {
+            memcpy(path, p, length);
+            path[length] = '\0';
+            if (create && mkdir(path, 0755) != 0 && errno != EEXIST) {
+                log_error("Failed to create backup root %s: %s", path, strerror(errno));
+            }
+            fds[count] = open_directory(path);
+            count++;
+        }
+        p += length;
+        if (*p == ':') {
+            p++;
+        }
+    }
+    return count;
+}
+
+static void close_roots(int* fds, int count) {
+    for (int i = 1; i < count; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Replace an archive in BACKUP_DIR with its erasure-coded shards
+ * The shards are written under temporary names and synced. Then the other
+ * roots get theirs, and shard 0 replaces the archive last. Until that
+ * rename the full archive stays in place, so a failure loses nothing;
+ * shards already installed in the other roots are removed again.
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param name Archive name
+ * @return SUCCESS on success, FAILURE on error (the archive is left as it was)
+ */
+int erasure_write(int backup_root_fd, const char* name) {
+    const int data_shards = ERASURE_DATA_SHARDS, parity_shards = ERASURE_PARITY_SHARDS;
+    const int shards = ERASURE_DATA_SHARDS + ERASURE_PARITY_SHARDS;
+    int root_fds[ERASURE_MAX_SHARDS], shard_fds[ERASURE_MAX_SHARDS];
+    const unsigned char *data[ERASURE_MAX_SHARDS];
+    unsigned char *parity[ERASURE_MAX_SHARDS];
+    char temp[NAME_MAX + 1];
+    ShardHeader header;
+    struct stat st;
+    const unsigned char *map = MAP_FAILED;
+    unsigned char *buffers = NULL;
+    uint64_t *hashes = NULL;
+    uint64_t stripe_bytes = (uint64_t)data_shards * ERASURE_CHUNK_SIZE;
+    uint64_t data_offset;
+    uint32_t stripes;
+    int archive_fd = -1;
+    int roots;
+    int created = 0;
+    int result = FAILURE;
+
+    pthread_once(&erasure_once, erasure_setup);
+    for (int i = 0; i < ERASURE_MAX_SHARDS; i++) {
+        shard_fds[i] = -1;
+    }
+
+    roots = open_roots(backup_root_fd, root_fds, TRUE);
+    if (roots != shards) {
+        log_error("Erasure coding %d+%d shards needs %d backup roots, %d configured",
+                  data_shards, parity_shards, shards, roots);
+        close_roots(root_fds, roots);
+        return FAILURE;
+    }
+    for (int i = 1; i < roots; i++) {
+        if (root_fds[i] == -1) {
+            log_error("Backup root %d is not available for %s", i, name);
+            goto cleanup;
+        }
+    }
+    if (snprintf(temp, sizeof(temp), ERASURE_TEMP_PREFIX "%s", name) >= (int)sizeof(temp)) {
+        errno = ENAMETOOLONG;
+        goto cleanup;
+    }
+
+    archive_fd = openat(backup_root_fd, name, O_RDONLY | O_CLOEXEC);
+    if (archive_fd == -1 || fstat(archive_fd, &st) != 0 || st.st_size == 0) {
+        log_error("Cannot read archive %s for erasure coding: %s", name, strerror(errno));
+        goto cleanup;
+    }
+    map = (const unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, archive_fd, 0);
+    if (map == MAP_FAILED) {
+        goto cleanup;
+    }
+    madvise((void*)map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    stripes = (uint32_t)(((uint64_t)st.st_size + stripe_bytes - 1) / stripe_bytes);
+    data_offset = shard_data_offset(stripes);
+    hashes = (uint64_t*)calloc((size_t)shards * stripes, sizeof(uint64_t));
+    buffers = (unsigned char*)aligned_alloc(64, (size_t)shards * ERASURE_CHUNK_SIZE);
+    if (hashes == NULL || buffers == NULL) {
+        log_error("Memory allocation failed for erasure coding");
+        goto cleanup;
+    }
+    for (int p = 0; p < parity_shards; p++) {
+        parity[p] = buffers + (size_t)(data_shards + p) * ERASURE_CHUNK_SIZE;
+    }
+
+    for (created = 0; created < shards; created++) {
+        shard_fds[created] = openat(root_fds[created], temp,
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (shard_fds[created] == -1) {
+            log_error("Failed to create shard %d of %s: %s", created, name, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    for (uint32_t s = 0; s < stripes; s++) {
+        for (int j = 0; j < data_shards; j++) {
+            uint64_t offset = s * stripe_bytes + (uint64_t)j * ERASURE_CHUNK_SIZE;
+
+            if (offset + ERASURE_CHUNK_SIZE <= (uint64_t)st.st_size) {
+                data[j] = map + offset;
+            } else {
+                /* The last stripe is padded with zeros */
+                unsigned char *padded = buffers + (size_t)j * ERASURE_CHUNK_SIZE;
+                size_t available = (offset < (uint64_t)st.st_size) ? (size_t)(st.st_size - offset) : 0;
+
+                if (available > 0) {
+                    memcpy(padded, map + offset, available);
+                }
+                memset(padded + available, 0, ERASURE_CHUNK_SIZE - available);
+                data[j] = padded;
+            }
+        }
+        erasure_encode_stripe(data, parity, data_shards, parity_shards, ERASURE_CHUNK_SIZE);
+
+        for (int i = 0; i < shards; i++) {
+            const unsigned char *chunk = (i < data_shards) ? data[i] : parity[i - data_shards];
+
+            hashes[(size_t)i * stripes + s] = chunk_hash(chunk, ERASURE_CHUNK_SIZE);
+            if (pwrite_all(shard_fds[i], chunk, ERASURE_CHUNK_SIZE,
+                           data_offset + (uint64_t)s * ERASURE_CHUNK_SIZE) != SUCCESS) {
+                log_error("Failed to write shard %d of %s: %s", i, name, strerror(errno));
+                goto cleanup;
+            }
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SHARD_MAGIC, sizeof(header.magic));
+    header.version = SHARD_VERSION;
+    header.data_shards = (uint8_t)data_shards;
+    header.parity_shards = (uint8_t)parity_shards;
+    header.chunk_size = ERASURE_CHUNK_SIZE;
+    header.stripe_count = stripes;
+    header.archive_size = (uint64_t)st.st_size;
+    header.archive_hash = chunk_hash(map, (size_t)st.st_size);
+    header.set_id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^ header.archive_hash;
+
+    for (int i = 0; i < shards; i++) {
+        header.shard_index = (uint8_t)i;
+        header.header_hash = header_hash(&header);
+        if (pwrite_all(shard_fds[i], &header, sizeof(header), 0) != SUCCESS ||
+            pwrite_all(shard_fds[i], hashes + (size_t)i * stripes, stripes * sizeof(uint64_t),
+                       sizeof(header)) != SUCCESS ||
+            fsync(shard_fds[i]) != 0) {
+            log_error("Failed to write shard %d of %s: %s", i, name, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    /* Shard 0 goes last: it is what makes the backup erasure-coded */
+    for (int i = shards - 1; i >= 0; i--) {
+        if (renameat(root_fds[i], temp, root_fds[i], name) != 0) {
+            log_error("Failed to install shard %d of %s: %s", i, name, strerror(errno));
+            /* Take back the shards already installed in the other roots */
+            for (int j = i + 1; j < shards; j++) {
+                unlinkat(root_fds[j], name, 0);
+            }
+            goto cleanup;
+        }
+    }
+    result = SUCCESS;
+    log_operation("Erasure coded %s into %d+%d shards of %u chunks (%s)", name, data_shards,
+                  parity_shards, stripes, erasure_implementation());
+
+cleanup:
+    for (int i = 0; i < created && i < shards; i++) {
+        if (shard_fds[i] != -1) {
+            close(shard_fds[i]);
+        }
+        if (result != SUCCESS) {
+            unlinkat(root_fds[i], temp, 0);
+        }
+    }
+    if (map != MAP_FAILED) {
+        munmap((void*)map, (size_t)st.st_size);
+    }
+    if (archive_fd != -1) {
+        close(archive_fd);
+    }
+    free(buffers);
+    free(hashes);
+    close_roots(root_fds, roots);
+    return result;
+}
+
+/**
+ * Check whether data starts with a shard header
+ * @return TRUE for an erasure-coded shard, FALSE otherwise
+ */
+int erasure_is_shard(const void* data, size_t size) {
+    return size >= sizeof(ShardHeader) && memcmp(data, SHARD_MAGIC, strlen(SHARD_MAGIC)) == 0;
+}
+
+static void shard_set_close(ShardSet* set) {
+    for (int i = 0; i < ERASURE_MAX_SHARDS; i++) {
+        if (set->fds[i] != -1) {
+            close(set->fds[i]);
+        }
+        free(set->hashes[i]);
+    }
+    close_roots(set->root_fds, set->roots);
+}
+
+/**
+ * Open the shards of a backup and agree on their layout
+ * A shard that is missing, has a damaged header or hash table, or belongs
+ * to a different set is left out (fds[i] == -1) and logged.
+ * @return SUCCESS with at least one usable shard, FAILURE otherwise
+ */
+static int shard_set_open(int backup_root_fd, const char* name, ShardSet* set) {
+    ShardHeader headers[ERASURE_MAX_SHARDS];
+    int valid[ERASURE_MAX_SHARDS];
+    int roots, reference = -1;
+
+    memset(set, 0, sizeof(ShardSet));
+    for (int i = 0; i < ERASURE_MAX_SHARDS; i++) {
+        set->fds[i] = -1;
+        set->root_fds[i] = -1;
+        valid[i] = FALSE;
+    }
+    roots = open_roots(backup_root_fd, set->root_fds, FALSE);
+    set->roots = roots;
+    set->shards = roots;
+
+    for (int i = 0; i < roots; i++) {
+        if (set->root_fds[i] == -1) {
+            continue;
+        }
+        set->fds[i] = openat(set->root_fds[i], name, O_RDONLY | O_CLOEXEC);
+        if (set->fds[i] == -1) {
+            continue;
+        }
+        valid[i] = (pread_all(set->fds[i], &headers[i], sizeof(ShardHeader), 0) == SUCCESS &&
+                    erasure_is_shard(&headers[i], sizeof(ShardHeader)) &&
+                    headers[i].version == SHARD_VERSION &&
+                    headers[i].header_hash == header_hash(&headers[i]) &&
+                    headers[i].shard_index == i && headers[i].data_shards > 0 &&
+                    headers[i].data_shards + headers[i].parity_shards <= ERASURE_MAX_SHARDS &&
+                    headers[i].chunk_size > 0 && headers[i].chunk_size <= 64 * ERASURE_CHUNK_SIZE);
+        if (valid[i] && reference == -1) {
+            reference = i;
+        }
+    }
+    if (reference == -1) {
+        log_error("No readable shard of %s", name);
+        shard_set_close(set);
+        errno = EIO;
+        return FAILURE;
+    }
+
+    set->header = headers[reference];
+    set->data_offset = shard_data_offset(set->header.stripe_count);
+    if (set->shards > set->header.data_shards + set->header.parity_shards) {
+        set->shards = set->header.data_shards + set->header.parity_shards;
+    }
+
+    for (int i = 0; i < roots; i++) {
+        const ShardHeader *h = &headers[i];
+        size_t table = (size_t)set->header.stripe_count * sizeof(uint64_t);
+
+        if (i < set->shards && valid[i] && h->set_id == set->header.set_id &&
+            h->data_shards == set->header.data_shards &&
+            h->parity_shards == set->header.parity_shards &&
+            h->chunk_size == set->header.chunk_size &&
+            h->stripe_count == set->header.stripe_count &&
+            h->archive_size == set->header.archive_size &&
+            h->archive_hash == set->header.archive_hash &&
+            (set->hashes[i] = (uint64_t*)malloc(table + 1)) != NULL &&
+            pread_all(set->fds[i], set->hashes[i], table, sizeof(ShardHeader)) == SUCCESS) {
+            continue;
+        }
+        if (i < set->header.data_shards + set->header.parity_shards) {
+            log_error("Shard %d of %s is missing or damaged", i, name);
+        }
+        if (set->fds[i] != -1) {
+            close(set->fds[i]);
+            set->fds[i] = -1;
+        }
+        free(set->hashes[i]);
+        set->hashes[i] = NULL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Read one chunk of a shard and check it against the shard's hash table
+ * @return SUCCESS if intact, FAILURE if unreadable or damaged
+ */
+static int read_chunk(ShardSet* set, int shard, uint32_t stripe, unsigned char* chunk) {
+    size_t size = set->header.chunk_size;
+
+    if (set->fds[shard] == -1) {
+        return FAILURE;
+    }
+    if (pread_all(set->fds[shard], chunk, size, set->data_offset + (uint64_t)stripe * size) != SUCCESS ||
+        chunk_hash(chunk, size) != set->hashes[shard][stripe]) {
+        set->bad[shard]++;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Rebuild an erasure-coded archive in memory
+ * Only data shards are read while they are intact; a missing or damaged
+ * chunk is rebuilt from the parity chunks of its stripe (degraded read).
+ * @param backup_root_fd Descriptor of BACKUP_DIR, holding shard 0
+ * @param name Archive name
+ * @param data Receives the archive in an anonymous mapping (release with munmap)
+ * @param size Receives its size
+ * @return SUCCESS on success, FAILURE if too many shards are lost (errno set)
+ */
+int erasure_read(int backup_root_fd, const char* name, char** data, size_t* size) {
+    ShardSet set;
+    unsigned char inverse[ERASURE_MAX_SHARDS * ERASURE_MAX_SHARDS];
+    int rows[ERASURE_MAX_SHARDS], inverted[ERASURE_MAX_SHARDS], intact[ERASURE_MAX_SHARDS];
+    unsigned char *buffers = NULL;
+    unsigned char *out = MAP_FAILED;
+    uint64_t rebuilt = 0;
+    size_t chunk_size;
+    int data_shards, have_inverse = FALSE;
+    int result = FAILURE;
+
+    pthread_once(&erasure_once, erasure_setup);
+    if (shard_set_open(backup_root_fd, name, &set) != SUCCESS) {
+        return FAILURE;
+    }
+    data_shards = set.header.data_shards;
+    chunk_size = set.header.chunk_size;
+
+    buffers = (unsigned char*)aligned_alloc(64, (size_t)(set.shards + 1) * chunk_size);
+    out = (unsigned char*)mmap(NULL, (size_t)set.header.archive_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == NULL || out == MAP_FAILED) {
+        log_error("Memory allocation failed reading %s", name);
+        goto cleanup;
+    }
+
+    for (uint32_t s = 0; s < set.header.stripe_count; s++) {
+        uint64_t stripe_offset = (uint64_t)s * data_shards * chunk_size;
+        int have = 0, complete = TRUE;
+
+        /* Data shards first: with all of them intact no decoding is needed */
+        for (int i = 0; i < set.shards && have < data_shards; i++) {
+            intact[i] = (read_chunk(&set, i, s, buffers + (size_t)i * chunk_size) == SUCCESS);
+            if (intact[i]) {
+                rows[have++] = i;
+            } else if (i < data_shards) {
+                complete = FALSE;
+            }
+        }
+        if (have < data_shards) {
+            log_error("Stripe %u of %s has %d of the %d intact chunks needed", s, name, have, data_shards);
+            errno = EIO;
+            goto cleanup;
+        }
+
+        if (!complete) {
+            unsigned char *scratch = buffers + (size_t)set.shards * chunk_size;
+
+            if (!have_inverse || memcmp(rows, inverted, data_shards * sizeof(int)) != 0) {
+                if (invert_rows(rows, data_shards, inverse) != SUCCESS) {
+                    errno = EIO;
+                    goto cleanup;
+                }
+                memcpy(inverted, rows, data_shards * sizeof(int));
+                have_inverse = TRUE;
+            }
+            for (int d = 0; d < data_shards; d++) {
+                if (intact[d]) {
+                    continue;
+                }
+                memset(scratch, 0, chunk_size);
+                for (int j = 0; j < data_shards; j++) {
+                    gf_mul_add(scratch, buffers + (size_t)rows[j] * chunk_size,
+                               inverse[d * data_shards + j], chunk_size);
+                }
+                memcpy(buffers + (size_t)d * chunk_size, scratch, chunk_size);
+                rebuilt++;
+            }
+        }
+
+        for (int d = 0; d < data_shards; d++) {
+            uint64_t offset = stripe_offset + (uint64_t)d * chunk_size;
+
+            if (offset >= set.header.archive_size) {
+                break;
+            }
+            memcpy(out + offset, buffers + (size_t)d * chunk_size,
+                   (offset + chunk_size <= set.header.archive_size)
+                       ? chunk_size : (size_t)(set.header.archive_size - offset));
+        }
+    }
+
+    if (chunk_hash(out, (size_t)set.header.archive_size) != set.header.archive_hash) {
+        log_error("Rebuilt archive %s does not match its fingerprint", name);
+        errno = EIO;
+        goto cleanup;
+    }
+    for (int i = 0; i < set.shards; i++) {
+        if (set.bad[i] > 0) {
+            log_error("Shard %d of %s has %llu damaged chunks", i, name, (unsigned long long)set.bad[i]);
+        }
+    }
+    if (rebuilt > 0) {
+        log_operation("Read %s degraded: %llu chunks rebuilt from parity", name,
+                      (unsigned long long)rebuilt);
+    }
+
+    mprotect(out, (size_t)set.header.archive_size, PROT_READ);
+    *data = (char*)out;
+    *size = (size_t)set.header.archive_size;
+    out = MAP_FAILED;
+    result = SUCCESS;
+
+cleanup:
+    if (out != MAP_FAILED) {
+        munmap(out, (size_t)set.header.archive_size);
+    }
+    free(buffers);
+    shard_set_close(&set);
+    return result;
+}
+
+/**
+ * Read every chunk of every shard of a backup, parity included
+ * A normal read never touches intact parity, so this is how damage to it
+ * is found.
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param name Archive name
+ * @param before_read Called before each chunk is read (may be NULL)
+ * @return Number of chunks missing or damaged (0 for an archive that is
+ *         not erasure-coded), FAILURE if stopped by before_read or the
+ *         shards cannot be opened
+ */
+int erasure_check(int backup_root_fd, const char* name, ErasureReadFn before_read) {
+    ShardHeader header;
+    ShardSet set;
+    unsigned char *chunk;
+    uint64_t damaged = 0;
+    int fd;
+
+    fd = openat(backup_root_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return FAILURE;
+    }
+    if (pread_all(fd, &header, sizeof(header), 0) != SUCCESS || !erasure_is_shard(&header, sizeof(header))) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    if (shard_set_open(backup_root_fd, name, &set) != SUCCESS) {
+        return FAILURE;
+    }
+    chunk = (unsigned char*)malloc(set.header.chunk_size);
+    if (chunk == NULL) {
+        shard_set_close(&set);
+        return FAILURE;
+    }
+
+    for (int i = 0; i < set.header.data_shards + set.header.parity_shards; i++) {
+        if (i >= set.shards || set.fds[i] == -1) {
+            damaged += set.header.stripe_count;
+            continue;
+        }
+        for (uint32_t s = 0; s < set.header.stripe_count; s++) {
+            if (before_read != NULL && !before_read(set.header.chunk_size)) {
+                free(chunk);
+                shard_set_close(&set);
+                errno = ECANCELED;
+                return FAILURE;
+            }
+            read_chunk(&set, i, s, chunk);
+        }
+        if (set.bad[i] > 0) {
+            log_error("Shard %d of %s has %llu damaged chunks", i, name, (unsigned long long)set.bad[i]);
+            damaged += set.bad[i];
+        }
+    }
+
+    free(chunk);
+    shard_set_close(&set);
+    return (damaged > INT_MAX) ? INT_MAX : (int)damaged;
+}
+
+/**
+ * Remove the shards of a backup from the roots other than BACKUP_DIR
+ * Shard 0 is the archive in BACKUP_DIR, which the caller removes.
+ * @param name Archive name
+ * @param bytes_freed Incremented by the space released (may be NULL)
+ * @return SUCCESS if no shard is left, FAILURE otherwise
+ */
+int erasure_remove(const char* name, uint64_t* bytes_freed) {
+    int root_fds[ERASURE_MAX_SHARDS];
+    int roots;
+    int result = SUCCESS;
+
+    roots = open_roots(-1, root_fds, FALSE);
+    for (int i = 1; i < roots; i++) {
+        struct stat st;
+
+        if (root_fds[i] == -1 || fstatat(root_fds[i], name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (unlinkat(root_fds[i], name, 0) != 0) {
+            log_error("Failed to remove shard %d of %s: %s", i, name, strerror(errno));
+            result = FAILURE;
+            continue;
+        }
+        if (bytes_freed != NULL) {
+            *bytes_freed += (uint64_t)st.st_blocks * 512;
+        }
+    }
+    close_roots(root_fds, roots);
+    return result;
+}
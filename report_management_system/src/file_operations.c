@@ -3,61 +3,385 @@
  * @brief Implementation of file transfer and monitoring functions
  */
 
+ #define LOG_MODULE LOG_MODULE_FILES
  #include "report_system.h"
+ #include <sys/sysmacros.h>
+
+ /* Verified copies are written under this prefix, then renamed into place */
+ #define COPY_TEMP_PREFIX ".copy."
 
  /* Static variables for tracking directory state */
  time_t last_scan_time = 0;
  ReportFile* previous_files = NULL;
  int previous_file_count = 0;
  
+ /**
+  * @struct TransferItem
+  * @brief A single upload travelling through the transfer pipeline
+  */
+ typedef struct {
+     char filename[NAME_MAX + 1];   /* Name of the file in the upload directory */
+     uid_t owner_uid;               /* Owner captured by the validation stage */
+ } TransferItem;
+ 
+ /**
+  * @struct TransferPipeline
+  * @brief Queues and counters shared by all transfer pipeline stages
+  */
+ typedef struct {
+     WorkQueue validate_queue;      /* enumerate -> validate */
+     WorkQueue move_queue;          /* validate -> move */
+     WorkQueue record_queue;        /* move -> record */
+     int upload_fd;                 /* Upload directory descriptor */
+     int dashboard_fd;              /* Dashboard directory descriptor */
+     pthread_mutex_t lock;          /* Protects the counters below */
+     int moved;
+     int rejected;
+     int failed;
+ } TransferPipeline;
+ 
+ /**
+  * Bump one of the pipeline counters
+  * @param pipeline Pipeline state
+  * @param counter Counter to increment
+  */
+ static void transfer_count(TransferPipeline* pipeline, int* counter) {
+     pthread_mutex_lock(&pipeline->lock);
+     (*counter)++;
+     pthread_mutex_unlock(&pipeline->lock);
+ }
+ 
+ /**
+  * Validation stage: check each upload is a regular file holding an XML
+  * report and remember its owner so later stages never re-stat it
+  * @param arg Pointer to the TransferPipeline
+  * @return NULL
+  */
+ static void* transfer_validate_worker(void* arg) {
+     TransferPipeline *pipeline = (TransferPipeline*)arg;
+     TransferItem *item;
+     struct stat file_stat;
+     
+     while ((item = (TransferItem*)work_queue_pop(&pipeline->validate_queue)) != NULL) {
+         if (fstatat(pipeline->upload_fd, item->filename, &file_stat, 
+                     AT_SYMLINK_NOFOLLOW) != 0) {
+             log_error("Failed to get file stats for %s: %s", 
+                       item->filename, strerror(errno));
+             transfer_count(pipeline, &pipeline->failed);
+             free(item);
+             continue;
+         }
+         
+         /* Directories and special files never leave the upload area */
+         if (!S_ISREG(file_stat.st_mode)) {
+             free(item);
+             continue;
+         }
+         
+         if (!is_valid_xml_report_at(pipeline->upload_fd, item->filename)) {
+             log_error("Rejected invalid report %s, left in upload directory", 
+                       item->filename);
+             transfer_count(pipeline, &pipeline->rejected);
+             free(item);
+             continue;
+         }
+         
+         item->owner_uid = file_stat.st_uid;
+         work_queue_push(&pipeline->move_queue, item);
+     }
+     
+     return NULL;
+ }
+ 
+ /**
+  * Move stage: rename each validated report into the dashboard
+  * Items are taken from the queue in batches so the renames can be
+  * submitted together; cross-device uploads fall back to copy and delete.
+  * @param arg Pointer to the TransferPipeline
+  * @return NULL
+  */
+ static void* transfer_move_worker(void* arg) {
+     TransferPipeline *pipeline = (TransferPipeline*)arg;
+     TransferItem *items[TRANSFER_MOVE_BATCH];
+     FileOp batch[TRANSFER_MOVE_BATCH];
+     FileOps fileops;
+     int taken;
+     
+     fileops_init(&fileops, FILEOPS_DEFAULT_BACKEND);
+     
+     while ((taken = work_queue_pop_batch(&pipeline->move_queue, 
+                                          (void**)items, TRANSFER_MOVE_BATCH)) > 0) {
+         for (int i = 0; i < taken; i++) {
+             log_debug("Moving file: %s to %s", items[i]->filename, DASHBOARD_DIR);
+             memset(&batch[i], 0, sizeof(FileOp));
+             batch[i].type = FILE_OP_RENAME;
+             batch[i].src_dirfd = pipeline->upload_fd;
+             batch[i].src_name = items[i]->filename;
+             batch[i].dst_dirfd = pipeline->dashboard_fd;
+             batch[i].dst_name = items[i]->filename;
+         }
+         
+         fileops_submit(&fileops, batch, taken);
+         
+         for (int i = 0; i < taken; i++) {
+             int moved = (batch[i].result == 0);
+             
+             if (moved) {
+                 metrics_count(METRIC_RENAMES, 1);
+             } else if (batch[i].result == -EXDEV) {
+                 moved = (move_file_at(pipeline->upload_fd, items[i]->filename,
+                                       pipeline->dashboard_fd, items[i]->filename) == SUCCESS);
+             } else if (!moved) {
+                 log_error("Failed to rename %s: %s", items[i]->filename, 
+                           strerror(-batch[i].result));
+             }
+             
+             if (!moved) {
+                 log_error("Failed to move file %s to dashboard", items[i]->filename);
+                 transfer_count(pipeline, &pipeline->failed);
+                 free(items[i]);
+                 continue;
+             }
+             
+             work_queue_push(&pipeline->record_queue, items[i]);
+         }
+     }
+     
+     fileops_destroy(&fileops);
+     return NULL;
+ }
+ 
+ /**
+  * Record stage: resolve owners and write the change log
+  * Runs on a single thread so change log entries are never interleaved.
+  * @param arg Pointer to the TransferPipeline
+  * @return NULL
+  */
+ static void* transfer_record_worker(void* arg) {
+     TransferPipeline *pipeline = (TransferPipeline*)arg;
+     TransferItem *item;
+     char owner[MAX_USER_LENGTH];
+     uid_t cached_uid = (uid_t)-1;
+     
+     /* The whole transfer's change log entries go out in a few large writes */
+     log_batch_begin(LOG_SINK_CHANGE);
+     while ((item = (TransferItem*)work_queue_pop(&pipeline->record_queue)) != NULL) {
+         /* Uploads mostly come from a handful of managers */
+         if (item->owner_uid != cached_uid) {
+             get_owner_name(item->owner_uid, owner, MAX_USER_LENGTH);
+             cached_uid = item->owner_uid;
+         }
+         
+         log_file_change(owner, item->filename, "transfer");
+         transfer_count(pipeline, &pipeline->moved);
+         free(item);
+     }
+     log_batch_end(LOG_SINK_CHANGE);
+     
+     return NULL;
+ }
+ 
+ /**
+  * Start the worker threads of one pipeline stage
+  * @param threads Array receiving the thread handles
+  * @param count Number of workers requested
+  * @param worker Thread entry point
+  * @param pipeline Pipeline state passed to each worker
+  * @return Number of workers actually started
+  */
+ static int start_transfer_stage(pthread_t* threads, int count, 
+                                 void* (*worker)(void*), TransferPipeline* pipeline) {
+     int started = 0;
+     
+     while (started < count) {
+         /* pthread_create reports its error by return value, not errno */
+         int rc = pthread_create(&threads[started], NULL, worker, pipeline);
+         if (rc != 0) {
+             log_error("Failed to start transfer worker: %s", strerror(rc));
+             break;
+         }
+         started++;
+     }
+     
+     return started;
+ }
+ 
+ /**
+  * Wait for the workers of one pipeline stage to finish
+  * @param threads Array of thread handles
+  * @param count Number of started workers
+  */
+ static void join_transfer_stage(pthread_t* threads, int count) {
+     for (int i = 0; i < count; i++) {
+         pthread_join(threads[i], NULL);
+     }
+ }
+ 
+ /**
+  * Clamp a configured worker count to the supported range
+  * @param requested Requested number of workers
+  * @return Number of workers to start
+  */
+ static int clamp_worker_count(int requested) {
+     if (requested < 1) {
+         return 1;
+     }
+     if (requested > TRANSFER_MAX_WORKERS) {
+         return TRANSFER_MAX_WORKERS;
+     }
+     return requested;
+ }
+ 
  /**
   * Transfer reports from upload directory to dashboard directory
   * @return SUCCESS on success, FAILURE on error
   */
  int transfer_reports(void) {
-     DIR *dir;
-     struct dirent *entry;
-     char src_path[MAX_PATH_LENGTH];
-     char dest_path[MAX_PATH_LENGTH];
+     uint64_t started = metrics_clock();
+     int result;
+     
+     REPORT_PROBE2(transfer__start, UPLOAD_DIR, DASHBOARD_DIR);
+     result = transfer_reports_with_config(NULL);
+     REPORT_PROBE1(transfer__done, result);
+     
+     metrics_latency(LATENCY_TRANSFER, started);
+     return result;
+ }
+ 
+ /**
+  * Transfer reports from upload directory to dashboard directory
+  * 
+  * Files flow through four stages connected by bounded queues: the calling
+  * thread enumerates the upload directory, validation workers stat and check
+  * each report, move workers rename it into the dashboard, and a single
+  * record worker writes the change log.
+  * 
+  * @param config Pipeline tuning, or NULL for the compiled-in defaults
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int transfer_reports_with_config(const TransferConfig* config) {
+     TransferConfig defaults = {
+         TRANSFER_VALIDATE_WORKERS,
+         TRANSFER_MOVE_WORKERS,
+         TRANSFER_QUEUE_CAPACITY
+     };
+     TransferPipeline pipeline;
+     pthread_t validate_threads[TRANSFER_MAX_WORKERS];
+     pthread_t move_threads[TRANSFER_MAX_WORKERS];
+     pthread_t record_thread;
+     int validate_count, move_count, record_count;
+     DirEnumerator iter;
+     DirEntry entry;
      int result = SUCCESS;
      
+     if (config == NULL) {
+         config = &defaults;
+     }
+     
      log_operation("Starting report transfer from upload to dashboard");
      
-     /* Open the upload directory */
-     dir = opendir(UPLOAD_DIR);
-     if (dir == NULL) {
+     memset(&pipeline, 0, sizeof(pipeline));
+     
+     /* Every stage works relative to these two descriptors */
+     pipeline.upload_fd = report_dir_fd(REPORT_DIR_UPLOAD);
+     pipeline.dashboard_fd = report_dir_fd(REPORT_DIR_DASHBOARD);
+     if (pipeline.upload_fd == -1 || pipeline.dashboard_fd == -1) {
          log_error("Failed to open upload directory: %s", strerror(errno));
          return FAILURE;
      }
      
-     /* Process each file in the directory */
-     while ((entry = readdir(dir)) != NULL) {
-         /* Skip directory entries and non-XML files */
-         if (entry->d_type == DT_DIR || 
-             strstr(entry->d_name, REPORT_EXTENSION) == NULL) {
-             continue;
-         }
-         
-         /* Construct source and destination paths */
-         snprintf(src_path, MAX_PATH_LENGTH, "%s/%s", UPLOAD_DIR, entry->d_name);
-         snprintf(dest_path, MAX_PATH_LENGTH, "%s/%s", DASHBOARD_DIR, entry->d_name);
-         
-         /* Move the file */
-         log_operation("Moving file: %s to %s", entry->d_name, DASHBOARD_DIR);
-         if (move_file(src_path, dest_path) != SUCCESS) {
-             log_error("Failed to move file %s to dashboard", entry->d_name);
-             result = FAILURE;
-             continue;
-         }
-         
-         /* Log the transfer operation */
-         char owner[MAX_USER_LENGTH];
-         if (get_file_owner(dest_path, owner, MAX_USER_LENGTH) == SUCCESS) {
-             log_file_change(owner, entry->d_name, "transfer");
+     /* Open the upload directory */
+     if (dir_enum_open(&iter, pipeline.upload_fd) != SUCCESS) {
+         dir_enum_close(&iter);
+         return FAILURE;
+     }
+     
+     if (work_queue_init(&pipeline.validate_queue, config->queue_capacity) != SUCCESS) {
+         dir_enum_close(&iter);
+         return FAILURE;
+     }
+     if (work_queue_init(&pipeline.move_queue, config->queue_capacity) != SUCCESS) {
+         work_queue_destroy(&pipeline.validate_queue);
+         dir_enum_close(&iter);
+         return FAILURE;
+     }
+     if (work_queue_init(&pipeline.record_queue, config->queue_capacity) != SUCCESS) {
+         work_queue_destroy(&pipeline.validate_queue);
+         work_queue_destroy(&pipeline.move_queue);
+         dir_enum_close(&iter);
+         return FAILURE;
+     }
+     pthread_mutex_init(&pipeline.lock, NULL);
+     pipeline.validate_queue.gauge = GAUGE_VALIDATE_QUEUE;
+     pipeline.move_queue.gauge = GAUGE_MOVE_QUEUE;
+     pipeline.record_queue.gauge = GAUGE_RECORD_QUEUE;
+     
+     /* Start every stage before feeding the first one */
+     validate_count = start_transfer_stage(validate_threads, 
+                                           clamp_worker_count(config->validate_workers),
+                                           transfer_validate_worker, &pipeline);
+     move_count = start_transfer_stage(move_threads, 
+                                       clamp_worker_count(config->move_workers),
+                                       transfer_move_worker, &pipeline);
+     record_count = start_transfer_stage(&record_thread, 1, 
+                                         transfer_record_worker, &pipeline);
+     
+     if (validate_count > 0 && move_count > 0 && record_count > 0) {
+         /* Enumerate stage: queue every XML file in the upload directory */
+         while (dir_enum_next(&iter, &entry)) {
+             TransferItem *item;
+             
+             /* Skip directory entries and non-XML files */
+             if (entry.type == DT_DIR || 
+                 strstr(entry.name, REPORT_EXTENSION) == NULL) {
+                 continue;
+             }
+             
+             item = (TransferItem*)malloc(sizeof(TransferItem));
+             if (item == NULL) {
+                 log_error("Memory allocation failed for transfer item");
+                 result = FAILURE;
+                 break;
+             }
+             
+             strncpy(item->filename, entry.name, NAME_MAX);
+             item->filename[NAME_MAX] = '\0';
+             item->owner_uid = (uid_t)-1;
+             work_queue_push(&pipeline.validate_queue, item);
          }
+     } else {
+         log_error("Transfer pipeline could not start all stages");
+         result = FAILURE;
+     }
+     
+     dir_enum_close(&iter);
+     
+     /* Drain the pipeline one stage at a time */
+     work_queue_close(&pipeline.validate_queue);
+     join_transfer_stage(validate_threads, validate_count);
+     work_queue_close(&pipeline.move_queue);
+     join_transfer_stage(move_threads, move_count);
+     work_queue_close(&pipeline.record_queue);
+     join_transfer_stage(&record_thread, record_count);
+     
+     /* Free anything stranded in a queue whose consumers never started */
+     void *leftover;
+     while ((leftover = work_queue_pop(&pipeline.validate_queue)) != NULL) free(leftover);
+     while ((leftover = work_queue_pop(&pipeline.move_queue)) != NULL) free(leftover);
+     while ((leftover = work_queue_pop(&pipeline.record_queue)) != NULL) free(leftover);
+     
+     work_queue_destroy(&pipeline.validate_queue);
+     work_queue_destroy(&pipeline.move_queue);
+     work_queue_destroy(&pipeline.record_queue);
+     pthread_mutex_destroy(&pipeline.lock);
+     
+     log_operation("Transfer finished: %d moved, %d rejected, %d failed", 
+                   pipeline.moved, pipeline.rejected, pipeline.failed);
+     
+     if (pipeline.failed > 0) {
+         result = FAILURE;
      }
      
-     closedir(dir);
      return result;
  }
  
@@ -74,29 +398,33 @@
      };
      int missing_count = 0;
      int found[4] = {0, 0, 0, 0};
-     DIR *dir;
-     struct dirent *entry;
+     DirEnumerator iter;
+     DirEntry entry;
+     int dashboard_fd;
      char department[MAX_USER_LENGTH];
      
      log_operation("Checking for missing department reports");
      
      /* Open the dashboard directory */
-     dir = opendir(DASHBOARD_DIR);
-     if (dir == NULL) {
+     dashboard_fd = report_dir_fd(REPORT_DIR_DASHBOARD);
+     if (dashboard_fd == -1 || dir_enum_open(&iter, dashboard_fd) != SUCCESS) {
          log_error("Failed to open dashboard directory: %s", strerror(errno));
+         if (dashboard_fd != -1) {
+             dir_enum_close(&iter);
+         }
          return 4; /* Assume all reports are missing */
      }
      
      /* Scan for report files */
-     while ((entry = readdir(dir)) != NULL) {
+     while (dir_enum_next(&iter, &entry)) {
          /* Skip directory entries and non-XML files */
-         if (entry->d_type == DT_DIR || 
-             strstr(entry->d_name, REPORT_EXTENSION) == NULL) {
+         if (entry.type == DT_DIR || 
+             strstr(entry.name, REPORT_EXTENSION) == NULL) {
              continue;
          }
          
          /* Extract department from filename */
-         if (extract_department_from_filename(entry->d_name, department, MAX_USER_LENGTH) != NULL) {
+         if (extract_department_from_filename(entry.name, department, MAX_USER_LENGTH) != NULL) {
              /* Mark the department as found */
              for (int i = 0; i < 4; i++) {
                  if (strcasecmp(department, department_reports[i]) == 0) {
@@ -107,7 +435,7 @@
          }
      }
      
-     closedir(dir);
+     dir_enum_close(&iter);
      
      /* Log missing reports */
      for (int i = 0; i < 4; i++) {
@@ -117,6 +445,8 @@
          }
      }
      
+     metrics_count(METRIC_MISSING_REPORTS, (uint64_t)missing_count);
+     metrics_gauge(GAUGE_MISSING_DEPARTMENTS, missing_count);
      log_operation("Missing report check completed, %d missing", missing_count);
      return missing_count;
  }
@@ -165,131 +495,341 @@
      return department;
  }
  
+ /**
+  * Order snapshot entries by file name
+  */
+ static int compare_report_names(const void* a, const void* b) {
+     return strcmp(((const ReportFile*)a)->filename, ((const ReportFile*)b)->filename);
+ }
+ 
+ /**
+  * Order pointers to snapshot entries by device and inode
+  */
+ static int compare_report_inodes(const void* a, const void* b) {
+     const FileIdentity *ia = &(*(ReportFile* const*)a)->identity;
+     const FileIdentity *ib = &(*(ReportFile* const*)b)->identity;
+     
+     if (ia->dev != ib->dev) {
+         return (ia->dev < ib->dev) ? -1 : 1;
+     }
+     if (ia->ino != ib->ino) {
+         return (ia->ino < ib->ino) ? -1 : 1;
+     }
+     return 0;
+ }
+ 
+ /**
+  * Find an unclaimed vanished entry that owns the given inode
+  * 
+  * @param vanished Vanished entries sorted by inode
+  * @param claimed Flags marking vanished entries already matched
+  * @param count Number of vanished entries
+  * @param identity Identity to look up
+  * @return Index into vanished, or -1 if the inode is new
+  */
+ static int find_vanished_inode(ReportFile** vanished, char* claimed, int count, 
+                                const FileIdentity* identity) {
+     int low = 0, high = count - 1;
+     
+     while (low <= high) {
+         int mid = low + (high - low) / 2;
+         const FileIdentity *probe = &vanished[mid]->identity;
+         
+         if (file_identity_same_inode(probe, identity)) {
+             return claimed[mid] ? -1 : mid;
+         }
+         if (probe->dev < identity->dev || 
+             (probe->dev == identity->dev && probe->ino < identity->ino)) {
+             low = mid + 1;
+         } else {
+             high = mid - 1;
+         }
+     }
+     
+     return -1;
+ }
+ 
+ /**
+  * Fingerprint every file of a fresh name-ordered snapshot
+  * Entries whose identity is unchanged since the previous snapshot reuse
+  * its fingerprint, so only new or rewritten files are read.
+  * 
+  * @param dirfd Directory the snapshot was taken of
+  * @param current Current snapshot, sorted by name
+  * @param current_count Entries in current
+  * @param previous Previous snapshot, sorted by name (may be NULL)
+  * @param previous_count Entries in previous
+  */
+ static void fingerprint_snapshot(int dirfd, ReportFile* current, int current_count, 
+                                  const ReportFile* previous, int previous_count) {
+     int j = 0;
+     
+     for (int i = 0; i < current_count; i++) {
+         ReportFile *file = &current[i];
+         
+         while (j < previous_count && strcmp(previous[j].filename, file->filename) < 0) {
+             j++;
+         }
+         
+         if (j < previous_count && previous[j].fingerprint.valid &&
+             strcmp(previous[j].filename, file->filename) == 0 &&
+             file_identity_same_version(&previous[j].identity, &file->identity)) {
+             file->fingerprint = previous[j].fingerprint;
+             continue;
+         }
+         
+         if (dirfd == -1 || fingerprint_file_at(dirfd, file->filename, &file->fingerprint) != SUCCESS) {
+             memset(&file->fingerprint, 0, sizeof(FileFingerprint));
+         }
+     }
+ }
+ 
+ /**
+  * Capture a new or changed upload into the continuous log, if it is open
+  */
+ static void capture_change(const ReportFile* file) {
+     cdp_capture(report_dir_fd(REPORT_DIR_UPLOAD), file->filename);
+ }
+ 
+ /**
+  * Log a rename of old_file to new_file in the change log
+  */
+ static void log_rename(const ReportFile* old_file, const ReportFile* new_file) {
+     char names[MAX_PATH_LENGTH];
+     
+     snprintf(names, MAX_PATH_LENGTH, "%.*s -> %.*s", 
+              (MAX_PATH_LENGTH - 8) / 2, old_file->filename,
+              (MAX_PATH_LENGTH - 8) / 2, new_file->filename);
+     log_file_change(new_file->owner, names, "rename");
+     capture_change(new_file);
+ }
+ 
  /**
   * Monitor directory for changes
+  * 
+  * Snapshots are kept sorted by name and compared with a single merge pass.
+  * A name whose inode changed is reported as "replace"; an inode that
+  * disappeared under one name and appeared under another is reported as
+  * "rename" instead of a delete/create pair. A changed identity (size,
+  * nanosecond mtime or ctime) only counts as "modify" when the content
+  * fingerprint changed too, so touches and chmods are not reported.
+  * Created and changed files are also captured into the continuous log
+  * when it is open, and the log is synced once per pass. The change log
+  * lines of a pass are written together.
+  * 
   * @return SUCCESS on success, FAILURE on error
   */
- int monitor_directory_changes(void) {
+ static int monitor_changes(void) {
      ReportFile *current_files = NULL;
      int current_file_count = 0;
+     ReportFile **appeared = NULL;
+     ReportFile **vanished = NULL;
+     char *claimed = NULL;
+     int appeared_count = 0, vanished_count = 0;
      int i, j;
-     int found;
+     uint64_t started = metrics_clock();
      
      /* Scan the upload directory */
      if (scan_directory(UPLOAD_DIR, &current_files, &current_file_count) != SUCCESS) {
          return FAILURE;
      }
      
+     /* Keep every snapshot name-ordered so the next diff is a merge */
+     qsort(current_files, current_file_count, sizeof(ReportFile), compare_report_names);
+     fingerprint_snapshot(report_dir_fd(REPORT_DIR_UPLOAD), current_files, current_file_count,
+                          previous_files, previous_file_count);
+     
      /* If this is the first scan, just save the results */
      if (previous_files == NULL) {
+         /* Catch up on changes made while the daemon was not running */
+         for (i = 0; i < current_file_count; i++) {
+             capture_change(&current_files[i]);
+         }
+         cdp_sync();
          previous_files = current_files;
          previous_file_count = current_file_count;
          last_scan_time = time(NULL);
+         metrics_latency(LATENCY_MONITOR, started);
          return SUCCESS;
      }
      
-     /* Look for new or modified files */
-     for (i = 0; i < current_file_count; i++) {
-         found = 0;
+     appeared = (ReportFile**)malloc((current_file_count + 1) * sizeof(ReportFile*));
+     vanished = (ReportFile**)malloc((previous_file_count + 1) * sizeof(ReportFile*));
+     claimed = (char*)calloc(previous_file_count + 1, 1);
+     if (appeared == NULL || vanished == NULL || claimed == NULL) {
+         log_error("Memory allocation failed for change detection");
+         free(appeared);
+         free(vanished);
+         free(claimed);
+         free_report_files(current_files, current_file_count);
+         return FAILURE;
+     }
+     
+     /* One write for all the changes this scan finds */
+     log_batch_begin(LOG_SINK_CHANGE);
+     
+     /* Merge the two name-ordered snapshots */
+     i = 0;
+     j = 0;
+     while (i < current_file_count || j < previous_file_count) {
+         int order;
          
-         for (j = 0; j < previous_file_count; j++) {
-             if (strcmp(current_files[i].filename, previous_files[j].filename) == 0) {
-                 found = 1;
-                 
-                 /* Check if file was modified */
-                 if (current_files[i].timestamp > previous_files[j].timestamp) {
-                     /* Log file modification */
-                     log_file_change(current_files[i].owner, 
-                                    current_files[i].filename, 
-                                    "modify");
-                 }
-                 
-                 break;
+         if (i == current_file_count) {
+             order = 1;
+         } else if (j == previous_file_count) {
+             order = -1;
+         } else {
+             order = strcmp(current_files[i].filename, previous_files[j].filename);
+         }
+         
+         if (order < 0) {
+             appeared[appeared_count++] = &current_files[i++];
+         } else if (order > 0) {
+             vanished[vanished_count++] = &previous_files[j++];
+         } else {
+             ReportFile *now = &current_files[i++];
+             ReportFile *before = &previous_files[j++];
+             
+             if (!file_identity_same_inode(&now->identity, &before->identity)) {
+                 /* Same name, different file: written elsewhere and renamed over */
+                 log_file_change(now->owner, now->filename, "replace");
+                 capture_change(now);
+             } else if (!file_identity_same_version(&now->identity, &before->identity) &&
+                        !fingerprint_equal(&now->fingerprint, &before->fingerprint)) {
+                 log_file_change(now->owner, now->filename, "modify");
+                 capture_change(now);
              }
          }
+     }
+     
+     /* Inodes that moved between names are renames */
+     qsort(vanished, vanished_count, sizeof(ReportFile*), compare_report_inodes);
+     for (i = 0; i < appeared_count; i++) {
+         int match = find_vanished_inode(vanished, claimed, vanished_count, 
+                                         &appeared[i]->identity);
          
-         if (!found) {
+         if (match < 0) {
              /* Log new file */
-             log_file_change(current_files[i].owner, 
-                            current_files[i].filename, 
-                            "create");
+             log_file_change(appeared[i]->owner, appeared[i]->filename, "create");
+             capture_change(appeared[i]);
+             continue;
+         }
+         
+         claimed[match] = 1;
+         log_rename(vanished[match], appeared[i]);
+         if (!fingerprint_equal(&appeared[i]->fingerprint, &vanished[match]->fingerprint)) {
+             /* Renamed and rewritten between two scans */
+             log_file_change(appeared[i]->owner, appeared[i]->filename, "modify");
          }
      }
      
-     /* Look for deleted files */
-     for (j = 0; j < previous_file_count; j++) {
-         found = 0;
+     /* A replaced name may have taken its new inode from a vanished name */
+     for (i = 0, j = 0; i < current_file_count && j < previous_file_count; ) {
+         int order = strcmp(current_files[i].filename, previous_files[j].filename);
          
-         for (i = 0; i < current_file_count; i++) {
-             if (strcmp(previous_files[j].filename, current_files[i].filename) == 0) {
-                 found = 1;
-                 break;
+         if (order == 0) {
+             if (!file_identity_same_inode(&current_files[i].identity, 
+                                           &previous_files[j].identity)) {
+                 int match = find_vanished_inode(vanished, claimed, vanished_count, 
+                                                 &current_files[i].identity);
+                 if (match >= 0) {
+                     claimed[match] = 1;
+                     log_rename(vanished[match], &current_files[i]);
+                 }
              }
+             i++;
+             j++;
+         } else if (order < 0) {
+             i++;
+         } else {
+             j++;
          }
-         
-         if (!found) {
-             /* Log file deletion */
-             log_file_change(previous_files[j].owner, 
-                            previous_files[j].filename, 
-                            "delete");
+     }
+     
+     /* Whatever is left really was deleted */
+     for (j = 0; j < vanished_count; j++) {
+         if (!claimed[j]) {
+             log_file_change(vanished[j]->owner, vanished[j]->filename, "delete");
          }
      }
      
+     log_batch_end(LOG_SINK_CHANGE);
+     free(appeared);
+     free(vanished);
+     free(claimed);
+     cdp_sync();
+     
      /* Free previous file list and update with current scan */
      free_report_files(previous_files, previous_file_count);
      previous_files = current_files;
      previous_file_count = current_file_count;
      last_scan_time = time(NULL);
      
+     metrics_latency(LATENCY_MONITOR, started);
      return SUCCESS;
  }
  
+ /**
+  * Detect and log the changes in the upload directory since the last scan
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int monitor_directory_changes(void) {
+     int result;
+     
+     REPORT_PROBE1(monitor__start, UPLOAD_DIR);
+     result = monitor_changes();
+     REPORT_PROBE2(monitor__done, previous_file_count, result);
+     return result;
+ }
+ 
  /**
   * Scan a directory and return information about all files
   * 
+  * Entries are collected with a single buffered getdents64 pass and then
+  * stat'ed relative to the directory descriptor in batches, so a large
+  * directory costs a few submissions rather than one path walk per file.
+  * 
   * @param dir_path Path to the directory to scan
   * @param files Pointer to an array of ReportFile structures to populate
   * @param count Pointer to store the number of files found
   * @return SUCCESS on success, FAILURE on error
   */
- int scan_directory(const char* dir_path, ReportFile** files, int* count) {
-     DIR *dir;
-     struct dirent *entry;
-     struct stat file_stat;
+ static int scan_directory_files(const char* dir_path, ReportFile** files, int* count) {
+     int dirfd;
+     DirEnumerator iter;
+     DirEntry entry;
+     FileOps fileops;
+     FileOp *batch;
      int file_count = 0;
+     int kept = 0;
      int array_size = 10; /* Initial size, will grow as needed */
+     uid_t cached_uid = (uid_t)-1;
+     char cached_owner[MAX_USER_LENGTH] = "";
+     uint64_t started = metrics_clock();
      
      /* Open the directory */
-     dir = opendir(dir_path);
-     if (dir == NULL) {
+     dirfd = open_directory(dir_path);
+     if (dirfd == -1) {
          log_error("Failed to open directory %s: %s", dir_path, strerror(errno));
          return FAILURE;
      }
      
      /* Allocate initial memory for files array */
      *files = (ReportFile*)malloc(array_size * sizeof(ReportFile));
-     if (*files == NULL) {
+     if (*files == NULL || dir_enum_open(&iter, dirfd) != SUCCESS) {
          log_error("Memory allocation failed for file list");
-         closedir(dir);
+         free(*files);
+         *files = NULL;
+         close(dirfd);
          return FAILURE;
      }
      
-     /* Process each file in the directory */
-     while ((entry = readdir(dir)) != NULL) {
-         char full_path[MAX_PATH_LENGTH];
+     /* Collect every candidate entry */
+     while (dir_enum_next(&iter, &entry)) {
+         ReportFile *file;
          
          /* Skip directory entries and hidden files */
-         if (entry->d_type == DT_DIR || entry->d_name[0] == '.') {
-             continue;
-         }
-         
-         /* Construct the full path */
-         snprintf(full_path, MAX_PATH_LENGTH, "%s/%s", dir_path, entry->d_name);
-         
-         /* Get file information */
-         if (stat(full_path, &file_stat) != 0) {
-             log_error("Failed to get file stats for %s: %s", 
-                       entry->d_name, strerror(errno));
+         if (entry.type == DT_DIR || entry.name[0] == '.') {
              continue;
          }
          
@@ -303,43 +843,145 @@
                  free(*files);
                  *files = NULL;
                  *count = 0;
-                 closedir(dir);
+                 dir_enum_close(&iter);
+                 close(dirfd);
                  return FAILURE;
              }
              *files = new_files;
          }
          
-         /* Fill in file information */
-         memcpy((*files)[file_count].path, full_path, MAX_PATH_LENGTH - 1);
-         (*files)[file_count].path[MAX_PATH_LENGTH - 1] = '\0';
-
-         memcpy((*files)[file_count].filename, entry->d_name, MAX_PATH_LENGTH - 1);
-         (*files)[file_count].filename[MAX_PATH_LENGTH - 1] = '\0';
-         
-         (*files)[file_count].timestamp = file_stat.st_mtime;
-         (*files)[file_count].size = file_stat.st_size;
-         
-         /* Get file owner */
-         get_file_owner(full_path, (*files)[file_count].owner, MAX_USER_LENGTH);
+         file = &(*files)[file_count];
+         snprintf(file->path, MAX_PATH_LENGTH, "%s/%s", dir_path, entry.name);
+         snprintf(file->filename, MAX_PATH_LENGTH, "%s", entry.name);
          
          /* Extract department if it's a report file */
-         if (strstr(entry->d_name, REPORT_EXTENSION) != NULL) {
-             extract_department_from_filename(entry->d_name, 
-                                            (*files)[file_count].department, 
-                                            MAX_USER_LENGTH);
-         } else {
-             (*files)[file_count].department[0] = '\0';
+         file->department[0] = '\0';
+         if (strstr(entry.name, REPORT_EXTENSION) != NULL) {
+             extract_department_from_filename(entry.name, file->department, 
+                                              MAX_USER_LENGTH);
          }
          
          file_count++;
      }
      
-     closedir(dir);
-     *count = file_count;
+     dir_enum_close(&iter);
+     
+     batch = (FileOp*)malloc(FILEOPS_BATCH_SIZE * sizeof(FileOp));
+     if (batch == NULL) {
+         log_error("Memory allocation failed for stat batch");
+         free(*files);
+         *files = NULL;
+         *count = 0;
+         close(dirfd);
+         return FAILURE;
+     }
+     
+     fileops_init(&fileops, FILEOPS_DEFAULT_BACKEND);
+     
+     /* Get file information, dropping entries that vanished meanwhile */
+     for (int base = 0; base < file_count; base += FILEOPS_BATCH_SIZE) {
+         int batch_count = file_count - base;
+         if (batch_count > FILEOPS_BATCH_SIZE) {
+             batch_count = FILEOPS_BATCH_SIZE;
+         }
+         
+         for (int i = 0; i < batch_count; i++) {
+             memset(&batch[i], 0, sizeof(FileOp));
+             batch[i].type = FILE_OP_STATX;
+             batch[i].src_dirfd = dirfd;
+             batch[i].src_name = (*files)[base + i].filename;
+         }
+         
+         fileops_submit(&fileops, batch, batch_count);
+         
+         for (int i = 0; i < batch_count; i++) {
+             ReportFile *file = &(*files)[base + i];
+             
+             if (batch[i].result != 0) {
+                 log_error("Failed to get file stats for %s: %s", 
+                           file->filename, strerror(-batch[i].result));
+                 continue;
+             }
+             
+             file->timestamp = batch[i].stx.stx_mtime.tv_sec;
+             file->size = (int)batch[i].stx.stx_size;
+             file_identity_from_statx(&batch[i].stx, &file->identity);
+             
+             /* Get file owner without another stat */
+             if (batch[i].stx.stx_uid != cached_uid) {
+                 cached_uid = batch[i].stx.stx_uid;
+                 get_owner_name(cached_uid, cached_owner, MAX_USER_LENGTH);
+             }
+             strcpy(file->owner, cached_owner);
+             
+             if (kept != base + i) {
+                 memcpy(&(*files)[kept], file, sizeof(ReportFile));
+             }
+             kept++;
+         }
+     }
+     
+     fileops_destroy(&fileops);
+     free(batch);
+     close(dirfd);
+     *count = kept;
      
+     metrics_count(METRIC_STAT_CALLS, (uint64_t)file_count);
+     metrics_count(METRIC_FILES_SCANNED, (uint64_t)kept);
+     metrics_latency(LATENCY_SCAN, started);
      return SUCCESS;
  }
  
+ /**
+  * Scan a directory and return information about all files
+  * @param dir_path Path to the directory to scan
+  * @param files Pointer to an array of ReportFile structures to populate
+  * @param count Pointer to store the number of files found
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int scan_directory(const char* dir_path, ReportFile** files, int* count) {
+     int result;
+     
+     REPORT_PROBE1(scan__start, dir_path);
+     result = scan_directory_files(dir_path, files, count);
+     REPORT_PROBE3(scan__done, dir_path, (result == SUCCESS) ? *count : 0, result);
+     return result;
+ }
+ 
+ /**
+  * Capture the identity of a file from a statx result
+  * 
+  * @param stx Result of statx with at least STATX_BASIC_STATS
+  * @param identity Identity to fill in
+  */
+ void file_identity_from_statx(const struct statx* stx, FileIdentity* identity) {
+     identity->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+     identity->ino = stx->stx_ino;
+     identity->size = stx->stx_size;
+     identity->mtime_ns = (int64_t)stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec;
+     identity->ctime_ns = (int64_t)stx->stx_ctime.tv_sec * 1000000000LL + stx->stx_ctime.tv_nsec;
+ }
+ 
+ /**
+  * Check whether two identities refer to the same inode
+  * @return TRUE if device and inode match, FALSE otherwise
+  */
+ int file_identity_same_inode(const FileIdentity* a, const FileIdentity* b) {
+     return (a->dev == b->dev && a->ino == b->ino) ? TRUE : FALSE;
+ }
+ 
+ /**
+  * Check whether two identities describe the same version of the same inode
+  * ctime is included so rewrites that restore the old mtime are still seen.
+  * @return TRUE if nothing changed, FALSE otherwise
+  */
+ int file_identity_same_version(const FileIdentity* a, const FileIdentity* b) {
+     return (file_identity_same_inode(a, b) && 
+             a->size == b->size && 
+             a->mtime_ns == b->mtime_ns && 
+             a->ctime_ns == b->ctime_ns) ? TRUE : FALSE;
+ }
+ 
  /**
   * Log file change to the change log
   * 
@@ -349,29 +991,14 @@
   * @return SUCCESS on success, FAILURE on error
   */
  int log_file_change(const char* username, const char* filename, const char* action) {
-     FILE *log_fp;
-     time_t now;
-     char time_str[MAX_TIME_LENGTH];
-     
-     /* Get current time */
-     now = time(NULL);
-     get_timestamp_string(now, time_str, MAX_TIME_LENGTH);
-     
-     /* Open the change log file for appending */
-     log_fp = fopen(CHANGE_LOG, "a");
-     if (log_fp == NULL) {
-         log_error("Failed to open change log file: %s", strerror(errno));
-         return FAILURE;
-     }
-     
-     /* Write the log entry */
-     fprintf(log_fp, "[%s] User: %s, File: %s, Action: %s\n", 
-             time_str, username, filename, action);
+     ChangeRecord record;
      
-     /* Close the log file */
-     fclose(log_fp);
+     snprintf(record.username, sizeof(record.username), "%s", username);
+     snprintf(record.filename, sizeof(record.filename), "%s", filename);
+     snprintf(record.action, sizeof(record.action), "%s", action);
+     record.timestamp = time(NULL);
      
-     return SUCCESS;
+     return log_change(&record);
  }
  
  /**
@@ -384,7 +1011,6 @@
   */
  int get_file_owner(const char* path, char* owner, size_t owner_size) {
      struct stat file_stat;
-     struct passwd *pwd;
      
      /* Get file information */
      if (stat(path, &file_stat) != 0) {
@@ -392,11 +1018,34 @@
          return FAILURE;
      }
      
+     if (get_owner_name(file_stat.st_uid, owner, owner_size) != SUCCESS) {
+         log_error("Failed to get owner for %s", path);
+         return FAILURE;
+     }
+     
+     return SUCCESS;
+ }
+ 
+ /**
+  * Resolve a user ID to a user name
+  * Safe to call from pipeline worker threads.
+  * 
+  * @param uid User ID to resolve
+  * @param owner Buffer to store the owner name (numeric ID if unknown)
+  * @param owner_size Size of the owner buffer
+  * @return SUCCESS on success, FAILURE if the user is unknown
+  */
+ int get_owner_name(uid_t uid, char* owner, size_t owner_size) {
+     struct passwd pwd_entry;
+     struct passwd *pwd = NULL;
+     char pwd_buffer[1024];
+     
+     metrics_count(METRIC_OWNER_LOOKUPS, 1);
+     
      /* Get user information */
-     pwd = getpwuid(file_stat.st_uid);
-     if (pwd == NULL) {
-         log_error("Failed to get owner for %s: %s", path, strerror(errno));
-         snprintf(owner, owner_size, "%d", file_stat.st_uid);
+     if (getpwuid_r(uid, &pwd_entry, pwd_buffer, sizeof(pwd_buffer), &pwd) != 0 || 
+         pwd == NULL) {
+         snprintf(owner, owner_size, "%d", (int)uid);
          return FAILURE;
      }
      
@@ -430,22 +1079,54 @@
   * @return SUCCESS on success, FAILURE on error
   */
  int move_file(const char* source, const char* destination) {
+     return move_file_at(AT_FDCWD, source, AT_FDCWD, destination);
+ }
+ 
+ /**
+  * Move a file between two directories
+  * 
+  * @param src_dirfd Directory descriptor for source (AT_FDCWD for a path)
+  * @param source Source file name or path
+  * @param dst_dirfd Directory descriptor for destination (AT_FDCWD for a path)
+  * @param destination Destination file name or path
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int move_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* destination) {
+     uint64_t started = metrics_clock();
+     FileFingerprint copied = { 0 };
+     
+     REPORT_PROBE2(move__start, source, destination);
+     
      /* First try to rename the file (works if on same filesystem) */
-     if (rename(source, destination) == 0) {
+     if (renameat2(src_dirfd, source, dst_dirfd, destination, 0) == 0) {
+         metrics_count(METRIC_RENAMES, 1);
+         metrics_latency(LATENCY_MOVE_FILE, started);
+         REPORT_PROBE3(move__done, source, 0, SUCCESS);
          return SUCCESS;
      }
      
-     /* If rename fails, try copy and delete */
-     if (copy_file(source, destination) == SUCCESS) {
-         /* Delete the source file */
-         if (unlink(source) != 0) {
-             log_error("Failed to delete source file after copy: %s", strerror(errno));
+     /* If rename fails, copy and delete; never delete the only good copy */
+     metrics_count(METRIC_COPY_FALLBACKS, 1);
+     for (int attempt = 0; attempt <= COPY_VERIFY_RETRIES; attempt++) {
+         if (copy_file_verified_at(src_dirfd, source, dst_dirfd, destination, &copied) == SUCCESS) {
+             break;
+         }
+         if (errno != EIO || attempt == COPY_VERIFY_RETRIES) {
+             REPORT_PROBE3(move__done, source, 0, FAILURE);
              return FAILURE;
          }
-         return SUCCESS;
+         log_error("Retrying copy of %s after failed verification", source);
      }
      
-     return FAILURE;
+     /* Delete the source file */
+     if (unlinkat(src_dirfd, source, 0) != 0) {
+         log_error("Failed to delete source file after copy: %s", strerror(errno));
+         REPORT_PROBE3(move__done, source, copied.size, FAILURE);
+         return FAILURE;
+     }
+     metrics_latency(LATENCY_MOVE_FILE, started);
+     REPORT_PROBE3(move__done, source, copied.size, SUCCESS);
+     return SUCCESS;
  }
  
  /**
@@ -456,47 +1137,262 @@
   * @return SUCCESS on success, FAILURE on error
   */
  int copy_file(const char* source, const char* destination) {
+     return copy_file_at(AT_FDCWD, source, AT_FDCWD, destination);
+ }
+ 
+ /**
+  * Copy a file between two directories
+  * The kernel is asked to move the data with copy_file_range first, which
+  * lets filesystems that support it share extents instead of copying bytes.
+  * On failure errno describes the first error encountered.
+  * 
+  * @param src_dirfd Directory descriptor for source (AT_FDCWD for a path)
+  * @param source Source file name or path
+  * @param dst_dirfd Directory descriptor for destination (AT_FDCWD for a path)
+  * @param destination Destination file name or path
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int copy_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* destination) {
      int src_fd, dest_fd;
-     char buffer[4096];
+     char buffer[65536];
      ssize_t bytes_read, bytes_written;
+     uint64_t copied = 0;
+     uint64_t started = metrics_clock();
      int result = SUCCESS;
+     int saved_errno = 0;
+     
+     REPORT_PROBE2(copy__start, source, destination);
      
      /* Open source file for reading */
-     src_fd = open(source, O_RDONLY);
+     src_fd = openat(src_dirfd, source, O_RDONLY);
      if (src_fd == -1) {
-         log_error("Failed to open source file %s: %s", source, strerror(errno));
+         saved_errno = errno;
+         log_error("Failed to open source file %s: %s", source, strerror(saved_errno));
+         REPORT_PROBE3(copy__done, source, 0, FAILURE);
+         errno = saved_errno;
          return FAILURE;
      }
      
      /* Open destination file for writing, create if it doesn't exist */
-     dest_fd = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     dest_fd = openat(dst_dirfd, destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
      if (dest_fd == -1) {
+         saved_errno = errno;
          log_error("Failed to open destination file %s: %s", 
-                   destination, strerror(errno));
+                   destination, strerror(saved_errno));
          close(src_fd);
+         REPORT_PROBE3(copy__done, source, 0, FAILURE);
+         errno = saved_errno;
+         return FAILURE;
+     }
+     
+     /* In-kernel copy; both file offsets advance so the fallback resumes */
+     do {
+         bytes_written = copy_file_range(src_fd, NULL, dest_fd, NULL, SSIZE_MAX, 0);
+         if (bytes_written > 0) {
+             copied += (uint64_t)bytes_written;
+         }
+     } while (bytes_written > 0);
+     
+     if (bytes_written == -1) {
+         /* Unsupported here (cross-device, old kernel, special file) */
+         while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
+             bytes_written = write(dest_fd, buffer, bytes_read);
+             if (bytes_written != bytes_read) {
+                 saved_errno = (bytes_written == -1) ? errno : EIO;
+                 log_error("Failed to write to destination file: %s", strerror(saved_errno));
+                 result = FAILURE;
+                 break;
+             }
+             copied += (uint64_t)bytes_written;
+         }
+         
+         /* Check for read error */
+         if (bytes_read == -1) {
+             saved_errno = errno;
+             log_error("Failed to read from source file: %s", strerror(saved_errno));
+             result = FAILURE;
+         }
+     }
+     
+     /* Close files */
+     close(src_fd);
+     if (close(dest_fd) != 0 && result == SUCCESS) {
+         saved_errno = errno;
+         log_error("Failed to close destination file %s: %s", 
+                   destination, strerror(saved_errno));
+         result = FAILURE;
+     }
+     
+     metrics_count(METRIC_BYTES_COPIED, copied);
+     metrics_latency(LATENCY_COPY_FILE, started);
+     REPORT_PROBE3(copy__done, source, copied, result);
+     errno = saved_errno;
+     return result;
+ }
+ 
+ /**
+  * Build the temporary name a verified copy is written under
+  * It sits next to the destination, so the final rename stays within one
+  * directory, and is unique per process and call.
+  * @return SUCCESS on success, FAILURE if the name does not fit
+  */
+ static int copy_temp_name(const char* destination, char* temp, size_t temp_size) {
+     static unsigned int sequence = 0;
+     const char *base = strrchr(destination, '/');
+     int dir_length = (base != NULL) ? (int)(base - destination + 1) : 0;
+     int length;
+     
+     base = (base != NULL) ? base + 1 : destination;
+     length = snprintf(temp, temp_size, "%.*s" COPY_TEMP_PREFIX "%ld.%u.%s", dir_length, destination,
+                       (long)getpid(), __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED), base);
+     if (length < 0 || (size_t)length >= temp_size || strlen(temp + dir_length) > NAME_MAX) {
+         errno = ENAMETOOLONG;
+         return FAILURE;
+     }
+     return SUCCESS;
+ }
+ 
+ /**
+  * Read a written copy back from the disk and fingerprint it
+  * The copy is synced first and its cached pages dropped, so the read-back
+  * comes from the device rather than from the page cache (as far as the
+  * kernel honours the advice).
+  * @return SUCCESS on success, FAILURE on error (errno set)
+  */
+ static int fingerprint_from_disk(int fd, char* buffer, size_t buffer_size, FileFingerprint* fingerprint) {
+     FingerprintState state;
+     off_t offset = 0;
+     ssize_t bytes_read;
+     
+     if (fsync(fd) != 0) {
          return FAILURE;
      }
+     posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
      
-     /* Copy data */
+     fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+     while ((bytes_read = pread(fd, buffer, buffer_size, offset)) > 0) {
+         fingerprint_update(&state, buffer, (size_t)bytes_read);
+         offset += bytes_read;
+     }
+     if (bytes_read == -1) {
+         return FAILURE;
+     }
+     fingerprint_final(&state, fingerprint);
+     return SUCCESS;
+ }
+ 
+ /**
+  * Copy a file between two directories and verify the copy
+  * The data passes through user memory once and is fingerprinted on the
+  * way into a temporary file next to the destination. That file is synced,
+  * read back from the disk and fingerprinted again, and only a matching
+  * copy is renamed over the destination. Whatever the destination held
+  * before is therefore untouched on any failure; on a mismatch errno is
+  * EIO and only the temporary file is removed.
+  * 
+  * @param src_dirfd Directory descriptor for source (AT_FDCWD for a path)
+  * @param source Source file name or path
+  * @param dst_dirfd Directory descriptor for destination (AT_FDCWD for a path)
+  * @param destination Destination file name or path
+  * @param fingerprint Receives the fingerprint of the copied data (may be NULL)
+  * @return SUCCESS on success, FAILURE on error or verification mismatch
+  */
+ int copy_file_verified_at(int src_dirfd, const char* source, int dst_dirfd, 
+                           const char* destination, FileFingerprint* fingerprint) {
+     int src_fd, dest_fd;
+     static __thread char buffer[65536];
+     char temp[MAX_PATH_LENGTH];
+     ssize_t bytes_read, bytes_written;
+     FingerprintState state;
+     FileFingerprint copied, on_disk;
+     off_t offset = 0;
+     uint64_t started = metrics_clock();
+     int result = SUCCESS;
+     int saved_errno = 0;
+     
+     REPORT_PROBE2(copy__start, source, destination);
+     
+     src_fd = openat(src_dirfd, source, O_RDONLY | O_CLOEXEC);
+     if (src_fd == -1) {
+         saved_errno = errno;
+         log_error("Failed to open source file %s: %s", source, strerror(saved_errno));
+         REPORT_PROBE3(copy__done, source, 0, FAILURE);
+         errno = saved_errno;
+         return FAILURE;
+     }
+     
+     /* Read access is needed to verify what was written */
+     dest_fd = -1;
+     if (copy_temp_name(destination, temp, sizeof(temp)) == SUCCESS) {
+         dest_fd = openat(dst_dirfd, temp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+     }
+     if (dest_fd == -1) {
+         saved_errno = errno;
+         log_error("Failed to open destination file %s: %s", 
+                   destination, strerror(saved_errno));
+         close(src_fd);
+         REPORT_PROBE3(copy__done, source, 0, FAILURE);
+         errno = saved_errno;
+         return FAILURE;
+     }
+     
+     /* Copy, hashing each chunk on the way */
+     fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
      while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
+         fingerprint_update(&state, buffer, (size_t)bytes_read);
          bytes_written = write(dest_fd, buffer, bytes_read);
          if (bytes_written != bytes_read) {
-             log_error("Failed to write to destination file: %s", strerror(errno));
+             saved_errno = (bytes_written == -1) ? errno : EIO;
+             log_error("Failed to write to destination file: %s", strerror(saved_errno));
              result = FAILURE;
              break;
          }
+         offset += bytes_read;
      }
-     
-     /* Check for read error */
      if (bytes_read == -1) {
-         log_error("Failed to read from source file: %s", strerror(errno));
+         saved_errno = errno;
+         log_error("Failed to read from source file: %s", strerror(saved_errno));
          result = FAILURE;
      }
-     
-     /* Close files */
+     fingerprint_final(&state, &copied);
      close(src_fd);
-     close(dest_fd);
      
+     /* Check what reached the disk, not what is in the page cache */
+     if (result == SUCCESS) {
+         if (fingerprint_from_disk(dest_fd, buffer, sizeof(buffer), &on_disk) != SUCCESS) {
+             saved_errno = errno;
+             log_error("Failed to read back %s: %s", destination, strerror(saved_errno));
+             result = FAILURE;
+         } else if (!fingerprint_equal(&copied, &on_disk)) {
+             saved_errno = EIO;
+             log_error("Verification failed for %s", destination);
+             result = FAILURE;
+         }
+     }
+     
+     if (close(dest_fd) != 0 && result == SUCCESS) {
+         saved_errno = errno;
+         log_error("Failed to close destination file %s: %s", 
+                   destination, strerror(saved_errno));
+         result = FAILURE;
+     }
+     
+     if (result == SUCCESS && renameat(dst_dirfd, temp, dst_dirfd, destination) != 0) {
+         saved_errno = errno;
+         log_error("Failed to install copy as %s: %s", destination, strerror(saved_errno));
+         result = FAILURE;
+     }
+     
+     if (result != SUCCESS) {
+         unlinkat(dst_dirfd, temp, 0);
+     } else if (fingerprint != NULL) {
+         *fingerprint = copied;
+     }
+     
+     metrics_count(METRIC_BYTES_COPIED, (uint64_t)offset);
+     metrics_latency(LATENCY_COPY_FILE, started);
+     REPORT_PROBE3(copy__done, source, (uint64_t)offset, result);
+     errno = saved_errno;
      return result;
  }
  
@@ -508,29 +1404,46 @@
   * @return TRUE if valid, FALSE if not
   */
  int is_valid_xml_report(const char* filepath) {
-     FILE *fp;
+     return is_valid_xml_report_at(AT_FDCWD, filepath);
+ }
+ 
+ /**
+  * Check if a file in a directory is a valid XML report
+  * 
+  * @param dirfd Directory descriptor (AT_FDCWD for a path)
+  * @param name File name or path to check
+  * @return TRUE if valid, FALSE if not
+  */
+ int is_valid_xml_report_at(int dirfd, const char* name) {
+     int fd;
      char buffer[1024];
-     int is_valid = FALSE;
+     ssize_t bytes_read;
+     char *line_end;
      
      /* Check file extension */
-     if (strstr(filepath, REPORT_EXTENSION) == NULL) {
+     if (strstr(name, REPORT_EXTENSION) == NULL) {
          return FALSE;
      }
      
      /* Open the file */
-     fp = fopen(filepath, "r");
-     if (fp == NULL) {
+     fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+     if (fd == -1) {
          return FALSE;
      }
      
-     /* Read the first few bytes to check for XML header */
-     if (fgets(buffer, sizeof(buffer), fp) != NULL) {
-         /* Basic check for XML format - should start with <?xml */
-         if (strstr(buffer, "<?xml") != NULL) {
-             is_valid = TRUE;
-         }
+     /* Read the first line to check for XML header */
+     bytes_read = read(fd, buffer, sizeof(buffer) - 1);
+     close(fd);
+     if (bytes_read <= 0) {
+         return FALSE;
      }
+     buffer[bytes_read] = '\0';
      
-     fclose(fp);
-     return is_valid;
- }
\ No newline at end of file
+     line_end = strchr(buffer, '\n');
+     if (line_end != NULL) {
+         *line_end = '\0';
+     }
+     
+     /* Basic check for XML format - should start with <?xml */
+     return (strstr(buffer, "<?xml") != NULL) ? TRUE : FALSE;
+ }
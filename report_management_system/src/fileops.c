@@ -0,0 +1,126 @@
+/**
+ * @file fileops.c
+ * @brief Batched file operation interface and its synchronous backend
+ *
+ * Scans, transfers and backups describe their work as arrays of FileOp
+ * entries and hand them to fileops_submit(). The io_uring backend in
+ * fileops_uring.c executes a batch with a handful of system calls; this
+ * file provides the portable one-syscall-per-operation fallback.
+ */
+
+#define LOG_MODULE LOG_MODULE_FILES
+#include "report_system.h"
+
+/**
+ * Initialize a file operation context
+ * @param ops Context to initialize
+ * @param backend Preferred backend (FILEOPS_BACKEND_URING or FILEOPS_BACKEND_SYNC)
+ * @return SUCCESS (an unavailable io_uring silently selects the sync backend)
+ */
+int fileops_init(FileOps* ops, int backend) {
+    ops->backend = FILEOPS_BACKEND_SYNC;
+    ops->uring = NULL;
+
+    if (backend == FILEOPS_BACKEND_URING) {
+        if (uring_backend_init(&ops->uring) == SUCCESS) {
+            ops->backend = FILEOPS_BACKEND_URING;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Release a file operation context
+ * @param ops Context to release
+ */
+void fileops_destroy(FileOps* ops) {
+    if (ops->uring != NULL) {
+        uring_backend_destroy(ops->uring);
+        ops->uring = NULL;
+    }
+    ops->backend = FILEOPS_BACKEND_SYNC;
+}
+
+/**
+ * Get a printable name for the backend a context is using
+ * @param ops File operation context
+ * @return Static backend name
+ */
+const char* fileops_backend_name(const FileOps* ops) {
+    return (ops->backend == FILEOPS_BACKEND_URING) ? "io_uring" : "sync";
+}
+
+/**
+ * Execute a batch of file operations
+ * Each entry's result field is set to 0 or a negative errno value.
+ * @param ops File operation context
+ * @param batch Array of operations
+ * @param count Number of operations in the batch
+ * @return Number of operations that failed
+ */
+int fileops_submit(FileOps* ops, FileOp* batch, int count) {
+    int failed = 0;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    if (ops->backend == FILEOPS_BACKEND_URING) {
+        uring_backend_submit(ops->uring, batch, count);
+    } else {
+        for (int i = 0; i < count; i++) {
+            fileops_execute_sync(&batch[i]);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (batch[i].result != 0) {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * Execute a single file operation with ordinary system calls
+ * @param op Operation to execute; its result field is updated
+ * @return 0 on success, negative errno on failure
+ */
+int fileops_execute_sync(FileOp* op) {
+    switch (op->type) {
+        case FILE_OP_STATX:
+            op->result = (statx(op->src_dirfd, op->src_name, op->flags,
+                                STATX_BASIC_STATS, &op->stx) == 0) ? 0 : -errno;
+            break;
+        case FILE_OP_RENAME:
+            op->result = (renameat2(op->src_dirfd, op->src_name, op->dst_dirfd,
+                                    op->dst_name, (unsigned)op->flags) == 0) ? 0 : -errno;
+            break;
+        case FILE_OP_UNLINK:
+            op->result = (unlinkat(op->src_dirfd, op->src_name, op->flags) == 0) ? 0 : -errno;
+            break;
+        case FILE_OP_COPY:
+            errno = 0;
+            if (op->flags & FILEOPS_COPY_VERIFY) {
+                if (copy_file_verified_at(op->src_dirfd, op->src_name, op->dst_dirfd,
+                                          op->dst_name, &op->fingerprint) == SUCCESS) {
+                    op->result = 0;
+                } else {
+                    op->result = (errno != 0) ? -errno : -EIO;
+                }
+            } else if (copy_file_at(op->src_dirfd, op->src_name,
+                                    op->dst_dirfd, op->dst_name) == SUCCESS) {
+                op->result = 0;
+            } else {
+                op->result = (errno != 0) ? -errno : -EIO;
+            }
+            break;
+        default:
+            op->result = -EINVAL;
+            break;
+    }
+
+    return op->result;
+}
@@ -0,0 +1,683 @@
+/**
+ * @file fileops_uring.c
+ * @brief io_uring backend for batched file operations
+ *
+ * Talks to the kernel through the raw io_uring system calls so the daemon
+ * has no liburing dependency. Small file copies are submitted as one linked
+ * chain (open source, open destination, read, end-of-file probe, write,
+ * close, close) using direct descriptors, so a whole batch of copies costs a single
+ * io_uring_enter call. Verified copies add a read-back of the destination
+ * to the chain and are checked and fingerprinted in the arena afterwards.
+ * Anything the ring cannot handle is executed with fileops_execute_sync().
+ */
+
+#define LOG_MODULE LOG_MODULE_FILES
+#include "report_system.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Submission ring size; also the largest number of SQEs per enter call */
+#define URING_ENTRIES      256
+
+/* SQEs used by one linked copy chain (one fewer without verification) */
+#define URING_COPY_STEPS   8
+
+/* Copy chains in flight per submission, two direct descriptors each */
+#define URING_COPY_SLOTS   (URING_ENTRIES / URING_COPY_STEPS)
+
+/* user_data layout: batch index in the high bits, chain step in the low 3 */
+#define URING_STEP_BITS    3
+#define URING_STEP_MASK    ((1ULL << URING_STEP_BITS) - 1)
+
+/* Steps of a copy chain */
+#define COPY_OPEN_SRC  0
+#define COPY_OPEN_DST  1
+#define COPY_READ      2
+#define COPY_EOF       3
+#define COPY_WRITE     4
+#define COPY_VERIFY    5
+#define COPY_CLOSE_SRC 6
+#define COPY_CLOSE_DST 7
+
+/**
+ * @struct UringState
+ * @brief Mapped rings and scratch memory for one io_uring instance
+ */
+typedef struct {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    int direct_files;          /* TRUE when direct descriptor slots exist */
+    char *copy_arena;          /* Data buffers for in-flight copy chains */
+    size_t copy_arena_size;
+} UringState;
+
+/**
+ * @struct CopyChain
+ * @brief Per-copy bookkeeping while its chain is in flight
+ */
+typedef struct {
+    int op_index;              /* Index of the FileOp in the batch */
+    int slot;                  /* First of two direct descriptor slots */
+    char *buffer;              /* Data read from the source */
+    char *readback;            /* Data read back from the destination, if verifying */
+    char probe;                /* Target of the end-of-file probe read */
+    int res[URING_COPY_STEPS]; /* Completion result of each step */
+} CopyChain;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Check that the kernel implements every opcode this backend submits
+ * @param ring_fd Ring file descriptor
+ * @return TRUE if all opcodes are supported, FALSE otherwise
+ */
+static int uring_probe_opcodes(int ring_fd) {
+    static const int required[] = {
+        IORING_OP_STATX, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT,
+        IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE
+    };
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    int supported = TRUE;
+
+    probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if (probe == NULL) {
+        return FALSE;
+    }
+
+    if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+        free(probe);
+        return FALSE;
+    }
+
+    for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+        if (required[i] > probe->last_op ||
+            !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = FALSE;
+            break;
+        }
+    }
+
+    free(probe);
+    return supported;
+}
+
+/**
+ * Register empty direct descriptor slots used by copy chains
+ * @param state Ring state
+ * @return TRUE if slots were registered, FALSE otherwise
+ */
+static int uring_register_direct_files(UringState* state) {
+    struct io_uring_rsrc_register reg;
+    int fds[URING_COPY_SLOTS * 2];
+
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = URING_COPY_SLOTS * 2;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sys_io_uring_register(state->ring_fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0) {
+        return TRUE;
+    }
+
+    /* Older kernels accept a table of -1 entries instead */
+    for (int i = 0; i < URING_COPY_SLOTS * 2; i++) {
+        fds[i] = -1;
+    }
+    return sys_io_uring_register(state->ring_fd, IORING_REGISTER_FILES,
+                                 fds, URING_COPY_SLOTS * 2) == 0;
+}
+
+/**
+ * Release everything held by a ring state
+ * @param state Ring state (may be partially initialized)
+ */
+static void uring_release(UringState* state) {
+    if (state->sqes != NULL && state->sqes != MAP_FAILED) {
+        munmap(state->sqes, state->sqes_size);
+    }
+    if (state->cq_ptr != NULL && state->cq_ptr != MAP_FAILED && state->cq_ptr != state->sq_ptr) {
+        munmap(state->cq_ptr, state->cq_size);
+    }
+    if (state->sq_ptr != NULL && state->sq_ptr != MAP_FAILED) {
+        munmap(state->sq_ptr, state->sq_size);
+    }
+    if (state->ring_fd >= 0) {
+        close(state->ring_fd);
+    }
+    free(state->copy_arena);
+    free(state);
+}
+
+/**
+ * Create an io_uring instance for batched file operations
+ * @param out Receives the backend state
+ * @return SUCCESS on success, FAILURE if io_uring is unavailable
+ */
+int uring_backend_init(void** out) {
+    struct io_uring_params params;
+    UringState *state;
+    char *sq_base, *cq_base;
+
+    *out = NULL;
+
+    state = (UringState*)calloc(1, sizeof(UringState));
+    if (state == NULL) {
+        return FAILURE;
+    }
+
+    memset(&params, 0, sizeof(params));
+    state->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (state->ring_fd < 0) {
+        /* Disabled by policy, seccomp or an old kernel: stay synchronous */
+        free(state);
+        return FAILURE;
+    }
+
+    if (!uring_probe_opcodes(state->ring_fd)) {
+        uring_release(state);
+        return FAILURE;
+    }
+
+    /* Map the submission and completion rings */
+    state->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    state->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_size > state->sq_size) {
+            state->sq_size = state->cq_size;
+        }
+        state->cq_size = state->sq_size;
+    }
+
+    state->sq_ptr = mmap(NULL, state->sq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) {
+        uring_release(state);
+        return FAILURE;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ptr = state->sq_ptr;
+    } else {
+        state->cq_ptr = mmap(NULL, state->cq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) {
+            uring_release(state);
+            return FAILURE;
+        }
+    }
+
+    state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = (struct io_uring_sqe*)mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                                             IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        uring_release(state);
+        return FAILURE;
+    }
+
+    sq_base = (char*)state->sq_ptr;
+    cq_base = (char*)state->cq_ptr;
+    state->sq_entries = params.sq_entries;
+    state->sq_head = (unsigned*)(sq_base + params.sq_off.head);
+    state->sq_tail = (unsigned*)(sq_base + params.sq_off.tail);
+    state->sq_mask = (unsigned*)(sq_base + params.sq_off.ring_mask);
+    state->sq_array = (unsigned*)(sq_base + params.sq_off.array);
+    state->cq_head = (unsigned*)(cq_base + params.cq_off.head);
+    state->cq_tail = (unsigned*)(cq_base + params.cq_off.tail);
+    state->cq_mask = (unsigned*)(cq_base + params.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)(cq_base + params.cq_off.cqes);
+
+    /* Without direct descriptors copies simply take the sync path */
+    state->direct_files = uring_register_direct_files(state);
+
+    *out = state;
+    return SUCCESS;
+}
+
+/**
+ * Tear down an io_uring instance
+ * @param backend Backend state from uring_backend_init
+ */
+void uring_backend_destroy(void* backend) {
+    if (backend != NULL) {
+        uring_release((UringState*)backend);
+    }
+}
+
+/**
+ * Claim the next free submission queue entry
+ * The caller guarantees the ring has room for the whole submission.
+ * @param state Ring state
+ * @return Zeroed SQE
+ */
+static struct io_uring_sqe* uring_get_sqe(UringState* state) {
+    unsigned tail = *state->sq_tail;
+    unsigned index = tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[index] = index;
+    __atomic_store_n(state->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/**
+ * Submit queued SQEs and wait until every one has completed
+ * @param state Ring state
+ * @param submitted Number of SQEs queued since the last call
+ * @param batch Batch whose results are being collected
+ * @param chains Copy chain bookkeeping, indexed by batch position
+ * @param pending Set for each queued unlinked operation; cleared on completion
+ * @return SUCCESS on success, FAILURE if the ring itself failed
+ */
+static int uring_run(UringState* state, unsigned submitted, FileOp* batch, CopyChain** chains,
+                     unsigned char* pending) {
+    unsigned pending_submit = submitted;
+    unsigned completed = 0;
+
+    while (completed < submitted) {
+        unsigned head, tail;
+        int ret;
+
+        ret = sys_io_uring_enter(state->ring_fd, pending_submit, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FAILURE;
+        }
+        pending_submit -= (unsigned)ret;
+
+        head = *state->cq_head;
+        tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+            int index = (int)(cqe->user_data >> URING_STEP_BITS);
+            int step = (int)(cqe->user_data & URING_STEP_MASK);
+
+            if (batch[index].type == FILE_OP_COPY && chains[index] != NULL) {
+                chains[index]->res[step] = cqe->res;
+            } else {
+                batch[index].result = cqe->res < 0 ? cqe->res : 0;
+                pending[index] = 0;
+            }
+
+            head++;
+            completed++;
+        }
+        __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Number of SQEs in the chain for a copy
+ */
+static unsigned uring_copy_steps(const FileOp* op) {
+    return (op->flags & FILEOPS_COPY_VERIFY) ? URING_COPY_STEPS : URING_COPY_STEPS - 1;
+}
+
+/**
+ * Arena bytes needed by a copy chain: the data, plus its read-back copy
+ */
+static size_t uring_copy_span(const FileOp* op) {
+    size_t span = ((size_t)op->size + 63) & ~(size_t)63;
+    return (op->flags & FILEOPS_COPY_VERIFY) ? span * 2 : span;
+}
+
+/**
+ * Queue the linked open-read-write-close chain for one copy
+ * @param state Ring state
+ * @param op Copy operation
+ * @param index Position of the operation in the batch
+ * @param chain Chain bookkeeping with its slot and buffers assigned
+ */
+static void uring_queue_copy(UringState* state, FileOp* op, int index, CopyChain* chain) {
+    struct io_uring_sqe *sqe;
+    unsigned long long tag = (unsigned long long)index << URING_STEP_BITS;
+    int slot = chain->slot;
+    int verify = (chain->readback != NULL);
+
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = op->src_dirfd;
+    sqe->addr = (unsigned long)op->src_name;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag | COPY_OPEN_SRC;
+
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = op->dst_dirfd;
+    sqe->addr = (unsigned long)op->dst_name;
+    sqe->open_flags = (verify ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+    sqe->len = 0644;
+    sqe->file_index = slot + 2;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag | COPY_OPEN_DST;
+
+    /* A short read or write breaks the link, cancelling the rest */
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot;
+    sqe->addr = (unsigned long)chain->buffer;
+    sqe->len = (unsigned)op->size;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->user_data = tag | COPY_READ;
+
+    /*
+     * One byte past the size statx reported: it must hit end of file, or
+     * the source grew and the copy above is truncated. The zero-length
+     * result counts as a short read, so this link must not sever.
+     */
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot;
+    sqe->addr = (unsigned long)&chain->probe;
+    sqe->len = 1;
+    sqe->off = (unsigned long long)op->size;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->user_data = tag | COPY_EOF;
+
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = slot + 1;
+    sqe->addr = (unsigned long)chain->buffer;
+    sqe->len = (unsigned)op->size;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->user_data = tag | COPY_WRITE;
+
+    if (verify) {
+        sqe = uring_get_sqe(state);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slot + 1;
+        sqe->addr = (unsigned long)chain->readback;
+        sqe->len = (unsigned)op->size;
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = tag | COPY_VERIFY;
+    }
+
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag | COPY_CLOSE_SRC;
+
+    sqe = uring_get_sqe(state);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 2;
+    sqe->user_data = tag | COPY_CLOSE_DST;
+}
+
+/**
+ * Queue a single unlinked operation (statx, rename or unlink)
+ * @param state Ring state
+ * @param op Operation to queue
+ * @param index Position of the operation in the batch
+ */
+static void uring_queue_simple(UringState* state, FileOp* op, int index) {
+    struct io_uring_sqe *sqe = uring_get_sqe(state);
+
+    sqe->user_data = (unsigned long long)index << URING_STEP_BITS;
+
+    switch (op->type) {
+        case FILE_OP_STATX:
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = op->src_dirfd;
+            sqe->addr = (unsigned long)op->src_name;
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (unsigned long)&op->stx;
+            sqe->statx_flags = (unsigned)op->flags;
+            break;
+        case FILE_OP_RENAME:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = op->src_dirfd;
+            sqe->addr = (unsigned long)op->src_name;
+            sqe->len = (unsigned)op->dst_dirfd;
+            sqe->off = (unsigned long)op->dst_name;
+            sqe->rename_flags = (unsigned)op->flags;
+            break;
+        case FILE_OP_UNLINK:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->fd = op->src_dirfd;
+            sqe->addr = (unsigned long)op->src_name;
+            sqe->unlink_flags = (unsigned)op->flags;
+            break;
+        default:
+            sqe->opcode = IORING_OP_NOP;
+            break;
+    }
+}
+
+/**
+ * Check a completed verified copy chain
+ * The data that was written is still in the arena: it is fingerprinted
+ * there and compared byte for byte with what the destination read back.
+ * @param op Copy operation; receives the fingerprint
+ * @param chain Completed chain
+ * @return 0 if the copy verified, -EIO otherwise (the copy is removed)
+ */
+static int uring_verify_copy(FileOp* op, const CopyChain* chain) {
+    fingerprint_buffer(chain->buffer, (size_t)op->size, &op->fingerprint);
+    if (chain->res[COPY_VERIFY] == op->size &&
+        memcmp(chain->buffer, chain->readback, (size_t)op->size) == 0) {
+        return 0;
+    }
+
+    log_error("Verification failed for %s", op->dst_name);
+    unlinkat(op->dst_dirfd, op->dst_name, 0);
+    return -EIO;
+}
+
+/**
+ * Close any direct descriptors left open by chains that failed midway
+ * @param state Ring state
+ * @param chains Chains submitted in the last round
+ * @param chain_count Number of chains
+ */
+static void uring_reset_slots(UringState* state, CopyChain* chains, int chain_count) {
+    unsigned queued = 0;
+
+    for (int c = 0; c < chain_count; c++) {
+        if (chains[c].res[COPY_CLOSE_SRC] == 0 && chains[c].res[COPY_CLOSE_DST] == 0) {
+            continue;
+        }
+        for (int s = 1; s <= 2; s++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(state);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = chains[c].slot + s;
+            sqe->user_data = 0;
+            queued++;
+        }
+    }
+
+    /* Results are irrelevant: an empty slot just reports -EBADF */
+    while (queued > 0) {
+        unsigned head, tail;
+        int ret = sys_io_uring_enter(state->ring_fd, queued, queued, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+            return;
+        }
+        head = *state->cq_head;
+        tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail && queued > 0) {
+            head++;
+            queued--;
+        }
+        __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Execute a batch of file operations on the ring
+ * @param backend Backend state from uring_backend_init
+ * @param batch Array of operations
+ * @param count Number of operations
+ * @return SUCCESS once every operation has a result
+ */
+int uring_backend_submit(void* backend, FileOp* batch, int count) {
+    UringState *state = (UringState*)backend;
+    CopyChain chains[URING_COPY_SLOTS];
+    CopyChain **chain_of;
+    unsigned char *pending;
+    int next = 0;
+
+    chain_of = (CopyChain**)calloc(count, sizeof(CopyChain*));
+    pending = (unsigned char*)calloc(count, 1);
+    if (chain_of == NULL || pending == NULL) {
+        free(chain_of);
+        free(pending);
+        for (int i = 0; i < count; i++) {
+            fileops_execute_sync(&batch[i]);
+        }
+        return SUCCESS;
+    }
+
+    while (next < count) {
+        unsigned queued = 0;
+        int chain_count = 0;
+        int first = next;
+        size_t arena_needed = 0;
+
+        /* Size the data arena for the copies that fit into this round */
+        for (int i = first; i < count; i++) {
+            FileOp *op = &batch[i];
+            if (op->type != FILE_OP_COPY) {
+                continue;
+            }
+            if (!state->direct_files || op->size < 0 || op->size > FILEOPS_COPY_INLINE_MAX) {
+                continue;
+            }
+            if (++chain_count > URING_COPY_SLOTS) {
+                break;
+            }
+            arena_needed += uring_copy_span(op);
+        }
+        if (arena_needed > state->copy_arena_size) {
+            char *arena = (char*)realloc(state->copy_arena, arena_needed);
+            if (arena != NULL) {
+                state->copy_arena = arena;
+                state->copy_arena_size = arena_needed;
+            }
+        }
+
+        chain_count = 0;
+        arena_needed = 0;
+        while (next < count) {
+            FileOp *op = &batch[next];
+            int inline_copy;
+
+            op->result = 0;
+            chain_of[next] = NULL;
+
+            if (op->type != FILE_OP_COPY) {
+                if (queued + 1 > state->sq_entries) {
+                    break;
+                }
+                uring_queue_simple(state, op, next);
+                pending[next] = 1;
+                queued++;
+                next++;
+                continue;
+            }
+
+            inline_copy = state->direct_files && op->size >= 0 &&
+                          op->size <= FILEOPS_COPY_INLINE_MAX;
+            if (inline_copy) {
+                size_t span = uring_copy_span(op);
+                unsigned steps = uring_copy_steps(op);
+                if (chain_count == URING_COPY_SLOTS ||
+                    queued + steps > state->sq_entries) {
+                    /* Round is full; this copy starts the next one */
+                    break;
+                } else if (arena_needed + span <= state->copy_arena_size) {
+                    CopyChain *chain = &chains[chain_count];
+                    chain->op_index = next;
+                    chain->slot = chain_count * 2;
+                    chain->buffer = state->copy_arena + arena_needed;
+                    chain->readback = (op->flags & FILEOPS_COPY_VERIFY) ?
+                                      chain->buffer + span / 2 : NULL;
+                    for (int s = 0; s < URING_COPY_STEPS; s++) {
+                        chain->res[s] = -ECANCELED;
+                    }
+                    chain_of[next] = chain;
+                    uring_queue_copy(state, op, next, chain);
+                    arena_needed += span;
+                    chain_count++;
+                    queued += steps;
+                    next++;
+                    continue;
+                }
+            }
+
+            /* Unknown size, too large, no direct descriptors or no buffer */
+            fileops_execute_sync(op);
+            next++;
+        }
+
+        if (queued > 0 && uring_run(state, queued, batch, chain_of, pending) != SUCCESS) {
+            /*
+             * The ring broke underneath us. Redo only the unlinked operations
+             * that never completed; a rename or unlink that did must not run
+             * twice. Unfinished copy chains still show -ECANCELED and are
+             * redone below.
+             */
+            for (int i = first; i < next; i++) {
+                if (pending[i]) {
+                    pending[i] = 0;
+                    fileops_execute_sync(&batch[i]);
+                }
+            }
+        }
+
+        for (int c = 0; c < chain_count; c++) {
+            CopyChain *chain = &chains[c];
+            FileOp *op = &batch[chain->op_index];
+
+            if (chain->res[COPY_WRITE] == op->size && chain->res[COPY_EOF] == 0 &&
+                chain->res[COPY_CLOSE_DST] == 0) {
+                op->result = (chain->readback != NULL) ? uring_verify_copy(op, chain) : 0;
+            } else if (chain->res[COPY_OPEN_SRC] < 0 && chain->res[COPY_OPEN_SRC] != -ECANCELED) {
+                op->result = chain->res[COPY_OPEN_SRC];
+            } else {
+                /* File changed size, ring failure or similar: redo it the slow way */
+                fileops_execute_sync(op);
+            }
+        }
+        uring_reset_slots(state, chains, chain_count);
+    }
+
+    free(chain_of);
+    free(pending);
+    return SUCCESS;
+}
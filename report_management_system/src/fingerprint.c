@@ -0,0 +1,581 @@
+/**
+ * @file fingerprint.c
+ * @brief Content fingerprints for report files
+ *
+ * The fingerprint is a 64-bit non-cryptographic hash in the style of XXH3:
+ * eight 64-bit lanes consume 64-byte stripes with a 32x32->64 multiply and
+ * are scrambled after every 1 KiB block. The lane arithmetic maps directly
+ * onto SSE2/AVX2, and the vector paths produce exactly the same value as
+ * the portable one. CRC32C is optionally computed alongside using the
+ * SSE4.2 crc32 instruction when the CPU has it.
+ *
+ * Fingerprints are cached by inode identity, so a file is hashed once per
+ * content change no matter whether monitoring, transfer or backup asks.
+ */
+
+#define LOG_MODULE LOG_MODULE_FILES
+#include "report_system.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINGERPRINT_X86 1
+#endif
+
+#define FP_LANES          8
+#define FP_STRIPE_SIZE    64
+#define FP_BLOCK_SIZE     FINGERPRINT_BLOCK_SIZE
+#define FP_BLOCK_STRIPES  (FP_BLOCK_SIZE / FP_STRIPE_SIZE)
+#define FP_SECRET_WORDS   24      /* Stripe keys use words 0..22, scramble 16..23 */
+#define FP_READ_SIZE      65536
+#define CRC_LANE_BYTES    512     /* Bytes per stream of the 3-way interleaved CRC32C */
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/**
+ * @struct FingerprintCacheSlot
+ * @brief One direct-mapped entry of the identity-keyed fingerprint cache
+ */
+typedef struct {
+    FileIdentity identity;
+    FileFingerprint fingerprint;
+} FingerprintCacheSlot;
+
+typedef void (*AccumulateFn)(uint64_t* acc, const unsigned char* stripe, int stripe_index);
+typedef void (*ScrambleFn)(uint64_t* acc);
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const unsigned char* data, size_t length);
+
+static uint64_t fp_secret[FP_SECRET_WORDS];
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_shift_table[4][256];
+static AccumulateFn accumulate_stripe;
+static ScrambleFn scramble_lanes;
+static Crc32cFn crc32c_update;
+static pthread_once_t fingerprint_once = PTHREAD_ONCE_INIT;
+
+static FingerprintCacheSlot *fingerprint_cache = NULL;
+static pthread_mutex_t fingerprint_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* --- Portable implementation ------------------------------------------ */
+
+static void accumulate_scalar(uint64_t* acc, const unsigned char* stripe, int stripe_index) {
+    for (int lane = 0; lane < FP_LANES; lane++) {
+        uint64_t data = read64(stripe + lane * 8);
+        uint64_t key = data ^ fp_secret[lane + stripe_index];
+        acc[lane ^ 1] += data;
+        acc[lane] += (uint64_t)(uint32_t)key * (key >> 32);
+    }
+}
+
+static void scramble_scalar(uint64_t* acc) {
+    for (int lane = 0; lane < FP_LANES; lane++) {
+        uint64_t value = acc[lane];
+        value ^= value >> 47;
+        value ^= fp_secret[16 + lane];
+        acc[lane] = value * PRIME32_1;
+    }
+}
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length--) {
+        crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* --- x86 vector implementations --------------------------------------- */
+
+#ifdef FINGERPRINT_X86
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t* acc, const unsigned char* stripe, int stripe_index) {
+    const unsigned char *secret = (const unsigned char*)(fp_secret + stripe_index);
+
+    for (int pair = 0; pair < FP_LANES / 2; pair++) {
+        __m128i lanes = _mm_loadu_si128((const __m128i*)(acc + pair * 2));
+        __m128i data = _mm_loadu_si128((const __m128i*)(stripe + pair * 16));
+        __m128i key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i*)(secret + pair * 16)));
+        __m128i key_hi = _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(key, key_hi);
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+
+        lanes = _mm_add_epi64(lanes, _mm_add_epi64(product, swapped));
+        _mm_storeu_si128((__m128i*)(acc + pair * 2), lanes);
+    }
+}
+
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t* acc) {
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+
+    for (int pair = 0; pair < FP_LANES / 2; pair++) {
+        __m128i lanes = _mm_loadu_si128((const __m128i*)(acc + pair * 2));
+        __m128i secret = _mm_loadu_si128((const __m128i*)(fp_secret + 16 + pair * 2));
+        __m128i lo, hi;
+
+        lanes = _mm_xor_si128(lanes, _mm_srli_epi64(lanes, 47));
+        lanes = _mm_xor_si128(lanes, secret);
+        lo = _mm_mul_epu32(lanes, prime);
+        hi = _mm_mul_epu32(_mm_srli_epi64(lanes, 32), prime);
+        _mm_storeu_si128((__m128i*)(acc + pair * 2), _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const unsigned char* stripe, int stripe_index) {
+    const unsigned char *secret = (const unsigned char*)(fp_secret + stripe_index);
+
+    for (int quad = 0; quad < FP_LANES / 4; quad++) {
+        __m256i lanes = _mm256_loadu_si256((const __m256i*)(acc + quad * 4));
+        __m256i data = _mm256_loadu_si256((const __m256i*)(stripe + quad * 32));
+        __m256i key = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i*)(secret + quad * 32)));
+        __m256i key_hi = _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1));
+        __m256i product = _mm256_mul_epu32(key, key_hi);
+        __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+
+        lanes = _mm256_add_epi64(lanes, _mm256_add_epi64(product, swapped));
+        _mm256_storeu_si256((__m256i*)(acc + quad * 4), lanes);
+    }
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t* acc) {
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+
+    for (int quad = 0; quad < FP_LANES / 4; quad++) {
+        __m256i lanes = _mm256_loadu_si256((const __m256i*)(acc + quad * 4));
+        __m256i secret = _mm256_loadu_si256((const __m256i*)(fp_secret + 16 + quad * 4));
+        __m256i lo, hi;
+
+        lanes = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+        lanes = _mm256_xor_si256(lanes, secret);
+        lo = _mm256_mul_epu32(lanes, prime);
+        hi = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+        _mm256_storeu_si256((__m256i*)(acc + quad * 4), _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+    }
+}
+
+/**
+ * Advance a CRC32C register over CRC_LANE_BYTES zero bytes
+ * The CRC is linear, so this is what lets independent streams be joined.
+ */
+static inline uint32_t crc32c_shift(uint32_t crc) {
+    return crc32c_shift_table[0][crc & 0xFF] ^ crc32c_shift_table[1][(crc >> 8) & 0xFF] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xFF] ^ crc32c_shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64;
+
+    /* The crc32 instruction has a 3-cycle latency: keep three streams busy */
+    while (length >= 3 * CRC_LANE_BYTES) {
+        uint64_t a = crc, b = 0, c = 0;
+
+        for (size_t i = 0; i < CRC_LANE_BYTES; i += 8) {
+            a = _mm_crc32_u64(a, read64(data + i));
+            b = _mm_crc32_u64(b, read64(data + CRC_LANE_BYTES + i));
+            c = _mm_crc32_u64(c, read64(data + 2 * CRC_LANE_BYTES + i));
+        }
+        crc = crc32c_shift(crc32c_shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        data += 3 * CRC_LANE_BYTES;
+        length -= 3 * CRC_LANE_BYTES;
+    }
+
+    crc64 = crc;
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, read64(data));
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif /* FINGERPRINT_X86 */
+
+/**
+ * Build the key material and pick the fastest implementation for this CPU
+ */
+static void fingerprint_setup(void) {
+    uint64_t seed = 0x5265706F72744650ULL; /* "ReportFP" */
+
+    /* splitmix64 keeps the secret reproducible across builds and hosts */
+    for (int i = 0; i < FP_SECRET_WORDS; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        fp_secret[i] = z ^ (z >> 31);
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78U : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+    /* Zero-byte advance of every single-byte register value, per byte lane */
+    {
+        static const unsigned char zeros[CRC_LANE_BYTES];
+        for (int lane = 0; lane < 4; lane++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                crc32c_shift_table[lane][i] = crc32c_software(i << (8 * lane), zeros, CRC_LANE_BYTES);
+            }
+        }
+    }
+
+    accumulate_stripe = accumulate_scalar;
+    scramble_lanes = scramble_scalar;
+    crc32c_update = crc32c_software;
+
+#ifdef FINGERPRINT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        accumulate_stripe = accumulate_avx2;
+        scramble_lanes = scramble_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        accumulate_stripe = accumulate_sse2;
+        scramble_lanes = scramble_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+}
+
+/**
+ * Name of the hash implementation selected for this CPU
+ * @return Static string ("avx2", "sse2" or "scalar")
+ */
+const char* fingerprint_implementation(void) {
+    pthread_once(&fingerprint_once, fingerprint_setup);
+#ifdef FINGERPRINT_X86
+    if (accumulate_stripe == accumulate_avx2) {
+        return "avx2";
+    }
+    if (accumulate_stripe == accumulate_sse2) {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+/**
+ * Consume whole 64-byte stripes of the current block
+ */
+static void consume_stripes(FingerprintState* state, const unsigned char* data, int stripes) {
+    for (int s = 0; s < stripes; s++) {
+        accumulate_stripe(state->acc, data + s * FP_STRIPE_SIZE, s);
+    }
+}
+
+/**
+ * Start a streaming fingerprint
+ * @param state State to initialize
+ * @param with_crc TRUE to also compute CRC32C
+ */
+void fingerprint_init(FingerprintState* state, int with_crc) {
+    static const uint64_t initial[FP_LANES] = {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+    };
+
+    pthread_once(&fingerprint_once, fingerprint_setup);
+
+    memcpy(state->acc, initial, sizeof(initial));
+    state->buffered = 0;
+    state->total_length = 0;
+    state->with_crc = with_crc;
+    state->crc = 0xFFFFFFFFU;
+}
+
+/**
+ * Feed data into a streaming fingerprint
+ * @param state Fingerprint state
+ * @param data Bytes to add
+ * @param length Number of bytes
+ */
+void fingerprint_update(FingerprintState* state, const void* data, size_t length) {
+    const unsigned char *bytes = (const unsigned char*)data;
+
+    state->total_length += length;
+    if (state->with_crc) {
+        state->crc = crc32c_update(state->crc, bytes, length);
+    }
+
+    /* Top up a partially filled block first */
+    if (state->buffered > 0) {
+        size_t take = FP_BLOCK_SIZE - state->buffered;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(state->buffer + state->buffered, bytes, take);
+        state->buffered += take;
+        bytes += take;
+        length -= take;
+
+        if (state->buffered < FP_BLOCK_SIZE) {
+            return;
+        }
+        consume_stripes(state, state->buffer, FP_BLOCK_STRIPES);
+        scramble_lanes(state->acc);
+        state->buffered = 0;
+    }
+
+    /* Whole blocks straight from the caller's memory */
+    while (length >= FP_BLOCK_SIZE) {
+        consume_stripes(state, bytes, FP_BLOCK_STRIPES);
+        scramble_lanes(state->acc);
+        bytes += FP_BLOCK_SIZE;
+        length -= FP_BLOCK_SIZE;
+    }
+
+    memcpy(state->buffer, bytes, length);
+    state->buffered = length;
+}
+
+static inline uint64_t fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/**
+ * Finish a streaming fingerprint
+ * @param state Fingerprint state
+ * @param fingerprint Receives the result
+ */
+void fingerprint_final(FingerprintState* state, FileFingerprint* fingerprint) {
+    uint64_t acc[FP_LANES];
+    size_t full = state->buffered / FP_STRIPE_SIZE;
+    size_t tail = state->buffered % FP_STRIPE_SIZE;
+    uint64_t hash;
+
+    /* Work on a copy so the state could keep streaming */
+    FingerprintState last = *state;
+    consume_stripes(&last, last.buffer, (int)full);
+    if (tail > 0) {
+        unsigned char padded[FP_STRIPE_SIZE];
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, last.buffer + full * FP_STRIPE_SIZE, tail);
+        accumulate_stripe(last.acc, padded, (int)full);
+    }
+    memcpy(acc, last.acc, sizeof(acc));
+
+    hash = state->total_length * PRIME64_1;
+    for (int pair = 0; pair < FP_LANES / 2; pair++) {
+        hash += fold64(acc[pair * 2] ^ fp_secret[pair * 2 + 3],
+                       acc[pair * 2 + 1] ^ fp_secret[pair * 2 + 4]);
+    }
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ULL;
+    hash ^= hash >> 32;
+
+    fingerprint->hash = hash;
+    fingerprint->size = state->total_length;
+    fingerprint->crc32c = state->with_crc ? ~state->crc : 0;
+    fingerprint->has_crc = state->with_crc;
+    fingerprint->valid = TRUE;
+}
+
+/**
+ * Fingerprint a buffer in one call
+ * @param data Bytes to hash
+ * @param length Number of bytes
+ * @param fingerprint Receives the result
+ */
+void fingerprint_buffer(const void* data, size_t length, FileFingerprint* fingerprint) {
+    FingerprintState state;
+
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+    fingerprint_update(&state, data, length);
+    fingerprint_final(&state, fingerprint);
+}
+
+/**
+ * Check whether two fingerprints describe the same content
+ * @return TRUE if both are valid and equal, FALSE otherwise
+ */
+int fingerprint_equal(const FileFingerprint* a, const FileFingerprint* b) {
+    if (!a->valid || !b->valid || a->hash != b->hash || a->size != b->size) {
+        return FALSE;
+    }
+    if (a->has_crc && b->has_crc && a->crc32c != b->crc32c) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Format a fingerprint as hexadecimal text
+ * @param fingerprint Fingerprint to format
+ * @param buffer Output buffer (at least FINGERPRINT_TEXT_LENGTH bytes)
+ * @param buffer_size Size of the buffer
+ * @return Pointer to the buffer
+ */
+char* fingerprint_format(const FileFingerprint* fingerprint, char* buffer, size_t buffer_size) {
+    snprintf(buffer, buffer_size, "%016llx", (unsigned long long)fingerprint->hash);
+    return buffer;
+}
+
+/* --- Identity-keyed cache ---------------------------------------------- */
+
+static size_t cache_slot(const FileIdentity* identity) {
+    uint64_t key = identity->ino * PRIME64_2 ^ identity->dev * PRIME64_3;
+    return (size_t)((key ^ (key >> 29)) & (FINGERPRINT_CACHE_SLOTS - 1));
+}
+
+/*
+ * Cached fingerprints are keyed by inode and the full version, ctime
+ * included: a same-size rewrite with its mtime put back (cp -p, touch -r,
+ * rsync -t) must not return the old fingerprint. A rename also changes
+ * ctime, so a transferred file is hashed once more at its new place.
+ */
+static int cache_identity_matches(const FileIdentity* a, const FileIdentity* b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+/**
+ * Look up a cached fingerprint
+ * @param identity Identity of the file as it is now
+ * @param fingerprint Receives the cached value
+ * @return TRUE on a hit, FALSE otherwise
+ */
+int fingerprint_cache_lookup(const FileIdentity* identity, FileFingerprint* fingerprint) {
+    int hit = FALSE;
+
+    pthread_mutex_lock(&fingerprint_cache_lock);
+    if (fingerprint_cache != NULL) {
+        FingerprintCacheSlot *slot = &fingerprint_cache[cache_slot(identity)];
+        if (slot->fingerprint.valid && cache_identity_matches(&slot->identity, identity)) {
+            *fingerprint = slot->fingerprint;
+            hit = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&fingerprint_cache_lock);
+
+    return hit;
+}
+
+/**
+ * Remember the fingerprint of a file version
+ * @param identity Identity of the file that was hashed
+ * @param fingerprint Its fingerprint
+ */
+void fingerprint_cache_store(const FileIdentity* identity, const FileFingerprint* fingerprint) {
+    pthread_mutex_lock(&fingerprint_cache_lock);
+    if (fingerprint_cache == NULL) {
+        fingerprint_cache = (FingerprintCacheSlot*)calloc(FINGERPRINT_CACHE_SLOTS,
+                                                          sizeof(FingerprintCacheSlot));
+    }
+    if (fingerprint_cache != NULL) {
+        FingerprintCacheSlot *slot = &fingerprint_cache[cache_slot(identity)];
+        slot->identity = *identity;
+        slot->fingerprint = *fingerprint;
+    }
+    pthread_mutex_unlock(&fingerprint_cache_lock);
+}
+
+/**
+ * Capture the identity of an open file
+ */
+static void identity_from_stat(const struct stat* st, FileIdentity* identity) {
+    identity->dev = st->st_dev;
+    identity->ino = st->st_ino;
+    identity->size = st->st_size;
+    identity->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    identity->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+}
+
+/**
+ * Fingerprint an open file, consulting and filling the cache
+ * The file is read from offset 0 with pread; its position is unchanged.
+ * @param fd Open file descriptor
+ * @param fingerprint Receives the result
+ * @return SUCCESS on success, FAILURE on error
+ */
+int fingerprint_fd(int fd, FileFingerprint* fingerprint) {
+    struct stat before, after;
+    FileIdentity identity;
+    FingerprintState state;
+    unsigned char *buffer;
+    off_t offset = 0;
+    ssize_t bytes_read;
+
+    if (fstat(fd, &before) != 0) {
+        return FAILURE;
+    }
+    identity_from_stat(&before, &identity);
+
+    if (fingerprint_cache_lookup(&identity, fingerprint)) {
+        return SUCCESS;
+    }
+
+    buffer = (unsigned char*)malloc(FP_READ_SIZE);
+    if (buffer == NULL) {
+        return FAILURE;
+    }
+
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+    while ((bytes_read = pread(fd, buffer, FP_READ_SIZE, offset)) > 0) {
+        fingerprint_update(&state, buffer, (size_t)bytes_read);
+        offset += bytes_read;
+    }
+    free(buffer);
+
+    if (bytes_read < 0) {
+        return FAILURE;
+    }
+    fingerprint_final(&state, fingerprint);
+
+    /* Only cache results that cannot have raced with a writer */
+    if (fstat(fd, &after) == 0) {
+        FileIdentity now;
+        identity_from_stat(&after, &now);
+        if (file_identity_same_version(&identity, &now)) {
+            fingerprint_cache_store(&identity, fingerprint);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Fingerprint a file by name
+ * @param dirfd Directory descriptor (AT_FDCWD for a path)
+ * @param name File name or path
+ * @param fingerprint Receives the result
+ * @return SUCCESS on success, FAILURE on error
+ */
+int fingerprint_file_at(int dirfd, const char* name, FileFingerprint* fingerprint) {
+    int fd;
+    int result;
+
+    /* O_NONBLOCK so a stray FIFO in a scanned directory cannot stall us */
+    fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return FAILURE;
+    }
+
+    result = fingerprint_fd(fd, fingerprint);
+    close(fd);
+
+    return result;
+}
@@ -0,0 +1,251 @@
+/**
+ * @file manifest.c
+ * @brief Per-backup manifest of file names and content fingerprints
+ *
+ * Every backup directory holds a MANIFEST file written after all copies
+ * were verified. One line per file:
+ *
+ *     <hash, 16 hex> <crc32c, 8 hex or -> <size> <name>
+ *
+ * The name comes last so it may contain spaces. Lines starting with '#'
+ * are comments. Entries are written sorted by name, followed by the
+ * manifest's Merkle tree as "# merkle" comment lines (see merkle.c).
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+
+#define MANIFEST_HEADER "# report backup manifest v1\n"
+#define MANIFEST_TEMP   ".MANIFEST.tmp"
+
+static int compare_manifest_names(const void* a, const void* b) {
+    return strcmp(((const ManifestEntry*)a)->filename, ((const ManifestEntry*)b)->filename);
+}
+
+/**
+ * Write a manifest into a backup directory
+ * The file is written under a temporary name, synced and renamed into
+ * place, so a manifest that exists is always complete.
+ * @param dirfd Backup directory descriptor
+ * @param entries Files to record, in any order
+ * @param count Number of entries
+ * @return SUCCESS on success, FAILURE on error
+ */
+int manifest_write(int dirfd, const ManifestEntry* entries, int count) {
+    ManifestEntry *sorted;
+    MerkleTree tree;
+    FILE *file;
+    int fd;
+    int result = SUCCESS;
+
+    sorted = (ManifestEntry*)malloc((count > 0 ? count : 1) * sizeof(ManifestEntry));
+    if (sorted == NULL) {
+        log_error("Memory allocation failed for manifest");
+        return FAILURE;
+    }
+    memcpy(sorted, entries, count * sizeof(ManifestEntry));
+    qsort(sorted, count, sizeof(ManifestEntry), compare_manifest_names);
+    if (merkle_build(sorted, count, &tree) != SUCCESS) {
+        log_error("Memory allocation failed for manifest");
+        free(sorted);
+        return FAILURE;
+    }
+
+    fd = openat(dirfd, MANIFEST_TEMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || (file = fdopen(fd, "w")) == NULL) {
+        log_error("Failed to create backup manifest: %s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        free(sorted);
+        return FAILURE;
+    }
+
+    fputs(MANIFEST_HEADER, file);
+    for (int i = 0; i < count; i++) {
+        const FileFingerprint *fp = &sorted[i].fingerprint;
+        char crc[9] = "-";
+
+        if (fp->has_crc) {
+            snprintf(crc, sizeof(crc), "%08x", fp->crc32c);
+        }
+        fprintf(file, "%016llx %s %llu %s\n", (unsigned long long)fp->hash, crc,
+                (unsigned long long)fp->size, sorted[i].filename);
+    }
+    merkle_write(file, &tree);
+    free(sorted);
+
+    if (fflush(file) != 0 || fsync(fd) != 0) {
+        log_error("Failed to write backup manifest: %s", strerror(errno));
+        result = FAILURE;
+    }
+    if (fclose(file) != 0) {
+        result = FAILURE;
+    }
+
+    if (result == SUCCESS && renameat(dirfd, MANIFEST_TEMP, dirfd, BACKUP_MANIFEST_NAME) != 0) {
+        log_error("Failed to install backup manifest: %s", strerror(errno));
+        result = FAILURE;
+    }
+    if (result != SUCCESS) {
+        unlinkat(dirfd, MANIFEST_TEMP, 0);
+    }
+
+    return result;
+}
+
+/**
+ * Load the manifest of a backup directory
+ * @param dirfd Backup directory descriptor
+ * @param entries Receives a malloc'd array sorted by name (caller frees)
+ * @param count Receives the number of entries
+ * @return SUCCESS on success, FAILURE if missing or unreadable
+ */
+int manifest_load(int dirfd, ManifestEntry** entries, int* count) {
+    char line[MAX_LINE_LENGTH];
+    ManifestEntry *list = NULL;
+    int capacity = 0;
+    int used = 0;
+    FILE *file;
+    int fd;
+
+    *entries = NULL;
+    *count = 0;
+
+    fd = openat(dirfd, BACKUP_MANIFEST_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (file = fdopen(fd, "r")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long hash, size;
+        char crc[16];
+        int name_offset = 0;
+        size_t length;
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%16llx %15s %llu %n", &hash, crc, &size, &name_offset) != 3 ||
+            name_offset == 0) {
+            log_error("Malformed backup manifest line: %s", line);
+            continue;
+        }
+
+        length = strcspn(line + name_offset, "\n");
+        if (length == 0 || length > NAME_MAX) {
+            continue;
+        }
+
+        if (used == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            ManifestEntry *grown = (ManifestEntry*)realloc(list, new_capacity * sizeof(ManifestEntry));
+            if (grown == NULL) {
+                log_error("Memory allocation failed for manifest");
+                free(list);
+                fclose(file);
+                return FAILURE;
+            }
+            list = grown;
+            capacity = new_capacity;
+        }
+
+        memset(&list[used], 0, sizeof(ManifestEntry));
+        memcpy(list[used].filename, line + name_offset, length);
+        list[used].fingerprint.hash = hash;
+        list[used].fingerprint.size = size;
+        if (strcmp(crc, "-") != 0) {
+            list[used].fingerprint.crc32c = (uint32_t)strtoul(crc, NULL, 16);
+            list[used].fingerprint.has_crc = TRUE;
+        }
+        list[used].fingerprint.valid = TRUE;
+        used++;
+    }
+    fclose(file);
+
+    /* Written sorted, but do not trust a hand-edited file */
+    if (used > 1) {
+        qsort(list, used, sizeof(ManifestEntry), compare_manifest_names);
+    }
+
+    *entries = list;
+    *count = used;
+    return SUCCESS;
+}
+
+/**
+ * Look up a file in a loaded manifest
+ * @param entries Entries from manifest_load
+ * @param count Number of entries
+ * @param filename Name to find
+ * @return Matching entry, or NULL if the file is not in the manifest
+ */
+const ManifestEntry* manifest_find(const ManifestEntry* entries, int count, const char* filename) {
+    ManifestEntry key;
+
+    if (entries == NULL || strlen(filename) > NAME_MAX) {
+        return NULL;
+    }
+    snprintf(key.filename, sizeof(key.filename), "%s", filename);
+    return (const ManifestEntry*)bsearch(&key, entries, count, sizeof(ManifestEntry),
+                                         compare_manifest_names);
+}
+
+/**
+ * Fingerprint the regular files of a directory, as a manifest would list them
+ * Fingerprints come from the identity cache where the file is unchanged.
+ * @param dirfd Directory descriptor
+ * @param entries Receives a malloc'd array sorted by name (caller frees)
+ * @param count Receives the number of entries
+ * @return SUCCESS on success, FAILURE on error
+ */
+int manifest_scan(int dirfd, ManifestEntry** entries, int* count) {
+    DirEnumerator iter;
+    DirEntry entry;
+    ManifestEntry *list = NULL;
+    int capacity = 0;
+    int used = 0;
+
+    *entries = NULL;
+    *count = 0;
+
+    if (dir_enum_open(&iter, dirfd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        if (entry.type != DT_REG && entry.type != DT_UNKNOWN) {
+            continue;
+        }
+        if (used == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            ManifestEntry *grown = (ManifestEntry*)realloc(list, new_capacity * sizeof(ManifestEntry));
+            if (grown == NULL) {
+                log_error("Memory allocation failed for manifest");
+                free(list);
+                dir_enum_close(&iter);
+                return FAILURE;
+            }
+            list = grown;
+            capacity = new_capacity;
+        }
+
+        memset(&list[used], 0, sizeof(ManifestEntry));
+        snprintf(list[used].filename, sizeof(list[used].filename), "%s", entry.name);
+        /* Directories and files that vanished meanwhile are not listed */
+        if (fingerprint_file_at(dirfd, entry.name, &list[used].fingerprint) == SUCCESS) {
+            used++;
+        }
+    }
+    dir_enum_close(&iter);
+
+    if (used > 1) {
+        qsort(list, used, sizeof(ManifestEntry), compare_manifest_names);
+    }
+
+    *entries = list;
+    *count = used;
+    return SUCCESS;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file merkle.c
+ * @brief Merkle trees over backup manifests
+ *
+ * Files are spread over MERKLE_FANOUT^MERKLE_DEPTH leaf buckets by a hash
+ * of their name, so a file keeps its bucket whatever else is added or
+ * removed, and two trees always have the same shape. A leaf hashes the
+ * (name, content hash, size) of its files in name order; an interior node
+ * hashes its children; an empty subtree hashes to 0. Equal roots mean equal
+ * file sets, and a diff descends only into children whose hashes differ,
+ * comparing file entries in the differing leaves alone.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+
+#define MERKLE_LEAVES      (MERKLE_NODES - MERKLE_LEAF_BASE)
+#define MERKLE_TREE_PREFIX "# merkle "
+
+/**
+ * @struct MerkleBuckets
+ * @brief Entries of a manifest grouped by leaf, each group in name order
+ */
+typedef struct {
+    int *order;                /* Entry indexes, bucket by bucket */
+    int start[MERKLE_LEAVES + 1];
+} MerkleBuckets;
+
+static int merkle_bucket(const char* filename) {
+    FileFingerprint fp;
+
+    fingerprint_buffer(filename, strlen(filename), &fp);
+    return (int)(fp.hash >> (64 - 4 * MERKLE_DEPTH));
+}
+
+/**
+ * Group entries by bucket with a stable counting sort
+ */
+static int merkle_group(const ManifestEntry* entries, int count, MerkleBuckets* buckets) {
+    int *bucket_of = (int*)malloc((count + 1) * sizeof(int));
+
+    buckets->order = (int*)malloc((count + 1) * sizeof(int));
+    if (bucket_of == NULL || buckets->order == NULL) {
+        free(bucket_of);
+        free(buckets->order);
+        buckets->order = NULL;
+        return FAILURE;
+    }
+
+    memset(buckets->start, 0, sizeof(buckets->start));
+    for (int i = 0; i < count; i++) {
+        bucket_of[i] = merkle_bucket(entries[i].filename);
+        buckets->start[bucket_of[i] + 1]++;
+    }
+    for (int b = 0; b < MERKLE_LEAVES; b++) {
+        buckets->start[b + 1] += buckets->start[b];
+    }
+    {
+        int fill[MERKLE_LEAVES];
+
+        memcpy(fill, buckets->start, sizeof(fill));
+        for (int i = 0; i < count; i++) {
+            buckets->order[fill[bucket_of[i]]++] = i;
+        }
+    }
+
+    free(bucket_of);
+    return SUCCESS;
+}
+
+/**
+ * Build the Merkle tree of a manifest
+ * @param entries Manifest entries sorted by name
+ * @param count Number of entries
+ * @param tree Receives the tree
+ * @return SUCCESS on success, FAILURE if out of memory
+ */
+int merkle_build(const ManifestEntry* entries, int count, MerkleTree* tree) {
+    MerkleBuckets buckets;
+    int level_base = MERKLE_LEAF_BASE;
+    int level_size = MERKLE_LEAVES;
+
+    if (merkle_group(entries, count, &buckets) != SUCCESS) {
+        return FAILURE;
+    }
+    memset(tree, 0, sizeof(MerkleTree));
+
+    for (int b = 0; b < MERKLE_LEAVES; b++) {
+        FingerprintState state;
+        FileFingerprint leaf;
+
+        if (buckets.start[b] == buckets.start[b + 1]) {
+            continue;
+        }
+        fingerprint_init(&state, FALSE);
+        for (int k = buckets.start[b]; k < buckets.start[b + 1]; k++) {
+            const ManifestEntry *entry = &entries[buckets.order[k]];
+            uint64_t fields[2] = { entry->fingerprint.hash, entry->fingerprint.size };
+
+            fingerprint_update(&state, entry->filename, strlen(entry->filename) + 1);
+            fingerprint_update(&state, fields, sizeof(fields));
+        }
+        fingerprint_final(&state, &leaf);
+        tree->nodes[MERKLE_LEAF_BASE + b] = leaf.hash | 1;   /* Never 0, which means empty */
+    }
+    free(buckets.order);
+
+    /* Interior levels, bottom up */
+    while (level_size > 1) {
+        int parent_base = (level_base - 1) / MERKLE_FANOUT;
+        int parent_size = level_size / MERKLE_FANOUT;
+
+        for (int p = 0; p < parent_size; p++) {
+            const uint64_t *children = &tree->nodes[level_base + p * MERKLE_FANOUT];
+            FileFingerprint node;
+            int empty = TRUE;
+
+            for (int c = 0; c < MERKLE_FANOUT; c++) {
+                empty &= (children[c] == 0);
+            }
+            if (!empty) {
+                fingerprint_buffer(children, MERKLE_FANOUT * sizeof(uint64_t), &node);
+                tree->nodes[parent_base + p] = node.hash | 1;
+            }
+        }
+        level_base = parent_base;
+        level_size = parent_size;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Append a tree to a manifest being written, as comment lines
+ * Readers that do not know the tree skip them.
+ */
+void merkle_write(FILE* file, const MerkleTree* tree) {
+    fprintf(file, MERKLE_TREE_PREFIX "v1 %d %d\n", MERKLE_FANOUT, MERKLE_DEPTH);
+    for (int i = 0; i < MERKLE_NODES; i++) {
+        if (tree->nodes[i] != 0) {
+            fprintf(file, MERKLE_TREE_PREFIX "%d %016llx\n", i, (unsigned long long)tree->nodes[i]);
+        }
+    }
+}
+
+/**
+ * Read the tree stored in a backup directory's manifest
+ * @param dirfd Backup directory descriptor
+ * @param tree Receives the tree
+ * @return SUCCESS if the manifest has a tree of this shape, FAILURE otherwise
+ */
+int merkle_load(int dirfd, MerkleTree* tree) {
+    char line[MAX_LINE_LENGTH];
+    int found = FALSE;
+    FILE *file;
+    int fd;
+
+    fd = openat(dirfd, BACKUP_MANIFEST_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (file = fdopen(fd, "r")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    memset(tree, 0, sizeof(MerkleTree));
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long hash;
+        int fanout, depth, index;
+
+        if (strncmp(line, MERKLE_TREE_PREFIX, strlen(MERKLE_TREE_PREFIX)) != 0) {
+            continue;
+        }
+        if (sscanf(line + strlen(MERKLE_TREE_PREFIX), "v1 %d %d", &fanout, &depth) == 2) {
+            found = (fanout == MERKLE_FANOUT && depth == MERKLE_DEPTH);
+        } else if (found && sscanf(line + strlen(MERKLE_TREE_PREFIX), "%d %16llx", &index, &hash) == 2 &&
+                   index >= 0 && index < MERKLE_NODES) {
+            tree->nodes[index] = hash;
+        }
+    }
+    fclose(file);
+
+    return found ? SUCCESS : FAILURE;
+}
+
+/**
+ * @struct MerkleDiff
+ * @brief State of one diff
+ */
+typedef struct {
+    const ManifestEntry *old_entries;
+    const ManifestEntry *new_entries;
+    const MerkleTree *old_tree;
+    const MerkleTree *new_tree;
+    MerkleBuckets old_buckets;
+    MerkleBuckets new_buckets;
+    MerkleDiffFn report;
+    void *context;
+    int differences;
+} MerkleDiff;
+
+/**
+ * Compare the files of one leaf, merging the two name-ordered lists
+ */
+static void merkle_diff_leaf(MerkleDiff* diff, int bucket) {
+    int i = diff->old_buckets.start[bucket], old_end = diff->old_buckets.start[bucket + 1];
+    int j = diff->new_buckets.start[bucket], new_end = diff->new_buckets.start[bucket + 1];
+
+    while (i < old_end || j < new_end) {
+        const ManifestEntry *a = (i < old_end) ? &diff->old_entries[diff->old_buckets.order[i]] : NULL;
+        const ManifestEntry *b = (j < new_end) ? &diff->new_entries[diff->new_buckets.order[j]] : NULL;
+        int order = (a == NULL) ? 1 : (b == NULL) ? -1 : strcmp(a->filename, b->filename);
+
+        if (order < 0) {
+            diff->differences++;
+            if (diff->report != NULL) {
+                diff->report(a->filename, MERKLE_REMOVED, diff->context);
+            }
+            i++;
+        } else if (order > 0) {
+            diff->differences++;
+            if (diff->report != NULL) {
+                diff->report(b->filename, MERKLE_ADDED, diff->context);
+            }
+            j++;
+        } else {
+            if (a->fingerprint.hash != b->fingerprint.hash || a->fingerprint.size != b->fingerprint.size) {
+                diff->differences++;
+                if (diff->report != NULL) {
+                    diff->report(a->filename, MERKLE_CHANGED, diff->context);
+                }
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+static void merkle_descend(MerkleDiff* diff, int node) {
+    if (diff->old_tree->nodes[node] == diff->new_tree->nodes[node]) {
+        return;
+    }
+    if (node >= MERKLE_LEAF_BASE) {
+        merkle_diff_leaf(diff, node - MERKLE_LEAF_BASE);
+        return;
+    }
+    for (int c = 1; c <= MERKLE_FANOUT; c++) {
+        merkle_descend(diff, node * MERKLE_FANOUT + c);
+    }
+}
+
+/**
+ * List the files that differ between two manifests
+ * Subtrees with equal hashes are skipped, so equal roots cost one
+ * comparison. Differences are reported leaf by leaf, in tree order.
+ * @param old_entries First manifest, sorted by name
+ * @param old_count Its number of entries
+ * @param old_tree Its tree (from merkle_build or merkle_load)
+ * @param new_entries Second manifest, sorted by name
+ * @param new_count Its number of entries
+ * @param new_tree Its tree
+ * @param report Called for each differing file (may be NULL)
+ * @param context Passed to report
+ * @return Number of differing files, or -1 if out of memory
+ */
+int merkle_diff(const ManifestEntry* old_entries, int old_count, const MerkleTree* old_tree,
+                const ManifestEntry* new_entries, int new_count, const MerkleTree* new_tree,
+                MerkleDiffFn report, void* context) {
+    MerkleDiff diff;
+
+    if (old_tree->nodes[0] == new_tree->nodes[0]) {
+        return 0;
+    }
+
+    memset(&diff, 0, sizeof(diff));
+    diff.old_entries = old_entries;
+    diff.new_entries = new_entries;
+    diff.old_tree = old_tree;
+    diff.new_tree = new_tree;
+    diff.report = report;
+    diff.context = context;
+    if (merkle_group(old_entries, old_count, &diff.old_buckets) != SUCCESS ||
+        merkle_group(new_entries, new_count, &diff.new_buckets) != SUCCESS) {
+        free(diff.old_buckets.order);
+        return -1;
+    }
+
+    merkle_descend(&diff, 0);
+
+    free(diff.old_buckets.order);
+    free(diff.new_buckets.order);
+    return diff.differences;
+}
@@ -0,0 +1,444 @@
+/**
+ * @file metrics.c
+ * @brief Operation counters and latency histograms
+ *
+ * Each thread that records a sample gets a shard of its own, so recording
+ * is a few plain stores to cache lines no other thread writes. Readers add
+ * up the shards. When a thread exits its shard is handed to the next new
+ * thread; counts are never reset, so the sums only grow. Shards are only
+ * ever added to the list, so readers walk it without taking a lock and
+ * never hold up a thread that is recording.
+ *
+ * Latencies are kept in log-linear buckets as in HdrHistogram: every power
+ * of two of nanoseconds is split into 1 << LATENCY_SUB_BITS buckets, which
+ * keeps each bucket within 12.5% of the values in it from 1 ns to hours.
+ */
+
+#include "report_system.h"
+
+/**
+ * @struct MetricsShard
+ * @brief Samples recorded by one thread
+ */
+typedef struct MetricsShard {
+    MetricsSnapshot data;
+    int in_use;
+    struct MetricsShard *next;
+} MetricsShard;
+
+static const char *const metric_names[METRIC_COUNT] = {
+    "files_scanned_total",
+    "stat_calls_total",
+    "bytes_copied_total",
+    "renames_total",
+    "copy_fallbacks_total",
+    "owner_lookups_total",
+    "backup_bytes_total",
+    "backups_total",
+    "missing_reports_total",
+    "log_suppressed_total",
+    "log_drops_total"
+};
+
+static const char *const metric_help[METRIC_COUNT] = {
+    "Directory entries kept by scans.",
+    "Files stat'ed by scans.",
+    "Bytes copied between files.",
+    "Files moved by renaming.",
+    "Moves that fell back to copying and deleting.",
+    "User name lookups.",
+    "Report bytes put in backups.",
+    "Backups written.",
+    "Department reports found missing, counted at every check.",
+    "Error messages held back by rate limiting.",
+    "Log lines that could not be written to their log file."
+};
+
+/* The gauges of a family are adjacent, differ in their labels, and the first has the help text */
+static const char *const gauge_names[GAUGE_COUNT] = {
+    "transfer_queue_depth",
+    "transfer_queue_depth",
+    "transfer_queue_depth",
+    "missing_departments",
+    "last_backup_bytes"
+};
+
+static const char *const gauge_labels[GAUGE_COUNT] = {
+    "{queue=\"validate\"}",
+    "{queue=\"move\"}",
+    "{queue=\"record\"}",
+    "",
+    ""
+};
+
+static const char *const gauge_help[GAUGE_COUNT] = {
+    "Reports waiting in each transfer pipeline queue.",
+    NULL,
+    NULL,
+    "Departments whose report was missing at the last check.",
+    "Report bytes put in the last backup."
+};
+
+static const char *const latency_names[LATENCY_COUNT] = {
+    "scan",
+    "monitor",
+    "transfer",
+    "move_file",
+    "copy_file",
+    "backup",
+    "lock_hold"
+};
+
+static MetricsShard *metrics_shards = NULL;
+static int64_t metrics_gauges[GAUGE_COUNT];
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static __thread MetricsShard *metrics_local = NULL;
+
+/**
+ * Hand the shard of an exiting thread back to the pool
+ */
+static void metrics_release(void* shard) {
+    pthread_mutex_lock(&metrics_lock);
+    ((MetricsShard*)shard)->in_use = FALSE;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void metrics_create_key(void) {
+    pthread_key_create(&metrics_key, metrics_release);
+}
+
+/**
+ * Give the calling thread a shard, reusing one left by an exited thread
+ * @return The shard, or NULL if none could be allocated
+ */
+static MetricsShard* metrics_attach(void) {
+    MetricsShard *shard;
+
+    pthread_once(&metrics_once, metrics_create_key);
+
+    pthread_mutex_lock(&metrics_lock);
+    for (shard = metrics_shards; shard != NULL; shard = shard->next) {
+        if (!shard->in_use) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+        if (shard == NULL) {
+            pthread_mutex_unlock(&metrics_lock);
+            return NULL;
+        }
+        shard->next = metrics_shards;
+        __atomic_store_n(&metrics_shards, shard, __ATOMIC_RELEASE);
+    }
+    shard->in_use = TRUE;
+    pthread_mutex_unlock(&metrics_lock);
+
+    pthread_setspecific(metrics_key, shard);
+    metrics_local = shard;
+    return shard;
+}
+
+static inline MetricsShard* metrics_shard(void) {
+    MetricsShard *shard = metrics_local;
+    return __builtin_expect(shard != NULL, 1) ? shard : metrics_attach();
+}
+
+/* Only the owning thread writes a shard, so an add needs no atomic read-modify-write */
+static inline void shard_add(uint64_t* slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Bucket holding a latency
+ */
+static inline unsigned int latency_bucket(uint64_t ns) {
+    unsigned int bits;
+
+    if (ns < (1u << LATENCY_SUB_BITS)) {
+        return (unsigned int)ns;
+    }
+    bits = 63 - (unsigned int)__builtin_clzll(ns);
+    if (bits >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return ((bits - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) |
+           (unsigned int)((ns >> (bits - LATENCY_SUB_BITS)) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+/**
+ * Largest latency in a bucket
+ * @param bucket Bucket index below LATENCY_BUCKETS
+ * @return Upper bound in nanoseconds
+ */
+uint64_t metrics_bucket_limit(unsigned int bucket) {
+    unsigned int shift;
+    uint64_t base;
+
+    if (bucket < (1u << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    base = (uint64_t)((1u << LATENCY_SUB_BITS) | (bucket & ((1u << LATENCY_SUB_BITS) - 1)));
+    return (base << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * Monotonic clock for timing operations
+ * @return Nanoseconds since an arbitrary start
+ */
+uint64_t metrics_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Add to an operation counter
+ * @param metric METRIC_* counter
+ * @param n Amount to add
+ */
+void metrics_count(int metric, uint64_t n) {
+    MetricsShard *shard = metrics_shard();
+
+    if (shard != NULL) {
+        shard_add(&shard->data.counters[metric], n);
+    }
+}
+
+/**
+ * Record the latency of an operation that started at metrics_clock() time started
+ * @param latency LATENCY_* histogram
+ * @param started Value of metrics_clock() when the operation started
+ */
+void metrics_latency(int latency, uint64_t started) {
+    MetricsShard *shard = metrics_shard();
+    uint64_t now = metrics_clock();
+    uint64_t ns = (now > started) ? now - started : 0;
+
+    if (shard == NULL) {
+        return;
+    }
+    shard_add(&shard->data.buckets[latency][latency_bucket(ns)], 1);
+    shard_add(&shard->data.count[latency], 1);
+    shard_add(&shard->data.sum[latency], ns);
+    if (ns > shard->data.max[latency]) {
+        __atomic_store_n(&shard->data.max[latency], ns, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Set a gauge
+ * @param gauge GAUGE_* gauge
+ * @param value Its current value
+ */
+void metrics_gauge(int gauge, int64_t value) {
+    __atomic_store_n(&metrics_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add up the shards of every thread
+ * @param snapshot Receives the totals
+ */
+void metrics_snapshot(MetricsSnapshot* snapshot) {
+    const MetricsShard *shard;
+
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+
+    for (shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        const MetricsSnapshot *data = &shard->data;
+
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            snapshot->counters[i] += __atomic_load_n(&data->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < LATENCY_COUNT; i++) {
+            uint64_t max = __atomic_load_n(&data->max[i], __ATOMIC_RELAXED);
+
+            snapshot->count[i] += __atomic_load_n(&data->count[i], __ATOMIC_RELAXED);
+            snapshot->sum[i] += __atomic_load_n(&data->sum[i], __ATOMIC_RELAXED);
+            if (max > snapshot->max[i]) {
+                snapshot->max[i] = max;
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                snapshot->buckets[i][b] += __atomic_load_n(&data->buckets[i][b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    for (int i = 0; i < GAUGE_COUNT; i++) {
+        snapshot->gauges[i] = __atomic_load_n(&metrics_gauges[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Latency below which a fraction of the samples fall
+ * @param snapshot Totals from metrics_snapshot
+ * @param latency LATENCY_* histogram
+ * @param quantile Fraction between 0 and 1
+ * @return Upper bound of the bucket holding the quantile, in nanoseconds
+ */
+uint64_t metrics_percentile(const MetricsSnapshot* snapshot, int latency, double quantile) {
+    uint64_t total = 0, seen = 0, rank;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        total += snapshot->buckets[latency][b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(quantile * (double)total + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += snapshot->buckets[latency][b];
+        if (seen >= rank) {
+            uint64_t limit = metrics_bucket_limit((unsigned int)b);
+            return (limit < snapshot->max[latency]) ? limit : snapshot->max[latency];
+        }
+    }
+    return snapshot->max[latency];
+}
+
+/**
+ * Name of a counter, as used in the status file
+ */
+const char* metrics_counter_name(int metric) {
+    return metric_names[metric];
+}
+
+/**
+ * Name of a latency histogram, as used in the status file
+ */
+const char* metrics_latency_name(int latency) {
+    return latency_names[latency];
+}
+
+/**
+ * Write the counters and latency summaries as status lines
+ * @param out Status file being written
+ */
+void metrics_write_status(FILE* out) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    MetricsSnapshot *snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+
+    if (snapshot == NULL) {
+        return;
+    }
+    metrics_snapshot(snapshot);
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        fprintf(out, "%s %llu\n", metric_names[i], (unsigned long long)snapshot->counters[i]);
+    }
+    for (int i = 0; i < GAUGE_COUNT; i++) {
+        fprintf(out, "%s%s %lld\n", gauge_names[i], gauge_labels[i], (long long)snapshot->gauges[i]);
+    }
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        fprintf(out, "latency_count{op=\"%s\"} %llu\n", latency_names[i],
+                (unsigned long long)snapshot->count[i]);
+        fprintf(out, "latency_sum_ns{op=\"%s\"} %llu\n", latency_names[i],
+                (unsigned long long)snapshot->sum[i]);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            fprintf(out, "latency_ns{op=\"%s\",quantile=\"%g\"} %llu\n", latency_names[i],
+                    quantiles[q], (unsigned long long)metrics_percentile(snapshot, i, quantiles[q]));
+        }
+        fprintf(out, "latency_max_ns{op=\"%s\"} %llu\n", latency_names[i],
+                (unsigned long long)snapshot->max[i]);
+    }
+    free(snapshot);
+}
+
+/**
+ * Write the counters and every non-empty latency bucket, cumulatively
+ * @param out Snapshot file being written
+ */
+void metrics_write_buckets(FILE* out) {
+    MetricsSnapshot *snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+
+    if (snapshot == NULL) {
+        return;
+    }
+    metrics_snapshot(snapshot);
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        fprintf(out, "%s %llu\n", metric_names[i], (unsigned long long)snapshot->counters[i]);
+    }
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        uint64_t seen = 0;
+
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (snapshot->buckets[i][b] == 0) {
+                continue;
+            }
+            seen += snapshot->buckets[i][b];
+            fprintf(out, "latency_bucket_ns{op=\"%s\",le=\"%llu\"} %llu\n", latency_names[i],
+                    (unsigned long long)metrics_bucket_limit((unsigned int)b),
+                    (unsigned long long)seen);
+        }
+        fprintf(out, "latency_count{op=\"%s\"} %llu\n", latency_names[i],
+                (unsigned long long)snapshot->count[i]);
+        fprintf(out, "latency_sum_ns{op=\"%s\"} %llu\n", latency_names[i],
+                (unsigned long long)snapshot->sum[i]);
+    }
+    free(snapshot);
+}
+
+/**
+ * Write the counters, gauges and latency histograms in Prometheus text format
+ * The histograms are exported with a bucket every PROMETHEUS_BUCKET_STEP
+ * powers of two rather than every recorded bucket, and in seconds.
+ * @param out Exposition file being written
+ */
+void metrics_write_prometheus(FILE* out) {
+    MetricsSnapshot *snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+
+    if (snapshot == NULL) {
+        return;
+    }
+    metrics_snapshot(snapshot);
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        fprintf(out, "# HELP " PROMETHEUS_PREFIX "%s %s\n", metric_names[i], metric_help[i]);
+        fprintf(out, "# TYPE " PROMETHEUS_PREFIX "%s counter\n", metric_names[i]);
+        fprintf(out, PROMETHEUS_PREFIX "%s %llu\n", metric_names[i],
+                (unsigned long long)snapshot->counters[i]);
+    }
+
+    for (int i = 0; i < GAUGE_COUNT; i++) {
+        if (gauge_help[i] != NULL) {
+            fprintf(out, "# HELP " PROMETHEUS_PREFIX "%s %s\n", gauge_names[i], gauge_help[i]);
+            fprintf(out, "# TYPE " PROMETHEUS_PREFIX "%s gauge\n", gauge_names[i]);
+        }
+        fprintf(out, PROMETHEUS_PREFIX "%s%s %lld\n", gauge_names[i], gauge_labels[i],
+                (long long)snapshot->gauges[i]);
+    }
+
+    fprintf(out, "# HELP " PROMETHEUS_PREFIX "operation_duration_seconds "
+            "Time taken by whole operations, and the time the directories stayed locked.\n");
+    fprintf(out, "# TYPE " PROMETHEUS_PREFIX "operation_duration_seconds histogram\n");
+    for (int i = 0; i < LATENCY_COUNT; i++) {
+        uint64_t seen = 0;
+        int b = 0;
+
+        for (int bits = PROMETHEUS_MIN_BITS; bits <= LATENCY_MAX_BITS; bits += PROMETHEUS_BUCKET_STEP) {
+            uint64_t bound = ((uint64_t)1 << bits) - 1;
+
+            /* Recorded buckets end exactly at each power of two */
+            while (b < LATENCY_BUCKETS - 1 && metrics_bucket_limit((unsigned int)b) <= bound) {
+                seen += snapshot->buckets[i][b++];
+            }
+            fprintf(out, PROMETHEUS_PREFIX "operation_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+                    latency_names[i], (double)bound / 1e9, (unsigned long long)seen);
+        }
+        fprintf(out, PROMETHEUS_PREFIX "operation_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                latency_names[i], (unsigned long long)snapshot->count[i]);
+        fprintf(out, PROMETHEUS_PREFIX "operation_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                latency_names[i], (double)snapshot->sum[i] / 1e9);
+        fprintf(out, PROMETHEUS_PREFIX "operation_duration_seconds_count{op=\"%s\"} %llu\n",
+                latency_names[i], (unsigned long long)snapshot->count[i]);
+    }
+    free(snapshot);
+}
@@ -0,0 +1,1038 @@
+/**
+ * @file pack.c
+ * @brief Single-file backup archives
+ *
+ * An archive backup is one file, backup_<time>.pack, laid out as
+ *
+ *   header   "RPTPACK1", version
+ *   data     each file's content, raw or as one gzip member, back to back
+ *   index    PackEntry table sorted by name, then the NUL-terminated names
+ *   trailer  "RPTPIDX1", index offset, entry count, names length, index hash
+ *
+ * The writer only appends, so a backup is one sequential stream, and the
+ * index goes last because only then are all offsets known. Every entry
+ * carries the fingerprint (hash, CRC32C, size) of the plain content, and
+ * extracting a file checks it. The archive is written under a temporary
+ * name and renamed into place once synced, so a .pack file that exists is
+ * complete. Readers map the whole file and look names up by binary search;
+ * an erasure-coded archive is rebuilt in memory instead (see erasure.c).
+ *
+ * In delta mode (version 2) reports arrive sorted by name, so each
+ * department's reports come in date order, and a report may be stored as a
+ * delta against the department's previous report: copies from the base and
+ * literal runs. Every keyframe_interval-th report of a department is stored
+ * in full, which bounds the chain a reader has to follow. Deltas only ever
+ * refer to entries of the same archive, so pruning one backup never breaks
+ * another.
+ */
+
+#define LOG_MODULE LOG_MODULE_BACKUP
+#include "report_system.h"
+#include <sys/mman.h>
+#include <zlib.h>
+
+#define PACK_MAGIC        "RPTPACK1"
+#define PACK_INDEX_MAGIC  "RPTPIDX1"
+#define PACK_VERSION      2         /* 2 added delta entries */
+#define PACK_CHUNK        65536
+#define PACK_GZIP_WINDOW  (15 + 16)
+#define PACK_DELTA_BLOCK  16        /* Shortest match worth a copy */
+#define PACK_DELTA_DEPTH  256       /* Longest chain a reader follows */
+#define PACK_DELTA_EMPTY  UINT32_MAX
+
+/**
+ * @struct PackHeader
+ * @brief Start of an archive
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} PackHeader;
+
+/**
+ * @struct PackTrailer
+ * @brief End of an archive, locating the index
+ */
+typedef struct {
+    char magic[8];
+    uint64_t index_offset;    /* First PackEntry */
+    uint32_t entry_count;
+    uint32_t names_length;    /* Name table bytes after the entries */
+    uint64_t index_hash;      /* Fingerprint hash of entries and names */
+} PackTrailer;
+
+/**
+ * Append a chunk and read it back
+ * @return SUCCESS if the chunk is on disk as written, FAILURE otherwise (errno set)
+ */
+static int pack_append(PackWriter* writer, const void* data, size_t length, void* readback) {
+    const char *p = (const char*)data;
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t written = pwrite(writer->fd, p + done, length - done, (off_t)(writer->offset + done));
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written == 0) {
+                errno = EIO;
+            }
+            return FAILURE;
+        }
+        done += (size_t)written;
+    }
+
+    if (readback != NULL &&
+        (pread(writer->fd, readback, length, (off_t)writer->offset) != (ssize_t)length ||
+         memcmp(data, readback, length) != 0)) {
+        errno = EIO;
+        return FAILURE;
+    }
+    writer->offset += length;
+    return SUCCESS;
+}
+
+/**
+ * Store bytes of the current entry: appended as they are, or fed to deflate
+ * @param finish TRUE with the entry's last bytes
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+static int pack_store(PackWriter* writer, z_stream* zs, const void* data, size_t length, int finish) {
+    static __thread unsigned char out[PACK_CHUNK], readback[PACK_CHUNK];
+    const char *p = (const char*)data;
+
+    if (writer->level == 0) {
+        while (length > 0) {
+            size_t chunk = (length < PACK_CHUNK) ? length : PACK_CHUNK;
+            if (pack_append(writer, p, chunk, readback) != SUCCESS) {
+                return FAILURE;
+            }
+            p += chunk;
+            length -= chunk;
+        }
+        return SUCCESS;
+    }
+
+    zs->next_in = (unsigned char*)p;
+    zs->avail_in = (uInt)length;
+    do {
+        zs->next_out = out;
+        zs->avail_out = sizeof(out);
+        deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (pack_append(writer, out, sizeof(out) - zs->avail_out, readback) != SUCCESS) {
+            return FAILURE;
+        }
+    } while (zs->avail_out == 0);
+    return SUCCESS;
+}
+
+static uint32_t delta_hash(const char* p, int bits) {
+    uint64_t a, b;
+
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, p + sizeof(a), sizeof(b));
+    return (uint32_t)(((a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL)) >> (64 - bits));
+}
+
+static void put_varint(char* out, size_t* length, uint64_t value) {
+    while (value >= 0x80) {
+        out[(*length)++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[(*length)++] = (char)value;
+}
+
+static int get_varint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+static void put_literal(char* out, size_t* length, const char* data, size_t count) {
+    if (count > 0) {
+        put_varint(out, length, (uint64_t)count << 1);
+        memcpy(out + *length, data, count);
+        *length += count;
+    }
+}
+
+/**
+ * Encode target as copies from base and literal runs
+ * The delta starts with the base's name table offset, then each op is a
+ * varint (length << 1 | is_copy), followed by the base offset of a copy or
+ * the bytes of a literal. Base blocks are indexed at PACK_DELTA_BLOCK
+ * boundaries; every target position is looked up and matches are extended
+ * both ways, so edits anywhere in a line still leave the rest shared.
+ * @return malloc'd delta, NULL if out of memory
+ */
+static char* delta_encode(const char* base, size_t base_size, uint32_t base_name,
+                          const char* target, size_t target_size, size_t* delta_length) {
+    size_t table_size;
+    uint32_t *table;
+    char *out;
+    size_t length = 0, pos = 0, literal = 0;
+    int bits = 10;
+
+    while (bits < 28 && ((size_t)1 << bits) < 2 * (base_size / PACK_DELTA_BLOCK)) {
+        bits++;
+    }
+    table_size = (size_t)1 << bits;
+    table = (uint32_t*)malloc(table_size * sizeof(uint32_t));
+    out = (char*)malloc(sizeof(uint32_t) + target_size + (target_size / PACK_DELTA_BLOCK + 2) * 20);
+    if (table == NULL || out == NULL) {
+        free(table);
+        free(out);
+        return NULL;
+    }
+    memset(table, 0xff, table_size * sizeof(uint32_t));
+    for (size_t i = 0; i + PACK_DELTA_BLOCK <= base_size; i += PACK_DELTA_BLOCK) {
+        table[delta_hash(base + i, bits)] = (uint32_t)i;
+    }
+
+    memcpy(out, &base_name, sizeof(base_name));
+    length = sizeof(base_name);
+    while (pos + PACK_DELTA_BLOCK <= target_size) {
+        uint32_t candidate = table[delta_hash(target + pos, bits)];
+        size_t start, from, end, from_end;
+
+        if (candidate == PACK_DELTA_EMPTY ||
+            memcmp(base + candidate, target + pos, PACK_DELTA_BLOCK) != 0) {
+            pos++;
+            continue;
+        }
+        start = pos;
+        from = candidate;
+        while (start > literal && from > 0 && target[start - 1] == base[from - 1]) {
+            start--;
+            from--;
+        }
+        end = pos + PACK_DELTA_BLOCK;
+        from_end = candidate + PACK_DELTA_BLOCK;
+        while (end < target_size && from_end < base_size && target[end] == base[from_end]) {
+            end++;
+            from_end++;
+        }
+
+        put_literal(out, &length, target + literal, start - literal);
+        put_varint(out, &length, ((uint64_t)(end - start) << 1) | 1);
+        put_varint(out, &length, from);
+        pos = literal = end;
+    }
+    put_literal(out, &length, target + literal, target_size - literal);
+
+    free(table);
+    *delta_length = length;
+    return out;
+}
+
+/**
+ * Rebuild content from its base and a delta (without the base name)
+ * @return SUCCESS on success, FAILURE if the delta does not fit
+ */
+static int delta_apply(const char* base, size_t base_size, const unsigned char* delta,
+                       size_t delta_length, char* out, size_t size) {
+    const unsigned char *end = delta + delta_length;
+    size_t length = 0;
+
+    while (delta < end) {
+        uint64_t op, count, from;
+
+        if (get_varint(&delta, end, &op) != SUCCESS) {
+            return FAILURE;
+        }
+        count = op >> 1;
+        if (count > size - length) {
+            return FAILURE;
+        }
+        if (op & 1) {
+            if (get_varint(&delta, end, &from) != SUCCESS || from > base_size ||
+                count > base_size - from) {
+                return FAILURE;
+            }
+            memcpy(out + length, base + from, count);
+        } else {
+            if (count > (uint64_t)(end - delta)) {
+                return FAILURE;
+            }
+            memcpy(out + length, delta, count);
+            delta += count;
+        }
+        length += count;
+    }
+    return (length == size) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Start writing an archive
+ * @param writer Writer to initialize
+ * @param dirfd Directory to create the archive in
+ * @param name Archive file name
+ * @param level zlib level for the entries, 0 to store them raw
+ * @param keyframe_interval Store reports as deltas, in full every N per
+ *        department (files must then be added in name order); 0 for no deltas
+ * @return SUCCESS on success, FAILURE on error
+ */
+int pack_create(PackWriter* writer, int dirfd, const char* name, int level, int keyframe_interval) {
+    PackHeader header;
+
+    memset(writer, 0, sizeof(PackWriter));
+    writer->dirfd = dirfd;
+    writer->level = level;
+    writer->keyframe_interval = keyframe_interval;
+    snprintf(writer->name, sizeof(writer->name), "%s", name);
+    snprintf(writer->temp, sizeof(writer->temp), ".%s.tmp", name);
+
+    writer->fd = openat(dirfd, writer->temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd == -1) {
+        log_error("Failed to create archive %s: %s", name, strerror(errno));
+        return FAILURE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    if (pack_append(writer, &header, sizeof(header), NULL) != SUCCESS) {
+        log_error("Failed to write archive %s: %s", name, strerror(errno));
+        pack_abort(writer);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Record an entry's name in the writer's name table
+ */
+static int pack_add_name(PackWriter* writer, const char* filename, PackEntry* entry) {
+    size_t length = strlen(filename);
+
+    if (writer->names_length + length + 1 > writer->names_capacity) {
+        size_t new_capacity = writer->names_capacity ? writer->names_capacity * 2 : 65536;
+        char *grown;
+
+        while (new_capacity < writer->names_length + length + 1) {
+            new_capacity *= 2;
+        }
+        grown = (char*)realloc(writer->names, new_capacity);
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        writer->names = grown;
+        writer->names_capacity = new_capacity;
+    }
+    memcpy(writer->names + writer->names_length, filename, length + 1);
+    entry->name_offset = (uint32_t)writer->names_length;
+    entry->name_length = (uint32_t)length;
+    writer->names_length += length + 1;
+    return SUCCESS;
+}
+
+/**
+ * Read a whole report for delta mode
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+static int read_report(int fd, size_t size_hint, char** data, size_t* length) {
+    size_t capacity = size_hint + 1;
+    char *buffer = (char*)malloc(capacity);
+    size_t used = 0;
+
+    if (buffer == NULL) {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    for (;;) {
+        ssize_t bytes_read;
+
+        if (used == capacity) {
+            char *grown = (capacity >= PACK_DELTA_MAX_SIZE) ? NULL : (char*)realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                free(buffer);
+                errno = EFBIG;
+                return FAILURE;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        bytes_read = read(fd, buffer + used, capacity - used);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return FAILURE;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        used += (size_t)bytes_read;
+    }
+
+    *data = buffer;
+    *length = used;
+    return SUCCESS;
+}
+
+/**
+ * Append one file to an archive
+ * The content is fingerprinted on the way in and every chunk is read back
+ * and compared after it is written. On failure the archive is cut back to
+ * where the entry started, so the call can simply be retried. In delta mode
+ * a report of the same department as the previous one is stored as a delta
+ * against it when that is smaller and the chain is not yet due a keyframe.
+ *
+ * @param writer Archive being written
+ * @param src_dirfd Directory of the file
+ * @param filename File to add (also its name in the archive)
+ * @param fingerprint Receives the fingerprint of the content (may be NULL)
+ * @return SUCCESS on success, FAILURE on error (errno set)
+ */
+int pack_add_file(PackWriter* writer, int src_dirfd, const char* filename, FileFingerprint* fingerprint) {
+    static __thread unsigned char in[PACK_CHUNK];
+    char department[MAX_USER_LENGTH] = "";
+    FingerprintState state;
+    FileFingerprint plain;
+    PackEntry entry;
+    z_stream zs;
+    struct stat st;
+    ssize_t bytes_read;
+    uint64_t start = writer->offset;
+    char *content = NULL;
+    size_t content_length = 0;
+    int is_delta = FALSE;
+    int src_fd;
+    int result = SUCCESS;
+    int saved_errno = 0;
+
+    src_fd = openat(src_dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if (src_fd == -1) {
+        return FAILURE;
+    }
+    if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(src_fd);
+        errno = EINVAL;
+        return FAILURE;
+    }
+
+    if (writer->level > 0) {
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, writer->level, Z_DEFLATED, PACK_GZIP_WINDOW, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            close(src_fd);
+            errno = EINVAL;
+            return FAILURE;
+        }
+    }
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+
+    if (writer->keyframe_interval > 0 && st.st_size <= PACK_DELTA_MAX_SIZE) {
+        /* Whole reports: the content becomes the next report's base */
+        char *delta = NULL;
+        size_t delta_length = 0;
+
+        if (read_report(src_fd, (size_t)st.st_size, &content, &content_length) != SUCCESS) {
+            saved_errno = errno;
+            result = FAILURE;
+        } else {
+            fingerprint_update(&state, content, content_length);
+            if (extract_department_from_filename(filename, department, sizeof(department)) == NULL) {
+                department[0] = '\0';
+            }
+            if (writer->base != NULL && department[0] != '\0' &&
+                strcmp(department, writer->base_department) == 0 &&
+                writer->chain + 1 < writer->keyframe_interval) {
+                delta = delta_encode(writer->base, writer->base_size, writer->base_name,
+                                     content, content_length, &delta_length);
+            }
+            is_delta = (delta != NULL && delta_length < content_length);
+            if (pack_store(writer, &zs, is_delta ? delta : content,
+                           is_delta ? delta_length : content_length, TRUE) != SUCCESS) {
+                saved_errno = errno;
+                result = FAILURE;
+            }
+            free(delta);
+        }
+    } else {
+        do {
+            bytes_read = read(src_fd, in, sizeof(in));
+            if (bytes_read == -1) {
+                saved_errno = errno;
+                result = FAILURE;
+                break;
+            }
+            fingerprint_update(&state, in, (size_t)bytes_read);
+            if (pack_store(writer, &zs, in, (size_t)bytes_read, bytes_read == 0) != SUCCESS) {
+                saved_errno = errno;
+                result = FAILURE;
+            }
+        } while (bytes_read > 0 && result == SUCCESS);
+    }
+
+    if (writer->level > 0) {
+        deflateEnd(&zs);
+    }
+    fingerprint_final(&state, &plain);
+    close(src_fd);
+
+    memset(&entry, 0, sizeof(entry));
+    if (result == SUCCESS) {
+        entry.offset = start;
+        entry.stored_length = writer->offset - start;
+        entry.size = plain.size;
+        entry.hash = plain.hash;
+        entry.crc32c = plain.crc32c;
+        entry.flags = (writer->level > 0 ? PACK_ENTRY_COMPRESSED : 0) |
+                      (plain.has_crc ? PACK_ENTRY_HAS_CRC : 0) |
+                      (is_delta ? PACK_ENTRY_DELTA : 0);
+
+        if (writer->count == writer->capacity) {
+            int new_capacity = writer->capacity ? writer->capacity * 2 : FILEOPS_BATCH_SIZE;
+            PackEntry *grown = (PackEntry*)realloc(writer->entries, new_capacity * sizeof(PackEntry));
+            if (grown == NULL) {
+                saved_errno = ENOMEM;
+                result = FAILURE;
+            } else {
+                writer->entries = grown;
+                writer->capacity = new_capacity;
+            }
+        }
+        if (result == SUCCESS && pack_add_name(writer, filename, &entry) != SUCCESS) {
+            saved_errno = ENOMEM;
+            result = FAILURE;
+        }
+    }
+
+    if (result != SUCCESS) {
+        /* Drop the partial entry */
+        free(content);
+        writer->offset = start;
+        ftruncate(writer->fd, (off_t)start);
+        if (saved_errno == EIO) {
+            log_error("Verification failed for %s in archive %s", filename, writer->name);
+        }
+        errno = saved_errno;
+        return FAILURE;
+    }
+
+    writer->entries[writer->count++] = entry;
+    if (content != NULL) {
+        free(writer->base);
+        writer->base = content;
+        writer->base_size = content_length;
+        writer->base_name = entry.name_offset;
+        writer->chain = is_delta ? writer->chain + 1 : 0;
+        snprintf(writer->base_department, sizeof(writer->base_department), "%s", department);
+    }
+    if (fingerprint != NULL) {
+        *fingerprint = plain;
+    }
+    return SUCCESS;
+}
+
+static int compare_pack_entries(const void* a, const void* b, void* names) {
+    return strcmp((const char*)names + ((const PackEntry*)a)->name_offset,
+                  (const char*)names + ((const PackEntry*)b)->name_offset);
+}
+
+/**
+ * Write the index, sync the archive and move it into place
+ * @param writer Archive being written; released in all cases
+ * @return SUCCESS on success, FAILURE on error
+ */
+int pack_finish(PackWriter* writer) {
+    FingerprintState state;
+    FileFingerprint index_fp;
+    PackTrailer trailer;
+    size_t entries_size = (size_t)writer->count * sizeof(PackEntry);
+    int result = SUCCESS;
+
+    if (writer->count > 1) {
+        qsort_r(writer->entries, writer->count, sizeof(PackEntry), compare_pack_entries, writer->names);
+    }
+
+    fingerprint_init(&state, FALSE);
+    fingerprint_update(&state, writer->entries, entries_size);
+    fingerprint_update(&state, writer->names, writer->names_length);
+    fingerprint_final(&state, &index_fp);
+
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, PACK_INDEX_MAGIC, sizeof(trailer.magic));
+    trailer.index_offset = writer->offset;
+    trailer.entry_count = (uint32_t)writer->count;
+    trailer.names_length = (uint32_t)writer->names_length;
+    trailer.index_hash = index_fp.hash;
+
+    if ((entries_size > 0 && pack_append(writer, writer->entries, entries_size, NULL) != SUCCESS) ||
+        (writer->names_length > 0 && pack_append(writer, writer->names, writer->names_length, NULL) != SUCCESS) ||
+        pack_append(writer, &trailer, sizeof(trailer), NULL) != SUCCESS ||
+        fsync(writer->fd) != 0) {
+        log_error("Failed to write archive index for %s: %s", writer->name, strerror(errno));
+        result = FAILURE;
+    }
+
+    if (result == SUCCESS &&
+        renameat2(writer->dirfd, writer->temp, writer->dirfd, writer->name, RENAME_NOREPLACE) != 0) {
+        log_error("Failed to install archive %s: %s", writer->name, strerror(errno));
+        result = FAILURE;
+    }
+    if (result != SUCCESS) {
+        pack_abort(writer);
+        return FAILURE;
+    }
+
+    close(writer->fd);
+    free(writer->entries);
+    free(writer->names);
+    free(writer->base);
+    memset(writer, 0, sizeof(PackWriter));
+    writer->fd = -1;
+    return SUCCESS;
+}
+
+/**
+ * Discard an archive that is being written
+ * @param writer Archive being written
+ */
+void pack_abort(PackWriter* writer) {
+    if (writer->fd != -1) {
+        close(writer->fd);
+        unlinkat(writer->dirfd, writer->temp, 0);
+    }
+    free(writer->entries);
+    free(writer->names);
+    free(writer->base);
+    memset(writer, 0, sizeof(PackWriter));
+    writer->fd = -1;
+}
+
+/**
+ * Open an archive for random access
+ * The whole file is mapped and its index checked before use.
+ * @param reader Reader to initialize
+ * @param dirfd Directory holding the archive
+ * @param name Archive file name
+ * @return SUCCESS on success, FAILURE if missing or damaged
+ */
+int pack_open(PackReader* reader, int dirfd, const char* name) {
+    const PackHeader *header;
+    const PackTrailer *trailer;
+    FingerprintState state;
+    FileFingerprint index_fp;
+    struct stat st;
+    uint64_t entries_size;
+
+    memset(reader, 0, sizeof(PackReader));
+    reader->fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (reader->fd == -1) {
+        return FAILURE;
+    }
+    if (fstat(reader->fd, &st) != 0 ||
+        (uint64_t)st.st_size < sizeof(PackHeader) + sizeof(PackTrailer)) {
+        goto damaged;
+    }
+    reader->size = (size_t)st.st_size;
+    reader->map = (const char*)mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        goto damaged;
+    }
+
+    /* Shard 0 of an erasure-coded archive: rebuild it from all the roots */
+    if (erasure_is_shard(reader->map, reader->size)) {
+        char *data;
+        size_t size;
+
+        munmap((void*)reader->map, reader->size);
+        reader->map = NULL;
+        close(reader->fd);
+        reader->fd = -1;
+        if (erasure_read(dirfd, name, &data, &size) != SUCCESS ||
+            size < sizeof(PackHeader) + sizeof(PackTrailer)) {
+            goto damaged;
+        }
+        reader->map = data;
+        reader->size = size;
+    }
+
+    header = (const PackHeader*)reader->map;
+    trailer = (const PackTrailer*)(reader->map + reader->size - sizeof(PackTrailer));
+    entries_size = (uint64_t)trailer->entry_count * sizeof(PackEntry);
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version < 1 || header->version > PACK_VERSION ||
+        memcmp(trailer->magic, PACK_INDEX_MAGIC, sizeof(trailer->magic)) != 0 ||
+        trailer->index_offset < sizeof(PackHeader) ||
+        trailer->index_offset + entries_size + trailer->names_length + sizeof(PackTrailer) != reader->size) {
+        goto damaged;
+    }
+
+    reader->entries = (const PackEntry*)(reader->map + trailer->index_offset);
+    reader->count = trailer->entry_count;
+    reader->names = reader->map + trailer->index_offset + entries_size;
+    reader->names_length = trailer->names_length;
+
+    fingerprint_init(&state, FALSE);
+    fingerprint_update(&state, reader->entries, entries_size);
+    fingerprint_update(&state, reader->names, reader->names_length);
+    fingerprint_final(&state, &index_fp);
+    if (index_fp.hash != trailer->index_hash) {
+        goto damaged;
+    }
+    for (uint32_t i = 0; i < reader->count; i++) {
+        const PackEntry *entry = &reader->entries[i];
+        if (entry->offset < sizeof(PackHeader) ||
+            entry->offset + entry->stored_length > trailer->index_offset ||
+            (uint64_t)entry->name_offset + entry->name_length >= reader->names_length ||
+            reader->names[entry->name_offset + entry->name_length] != '\0') {
+            goto damaged;
+        }
+    }
+
+    /* Restores touch a few entries, not the whole file */
+    madvise((void*)reader->map, reader->size, MADV_RANDOM);
+    return SUCCESS;
+
+damaged:
+    log_error("Backup archive %s is damaged", name);
+    pack_close(reader);
+    errno = EIO;
+    return FAILURE;
+}
+
+/**
+ * Close an archive opened with pack_open
+ * @param reader Reader to close
+ */
+void pack_close(PackReader* reader) {
+    if (reader->map != NULL) {
+        munmap((void*)reader->map, reader->size);
+    }
+    if (reader->fd != -1) {
+        close(reader->fd);
+    }
+    memset(reader, 0, sizeof(PackReader));
+    reader->fd = -1;
+}
+
+/**
+ * Get the file name of an archive entry
+ */
+const char* pack_entry_name(const PackReader* reader, const PackEntry* entry) {
+    return reader->names + entry->name_offset;
+}
+
+/**
+ * Look up a file in an archive
+ * @return The entry, or NULL if the archive does not hold the file
+ */
+const PackEntry* pack_find(const PackReader* reader, const char* filename) {
+    uint32_t low = 0, high = reader->count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int order = strcmp(pack_entry_name(reader, &reader->entries[mid]), filename);
+        if (order == 0) {
+            return &reader->entries[mid];
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get an entry's recorded fingerprint
+ */
+void pack_entry_fingerprint(const PackEntry* entry, FileFingerprint* fingerprint) {
+    memset(fingerprint, 0, sizeof(FileFingerprint));
+    fingerprint->hash = entry->hash;
+    fingerprint->size = entry->size;
+    fingerprint->crc32c = entry->crc32c;
+    fingerprint->has_crc = (entry->flags & PACK_ENTRY_HAS_CRC) != 0;
+    fingerprint->valid = TRUE;
+}
+
+/**
+ * Build a manifest from an archive's index
+ * @param reader Open archive
+ * @param entries Receives a malloc'd array sorted by name (caller frees)
+ * @param count Receives the number of entries
+ * @return SUCCESS on success, FAILURE on error
+ */
+int pack_manifest(const PackReader* reader, ManifestEntry** entries, int* count) {
+    ManifestEntry *list = (ManifestEntry*)calloc(reader->count + 1, sizeof(ManifestEntry));
+
+    *entries = NULL;
+    *count = 0;
+    if (list == NULL) {
+        log_error("Memory allocation failed for manifest");
+        return FAILURE;
+    }
+    for (uint32_t i = 0; i < reader->count; i++) {
+        snprintf(list[i].filename, sizeof(list[i].filename), "%s",
+                 pack_entry_name(reader, &reader->entries[i]));
+        pack_entry_fingerprint(&reader->entries[i], &list[i].fingerprint);
+    }
+
+    *entries = list;
+    *count = (int)reader->count;
+    return SUCCESS;
+}
+
+/**
+ * Inflate a whole gzip member into memory
+ */
+static int inflate_all(const unsigned char* data, size_t length, size_t size_hint,
+                       unsigned char** out, size_t* out_length) {
+    size_t capacity = size_hint + 64;
+    unsigned char *buffer = (unsigned char*)malloc(capacity);
+    z_stream zs;
+    int status;
+
+    memset(&zs, 0, sizeof(zs));
+    if (buffer == NULL || inflateInit2(&zs, PACK_GZIP_WINDOW) != Z_OK) {
+        free(buffer);
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    zs.next_in = (unsigned char*)data;
+    zs.avail_in = (uInt)length;
+    do {
+        if (zs.total_out == capacity) {
+            unsigned char *grown = (unsigned char*)realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                status = Z_MEM_ERROR;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        zs.next_out = buffer + zs.total_out;
+        zs.avail_out = (uInt)(capacity - zs.total_out);
+        status = inflate(&zs, Z_NO_FLUSH);
+    } while (status == Z_OK);
+    *out_length = zs.total_out;
+    inflateEnd(&zs);
+
+    if (status != Z_STREAM_END) {
+        free(buffer);
+        errno = (status == Z_MEM_ERROR) ? ENOMEM : EIO;
+        return FAILURE;
+    }
+    *out = buffer;
+    return SUCCESS;
+}
+
+/**
+ * Load an entry's plain content, following delta chains
+ */
+static int pack_load(const PackReader* reader, const PackEntry* entry, int depth,
+                     char** data, size_t* length) {
+    const unsigned char *stored = (const unsigned char*)reader->map + entry->offset;
+    size_t stored_length = entry->stored_length;
+    unsigned char *inflated = NULL;
+    const PackEntry *base_entry;
+    char *base = NULL, *out;
+    size_t base_size;
+    uint32_t base_name;
+
+    if (entry->flags & PACK_ENTRY_COMPRESSED) {
+        if (inflate_all(stored, stored_length, entry->size, &inflated, &stored_length) != SUCCESS) {
+            return FAILURE;
+        }
+        stored = inflated;
+    }
+
+    if (!(entry->flags & PACK_ENTRY_DELTA)) {
+        if (stored_length != entry->size) {
+            goto damaged;
+        }
+        if (inflated != NULL) {
+            *data = (char*)inflated;
+        } else if ((*data = (char*)malloc(stored_length + 1)) != NULL) {
+            memcpy(*data, stored, stored_length);
+        } else {
+            errno = ENOMEM;
+            return FAILURE;
+        }
+        *length = stored_length;
+        return SUCCESS;
+    }
+
+    if (depth >= PACK_DELTA_DEPTH || stored_length < sizeof(base_name)) {
+        goto damaged;
+    }
+    memcpy(&base_name, stored, sizeof(base_name));
+    if (base_name >= reader->names_length ||
+        memchr(reader->names + base_name, '\0', reader->names_length - base_name) == NULL) {
+        goto damaged;
+    }
+    base_entry = pack_find(reader, reader->names + base_name);
+    if (base_entry == NULL || base_entry == entry ||
+        pack_load(reader, base_entry, depth + 1, &base, &base_size) != SUCCESS) {
+        goto damaged;
+    }
+
+    out = (char*)malloc(entry->size + 1);
+    if (out == NULL || delta_apply(base, base_size, stored + sizeof(base_name),
+                                   stored_length - sizeof(base_name), out, entry->size) != SUCCESS) {
+        free(out);
+        free(base);
+        goto damaged;
+    }
+    free(base);
+    free(inflated);
+    *data = out;
+    *length = entry->size;
+    return SUCCESS;
+
+damaged:
+    free(inflated);
+    errno = EIO;
+    return FAILURE;
+}
+
+/**
+ * Read an entry's plain content into memory
+ * Delta entries are rebuilt from their chain back to the keyframe, which
+ * holds at most BACKUP_DELTA_KEYFRAME reports. The content is not checked
+ * against the entry's fingerprint; pack_extract() does that.
+ * @param reader Open archive
+ * @param entry Entry to read
+ * @param data Receives a malloc'd buffer (caller frees)
+ * @param length Receives the content length
+ * @return SUCCESS on success, FAILURE on error or damaged data (errno set)
+ */
+int pack_read_entry(const PackReader* reader, const PackEntry* entry, char** data, size_t* length) {
+    return pack_load(reader, entry, 0, data, length);
+}
+
+/**
+ * Write a whole buffer, retrying short writes
+ */
+static int pack_write_all(int fd, const void* data, size_t length) {
+    const char *p = (const char*)data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, p, length);
+        if (written <= 0) {
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written == 0) {
+                errno = EIO;
+            }
+            return FAILURE;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write an archive entry out as a file, checking its fingerprint
+ * @param reader Open archive
+ * @param entry Entry to extract
+ * @param dst_dirfd Directory to create the file in
+ * @param destination File to create (removed again if the check fails)
+ * @return SUCCESS on success, FAILURE on error or mismatch (errno set)
+ */
+int pack_extract(const PackReader* reader, const PackEntry* entry, int dst_dirfd, const char* destination) {
+    static __thread unsigned char out[PACK_CHUNK];
+    const unsigned char *data = (const unsigned char*)reader->map + entry->offset;
+    FingerprintState state;
+    FileFingerprint expected, extracted;
+    int dst_fd;
+    int result = SUCCESS;
+    int saved_errno = 0;
+
+    dst_fd = openat(dst_dirfd, destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst_fd == -1) {
+        return FAILURE;
+    }
+    fingerprint_init(&state, FINGERPRINT_WITH_CRC32C);
+
+    if (entry->flags & PACK_ENTRY_DELTA) {
+        char *content;
+        size_t length;
+
+        if (pack_read_entry(reader, entry, &content, &length) != SUCCESS) {
+            saved_errno = errno;
+            result = FAILURE;
+        } else {
+            fingerprint_update(&state, content, length);
+            if (pack_write_all(dst_fd, content, length) != SUCCESS) {
+                saved_errno = errno;
+                result = FAILURE;
+            }
+            free(content);
+        }
+    } else if (entry->flags & PACK_ENTRY_COMPRESSED) {
+        z_stream zs;
+        int status;
+
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, PACK_GZIP_WINDOW) != Z_OK) {
+            close(dst_fd);
+            unlinkat(dst_dirfd, destination, 0);
+            errno = ENOMEM;
+            return FAILURE;
+        }
+        zs.next_in = (unsigned char*)data;
+        zs.avail_in = (uInt)entry->stored_length;
+        do {
+            size_t produced;
+
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            status = inflate(&zs, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END) {
+                saved_errno = EIO;
+                result = FAILURE;
+                break;
+            }
+            produced = sizeof(out) - zs.avail_out;
+            fingerprint_update(&state, out, produced);
+            if (pack_write_all(dst_fd, out, produced) != SUCCESS) {
+                saved_errno = errno;
+                result = FAILURE;
+                break;
+            }
+        } while (status != Z_STREAM_END);
+        inflateEnd(&zs);
+    } else {
+        fingerprint_update(&state, data, entry->stored_length);
+        if (pack_write_all(dst_fd, data, entry->stored_length) != SUCCESS) {
+            saved_errno = errno;
+            result = FAILURE;
+        }
+    }
+    fingerprint_final(&state, &extracted);
+
+    if (close(dst_fd) != 0 && result == SUCCESS) {
+        saved_errno = errno;
+        result = FAILURE;
+    }
+
+    pack_entry_fingerprint(entry, &expected);
+    if (result == SUCCESS && !fingerprint_equal(&extracted, &expected)) {
+        log_error("Archived copy of %s does not match its checksum", pack_entry_name(reader, entry));
+        saved_errno = EIO;
+        result = FAILURE;
+    }
+    if (result != SUCCESS) {
+        unlinkat(dst_dirfd, destination, 0);
+    }
+
+    errno = saved_errno;
+    return result;
+}
@@ -26,6 +26,8 @@
  #include <pwd.h>
  #include <grp.h>
  #include <limits.h>
+ #include <pthread.h>
+ #include <stdint.h>
  
  /* Department definitions */
  #define DEPT_WAREHOUSE    "Warehouse"
@@ -38,16 +40,19 @@
  #define REPORT_PREFIX     "report_"
  
  /* Path definitions - these would normally be in a config file */
- #define UPLOAD_DIR      "/var/report_system/upload"
- #define DASHBOARD_DIR   "/var/report_system/dashboard"
- #define BACKUP_DIR      "/var/report_system/backup"
- #define LOG_DIR         "/var/report_system/logs"
+ #ifndef REPORT_ROOT
+ #define REPORT_ROOT     "/var/report_system"   /* The benchmark builds with a scratch root */
+ #endif
+ #define UPLOAD_DIR      REPORT_ROOT "/upload"
+ #define DASHBOARD_DIR   REPORT_ROOT "/dashboard"
+ #define BACKUP_DIR      REPORT_ROOT "/backup"
+ #define LOG_DIR         REPORT_ROOT "/logs"
  #define PID_FILE        "/var/run/report_daemon.pid"
  #define LOCK_FILE       "/var/run/report_daemon.lock"
- #define CHANGE_LOG      "/var/report_system/logs/changes.log"
- #define ERROR_LOG       "/var/report_system/logs/error.log"
- #define OPERATION_LOG   "/var/report_system/logs/operations.log"
- #define FIFO_PATH       "/var/report_system/ipc_pipe"
+ #define CHANGE_LOG      LOG_DIR "/changes.log"
+ #define ERROR_LOG       LOG_DIR "/error.log"
+ #define OPERATION_LOG   LOG_DIR "/operations.log"
+ #define FIFO_PATH       REPORT_ROOT "/ipc_pipe"
  
  /* Time settings */
  #define TRANSFER_HOUR   1    /* 1:00 AM */
@@ -55,6 +60,329 @@
  #define UPLOAD_DEADLINE_HOUR 23   /* 11:30 PM */
  #define UPLOAD_DEADLINE_MINUTE 30
  
+ /* Transfer pipeline settings */
+ #define TRANSFER_VALIDATE_WORKERS 4     /* Threads validating uploaded files */
+ #define TRANSFER_MOVE_WORKERS     4     /* Threads moving files to the dashboard */
+ #define TRANSFER_QUEUE_CAPACITY   256   /* Items buffered between two stages */
+ #define TRANSFER_MOVE_BATCH       64    /* Renames submitted together by a move worker */
+ #define TRANSFER_MAX_WORKERS      64
+ 
+ /* Batched file operation settings */
+ #define FILEOPS_BACKEND_SYNC    0
+ #define FILEOPS_BACKEND_URING   1
+ #ifndef FILEOPS_DEFAULT_BACKEND
+ #define FILEOPS_DEFAULT_BACKEND FILEOPS_BACKEND_URING
+ #endif
+ #define FILEOPS_BATCH_SIZE      256            /* Operations per submitted batch */
+ #define FILEOPS_COPY_INLINE_MAX (256 * 1024)   /* Largest copy done as one linked chain */
+ #define FILEOPS_COPY_VERIFY     0x1            /* Copy flag: hash in flight, verify destination */
+ #define COPY_VERIFY_RETRIES     2              /* Extra attempts after a failed verified copy */
+ 
+ /* Backup settings */
+ #define BACKUP_MANIFEST_NAME    "MANIFEST"     /* Per-backup list of files and fingerprints */
+ #define BACKUP_NAME_PREFIX      "backup_"      /* Followed by YYYY-MM-DD_HH-MM-SS */
+ #define BACKUP_NAME_FORMAT      "%Y-%m-%d_%H-%M-%S"
+ 
+ /* Merkle tree stored in each manifest: files bucketed by name hash into
+    MERKLE_FANOUT^MERKLE_DEPTH leaves, nodes numbered level by level */
+ #define MERKLE_FANOUT           16
+ #define MERKLE_DEPTH            3
+ #define MERKLE_LEAF_BASE        (1 + 16 + 256)     /* Index of the first leaf */
+ #define MERKLE_NODES            (MERKLE_LEAF_BASE + 4096)
+ #define MERKLE_ADDED            1                  /* Change passed to a MerkleDiffFn */
+ #define MERKLE_REMOVED          2
+ #define MERKLE_CHANGED          3
+ 
+ /* Backup compression: each file stored as one gzip member, <name>.gz */
+ #define BACKUP_COMPRESSION_NONE 0
+ #define BACKUP_COMPRESSION_ZLIB 1
+ #ifndef BACKUP_COMPRESSION
+ #define BACKUP_COMPRESSION      BACKUP_COMPRESSION_NONE
+ #endif
+ #ifndef BACKUP_COMPRESSION_LEVEL
+ #define BACKUP_COMPRESSION_LEVEL 6             /* zlib level, 1 (fast) to 9 (small) */
+ #endif
+ #define BACKUP_COMPRESS_WORKERS 4              /* Threads compressing a batch */
+ #define BACKUP_MAX_WORKERS      64
+ #define BACKUP_COMPRESSED_SUFFIX ".gz"
+ 
+ /* Backup layout: a directory of files, or one archive file <name>.pack, or a
+    checkpoint directory linking versions from the continuous log, or an
+    archive split into Reed-Solomon shards across several backup roots */
+ #define BACKUP_FORMAT_DIRECTORY 0
+ #define BACKUP_FORMAT_ARCHIVE   1
+ #define BACKUP_FORMAT_CONTINUOUS 2
+ #define BACKUP_FORMAT_ERASURE   3
+ #ifndef BACKUP_FORMAT
+ #define BACKUP_FORMAT           BACKUP_FORMAT_DIRECTORY
+ #endif
+ #define BACKUP_ARCHIVE_SUFFIX   ".pack"
+ #define PACK_ENTRY_COMPRESSED   0x1            /* Entry stored as a gzip member */
+ #define PACK_ENTRY_HAS_CRC      0x2            /* crc32c is set */
+ #define PACK_ENTRY_DELTA        0x4            /* Entry stored as a delta against another */
+ 
+ /* Delta storage (archives only): each report stored against its department's
+    previous report, with a full keyframe every BACKUP_DELTA_KEYFRAME reports */
+ #ifndef BACKUP_DELTA
+ #define BACKUP_DELTA            0              /* 1 to enable */
+ #endif
+ #ifndef BACKUP_DELTA_KEYFRAME
+ #define BACKUP_DELTA_KEYFRAME   8
+ #endif
+ #define PACK_DELTA_MAX_SIZE     (16 * 1024 * 1024) /* Larger files are always stored in full */
+ #if BACKUP_DELTA && BACKUP_FORMAT != BACKUP_FORMAT_ARCHIVE && BACKUP_FORMAT != BACKUP_FORMAT_ERASURE
+ #error "BACKUP_DELTA needs BACKUP_FORMAT_ARCHIVE or BACKUP_FORMAT_ERASURE"
+ #endif
+ 
+ /* Erasure-coded archives (BACKUP_FORMAT_ERASURE): ERASURE_DATA_SHARDS data
+    shards plus ERASURE_PARITY_SHARDS parity shards, all named like the
+    archive; shard 0 in BACKUP_DIR, shard i in the i-th of ERASURE_ROOTS */
+ #ifndef ERASURE_DATA_SHARDS
+ #define ERASURE_DATA_SHARDS     3
+ #endif
+ #ifndef ERASURE_PARITY_SHARDS
+ #define ERASURE_PARITY_SHARDS   1                  /* Roots that may be lost */
+ #endif
+ #ifndef ERASURE_ROOTS
+ #define ERASURE_ROOTS           REPORT_ROOT "/backup.1:" REPORT_ROOT "/backup.2:" \
+                                 REPORT_ROOT "/backup.3"   /* Colon separated */
+ #endif
+ #define ERASURE_MAX_SHARDS      32
+ #define ERASURE_CHUNK_SIZE      (64 * 1024)        /* Bytes per shard per stripe */
+ #define ERASURE_TEMP_PREFIX     ".shard."          /* Shard being written */
+ #if ERASURE_DATA_SHARDS < 1 || ERASURE_PARITY_SHARDS < 0 || \
+     ERASURE_DATA_SHARDS + ERASURE_PARITY_SHARDS > ERASURE_MAX_SHARDS
+ #error "ERASURE_DATA_SHARDS + ERASURE_PARITY_SHARDS must be between 1 and ERASURE_MAX_SHARDS"
+ #endif
+ 
+ /* Continuous data protection (BACKUP_FORMAT_CONTINUOUS), kept in BACKUP_DIR */
+ #define CDP_DIR_NAME            "continuous"
+ #define CDP_JOURNAL_NAME        "journal"          /* One line per captured version */
+ #define CDP_OBJECTS_NAME        "objects"          /* Version files, named by sequence */
+ #ifndef CDP_KEEP_DAYS
+ #define CDP_KEEP_DAYS           7                  /* Versions no checkpoint links to */
+ #endif
+ 
+ /* Backup catalog settings (files live in BACKUP_DIR) */
+ #define CATALOG_BACKUPS_FILE    "catalog.backups"  /* Time-sorted backup table */
+ #define CATALOG_RECORDS_FILE    "catalog.records"  /* Append-only (name, hash) -> backups */
+ #define CATALOG_NAMES_FILE      "catalog.names"    /* Interned file names */
+ #define CATALOG_INDEX_FILE      "catalog.index"    /* Hash index over the records */
+ #define CATALOG_INDEX_MIN_SLOTS (1 << 16)
+ #ifndef CATALOG_MAP_RESERVE
+ #define CATALOG_MAP_RESERVE     (1ULL << 36)       /* Address space mapped per growing file (at most) */
+ #endif
+ #define CATALOG_BACKUP_PRUNED   0x1                /* CatalogBackup flag: removed by retention */
+ 
+ /* Retention: keep the newest backup of each of the last N days, weeks and months */
+ #ifndef RETENTION_DAILY
+ #define RETENTION_DAILY         7
+ #endif
+ #ifndef RETENTION_WEEKLY
+ #define RETENTION_WEEKLY        4
+ #endif
+ #ifndef RETENTION_MONTHLY
+ #define RETENTION_MONTHLY       12
+ #endif
+ #define RETENTION_PRUNE_PREFIX  ".prune."          /* Expired backup being deleted */
+ #define RETENTION_BATCH         256                /* Unlinks between checks for a transfer */
+ 
+ /* Backup scrub settings (state files live in BACKUP_DIR) */
+ #ifndef SCRUB_INTERVAL
+ #define SCRUB_INTERVAL          (7 * 24 * 60 * 60) /* Seconds from one full pass to the next */
+ #endif
+ #ifndef SCRUB_RATE_LIMIT
+ #define SCRUB_RATE_LIMIT        (32 * 1024 * 1024) /* Bytes read per second, 0 for no limit */
+ #endif
+ #define SCRUB_WORKERS           4
+ #define SCRUB_BATCH             64                 /* Files handed to a worker at a time */
+ #define SCRUB_READ_SIZE         (256 * 1024)       /* Bytes per read, and per yield check */
+ #define SCRUB_STATE_FILE        ".scrub.state"     /* Pass position, for resuming */
+ #define SCRUB_HOLD_FILE         ".scrub.hold"      /* Held shared by restores */
+ 
+ /* Scrub outcomes for a file */
+ #define SCRUB_OK           0    /* Content matches the manifest */
+ #define SCRUB_DAMAGED      1    /* Content differs, or fails to decode */
+ #define SCRUB_UNREADABLE   2    /* Missing or cannot be read */
+ #define SCRUB_SKIPPED      3    /* Already checked via another link, or pruned */
+ #define SCRUB_STOPPED      4    /* The scrubber is being stopped */
+ 
+ /* Restore settings */
+ #define RESTORE_DEFAULT_WORKERS 4
+ #define RESTORE_MAX_WORKERS     64
+ 
+ /* Restore actions for a file */
+ #define RESTORE_UNCHANGED  0    /* Live file matches the backup */
+ #define RESTORE_MISSING    1    /* In the backup only: copied back */
+ #define RESTORE_DIFFERENT  2    /* Live content differs: replaced */
+ #define RESTORE_EXTRA      3    /* Not in the backup: removed */
+ 
+ /* Change log formats: the text CHANGE_LOG, the binary log in CHANGELOG_DIR, or both */
+ #define CHANGE_LOG_TEXT       0x1
+ #define CHANGE_LOG_BINARY     0x2
+ #ifndef CHANGE_LOG_FORMAT
+ #define CHANGE_LOG_FORMAT     (CHANGE_LOG_TEXT | CHANGE_LOG_BINARY)
+ #endif
+ #ifndef CHANGELOG_DIR
+ #define CHANGELOG_DIR         LOG_DIR "/changes"
+ #endif
+ #define CHANGELOG_NAMES_FILE  "names"          /* Interned file names, NUL terminated */
+ #define CHANGELOG_SEGMENT_SUFFIX ".seg"
+ #ifndef CHANGELOG_SEGMENT_RECORDS
+ #define CHANGELOG_SEGMENT_RECORDS (1 << 20)    /* Records before a segment is sealed */
+ #endif
+ #ifndef CHANGELOG_INDEX_STRIDE
+ #define CHANGELOG_INDEX_STRIDE 256             /* Records per sparse time index entry */
+ #endif
+ #define CHANGELOG_BUFFER_RECORDS 1024          /* Records held before a write */
+ #define CHANGELOG_NO_UID      0xFFFFFFFFU      /* Owner name that is not a local user */
+ 
+ /* Change log action codes */
+ #define CHANGE_ACTION_OTHER    0
+ #define CHANGE_ACTION_CREATE   1
+ #define CHANGE_ACTION_MODIFY   2
+ #define CHANGE_ACTION_DELETE   3
+ #define CHANGE_ACTION_RENAME   4
+ #define CHANGE_ACTION_REPLACE  5
+ #define CHANGE_ACTION_TRANSFER 6
+ #define CHANGE_ACTION_COUNT    7
+ 
+ /* Log sinks, each kept open with O_APPEND (see log_batch_begin) */
+ #define LOG_SINK_ERROR        0
+ #define LOG_SINK_OPERATION    1
+ #define LOG_SINK_CHANGE       2
+ #define LOG_SINK_COUNT        3
+ #define LOG_LINE_LENGTH       4096            /* Longer lines are cut short */
+ #define LOG_BATCH_SIZE        (64 * 1024)     /* Buffered bytes before a batch is written */
+ 
+ /* Log levels; levels below LOG_MIN_LEVEL are compiled out */
+ #define LOG_LEVEL_TRACE       0
+ #define LOG_LEVEL_DEBUG       1
+ #define LOG_LEVEL_INFO        2
+ #define LOG_LEVEL_WARN        3
+ #define LOG_LEVEL_ERROR       4
+ #define LOG_LEVEL_COUNT       5
+ #ifndef LOG_MIN_LEVEL
+ #define LOG_MIN_LEVEL         LOG_LEVEL_DEBUG
+ #endif
+ #define LOG_DEFAULT_LEVEL     LOG_LEVEL_INFO  /* Runtime level when LOG_CONFIG_FILE does not set one */
+ #define LOG_CONFIG_FILE       REPORT_ROOT "/logging.conf"
+ 
+ /* Modules with their own runtime level; a source file sets LOG_MODULE before including this header */
+ #define LOG_MODULE_DAEMON     0
+ #define LOG_MODULE_FILES      1
+ #define LOG_MODULE_BACKUP     2
+ #define LOG_MODULE_RESTORE    3
+ #define LOG_MODULE_RETENTION  4
+ #define LOG_MODULE_SCRUB      5
+ #define LOG_MODULE_COUNT      6
+ #ifndef LOG_MODULE
+ #define LOG_MODULE            LOG_MODULE_DAEMON
+ #endif
+ 
+ /* Sinks copied to syslog, as a mask of 1 << LOG_SINK_* */
+ #ifndef LOG_SYSLOG_SINKS
+ #define LOG_SYSLOG_SINKS      ((1 << LOG_SINK_ERROR) | (1 << LOG_SINK_OPERATION))
+ #endif
+ 
+ /* Error log rate limits, per log_error() call site */
+ #ifndef LOG_LIMIT_BURST
+ #define LOG_LIMIT_BURST       10              /* Messages written before limiting starts */
+ #endif
+ #ifndef LOG_LIMIT_PER_MINUTE
+ #define LOG_LIMIT_PER_MINUTE  6               /* Messages written per minute after that */
+ #endif
+ #define LOG_LIMIT_SUMMARY     60              /* Seconds between "Suppressed" summary lines */
+ #define LOG_LIMIT_SITES       512             /* Call sites tracked (power of two) */
+ 
+ /* Status file, rewritten every STATUS_INTERVAL seconds (see status_write) */
+ #define STATUS_FILE           "/var/run/report_daemon.status"
+ #define STATUS_INTERVAL       10
+ 
+ /* Operation counters, kept per thread (see metrics.c) */
+ #define METRIC_FILES_SCANNED  0               /* Entries kept by scan_directory */
+ #define METRIC_STAT_CALLS     1
+ #define METRIC_BYTES_COPIED   2
+ #define METRIC_RENAMES        3               /* Moves done by renaming */
+ #define METRIC_COPY_FALLBACKS 4               /* Moves that had to copy and delete */
+ #define METRIC_OWNER_LOOKUPS  5               /* getpwuid_r calls */
+ #define METRIC_BACKUP_BYTES   6               /* Report bytes put in backups */
+ #define METRIC_BACKUPS        7               /* Backups written */
+ #define METRIC_MISSING_REPORTS 8              /* Departments found missing, per check */
+ #define METRIC_LOG_SUPPRESSED 9               /* Error messages held back by rate limiting */
+ #define METRIC_LOG_DROPS      10              /* Log lines that could not be written to their file */
+ #define METRIC_COUNT          11
+ 
+ /* Gauges: the latest value, set by whoever knows it */
+ #define GAUGE_VALIDATE_QUEUE  0               /* Transfer pipeline queue depths */
+ #define GAUGE_MOVE_QUEUE      1
+ #define GAUGE_RECORD_QUEUE    2
+ #define GAUGE_MISSING_DEPARTMENTS 3           /* Found by the last check */
+ #define GAUGE_LAST_BACKUP_BYTES 4
+ #define GAUGE_COUNT           5
+ 
+ /* Latency histograms of whole operations, in nanoseconds */
+ #define LATENCY_SCAN          0
+ #define LATENCY_MONITOR       1
+ #define LATENCY_TRANSFER      2
+ #define LATENCY_MOVE_FILE     3
+ #define LATENCY_COPY_FILE     4
+ #define LATENCY_BACKUP        5
+ #define LATENCY_LOCK_HOLD     6               /* lock_directories to unlock_directories */
+ #define LATENCY_COUNT         7
+ #define LATENCY_SUB_BITS      3               /* Buckets per power of two: 1 << LATENCY_SUB_BITS */
+ #define LATENCY_MAX_BITS      44              /* Longer than 2^44 ns (~4.9 h) lands in the last bucket */
+ #define LATENCY_BUCKETS       ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+ 
+ /* Metrics snapshot with every latency bucket, rewritten every METRICS_INTERVAL seconds */
+ #define METRICS_FILE          "/var/run/report_daemon.metrics"
+ #define METRICS_INTERVAL      60
+ 
+ /* Prometheus text format, rewritten with the status file for the node exporter's
+  * textfile collector; nothing is written while PROMETHEUS_DIR does not exist */
+ #ifndef PROMETHEUS_DIR
+ #define PROMETHEUS_DIR        "/var/lib/node_exporter/textfile_collector"
+ #endif
+ #define PROMETHEUS_FILE       PROMETHEUS_DIR "/report_daemon.prom"
+ #define PROMETHEUS_PREFIX     "report_daemon_"
+ #define PROMETHEUS_BUCKET_STEP 2              /* Exported bucket bounds are 2^(n * STEP) ns */
+ #define PROMETHEUS_MIN_BITS   10              /* Smallest exported bound, about 1 us */
+ 
+ /* Log rotation: a log is renamed to <name>.<LOG_ROTATE_STAMP> and gzipped (see log_rotation_start) */
+ #ifndef LOG_ROTATE_SIZE
+ #define LOG_ROTATE_SIZE       (16 * 1024 * 1024) /* Rotate at this size, 0 for no size limit */
+ #endif
+ #ifndef LOG_ROTATE_AGE
+ #define LOG_ROTATE_AGE        (24 * 60 * 60)  /* Rotate once the first line is this old, 0 for never */
+ #endif
+ #ifndef LOG_ROTATE_KEEP
+ #define LOG_ROTATE_KEEP       14              /* Rotated files kept per log */
+ #endif
+ #define LOG_ROTATE_LEVEL      6               /* zlib level for rotated logs */
+ #define LOG_ROTATE_STAMP      "%Y%m%d-%H%M%S"
+ 
+ /* Report directory handles (see report_dir_fd) */
+ #define REPORT_DIR_UPLOAD     0
+ #define REPORT_DIR_DASHBOARD  1
+ #define REPORT_DIR_BACKUP     2
+ #define REPORT_DIR_LOGS       3
+ #define REPORT_DIR_COUNT      4
+ #define DIR_ENUM_BUFFER_SIZE  (128 * 1024)   /* getdents64 buffer per enumeration */
+ 
+ /* Batched file operation types */
+ #define FILE_OP_STATX   1
+ #define FILE_OP_RENAME  2
+ #define FILE_OP_COPY    3
+ #define FILE_OP_UNLINK  4
+ 
+ /* Content fingerprint settings */
+ #ifndef FINGERPRINT_WITH_CRC32C
+ #define FINGERPRINT_WITH_CRC32C TRUE       /* Also compute CRC32C alongside the hash */
+ #endif
+ #define FINGERPRINT_BLOCK_SIZE  1024       /* Bytes hashed between lane scrambles */
+ #define FINGERPRINT_CACHE_SLOTS (1 << 16)  /* Identity-keyed cache entries (power of 2) */
+ #define FINGERPRINT_TEXT_LENGTH 17         /* Hex digest plus terminator */
+ 
  /* Permission settings */
  #define UPLOAD_PERMISSIONS    0777
  #define DASHBOARD_PERMISSIONS 0755
@@ -81,6 +409,43 @@
  #define MSG_TRANSFER_COMPLETE 4
  #define MSG_ERROR            5
  
+ /**
+  * @struct FileIdentity
+  * @brief Inode identity and version of a file, as captured by one statx
+  */
+ typedef struct {
+     uint64_t dev;                     /* Device holding the inode */
+     uint64_t ino;                     /* Inode number */
+     uint64_t size;                    /* File size in bytes */
+     int64_t mtime_ns;                 /* Modification time in nanoseconds */
+     int64_t ctime_ns;                 /* Status change time in nanoseconds */
+ } FileIdentity;
+ 
+ /**
+  * @struct FileFingerprint
+  * @brief Content fingerprint of a file version
+  */
+ typedef struct {
+     uint64_t hash;                    /* 64-bit content hash */
+     uint64_t size;                    /* Number of bytes hashed */
+     uint32_t crc32c;                  /* CRC32C, if has_crc */
+     int has_crc;                      /* TRUE when crc32c was computed */
+     int valid;                        /* FALSE until computed */
+ } FileFingerprint;
+ 
+ /**
+  * @struct FingerprintState
+  * @brief Streaming fingerprint computation
+  */
+ typedef struct {
+     uint64_t acc[8] __attribute__((aligned(32)));   /* Hash lanes */
+     unsigned char buffer[FINGERPRINT_BLOCK_SIZE];   /* Partial block */
+     size_t buffered;                  /* Bytes held in buffer */
+     uint64_t total_length;            /* Bytes consumed so far */
+     uint32_t crc;                     /* Running CRC32C */
+     int with_crc;                     /* TRUE to maintain crc */
+ } FingerprintState;
+ 
  /**
   * @struct ReportFile
   * @brief Structure to hold information about a report file
@@ -92,6 +457,8 @@
      time_t timestamp;                 /* Last modification time */
      char owner[MAX_USER_LENGTH];      /* Owner of the file */
      int size;                         /* File size in bytes */
+     FileIdentity identity;            /* Inode identity for change detection */
+     FileFingerprint fingerprint;      /* Content fingerprint, reused while identity holds */
  } ReportFile;
  
  /**
@@ -101,10 +468,346 @@
  typedef struct {
      char username[MAX_USER_LENGTH]; /* User who made the change */
      char filename[MAX_PATH_LENGTH]; /* File that was changed */
-     char action[MAX_USER_LENGTH];   /* Action performed (create, modify, delete) */
+     char action[MAX_USER_LENGTH];   /* Action performed (create, modify, delete, rename, replace) */
      time_t timestamp;               /* When the change occurred */
  } ChangeRecord;
  
+ /**
+  * @struct ChangeLogRecord
+  * @brief One change in a binary change log segment
+  */
+ typedef struct {
+     uint32_t timestamp;               /* Seconds since the epoch */
+     uint32_t uid;                     /* Owner, or CHANGELOG_NO_UID */
+     uint32_t name_id;                 /* Offset of the file name in the names file */
+     uint32_t action;                  /* CHANGE_ACTION_* */
+ } ChangeLogRecord;
+ 
+ /**
+  * @struct ChangeLogUser
+  * @brief Posting list of one user in a sealed segment
+  */
+ typedef struct {
+     uint32_t uid;
+     uint32_t count;                   /* Records by this user */
+     uint32_t first;                   /* Their first entry in the postings */
+ } ChangeLogUser;
+ 
+ /**
+  * @struct ChangeLogSegment
+  * @brief Change log segment mapped for queries
+  */
+ typedef struct {
+     int fd;
+     const char *map;
+     size_t size;
+     const ChangeLogRecord *records;   /* In time order */
+     uint32_t count;
+     int sealed;                       /* FALSE while the segment is being written */
+     const uint32_t *time_index;       /* Time of every CHANGELOG_INDEX_STRIDE-th record */
+     uint32_t time_index_count;
+     const ChangeLogUser *users;       /* Sorted by uid */
+     uint32_t user_count;
+     const uint32_t *postings;         /* Record numbers, grouped by user, ascending */
+ } ChangeLogSegment;
+ 
+ /**
+  * @struct ChangeLogNames
+  * @brief Interned file names mapped for queries
+  */
+ typedef struct {
+     int fd;
+     const char *map;
+     size_t size;
+ } ChangeLogNames;
+ 
+ /**
+  * @struct WorkQueue
+  * @brief Bounded blocking queue connecting two pipeline stages
+  */
+ typedef struct {
+     void **items;              /* Ring buffer of queued items */
+     int capacity;              /* Maximum number of queued items */
+     int head;                  /* Index of the oldest item */
+     int count;                 /* Number of queued items */
+     int closed;                /* TRUE once producers are finished */
+     int gauge;                 /* GAUGE_* kept at count, -1 for none */
+     pthread_mutex_t lock;
+     pthread_cond_t not_empty;
+     pthread_cond_t not_full;
+ } WorkQueue;
+ 
+ /**
+  * @struct TransferConfig
+  * @brief Tuning for the upload to dashboard transfer pipeline
+  */
+ typedef struct {
+     int validate_workers;      /* Workers in the validation stage */
+     int move_workers;          /* Workers in the move stage */
+     int queue_capacity;        /* Capacity of each inter-stage queue */
+ } TransferConfig;
+ 
+ /**
+  * @struct BackupConfig
+  * @brief How backup_dashboard_with_config stores the files
+  */
+ typedef struct {
+     int format;                /* BACKUP_FORMAT_* */
+     int compression;           /* BACKUP_COMPRESSION_* */
+     int level;                 /* Compression level */
+     int workers;               /* Threads compressing each batch */
+     int keyframe_interval;     /* Archives: full copy every N reports per department, 0 for no deltas */
+ } BackupConfig;
+ 
+ /**
+  * @struct FileOp
+  * @brief One entry of a batch handed to fileops_submit()
+  */
+ typedef struct {
+     int type;                  /* FILE_OP_* */
+     int flags;                 /* AT_* (statx, unlink), RENAME_* or FILEOPS_COPY_* flags */
+     int src_dirfd;             /* Directory of src_name, or AT_FDCWD */
+     const char *src_name;      /* Source (or only) file */
+     int dst_dirfd;             /* Directory of dst_name, or AT_FDCWD */
+     const char *dst_name;      /* Destination for rename and copy */
+     off_t size;                /* Copy: source size if known, -1 otherwise */
+     struct statx stx;          /* Statx: the result */
+     FileFingerprint fingerprint; /* Verified copy: fingerprint of the copied data */
+     int result;                /* 0 on success, negative errno on failure */
+ } FileOp;
+ 
+ /**
+  * @struct ManifestEntry
+  * @brief One file recorded in a backup manifest
+  */
+ typedef struct {
+     char filename[NAME_MAX + 1];      /* Name within the backup directory */
+     FileFingerprint fingerprint;      /* Content fingerprint (size included) */
+ } ManifestEntry;
+ 
+ /**
+  * @struct MerkleTree
+  * @brief Hash tree over a manifest's (name, fingerprint) entries
+  */
+ typedef struct {
+     uint64_t nodes[MERKLE_NODES];     /* Root first; 0 marks an empty subtree */
+ } MerkleTree;
+ 
+ typedef void (*MerkleDiffFn)(const char* filename, int change, void* context);
+ 
+ /**
+  * @struct PackEntry
+  * @brief Index entry of a backup archive
+  */
+ typedef struct {
+     uint64_t offset;                  /* Start of the stored data in the archive */
+     uint64_t stored_length;           /* Bytes stored (compressed size if compressed) */
+     uint64_t size;                    /* Size of the plain content */
+     uint64_t hash;                    /* Fingerprint of the plain content */
+     uint32_t crc32c;
+     uint32_t flags;                   /* PACK_ENTRY_* */
+     uint32_t name_offset;             /* NUL-terminated name in the name table */
+     uint32_t name_length;
+ } PackEntry;
+ 
+ /**
+  * @struct PackWriter
+  * @brief Backup archive being written
+  */
+ typedef struct {
+     int dirfd;                        /* Directory of the archive */
+     int fd;                           /* Temporary file being appended to */
+     char name[NAME_MAX + 1];          /* Final archive name */
+     char temp[NAME_MAX + 1];          /* Name while being written */
+     int level;                        /* zlib level, 0 to store raw */
+     uint64_t offset;                  /* End of the data written so far */
+     PackEntry *entries;
+     int count, capacity;
+     char *names;                      /* Name table */
+     size_t names_length, names_capacity;
+     int keyframe_interval;            /* 0 stores every file in full */
+     char *base;                       /* Previous report, the next delta's base */
+     size_t base_size;
+     uint32_t base_name;               /* Its name table offset */
+     int chain;                        /* Deltas since the last keyframe */
+     char base_department[MAX_USER_LENGTH];
+ } PackWriter;
+ 
+ /**
+  * @struct PackReader
+  * @brief Backup archive mapped for reading
+  */
+ typedef struct {
+     int fd;
+     const char *map;                  /* Whole archive */
+     size_t size;
+     const PackEntry *entries;         /* Index, sorted by name */
+     uint32_t count;
+     const char *names;
+     uint32_t names_length;
+ } PackReader;
+ 
+ /**
+  * @struct CatalogBackup
+  * @brief Entry of the catalog's backup table, in creation order
+  */
+ typedef struct {
+     uint32_t id;                      /* 1-based, increasing with time */
+     uint32_t file_count;              /* Files in the backup */
+     int64_t created;                  /* Creation time (from the backup name) */
+     uint64_t record_count;            /* Catalog records once this backup was added */
+     uint64_t names_length;            /* Name table bytes once this backup was added */
+     char name[28];                    /* backup_YYYY-MM-DD_HH-MM-SS */
+     uint32_t flags;                   /* CATALOG_BACKUP_* */
+ } CatalogBackup;
+ 
+ /**
+  * @struct CatalogRecord
+  * @brief A file version held by a contiguous range of backups
+  */
+ typedef struct {
+     uint64_t name_hash;               /* Hash of the file name */
+     uint64_t content_hash;            /* Content fingerprint hash */
+     uint64_t size;                    /* File size */
+     uint64_t name_offset;             /* NUL-terminated name in the name table */
+     uint32_t first_backup;            /* Backups first_backup..last_backup hold it */
+     uint32_t last_backup;
+     uint32_t prev_version;            /* Older record of the same version, 0 if none */
+     uint32_t prev_name;               /* Older record of the same name, 0 if none */
+     uint32_t name_length;             /* Name length without the NUL */
+     uint32_t crc32c;                  /* CRC32C of the content, 0 if unknown */
+ } CatalogRecord;
+ 
+ /**
+  * @struct BackupCatalog
+  * @brief Open backup catalog (memory-mapped)
+  */
+ typedef struct {
+     int dirfd;                        /* Directory holding the catalog */
+     int writable;                     /* TRUE when opened for adding backups */
+     int backups_fd, records_fd, names_fd, index_fd;
+     CatalogBackup *backups;           /* Backup table, backup_count entries */
+     uint32_t backup_count;
+     CatalogRecord *records;           /* Record table, record_count committed entries */
+     uint64_t record_count;
+     uint64_t records_available;       /* Entries present in the file when mapped */
+     char *names;                      /* Name table */
+     uint64_t names_length;
+     void *index;                      /* Hash index (header plus slots) */
+     size_t index_size;
+     uint64_t map_reserve;             /* Bytes mapped per growing file */
+ } BackupCatalog;
+ 
+ /**
+  * @struct FileOps
+  * @brief Context executing FileOp batches on the selected backend
+  */
+ typedef struct {
+     int backend;               /* FILEOPS_BACKEND_* actually in use */
+     void *uring;               /* io_uring backend state, if any */
+ } FileOps;
+ 
+ /**
+  * @struct DirEnumerator
+  * @brief Buffered getdents64 walk over an open directory
+  */
+ typedef struct {
+     int dirfd;                 /* Private descriptor of the directory (owned) */
+     char *buffer;              /* Raw linux_dirent64 records */
+     long pos;                  /* Offset of the next record in buffer */
+     long length;               /* Valid bytes in buffer */
+     int finished;              /* TRUE once the kernel returned no more */
+ } DirEnumerator;
+ 
+ /**
+  * @struct DirEntry
+  * @brief One entry produced by dir_enum_next()
+  */
+ typedef struct {
+     const char *name;          /* Valid until the next dir_enum_next() call */
+     unsigned char type;        /* DT_* type, DT_UNKNOWN if not provided */
+     ino_t inode;               /* Inode number from the directory entry */
+ } DirEntry;
+ 
+ /**
+  * @struct RestoreOptions
+  * @brief What to restore and how
+  */
+ typedef struct {
+     const char *backup;               /* Backup id or directory name, NULL to use point_in_time */
+     time_t point_in_time;             /* Restore the newest backup taken at or before this */
+     const char *target_dir;           /* Directory to restore into, NULL for the dashboard */
+     int workers;                      /* Parallel restore threads */
+     int dry_run;                      /* Only report what would change */
+     int keep_extra;                   /* Leave files that are not in the backup */
+     int verify;                       /* Check restored files against the manifest */
+ } RestoreOptions;
+ 
+ /**
+  * @struct RestoreSummary
+  * @brief Outcome of a restore
+  */
+ typedef struct {
+     char backup_name[MAX_TIME_LENGTH];  /* Backup that was restored */
+     int unchanged;                    /* Files already matching the backup */
+     int restored;                     /* Files copied back or replaced */
+     int removed;                      /* Files removed as not in the backup */
+     int failed;                       /* Files that could not be restored */
+ } RestoreSummary;
+ 
+ /* Called before each chunk erasure_check reads; returns FALSE to stop */
+ typedef int (*ErasureReadFn)(uint64_t bytes);
+ 
+ /* Called for each file that differs, in name order */
+ typedef void (*RestoreReportFn)(const char* filename, int action, int result, void* context);
+ 
+ /**
+  * @struct RetentionPolicy
+  * @brief How many daily, weekly and monthly backups to keep
+  */
+ typedef struct {
+     int daily;                        /* Distinct days, newest backup of each */
+     int weekly;                       /* Distinct ISO weeks */
+     int monthly;                      /* Distinct months */
+ } RetentionPolicy;
+ 
+ /**
+  * @struct RetentionStats
+  * @brief Outcome of a pruning pass
+  */
+ typedef struct {
+     int kept;                         /* Backups kept by the policy */
+     int pruned;                       /* Backups removed */
+     uint64_t files_removed;           /* Directory entries unlinked */
+     uint64_t bytes_freed;             /* Space released (last link removed) */
+     uint64_t bytes_shared;            /* Space still held by other hard links */
+     uint64_t versions_removed;        /* Continuous log versions removed */
+ } RetentionStats;
+ 
+ /**
+  * @struct ScrubStats
+  * @brief Outcome of a scrub pass
+  */
+ typedef struct {
+     int backups;                      /* Backups fully checked */
+     uint64_t files;                   /* Files checked */
+     uint64_t bytes;                   /* Bytes read */
+     uint64_t damaged;                 /* Files whose content no longer matches */
+     uint64_t unreadable;              /* Files or manifests that could not be read */
+     uint64_t damaged_chunks;          /* Erasure-coded shard chunks missing or damaged */
+ } ScrubStats;
+ 
+ /**
+  * @struct CdpVersion
+  * @brief One version captured into the continuous log
+  */
+ typedef struct {
+     uint64_t sequence;                /* Version number, also the object name */
+     time_t captured;
+     FileFingerprint fingerprint;
+     char filename[NAME_MAX + 1];
+ } CdpVersion;
+ 
  /**
   * @struct IPCMessage
   * @brief Structure for inter-process communication
@@ -116,6 +819,61 @@
      char message[MAX_LINE_LENGTH];   /* Additional message text */
  } IPCMessage;
  
+ /**
+  * @struct MetricsSnapshot
+  * @brief Counters and latency histograms, of one thread or added up
+  */
+ typedef struct {
+     uint64_t counters[METRIC_COUNT];
+     uint64_t count[LATENCY_COUNT];
+     uint64_t sum[LATENCY_COUNT];                /* Nanoseconds */
+     uint64_t max[LATENCY_COUNT];
+     uint64_t buckets[LATENCY_COUNT][LATENCY_BUCKETS];
+     int64_t gauges[GAUGE_COUNT];                /* Filled in by metrics_snapshot only */
+ } MetricsSnapshot;
+ 
+ /* Status Functions */
+ int status_write(void);
+ int status_write_metrics(void);
+ int status_write_prometheus(void);
+ void status_remove(void);
+ 
+ /* Metrics Functions */
+ uint64_t metrics_clock(void);
+ void metrics_count(int metric, uint64_t n);
+ void metrics_latency(int latency, uint64_t started);
+ void metrics_gauge(int gauge, int64_t value);
+ void metrics_snapshot(MetricsSnapshot* snapshot);
+ uint64_t metrics_percentile(const MetricsSnapshot* snapshot, int latency, double quantile);
+ uint64_t metrics_bucket_limit(unsigned int bucket);
+ const char* metrics_counter_name(int metric);
+ const char* metrics_latency_name(int latency);
+ void metrics_write_status(FILE* out);
+ void metrics_write_buckets(FILE* out);
+ void metrics_write_prometheus(FILE* out);
+ 
+ /* USDT probes of provider "report_daemon" for perf and bpftrace. Each is a
+  * single NOP until a tracer attaches; without <sys/sdt.h>, or with
+  * REPORT_NO_PROBES defined, they compile to nothing. */
+ #if !defined(REPORT_NO_PROBES) && defined(__has_include)
+ #if __has_include(<sys/sdt.h>)
+ #include <sys/sdt.h>
+ #define REPORT_PROBES 1
+ #endif
+ #endif
+ 
+ #ifdef REPORT_PROBES
+ #define REPORT_PROBE(name)                 DTRACE_PROBE(report_daemon, name)
+ #define REPORT_PROBE1(name, a)             DTRACE_PROBE1(report_daemon, name, a)
+ #define REPORT_PROBE2(name, a, b)          DTRACE_PROBE2(report_daemon, name, a, b)
+ #define REPORT_PROBE3(name, a, b, c)       DTRACE_PROBE3(report_daemon, name, a, b, c)
+ #else
+ #define REPORT_PROBE(name)                 do { } while (0)
+ #define REPORT_PROBE1(name, a)             do { } while (0)
+ #define REPORT_PROBE2(name, a, b)          do { } while (0)
+ #define REPORT_PROBE3(name, a, b, c)       do { } while (0)
+ #endif
+ 
  /* Daemon Initialization Functions */
  int daemon_init(void);
  int create_pid_file(void);
@@ -126,22 +884,183 @@
  
  /* Core Operation Functions */
  int transfer_reports(void);
+ int transfer_reports_with_config(const TransferConfig* config);
  int backup_dashboard(void);
+ int backup_dashboard_with_config(const BackupConfig* config);
  int lock_directories(void);
  int unlock_directories(void);
  int check_missing_reports(void);
+ int restore_resolve_backup(int backup_root_fd, const RestoreOptions* options, 
+                            char* name, size_t name_size);
+ int restore_dashboard(const RestoreOptions* options, RestoreSummary* summary,
+                       RestoreReportFn report, void* context);
+ 
+ /* Backup Retention Functions */
+ void retention_default_policy(RetentionPolicy* policy);
+ int retention_select(const time_t* created, int count, const RetentionPolicy* policy, int* keep);
+ int retention_prune(int backup_root_fd, const RetentionPolicy* policy, RetentionStats* stats);
+ int retention_start(void);
+ void retention_request(void);
+ void retention_pause(void);
+ void retention_resume(void);
+ void retention_stop(void);
+ 
+ /* Backup Scrub Functions */
+ int scrub_pass(int backup_root_fd, ScrubStats* stats);
+ int scrub_start(void);
+ void scrub_pause(void);
+ void scrub_resume(void);
+ int scrub_hold(void);
+ void scrub_release(int fd);
+ void scrub_stop(void);
  
  /* File Monitoring Functions */
  int monitor_directory_changes(void);
  int log_file_change(const char* username, const char* filename, const char* action);
  int get_file_owner(const char* path, char* owner, size_t owner_size);
+ int get_owner_name(uid_t uid, char* owner, size_t owner_size);
  int scan_directory(const char* dir_path, ReportFile** files, int* count);
+ void file_identity_from_statx(const struct statx* stx, FileIdentity* identity);
+ int file_identity_same_inode(const FileIdentity* a, const FileIdentity* b);
+ int file_identity_same_version(const FileIdentity* a, const FileIdentity* b);
  
  /* Directory Management Functions */
  int create_directory_if_not_exists(const char* path);
  int set_directory_permissions(const char* path, mode_t mode);
  int is_directory_empty(const char* path);
  
+ /* Batched File Operation Functions */
+ int fileops_init(FileOps* ops, int backend);
+ void fileops_destroy(FileOps* ops);
+ const char* fileops_backend_name(const FileOps* ops);
+ int fileops_submit(FileOps* ops, FileOp* batch, int count);
+ int fileops_execute_sync(FileOp* op);
+ int uring_backend_init(void** backend);
+ void uring_backend_destroy(void* backend);
+ int uring_backend_submit(void* backend, FileOp* batch, int count);
+ 
+ /* Content Fingerprint Functions */
+ void fingerprint_init(FingerprintState* state, int with_crc);
+ void fingerprint_update(FingerprintState* state, const void* data, size_t length);
+ void fingerprint_final(FingerprintState* state, FileFingerprint* fingerprint);
+ void fingerprint_buffer(const void* data, size_t length, FileFingerprint* fingerprint);
+ int fingerprint_fd(int fd, FileFingerprint* fingerprint);
+ int fingerprint_file_at(int dirfd, const char* name, FileFingerprint* fingerprint);
+ int fingerprint_equal(const FileFingerprint* a, const FileFingerprint* b);
+ char* fingerprint_format(const FileFingerprint* fingerprint, char* buffer, size_t buffer_size);
+ int fingerprint_cache_lookup(const FileIdentity* identity, FileFingerprint* fingerprint);
+ void fingerprint_cache_store(const FileIdentity* identity, const FileFingerprint* fingerprint);
+ const char* fingerprint_implementation(void);
+ 
+ /* Compression Functions */
+ int compress_file_at(int src_dirfd, const char* source, int dst_dirfd,
+                      const char* destination, int level, FileFingerprint* fingerprint);
+ int decompress_file_at(int src_dirfd, const char* source, int dst_dirfd,
+                        const char* destination, FileFingerprint* fingerprint);
+ int compress_file_op(FileOp* op, int level);
+ int compress_batch(FileOp* batch, int count, int level, int workers);
+ 
+ /* Backup Archive Functions */
+ int pack_create(PackWriter* writer, int dirfd, const char* name, int level, int keyframe_interval);
+ int pack_add_file(PackWriter* writer, int src_dirfd, const char* filename, FileFingerprint* fingerprint);
+ int pack_finish(PackWriter* writer);
+ void pack_abort(PackWriter* writer);
+ int pack_open(PackReader* reader, int dirfd, const char* name);
+ void pack_close(PackReader* reader);
+ const PackEntry* pack_find(const PackReader* reader, const char* filename);
+ const char* pack_entry_name(const PackReader* reader, const PackEntry* entry);
+ void pack_entry_fingerprint(const PackEntry* entry, FileFingerprint* fingerprint);
+ int pack_manifest(const PackReader* reader, ManifestEntry** entries, int* count);
+ int pack_read_entry(const PackReader* reader, const PackEntry* entry, char** data, size_t* length);
+ int pack_extract(const PackReader* reader, const PackEntry* entry, int dst_dirfd, const char* destination);
+ 
+ /* Erasure Coding Functions */
+ const char* erasure_implementation(void);
+ void erasure_encode_stripe(const unsigned char* const* data, unsigned char* const* parity,
+                            int data_shards, int parity_shards, size_t length);
+ int erasure_write(int backup_root_fd, const char* name);
+ int erasure_is_shard(const void* data, size_t size);
+ int erasure_read(int backup_root_fd, const char* name, char** data, size_t* size);
+ int erasure_check(int backup_root_fd, const char* name, ErasureReadFn before_read);
+ int erasure_remove(const char* name, uint64_t* bytes_freed);
+ 
+ /* Continuous Data Protection Functions */
+ int cdp_open(void);
+ void cdp_close(void);
+ int cdp_capture(int dirfd, const char* filename);
+ int cdp_sync(void);
+ int cdp_checkpoint(int dashboard_fd, int backup_root_fd, const char* backup_name);
+ int cdp_history(int backup_root_fd, const char* filename, CdpVersion** versions, int* count);
+ int cdp_extract(int backup_root_fd, const CdpVersion* version, int dst_dirfd, const char* destination);
+ int cdp_latest_versions(uint64_t** sequences, int* count);
+ 
+ /* Binary Change Log Functions */
+ int changelog_append(time_t when, const char* username, const char* filename, const char* action);
+ int changelog_flush(void);
+ void changelog_close(void);
+ int changelog_action_code(const char* action);
+ const char* changelog_action_name(uint32_t code);
+ int changelog_segment_open(ChangeLogSegment* segment, int dirfd, const char* name);
+ void changelog_segment_close(ChangeLogSegment* segment);
+ uint32_t changelog_lower_bound(const ChangeLogSegment* segment, time_t when);
+ const uint32_t* changelog_user_postings(const ChangeLogSegment* segment, uint32_t uid, uint32_t* count);
+ int changelog_names_open(ChangeLogNames* names, int dirfd);
+ void changelog_names_close(ChangeLogNames* names);
+ const char* changelog_name(const ChangeLogNames* names, uint32_t name_id);
+ 
+ /* Backup Manifest Functions */
+ int manifest_write(int dirfd, const ManifestEntry* entries, int count);
+ int manifest_load(int dirfd, ManifestEntry** entries, int* count);
+ const ManifestEntry* manifest_find(const ManifestEntry* entries, int count, const char* filename);
+ int manifest_scan(int dirfd, ManifestEntry** entries, int* count);
+ 
+ /* Merkle Tree Functions */
+ int merkle_build(const ManifestEntry* entries, int count, MerkleTree* tree);
+ void merkle_write(FILE* file, const MerkleTree* tree);
+ int merkle_load(int dirfd, MerkleTree* tree);
+ int merkle_diff(const ManifestEntry* old_entries, int old_count, const MerkleTree* old_tree,
+                 const ManifestEntry* new_entries, int new_count, const MerkleTree* new_tree,
+                 MerkleDiffFn report, void* context);
+ 
+ /* Backup Catalog Functions */
+ int catalog_open(BackupCatalog* catalog, int dirfd, int writable);
+ void catalog_close(BackupCatalog* catalog);
+ int catalog_add_backup(BackupCatalog* catalog, const char* backup_name, time_t created,
+                        const ManifestEntry* entries, int count);
+ int catalog_sync(BackupCatalog* catalog);
+ const CatalogBackup* catalog_backup_by_id(const BackupCatalog* catalog, uint32_t id);
+ const CatalogBackup* catalog_backup_by_name(const BackupCatalog* catalog, const char* name);
+ const CatalogBackup* catalog_backup_at(const BackupCatalog* catalog, time_t when);
+ const CatalogRecord* catalog_record(const BackupCatalog* catalog, uint32_t number);
+ const char* catalog_record_name(const BackupCatalog* catalog, const CatalogRecord* record);
+ const CatalogRecord* catalog_lookup(const BackupCatalog* catalog, const char* filename, 
+                                     uint64_t content_hash);
+ const CatalogRecord* catalog_lookup_name(const BackupCatalog* catalog, const char* filename);
+ int catalog_backups_holding(const BackupCatalog* catalog, const char* filename, 
+                             uint64_t content_hash, uint32_t* ids, int max_ids);
+ int catalog_mark_pruned(BackupCatalog* catalog, uint32_t id);
+ int parse_backup_name(const char* name, time_t* created);
+ int backup_is_archive(const char* name);
+ int backup_load_manifest(int backup_root_fd, const char* name, ManifestEntry** entries, int* count);
+ int backup_load_tree(int backup_root_fd, const char* name, const ManifestEntry* entries, int count,
+                      MerkleTree* tree);
+ 
+ /* Directory Handle Functions */
+ int open_directory(const char* path);
+ int report_dir_fd(int which);
+ void close_report_dirs(void);
+ int dir_enum_open(DirEnumerator* iter, int dirfd);
+ int dir_enum_next(DirEnumerator* iter, DirEntry* entry);
+ void dir_enum_close(DirEnumerator* iter);
+ 
+ /* Work Queue Functions */
+ int work_queue_init(WorkQueue* queue, int capacity);
+ void work_queue_destroy(WorkQueue* queue);
+ int work_queue_push(WorkQueue* queue, void* item);
+ void* work_queue_pop(WorkQueue* queue);
+ int work_queue_pop_batch(WorkQueue* queue, void** items, int max_items);
+ void work_queue_close(WorkQueue* queue);
+ 
  /* IPC Functions */
  int setup_ipc(void);
  int cleanup_ipc(void);
@@ -149,16 +1068,49 @@
  int receive_ipc_message(IPCMessage* msg);
  
  /* Logging Functions */
- void log_error(const char* format, ...);
- void log_operation(const char* format, ...);
- void log_change(ChangeRecord* record);
+ extern unsigned char log_module_levels[LOG_MODULE_COUNT];
+ void log_message_at(int level, const char* file, int line, const char* format, ...);
+ void log_load_config(void);
+ void log_summarize_suppressed(int all);
+ void log_write_status(FILE* out);
+ 
+ /* A disabled level costs one compare at run time, or nothing below LOG_MIN_LEVEL */
+ #define log_enabled(level) \
+     ((level) >= LOG_MIN_LEVEL && \
+      (level) >= __atomic_load_n(&log_module_levels[LOG_MODULE], __ATOMIC_RELAXED))
+ #define log_at(level, ...) \
+     do { \
+         if (log_enabled(level)) { \
+             log_message_at((level), __FILE__, __LINE__, __VA_ARGS__); \
+         } \
+     } while (0)
+ #define log_error(...)     log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+ #define log_warn(...)      log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+ #define log_info(...)      log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+ #define log_debug(...)     log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+ #define log_trace(...)     log_at(LOG_LEVEL_TRACE, __VA_ARGS__)
+ #define log_operation(...) log_info(__VA_ARGS__)
+ int log_change(const ChangeRecord* record);
+ void log_batch_begin(int which);
+ void log_batch_end(int which);
+ void log_reopen(void);
+ void log_close(void);
+ int log_rotation_start(void);
+ void log_rotation_stop(void);
  
  /* Utility Functions */
  char* get_timestamp_string(time_t timestamp, char* buffer, size_t buffer_size);
+ int parse_local_time(const char* text, int end_of_day, time_t* when);
+ void lower_thread_priority(const char* purpose);
  int is_valid_xml_report(const char* filepath);
+ int is_valid_xml_report_at(int dirfd, const char* name);
  char* extract_department_from_filename(const char* filename, char* department, size_t dept_size);
  int copy_file(const char* source, const char* destination);
+ int copy_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* destination);
+ int copy_file_verified_at(int src_dirfd, const char* source, int dst_dirfd, 
+                           const char* destination, FileFingerprint* fingerprint);
  int move_file(const char* source, const char* destination);
+ int move_file_at(int src_dirfd, const char* source, int dst_dirfd, const char* destination);
  void free_report_files(ReportFile* files, int count);
  
  /* Static variables for tracking directory state - these would typically be 
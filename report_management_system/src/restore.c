@@ -0,0 +1,614 @@
+/**
+ * @file restore.c
+ * @brief Point-in-time restore of the dashboard from a backup
+ *
+ * The chosen backup's manifest is merged with a listing of the live
+ * directory, and worker threads compare each file: sizes first, then
+ * content fingerprints. Only files that are missing or differ are copied
+ * back, so restoring a mostly intact dashboard reads it but writes little.
+ * Files are restored under a temporary name and renamed into place, using
+ * a reflink when the filesystem supports one and copy_file_range otherwise.
+ * Files of compressed backups (<name>.gz) are decompressed instead, and
+ * archive backups (<name>.pack) are mapped and extracted entry by entry.
+ */
+
+#define LOG_MODULE LOG_MODULE_RESTORE
+#include "report_system.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define RESTORE_TEMP_PREFIX ".restore."
+
+/**
+ * @struct RestoreJob
+ * @brief One file name present in the backup, the live directory or both
+ */
+typedef struct {
+    char filename[NAME_MAX + 1];
+    FileFingerprint expected;  /* Content in the backup (may be computed lazily) */
+    int in_backup;             /* TRUE if the backup holds the file */
+    int live;                  /* TRUE if the target directory holds the file */
+    int action;                /* RESTORE_* */
+    int result;                /* SUCCESS or FAILURE */
+} RestoreJob;
+
+/**
+ * @struct RestoreContext
+ * @brief State shared by the restore workers
+ */
+typedef struct {
+    RestoreJob *jobs;
+    int job_count;
+    int next;                  /* Next job to claim */
+    int backup_fd;
+    int target_fd;
+    int archive;               /* TRUE if restoring from pack */
+    PackReader pack;
+    const RestoreOptions *options;
+} RestoreContext;
+
+static int is_all_digits(const char* text) {
+    if (*text == '\0') {
+        return FALSE;
+    }
+    for (; *text != '\0'; text++) {
+        if (*text < '0' || *text > '9') {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Pick a backup by listing BACKUP_DIR, for when there is no catalog
+ */
+static int resolve_without_catalog(int backup_root_fd, const RestoreOptions* options,
+                                   char* name, size_t name_size) {
+    DirEnumerator iter;
+    DirEntry entry;
+    char best[NAME_MAX + 1] = "";
+
+    if (dir_enum_open(&iter, backup_root_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        time_t created;
+
+        if (parse_backup_name(entry.name, &created) != SUCCESS) {
+            continue;
+        }
+        if (options->backup != NULL) {
+            if (strcmp(entry.name, options->backup) == 0) {
+                snprintf(best, sizeof(best), "%s", entry.name);
+                break;
+            }
+        } else if (created <= options->point_in_time && strcmp(entry.name, best) > 0) {
+            snprintf(best, sizeof(best), "%s", entry.name);
+        }
+    }
+    dir_enum_close(&iter);
+
+    if (best[0] == '\0') {
+        return FAILURE;
+    }
+    snprintf(name, name_size, "%s", best);
+    return SUCCESS;
+}
+
+/**
+ * Work out which backup a restore refers to
+ * Backup ids and times are resolved through the backup catalog; without a
+ * catalog the backup directories are listed instead (names only).
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param options Restore options (backup or point_in_time)
+ * @param name Receives the backup directory name
+ * @param name_size Size of name
+ * @return SUCCESS if a backup was found, FAILURE otherwise
+ */
+int restore_resolve_backup(int backup_root_fd, const RestoreOptions* options,
+                           char* name, size_t name_size) {
+    BackupCatalog catalog;
+    const CatalogBackup *backup = NULL;
+
+    if (catalog_open(&catalog, backup_root_fd, FALSE) != SUCCESS) {
+        if (options->backup != NULL && is_all_digits(options->backup)) {
+            log_error("Backup ids need the backup catalog, which is missing");
+            return FAILURE;
+        }
+        return resolve_without_catalog(backup_root_fd, options, name, name_size);
+    }
+
+    if (options->backup == NULL) {
+        backup = catalog_backup_at(&catalog, options->point_in_time);
+    } else if (is_all_digits(options->backup)) {
+        backup = catalog_backup_by_id(&catalog, (uint32_t)strtoul(options->backup, NULL, 10));
+    } else {
+        backup = catalog_backup_by_name(&catalog, options->backup);
+    }
+
+    if (backup != NULL && (backup->flags & CATALOG_BACKUP_PRUNED)) {
+        log_error("Backup %s was removed by the retention policy", backup->name);
+        catalog_close(&catalog);
+        return FAILURE;
+    }
+    if (backup != NULL) {
+        snprintf(name, name_size, "%s", backup->name);
+    }
+    catalog_close(&catalog);
+
+    /* An uncatalogued backup (no manifest) can still be named directly */
+    if (backup == NULL && options->backup != NULL && !is_all_digits(options->backup)) {
+        return resolve_without_catalog(backup_root_fd, options, name, name_size);
+    }
+    return (backup != NULL) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Build the name of a file's compressed copy
+ */
+static int compressed_name(const char* filename, char* name, size_t name_size) {
+    return snprintf(name, name_size, "%s" BACKUP_COMPRESSED_SUFFIX, filename) < (int)name_size;
+}
+
+/**
+ * Fingerprint a file's content in the backup, plain or compressed
+ */
+static int fingerprint_backup_file(int backup_fd, const char* filename, FileFingerprint* fingerprint) {
+    char packed[NAME_MAX + 1];
+
+    if (fingerprint_file_at(backup_fd, filename, fingerprint) == SUCCESS) {
+        return SUCCESS;
+    }
+    if (errno != ENOENT || !compressed_name(filename, packed, sizeof(packed))) {
+        return FAILURE;
+    }
+    return decompress_file_at(backup_fd, packed, -1, NULL, fingerprint);
+}
+
+/**
+ * List the files of a backup that has no manifest
+ * Their fingerprints are computed only when a live file has to be compared.
+ */
+static int list_backup_files(int backup_fd, ManifestEntry** entries, int* count) {
+    DirEnumerator iter;
+    DirEntry entry;
+    ManifestEntry *list = NULL;
+    int used = 0, capacity = 0;
+
+    *entries = NULL;
+    *count = 0;
+    if (dir_enum_open(&iter, backup_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        if (entry.type == DT_DIR || strcmp(entry.name, BACKUP_MANIFEST_NAME) == 0) {
+            continue;
+        }
+        if (used == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            ManifestEntry *grown = (ManifestEntry*)realloc(list, new_capacity * sizeof(ManifestEntry));
+            if (grown == NULL) {
+                log_error("Memory allocation failed for restore");
+                free(list);
+                dir_enum_close(&iter);
+                return FAILURE;
+            }
+            list = grown;
+            capacity = new_capacity;
+        }
+        memset(&list[used], 0, sizeof(ManifestEntry));
+        snprintf(list[used].filename, sizeof(list[used].filename), "%s", entry.name);
+        {
+            /* Compressed copies restore under their plain name */
+            size_t length = strlen(entry.name);
+            size_t suffix = strlen(BACKUP_COMPRESSED_SUFFIX);
+            if (length > suffix && strcmp(entry.name + length - suffix, BACKUP_COMPRESSED_SUFFIX) == 0) {
+                list[used].filename[length - suffix] = '\0';
+            }
+        }
+        used++;
+    }
+    dir_enum_close(&iter);
+
+    *entries = list;
+    *count = used;
+    return SUCCESS;
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const ManifestEntry*)a)->filename, ((const ManifestEntry*)b)->filename);
+}
+
+/**
+ * List the regular files currently in the target directory, sorted
+ */
+static int list_live_files(int target_fd, char*** names, int* count) {
+    DirEnumerator iter;
+    DirEntry entry;
+    char **list = NULL;
+    int used = 0, capacity = 0;
+
+    *names = NULL;
+    *count = 0;
+    if (dir_enum_open(&iter, target_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        if (entry.type == DT_DIR) {
+            continue;
+        }
+        if (used == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 256;
+            char **grown = (char**)realloc(list, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            list = grown;
+            capacity = new_capacity;
+        }
+        list[used] = strdup(entry.name);
+        if (list[used] != NULL) {
+            used++;
+        }
+    }
+    dir_enum_close(&iter);
+
+    if (used > 1) {
+        qsort(list, used, sizeof(char*), compare_strings);
+    }
+    *names = list;
+    *count = used;
+    return SUCCESS;
+}
+
+/**
+ * Decide what has to happen to one file
+ */
+static int restore_classify(RestoreContext* ctx, RestoreJob* job) {
+    struct stat st;
+    FileFingerprint live;
+
+    if (!job->in_backup) {
+        return RESTORE_EXTRA;
+    }
+    if (!job->live) {
+        return RESTORE_MISSING;
+    }
+
+    if (!job->expected.valid &&
+        fingerprint_backup_file(ctx->backup_fd, job->filename, &job->expected) != SUCCESS) {
+        /* Unreadable backup copy: the restore attempt will report it */
+        return RESTORE_DIFFERENT;
+    }
+
+    /* Sizes are free from stat; only equal sizes need the content read */
+    if (fstatat(ctx->target_fd, job->filename, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISREG(st.st_mode) || (uint64_t)st.st_size != job->expected.size) {
+        return RESTORE_DIFFERENT;
+    }
+    if (fingerprint_file_at(ctx->target_fd, job->filename, &live) != SUCCESS ||
+        !fingerprint_equal(&live, &job->expected)) {
+        return RESTORE_DIFFERENT;
+    }
+    return RESTORE_UNCHANGED;
+}
+
+/**
+ * Decompress one file from a compressed backup into a temporary name
+ */
+static int restore_compressed(RestoreContext* ctx, RestoreJob* job, const char* temp) {
+    char packed[NAME_MAX + 1];
+    FileFingerprint restored;
+
+    if (!compressed_name(job->filename, packed, sizeof(packed)) ||
+        decompress_file_at(ctx->backup_fd, packed, ctx->target_fd, temp, &restored) != SUCCESS) {
+        log_error("Failed to restore %s from its compressed copy: %s", job->filename, strerror(errno));
+        return FAILURE;
+    }
+    if (ctx->options->verify && job->expected.valid && !fingerprint_equal(&restored, &job->expected)) {
+        log_error("Restored copy of %s does not match the backup manifest", job->filename);
+        unlinkat(ctx->target_fd, temp, 0);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Extract one file from an archive backup into a temporary name
+ * pack_extract() always checks the entry's fingerprint.
+ */
+static int restore_archived(RestoreContext* ctx, RestoreJob* job, const char* temp) {
+    const PackEntry *entry = pack_find(&ctx->pack, job->filename);
+
+    if (entry == NULL) {
+        log_error("Backup archive has no entry for %s", job->filename);
+        return FAILURE;
+    }
+    if (pack_extract(&ctx->pack, entry, ctx->target_fd, temp) != SUCCESS) {
+        log_error("Failed to restore %s from the archive: %s", job->filename, strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Copy one file back from the backup and rename it into place
+ */
+static int restore_file(RestoreContext* ctx, RestoreJob* job, int job_index) {
+    char temp[NAME_MAX + 1];
+    int src_fd, dst_fd;
+    int cloned;
+
+    snprintf(temp, sizeof(temp), RESTORE_TEMP_PREFIX "%ld.%d", (long)getpid(), job_index);
+
+    if (ctx->archive) {
+        if (restore_archived(ctx, job, temp) != SUCCESS) {
+            return FAILURE;
+        }
+        goto install;
+    }
+
+    src_fd = openat(ctx->backup_fd, job->filename, O_RDONLY | O_CLOEXEC);
+    if (src_fd == -1 && errno == ENOENT) {
+        if (restore_compressed(ctx, job, temp) != SUCCESS) {
+            return FAILURE;
+        }
+        goto install;
+    }
+    if (src_fd == -1) {
+        log_error("Failed to open backup copy of %s: %s", job->filename, strerror(errno));
+        return FAILURE;
+    }
+    dst_fd = openat(ctx->target_fd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dst_fd == -1) {
+        log_error("Failed to create %s: %s", temp, strerror(errno));
+        close(src_fd);
+        return FAILURE;
+    }
+
+    /* Share the backup's extents if the filesystem can, else copy in kernel */
+    cloned = (ioctl(dst_fd, FICLONE, src_fd) == 0);
+    close(src_fd);
+    if (close(dst_fd) != 0) {
+        cloned = FALSE;
+    }
+    if (!cloned && copy_file_at(ctx->backup_fd, job->filename, ctx->target_fd, temp) != SUCCESS) {
+        unlinkat(ctx->target_fd, temp, 0);
+        return FAILURE;
+    }
+
+    if (ctx->options->verify && job->expected.valid) {
+        FileFingerprint restored;
+        if (fingerprint_file_at(ctx->target_fd, temp, &restored) != SUCCESS ||
+            !fingerprint_equal(&restored, &job->expected)) {
+            log_error("Restored copy of %s does not match the backup manifest", job->filename);
+            unlinkat(ctx->target_fd, temp, 0);
+            return FAILURE;
+        }
+    }
+
+install:
+    if (renameat(ctx->target_fd, temp, ctx->target_fd, job->filename) != 0) {
+        log_error("Failed to restore %s: %s", job->filename, strerror(errno));
+        unlinkat(ctx->target_fd, temp, 0);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Restore worker: claim jobs until none are left
+ */
+static void* restore_worker(void* arg) {
+    RestoreContext *ctx = (RestoreContext*)arg;
+
+    for (;;) {
+        int index = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        RestoreJob *job;
+
+        if (index >= ctx->job_count) {
+            break;
+        }
+        job = &ctx->jobs[index];
+        job->action = restore_classify(ctx, job);
+        job->result = SUCCESS;
+
+        if (ctx->options->dry_run || job->action == RESTORE_UNCHANGED) {
+            continue;
+        }
+        if (job->action == RESTORE_EXTRA) {
+            if (!ctx->options->keep_extra && unlinkat(ctx->target_fd, job->filename, 0) != 0) {
+                log_error("Failed to remove %s: %s", job->filename, strerror(errno));
+                job->result = FAILURE;
+            }
+        } else {
+            job->result = restore_file(ctx, job, index);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Bring a directory back to the state recorded in a backup
+ *
+ * Files missing from the directory are copied back, files whose content
+ * differs are replaced, and files not in the backup are removed unless
+ * keep_extra is set. With dry_run nothing is changed. The report callback
+ * sees every file that differs, in name order, once all workers are done.
+ *
+ * @param options What to restore and how
+ * @param summary Receives the counts (may be NULL)
+ * @param report Callback for differing files (may be NULL)
+ * @param context Passed to report
+ * @return SUCCESS if every file was restored, FAILURE otherwise
+ */
+int restore_dashboard(const RestoreOptions* options, RestoreSummary* summary,
+                      RestoreReportFn report, void* context) {
+    RestoreSummary local;
+    RestoreContext ctx;
+    ManifestEntry *entries = NULL;
+    char **live = NULL;
+    int entry_count = 0, live_count = 0;
+    pthread_t threads[RESTORE_MAX_WORKERS];
+    int workers, started = 0;
+    int backup_root_fd, i, j;
+    int result = SUCCESS;
+
+    if (summary == NULL) {
+        summary = &local;
+    }
+    memset(summary, 0, sizeof(RestoreSummary));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.options = options;
+    ctx.backup_fd = -1;
+    ctx.pack.fd = -1;
+
+    backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+    if (backup_root_fd == -1 ||
+        restore_resolve_backup(backup_root_fd, options, summary->backup_name,
+                               sizeof(summary->backup_name)) != SUCCESS) {
+        log_error("No backup matches the restore request");
+        return FAILURE;
+    }
+
+    /* The catalog names archives without their suffix */
+    if (!backup_is_archive(summary->backup_name)) {
+        ctx.backup_fd = openat(backup_root_fd, summary->backup_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (ctx.backup_fd == -1 && (errno == ENOENT || backup_is_archive(summary->backup_name))) {
+        char archive[NAME_MAX + 1];
+
+        snprintf(archive, sizeof(archive), "%s%s", summary->backup_name,
+                 backup_is_archive(summary->backup_name) ? "" : BACKUP_ARCHIVE_SUFFIX);
+        ctx.archive = (pack_open(&ctx.pack, backup_root_fd, archive) == SUCCESS);
+    }
+    ctx.target_fd = (options->target_dir != NULL) ? open_directory(options->target_dir)
+                                                  : report_dir_fd(REPORT_DIR_DASHBOARD);
+    if ((ctx.backup_fd == -1 && !ctx.archive) || ctx.target_fd == -1) {
+        log_error("Failed to open directories for restore: %s", strerror(errno));
+        result = FAILURE;
+        goto cleanup;
+    }
+
+    if (ctx.archive) {
+        if (pack_manifest(&ctx.pack, &entries, &entry_count) != SUCCESS) {
+            result = FAILURE;
+            goto cleanup;
+        }
+    } else if (manifest_load(ctx.backup_fd, &entries, &entry_count) != SUCCESS) {
+        log_operation("Backup %s has no manifest, comparing file contents", summary->backup_name);
+        if (list_backup_files(ctx.backup_fd, &entries, &entry_count) != SUCCESS) {
+            result = FAILURE;
+            goto cleanup;
+        }
+        if (entry_count > 1) {
+            qsort(entries, entry_count, sizeof(ManifestEntry), compare_entries);
+        }
+    }
+    if (list_live_files(ctx.target_fd, &live, &live_count) != SUCCESS) {
+        result = FAILURE;
+        goto cleanup;
+    }
+
+    /* Merge the two sorted name lists into one job per name */
+    ctx.jobs = (RestoreJob*)calloc(entry_count + live_count + 1, sizeof(RestoreJob));
+    if (ctx.jobs == NULL) {
+        log_error("Memory allocation failed for restore");
+        result = FAILURE;
+        goto cleanup;
+    }
+    for (i = 0, j = 0; i < entry_count || j < live_count; ) {
+        RestoreJob *job = &ctx.jobs[ctx.job_count++];
+        int order = (i == entry_count) ? 1 : (j == live_count) ? -1 :
+                    strcmp(entries[i].filename, live[j]);
+
+        if (order <= 0) {
+            snprintf(job->filename, sizeof(job->filename), "%s", entries[i].filename);
+            job->expected = entries[i].fingerprint;
+            job->in_backup = TRUE;
+            i++;
+        }
+        if (order >= 0) {
+            snprintf(job->filename, sizeof(job->filename), "%s", live[j]);
+            job->live = TRUE;
+            j++;
+        }
+    }
+
+    log_operation("%s backup %s into %s (%d files)", options->dry_run ? "Comparing" : "Restoring",
+                  summary->backup_name, options->target_dir ? options->target_dir : DASHBOARD_DIR,
+                  entry_count);
+
+    workers = options->workers;
+    if (workers < 1) {
+        workers = RESTORE_DEFAULT_WORKERS;
+    }
+    if (workers > RESTORE_MAX_WORKERS) {
+        workers = RESTORE_MAX_WORKERS;
+    }
+    for (started = 0; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, restore_worker, &ctx) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        restore_worker(&ctx);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < ctx.job_count; i++) {
+        RestoreJob *job = &ctx.jobs[i];
+
+        if (job->action == RESTORE_UNCHANGED) {
+            summary->unchanged++;
+            continue;
+        }
+        if (job->action == RESTORE_EXTRA && options->keep_extra) {
+            continue;
+        }
+        if (report != NULL) {
+            report(job->filename, job->action, job->result, context);
+        }
+        if (job->result != SUCCESS) {
+            summary->failed++;
+        } else if (job->action == RESTORE_EXTRA) {
+            summary->removed++;
+        } else {
+            summary->restored++;
+        }
+    }
+    if (summary->failed > 0) {
+        result = FAILURE;
+    }
+
+    log_operation("%s %s: %d %s, %d %s, %d unchanged, %d failed",
+                  options->dry_run ? "Compared with" : "Restored", summary->backup_name,
+                  summary->restored, options->dry_run ? "to restore" : "restored",
+                  summary->removed, options->dry_run ? "to remove" : "removed",
+                  summary->unchanged, summary->failed);
+
+cleanup:
+    if (ctx.backup_fd != -1) {
+        close(ctx.backup_fd);
+    }
+    if (ctx.archive) {
+        pack_close(&ctx.pack);
+    }
+    if (options->target_dir != NULL && ctx.target_fd != -1) {
+        close(ctx.target_fd);
+    }
+    for (i = 0; i < live_count; i++) {
+        free(live[i]);
+    }
+    free(live);
+    free(entries);
+    free(ctx.jobs);
+    return result;
+}
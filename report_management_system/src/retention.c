@@ -0,0 +1,578 @@
+/**
+ * @file retention.c
+ * @brief Backup retention policy and background pruning
+ *
+ * The policy keeps the newest backup of each of the last N days, M weeks
+ * and K months that have backups; a backup may count for several of these
+ * at once, and the newest backup is always kept. Everything else expires.
+ *
+ * Pruning runs on its own thread at idle I/O priority. An expired backup
+ * is first renamed to .prune.<name>, which hides it from restores and the
+ * catalog immediately, then emptied in batches with unlinkat() relative
+ * to its directory descriptor (an archive backup is a single unlink, plus
+ * one per other backup root when it is erasure-coded).
+ * Between batches the pruner waits while a
+ * transfer or backup holds the directories, so it never competes with the
+ * nightly run. Directories left behind by an interrupted pass are finished
+ * first on the next one.
+ *
+ * The same pass trims the continuous log: a captured version that no
+ * checkpoint links to any more is removed once older than CDP_KEEP_DAYS,
+ * unless it is the newest version of its file.
+ */
+
+#define LOG_MODULE LOG_MODULE_RETENTION
+#include "report_system.h"
+
+/* Pruning thread state, protected by retention_lock */
+static pthread_mutex_t retention_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retention_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t retention_thread;
+static int retention_running = FALSE;
+static int retention_requested = FALSE;
+static int retention_stopping = FALSE;
+static int retention_paused = 0;        /* Nesting depth of retention_pause() */
+
+/**
+ * Fill in the compiled-in retention policy
+ * @param policy Policy to initialize
+ */
+void retention_default_policy(RetentionPolicy* policy) {
+    policy->daily = RETENTION_DAILY;
+    policy->weekly = RETENTION_WEEKLY;
+    policy->monthly = RETENTION_MONTHLY;
+}
+
+/**
+ * Decide which backups a policy keeps
+ * @param created Creation times, oldest first
+ * @param count Number of backups
+ * @param policy Retention policy
+ * @param keep Receives TRUE for each backup to keep
+ * @return Number of backups kept
+ */
+int retention_select(const time_t* created, int count, const RetentionPolicy* policy, int* keep) {
+    long last_day = -1, last_week = -1, last_month = -1;
+    int days = 0, weeks = 0, months = 0;
+    int kept = 0;
+
+    /* Newest first, so the first backup seen in a period is its newest */
+    for (int i = count - 1; i >= 0; i--) {
+        struct tm tm_info;
+        char week[16];
+        long day_key, week_key, month_key;
+
+        localtime_r(&created[i], &tm_info);
+        day_key = (tm_info.tm_year + 1900L) * 1000 + tm_info.tm_yday;
+        strftime(week, sizeof(week), "%G%V", &tm_info);
+        week_key = atol(week);
+        month_key = (tm_info.tm_year + 1900L) * 12 + tm_info.tm_mon;
+
+        keep[i] = (i == count - 1);
+        if (days < policy->daily && day_key != last_day) {
+            keep[i] = TRUE;
+            last_day = day_key;
+            days++;
+        }
+        if (weeks < policy->weekly && week_key != last_week) {
+            keep[i] = TRUE;
+            last_week = week_key;
+            weeks++;
+        }
+        if (months < policy->monthly && month_key != last_month) {
+            keep[i] = TRUE;
+            last_month = month_key;
+            months++;
+        }
+        if (keep[i]) {
+            kept++;
+        }
+    }
+
+    return kept;
+}
+
+/**
+ * Wait while a transfer or backup is running
+ * @return FALSE if the pruner is being stopped, TRUE to carry on
+ */
+static int retention_wait_idle(void) {
+    int stopping;
+
+    pthread_mutex_lock(&retention_lock);
+    while (retention_paused > 0 && !retention_stopping) {
+        pthread_cond_wait(&retention_wake, &retention_lock);
+    }
+    stopping = retention_stopping;
+    pthread_mutex_unlock(&retention_lock);
+
+    return !stopping;
+}
+
+static int prune_entry(int parent_fd, const char* name, RetentionStats* stats);
+
+/**
+ * Empty and remove a directory, RETENTION_BATCH entries at a time
+ * @return SUCCESS if the directory is gone, FAILURE otherwise
+ */
+static int prune_directory(int parent_fd, const char* name, RetentionStats* stats) {
+    char (*batch)[NAME_MAX + 1];
+    int dirfd;
+    int result = SUCCESS;
+
+    dirfd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd == -1) {
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+    batch = malloc(RETENTION_BATCH * sizeof(*batch));
+    if (batch == NULL) {
+        close(dirfd);
+        return FAILURE;
+    }
+
+    for (;;) {
+        DirEnumerator iter;
+        DirEntry entry;
+        int count = 0, removed = 0;
+
+        if (!retention_wait_idle()) {
+            result = FAILURE;
+            break;
+        }
+
+        /* Collect first: unlinking while getdents walks the directory may skip entries */
+        if (dir_enum_open(&iter, dirfd) != SUCCESS) {
+            result = FAILURE;
+            break;
+        }
+        while (count < RETENTION_BATCH && dir_enum_next(&iter, &entry)) {
+            snprintf(batch[count++], NAME_MAX + 1, "%s", entry.name);
+        }
+        dir_enum_close(&iter);
+        if (count == 0) {
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (prune_entry(dirfd, batch[i], stats) == SUCCESS) {
+                removed++;
+            }
+        }
+
+        if (removed == 0) {
+            /* Nothing could be removed; retrying would spin */
+            result = FAILURE;
+            break;
+        }
+    }
+
+    free(batch);
+    close(dirfd);
+
+    if (result == SUCCESS && unlinkat(parent_fd, name, AT_REMOVEDIR) != 0) {
+        log_error("Failed to remove directory %s: %s", name, strerror(errno));
+        result = FAILURE;
+    }
+    return result;
+}
+
+/**
+ * Remove a file or directory tree being pruned
+ * Space is counted per unlink: a file whose link count is still above one
+ * lives on elsewhere, so only the removal of its last link frees anything.
+ * @return SUCCESS if the entry is gone, FAILURE otherwise
+ */
+static int prune_entry(int parent_fd, const char* name, RetentionStats* stats) {
+    struct stat st;
+
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return prune_directory(parent_fd, name, stats);
+    }
+    if (unlinkat(parent_fd, name, 0) != 0) {
+        log_error("Failed to remove %s: %s", name, strerror(errno));
+        return FAILURE;
+    }
+    stats->files_removed++;
+    if (st.st_nlink > 1) {
+        stats->bytes_shared += (uint64_t)st.st_blocks * 512;
+    } else {
+        stats->bytes_freed += (uint64_t)st.st_blocks * 512;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Flag catalogued backups whose directory is gone
+ * This covers backups renamed for pruning as well as ones removed by
+ * hand, so the catalog also heals after an interrupted pass.
+ */
+static void retention_update_catalog(int backup_root_fd) {
+    BackupCatalog catalog;
+    int marked = 0;
+
+    if (faccessat(backup_root_fd, CATALOG_BACKUPS_FILE, F_OK, 0) != 0 ||
+        catalog_open(&catalog, backup_root_fd, TRUE) != SUCCESS) {
+        return;
+    }
+    for (uint32_t i = 0; i < catalog.backup_count; i++) {
+        const CatalogBackup *backup = &catalog.backups[i];
+        char archive[NAME_MAX + 1];
+        struct stat st;
+
+        if ((backup->flags & CATALOG_BACKUP_PRUNED) ||
+            fstatat(backup_root_fd, backup->name, &st, AT_SYMLINK_NOFOLLOW) == 0 ||
+            errno != ENOENT) {
+            continue;
+        }
+        snprintf(archive, sizeof(archive), "%s" BACKUP_ARCHIVE_SUFFIX, backup->name);
+        if (fstatat(backup_root_fd, archive, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+            continue;
+        }
+        if (catalog_mark_pruned(&catalog, backup->id) == SUCCESS) {
+            marked++;
+        }
+    }
+    catalog_close(&catalog);
+
+    if (marked > 0) {
+        log_operation("Marked %d pruned backups in the catalog", marked);
+    }
+}
+
+static int compare_sequences(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Remove old continuous log versions that no backup links to
+ * Needs the log open in this process to know each file's newest version;
+ * otherwise nothing is removed.
+ */
+static int prune_versions(int backup_root_fd, RetentionStats* stats) {
+    char (*batch)[NAME_MAX + 1];
+    DirEnumerator iter;
+    DirEntry entry;
+    uint64_t *latest;
+    int latest_count;
+    time_t cutoff = time(NULL) - (time_t)CDP_KEEP_DAYS * 24 * 60 * 60;
+    int objects_fd;
+    int result = SUCCESS;
+
+    if (cdp_latest_versions(&latest, &latest_count) != SUCCESS) {
+        return SUCCESS;
+    }
+    objects_fd = openat(backup_root_fd, CDP_DIR_NAME "/" CDP_OBJECTS_NAME,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    batch = malloc(RETENTION_BATCH * sizeof(*batch));
+    if (objects_fd == -1 || batch == NULL) {
+        if (objects_fd != -1) {
+            close(objects_fd);
+        }
+        free(batch);
+        free(latest);
+        return (errno == ENOENT) ? SUCCESS : FAILURE;
+    }
+
+    if (dir_enum_open(&iter, objects_fd) == SUCCESS) {
+        int more = TRUE;
+
+        /* A single walk: entries it skips because of the unlinks wait for the next pass */
+        while (more) {
+            int count = 0;
+
+            while (count < RETENTION_BATCH && (more = dir_enum_next(&iter, &entry))) {
+                snprintf(batch[count++], NAME_MAX + 1, "%s", entry.name);
+            }
+            if (!retention_wait_idle()) {
+                result = FAILURE;
+                break;
+            }
+            for (int i = 0; i < count; i++) {
+                uint64_t sequence = strtoull(batch[i], NULL, 10);
+                struct stat st;
+
+                if (bsearch(&sequence, latest, latest_count, sizeof(uint64_t), compare_sequences) != NULL ||
+                    fstatat(objects_fd, batch[i], &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                    !S_ISREG(st.st_mode) || st.st_nlink > 1 || st.st_mtime >= cutoff) {
+                    continue;
+                }
+                if (unlinkat(objects_fd, batch[i], 0) != 0) {
+                    log_error("Failed to remove version %s: %s", batch[i], strerror(errno));
+                    result = FAILURE;
+                    continue;
+                }
+                stats->versions_removed++;
+                stats->bytes_freed += (uint64_t)st.st_blocks * 512;
+            }
+        }
+        dir_enum_close(&iter);
+    }
+
+    close(objects_fd);
+    free(batch);
+    free(latest);
+    return result;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Apply a retention policy to BACKUP_DIR
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param policy Retention policy
+ * @param stats Receives what was kept and removed (may be NULL)
+ * @return SUCCESS if every expired backup was removed, FAILURE otherwise
+ */
+int retention_prune(int backup_root_fd, const RetentionPolicy* policy, RetentionStats* stats) {
+    RetentionStats local;
+    DirEnumerator iter;
+    DirEntry entry;
+    char **names = NULL;
+    time_t *created = NULL;
+    int *keep = NULL;
+    int count = 0, capacity = 0;
+    int expired = 0;
+    int result = SUCCESS;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(RetentionStats));
+
+    if (dir_enum_open(&iter, backup_root_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        time_t when;
+
+        if (entry.type != DT_DIR && entry.type != DT_UNKNOWN &&
+            !(entry.type == DT_REG && backup_is_archive(entry.name))) {
+            continue;
+        }
+        if (strncmp(entry.name, RETENTION_PRUNE_PREFIX, strlen(RETENTION_PRUNE_PREFIX)) != 0 &&
+            parse_backup_name(entry.name, &when) != SUCCESS) {
+            continue;
+        }
+        if (count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            char **grown = (char**)realloc(names, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+            capacity = new_capacity;
+        }
+        names[count] = strdup(entry.name);
+        if (names[count] != NULL) {
+            count++;
+        }
+    }
+    dir_enum_close(&iter);
+
+    /* ".prune." sorts before "backup_", and backup names sort by time */
+    if (count > 1) {
+        qsort(names, count, sizeof(char*), compare_names);
+    }
+    created = (time_t*)calloc(count + 1, sizeof(time_t));
+    keep = (int*)calloc(count + 1, sizeof(int));
+    if (created == NULL || keep == NULL) {
+        log_error("Memory allocation failed for retention");
+        result = FAILURE;
+        goto cleanup;
+    }
+
+    {
+        int first = 0;
+
+        /* Left over from an interrupted pass */
+        while (first < count && names[first][0] == '.') {
+            keep[first++] = FALSE;
+            expired++;
+        }
+        for (int i = first; i < count; i++) {
+            parse_backup_name(names[i], &created[i]);
+        }
+        stats->kept = retention_select(created + first, count - first, policy, keep + first);
+
+        /* Renaming is quick and takes expired backups out of view at once */
+        for (int i = first; i < count; i++) {
+            char pruned[NAME_MAX + 1];
+
+            if (keep[i]) {
+                continue;
+            }
+            snprintf(pruned, sizeof(pruned), RETENTION_PRUNE_PREFIX "%s", names[i]);
+            if (renameat(backup_root_fd, names[i], backup_root_fd, pruned) != 0) {
+                log_error("Failed to expire backup %s: %s", names[i], strerror(errno));
+                keep[i] = TRUE;
+                result = FAILURE;
+                continue;
+            }
+            free(names[i]);
+            names[i] = strdup(pruned);
+            stats->pruned++;
+            expired++;
+        }
+    }
+
+    if (expired > 0 && retention_wait_idle()) {
+        retention_update_catalog(backup_root_fd);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (keep[i] || names[i] == NULL) {
+            continue;
+        }
+        /* Shards in the other roots go first; shard 0 here still names them */
+        if (backup_is_archive(names[i]) &&
+            erasure_remove(names[i] + strlen(RETENTION_PRUNE_PREFIX), &stats->bytes_freed) != SUCCESS) {
+            result = FAILURE;
+            break;
+        }
+        if (prune_entry(backup_root_fd, names[i], stats) != SUCCESS) {
+            result = FAILURE;
+            break;
+        }
+    }
+
+    if (result == SUCCESS && prune_versions(backup_root_fd, stats) != SUCCESS) {
+        result = FAILURE;
+    }
+
+    if (stats->pruned > 0 || stats->files_removed > 0 || stats->versions_removed > 0) {
+        log_operation("Retention kept %d backups and pruned %d: %llu files and %llu versions removed, "
+                      "%.1f MiB freed, %.1f MiB still shared by hard links%s",
+                      stats->kept, stats->pruned, (unsigned long long)stats->files_removed,
+                      (unsigned long long)stats->versions_removed,
+                      stats->bytes_freed / 1048576.0, stats->bytes_shared / 1048576.0,
+                      (result == SUCCESS) ? "" : " (incomplete)");
+    }
+
+cleanup:
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(created);
+    free(keep);
+    return result;
+}
+
+/**
+ * Pruning thread: one pass per request
+ */
+static void* retention_thread_main(void* arg) {
+    RetentionPolicy policy;
+
+    (void)arg;
+    lower_thread_priority("pruning");
+    retention_default_policy(&policy);
+
+    for (;;) {
+        int backup_root_fd;
+
+        pthread_mutex_lock(&retention_lock);
+        while (!retention_requested && !retention_stopping) {
+            pthread_cond_wait(&retention_wake, &retention_lock);
+        }
+        if (retention_stopping) {
+            pthread_mutex_unlock(&retention_lock);
+            break;
+        }
+        retention_requested = FALSE;
+        pthread_mutex_unlock(&retention_lock);
+
+        backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+        if (backup_root_fd == -1) {
+            continue;
+        }
+        retention_prune(backup_root_fd, &policy, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the background pruning thread
+ * It also runs one pass straight away to finish any interrupted pruning.
+ * @return SUCCESS on success, FAILURE on error
+ */
+int retention_start(void) {
+    pthread_mutex_lock(&retention_lock);
+    if (retention_running) {
+        pthread_mutex_unlock(&retention_lock);
+        return SUCCESS;
+    }
+    retention_stopping = FALSE;
+    retention_requested = TRUE;
+    if (pthread_create(&retention_thread, NULL, retention_thread_main, NULL) != 0) {
+        pthread_mutex_unlock(&retention_lock);
+        log_error("Failed to start the pruning thread");
+        return FAILURE;
+    }
+    retention_running = TRUE;
+    pthread_mutex_unlock(&retention_lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Ask the pruning thread for a pass, e.g. after a backup
+ * Returns immediately; requests made during a pass coalesce into one more.
+ */
+void retention_request(void) {
+    pthread_mutex_lock(&retention_lock);
+    retention_requested = TRUE;
+    pthread_cond_broadcast(&retention_wake);
+    pthread_mutex_unlock(&retention_lock);
+}
+
+/**
+ * Hold the pruner at its next batch boundary until retention_resume()
+ * Calls nest.
+ */
+void retention_pause(void) {
+    pthread_mutex_lock(&retention_lock);
+    retention_paused++;
+    pthread_mutex_unlock(&retention_lock);
+}
+
+/**
+ * Let the pruner continue after retention_pause()
+ */
+void retention_resume(void) {
+    pthread_mutex_lock(&retention_lock);
+    if (retention_paused > 0) {
+        retention_paused--;
+    }
+    pthread_cond_broadcast(&retention_wake);
+    pthread_mutex_unlock(&retention_lock);
+}
+
+/**
+ * Stop the pruning thread
+ * A pass in progress stops at its next batch; it is resumed on restart.
+ */
+void retention_stop(void) {
+    pthread_mutex_lock(&retention_lock);
+    if (!retention_running) {
+        pthread_mutex_unlock(&retention_lock);
+        return;
+    }
+    retention_stopping = TRUE;
+    pthread_cond_broadcast(&retention_wake);
+    pthread_mutex_unlock(&retention_lock);
+
+    pthread_join(retention_thread, NULL);
+
+    pthread_mutex_lock(&retention_lock);
+    retention_running = FALSE;
+    retention_stopping = FALSE;
+    pthread_mutex_unlock(&retention_lock);
+}
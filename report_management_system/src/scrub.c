@@ -0,0 +1,818 @@
+/**
+ * @file scrub.c
+ * @brief Background scrubbing of backups
+ *
+ * A scrub pass re-reads every backup under BACKUP_DIR, oldest first, and
+ * checks each file's content against the fingerprint in the backup's
+ * manifest, so damage is found while a newer backup or the dashboard can
+ * still replace it. Plain files are read directly, never through the
+ * fingerprint cache; compressed copies are decompressed and archive
+ * entries are rebuilt. Every shard of an erasure-coded archive, parity
+ * included, is checked chunk by chunk before its files. Files that the
+ * continuous log hard links into many checkpoints are read once per pass.
+ *
+ * Each backup is split into batches of SCRUB_BATCH files shared by
+ * SCRUB_WORKERS threads at idle priority. All reads draw from one token
+ * bucket of SCRUB_RATE_LIMIT bytes per second. Before every read a worker
+ * checks whether it must yield: to a transfer or backup in this process
+ * (scrub_pause), or to a restore in any process holding SCRUB_HOLD_FILE
+ * (scrub_hold). It waits until they are done.
+ *
+ * Progress is saved in SCRUB_STATE_FILE as the backup being scrubbed and
+ * the number of its files already checked, so a pass cut short by a stop
+ * or a crash resumes there. A new pass starts SCRUB_INTERVAL after the
+ * previous one completed.
+ */
+
+#define LOG_MODULE LOG_MODULE_SCRUB
+#include "report_system.h"
+#include <sys/file.h>
+
+#define SCRUB_STATE_TEMP ".scrub.state.tmp"
+
+/**
+ * @struct ScrubSeen
+ * @brief Files already verified in this pass, by inode
+ */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+} ScrubSeen;
+
+/**
+ * @struct ScrubJob
+ * @brief One backup being scrubbed
+ */
+typedef struct {
+    int backup_root_fd;
+    const char *name;                 /* Backup name */
+    int backup_fd;                    /* Directory backup, or -1 */
+    int archive;                      /* TRUE for an archive backup */
+    PackReader pack;
+    ManifestEntry *entries;
+    int count;
+    int first;                        /* Files before this were checked earlier */
+    int next_batch;                   /* Next batch to hand out */
+    int batches;
+    unsigned char *done;              /* Finished batches */
+    int low_water;                    /* Batches before this are all finished */
+    ScrubStats *stats;
+} ScrubJob;
+
+/* Scrubber state, protected by scrub_lock */
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t scrub_thread;
+static int scrub_running = FALSE;
+static int scrub_stopping = FALSE;
+static int scrub_paused = 0;           /* Nesting depth of scrub_pause() */
+static int scrub_hold_fd = -1;         /* SCRUB_HOLD_FILE, probed before each read */
+static struct timespec scrub_budget;   /* When the token bucket is next empty */
+static ScrubSeen *scrub_seen = NULL;   /* Open addressing, inode 0 is free */
+static size_t scrub_seen_capacity = 0;
+static size_t scrub_seen_count = 0;
+
+/**
+ * Check whether a restore holds SCRUB_HOLD_FILE
+ * A restore takes it shared; the probe takes it exclusive without waiting
+ * and lets go at once, so a restore is never held up by more than that.
+ * Called with scrub_lock held.
+ */
+static int scrub_held_elsewhere(void) {
+    if (scrub_hold_fd == -1) {
+        return FALSE;
+    }
+    if (flock(scrub_hold_fd, LOCK_EX | LOCK_NB) != 0) {
+        return (errno == EWOULDBLOCK);
+    }
+    flock(scrub_hold_fd, LOCK_UN);
+    return FALSE;
+}
+
+/**
+ * Wait while a transfer, backup or restore is running
+ * @return FALSE if the scrubber is being stopped, TRUE to carry on
+ */
+static int scrub_wait_idle(void) {
+    int stopping;
+
+    pthread_mutex_lock(&scrub_lock);
+    for (;;) {
+        if (scrub_stopping) {
+            break;
+        }
+        if (scrub_paused > 0) {
+            pthread_cond_wait(&scrub_wake, &scrub_lock);
+        } else if (scrub_held_elsewhere()) {
+            /* No wakeup comes from another process; look again shortly */
+            struct timespec until;
+
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&scrub_wake, &scrub_lock, &until);
+        } else {
+            break;
+        }
+    }
+    stopping = scrub_stopping;
+    pthread_mutex_unlock(&scrub_lock);
+
+    return !stopping;
+}
+
+/**
+ * Take bytes from the token bucket, sleeping until they are available
+ * The bucket holds at most one second of reads.
+ */
+static void scrub_throttle(uint64_t bytes) {
+    struct timespec now, until;
+    long long budget_ns, now_ns;
+
+    if (SCRUB_RATE_LIMIT <= 0 || bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&scrub_lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    budget_ns = scrub_budget.tv_sec * 1000000000LL + scrub_budget.tv_nsec;
+    if (budget_ns < now_ns - 1000000000LL) {
+        budget_ns = now_ns - 1000000000LL;
+    }
+    budget_ns += (long long)(bytes * 1000000000ULL / (uint64_t)SCRUB_RATE_LIMIT);
+    scrub_budget.tv_sec = budget_ns / 1000000000LL;
+    scrub_budget.tv_nsec = budget_ns % 1000000000LL;
+    until = scrub_budget;
+    pthread_mutex_unlock(&scrub_lock);
+
+    if (budget_ns > now_ns) {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+        }
+    }
+}
+
+/**
+ * Yield and throttle before erasure_check reads a chunk
+ * @return FALSE if the scrubber is being stopped
+ */
+static int scrub_before_chunk(uint64_t bytes) {
+    if (!scrub_wait_idle()) {
+        return FALSE;
+    }
+    scrub_throttle(bytes);
+    return TRUE;
+}
+
+/**
+ * Record a file as verified in this pass
+ * Called with scrub_lock held.
+ * @return TRUE if it was already verified, FALSE if it is new
+ */
+static int scrub_seen_before(const struct stat* st) {
+    size_t slot;
+
+    if (st->st_nlink < 2 || st->st_ino == 0) {
+        return FALSE;             /* Only hard links can come round again */
+    }
+    if (scrub_seen_count * 2 >= scrub_seen_capacity) {
+        size_t capacity = scrub_seen_capacity ? scrub_seen_capacity * 2 : 4096;
+        ScrubSeen *grown = (ScrubSeen*)calloc(capacity, sizeof(ScrubSeen));
+
+        if (grown == NULL) {
+            return FALSE;
+        }
+        for (size_t i = 0; i < scrub_seen_capacity; i++) {
+            if (scrub_seen[i].inode != 0) {
+                slot = ((uint64_t)scrub_seen[i].inode * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+                while (grown[slot].inode != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                grown[slot] = scrub_seen[i];
+            }
+        }
+        free(scrub_seen);
+        scrub_seen = grown;
+        scrub_seen_capacity = capacity;
+    }
+
+    slot = ((uint64_t)st->st_ino * 0x9E3779B97F4A7C15ULL) & (scrub_seen_capacity - 1);
+    while (scrub_seen[slot].inode != 0) {
+        if (scrub_seen[slot].inode == st->st_ino && scrub_seen[slot].device == st->st_dev) {
+            return TRUE;
+        }
+        slot = (slot + 1) & (scrub_seen_capacity - 1);
+    }
+    scrub_seen[slot].device = st->st_dev;
+    scrub_seen[slot].inode = st->st_ino;
+    scrub_seen_count++;
+    return FALSE;
+}
+
+/**
+ * Read a plain file in full and fingerprint it
+ * @return SUCCESS when read (fingerprint set, or valid FALSE if already
+ *         verified this pass), FAILURE on a read error or a stop
+ */
+static int scrub_read_plain(int fd, const ManifestEntry* expected, FileFingerprint* fingerprint) {
+    FingerprintState state;
+    unsigned char *buffer;
+    struct stat st;
+    off_t offset = 0;
+    ssize_t bytes_read;
+    int seen;
+
+    if (fstat(fd, &st) != 0) {
+        return FAILURE;
+    }
+    pthread_mutex_lock(&scrub_lock);
+    seen = scrub_seen_before(&st);
+    pthread_mutex_unlock(&scrub_lock);
+    if (seen) {
+        fingerprint->valid = FALSE;
+        return SUCCESS;
+    }
+
+    buffer = (unsigned char*)malloc(SCRUB_READ_SIZE);
+    if (buffer == NULL) {
+        return FAILURE;
+    }
+    fingerprint_init(&state, expected->fingerprint.has_crc);
+    for (;;) {
+        if (!scrub_wait_idle()) {
+            free(buffer);
+            errno = ECANCELED;
+            return FAILURE;
+        }
+        bytes_read = pread(fd, buffer, SCRUB_READ_SIZE, offset);
+        if (bytes_read <= 0) {
+            break;
+        }
+        /* Charge what was read: small reports must not be billed a full buffer */
+        scrub_throttle((uint64_t)bytes_read);
+        fingerprint_update(&state, buffer, (size_t)bytes_read);
+        offset += bytes_read;
+    }
+    free(buffer);
+
+    if (bytes_read < 0) {
+        return FAILURE;
+    }
+    fingerprint_final(&state, fingerprint);
+    return SUCCESS;
+}
+
+/**
+ * Check one file of a backup against its manifest entry
+ * @return SCRUB_OK, SCRUB_DAMAGED, SCRUB_UNREADABLE, SCRUB_SKIPPED or
+ *         SCRUB_STOPPED
+ */
+static int scrub_file(ScrubJob* job, const ManifestEntry* expected, uint64_t* bytes) {
+    FileFingerprint actual;
+    char want[64], got[64];
+
+    memset(&actual, 0, sizeof(actual));
+    if (!scrub_wait_idle()) {
+        return SCRUB_STOPPED;
+    }
+
+    if (job->archive) {
+        const PackEntry *entry = pack_find(&job->pack, expected->filename);
+        char *data;
+        size_t length;
+
+        if (entry == NULL) {
+            log_error("Scrub: %s is missing from %s", expected->filename, job->name);
+            return SCRUB_UNREADABLE;
+        }
+        scrub_throttle(entry->stored_length);
+        if (pack_read_entry(&job->pack, entry, &data, &length) != SUCCESS) {
+            log_error("Scrub: %s in %s is damaged: %s", expected->filename, job->name,
+                      strerror(errno));
+            return SCRUB_DAMAGED;
+        }
+        fingerprint_buffer(data, length, &actual);
+        free(data);
+    } else {
+        int fd = openat(job->backup_fd, expected->filename, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (fd == -1 && errno == ENOENT) {
+            char packed[NAME_MAX + 1];
+            struct stat st;
+
+            if (snprintf(packed, sizeof(packed), "%s" BACKUP_COMPRESSED_SUFFIX,
+                         expected->filename) >= (int)sizeof(packed)) {
+                errno = ENAMETOOLONG;
+            } else if (fstatat(job->backup_fd, packed, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                scrub_throttle((uint64_t)st.st_size);
+                if (decompress_file_at(job->backup_fd, packed, -1, NULL, &actual) != SUCCESS) {
+                    log_error("Scrub: %s in %s is damaged: %s", packed, job->name, strerror(errno));
+                    return SCRUB_DAMAGED;
+                }
+                *bytes += (uint64_t)st.st_size;
+                goto compare;
+            }
+        }
+        if (fd == -1) {
+            /* Being pruned while we read it is not damage */
+            if (errno == ENOENT && faccessat(job->backup_root_fd, job->name, F_OK, 0) != 0) {
+                return SCRUB_SKIPPED;
+            }
+            log_error("Scrub: cannot open %s in %s: %s", expected->filename, job->name, strerror(errno));
+            return SCRUB_UNREADABLE;
+        }
+        if (scrub_read_plain(fd, expected, &actual) != SUCCESS) {
+            int saved = errno;
+
+            close(fd);
+            if (saved == ECANCELED) {
+                return SCRUB_STOPPED;
+            }
+            log_error("Scrub: cannot read %s in %s: %s", expected->filename, job->name, strerror(saved));
+            return SCRUB_UNREADABLE;
+        }
+        close(fd);
+        if (!actual.valid) {
+            return SCRUB_SKIPPED;
+        }
+    }
+    *bytes += actual.size;
+
+compare:
+    if (!fingerprint_equal(&expected->fingerprint, &actual)) {
+        log_error("Scrub: %s in %s is damaged: expected %s, read %s", expected->filename, job->name,
+                  fingerprint_format(&expected->fingerprint, want, sizeof(want)),
+                  fingerprint_format(&actual, got, sizeof(got)));
+        return SCRUB_DAMAGED;
+    }
+    return SCRUB_OK;
+}
+
+/**
+ * Save the pass position: the backup being scrubbed and how many of its
+ * files are done, or "-" once the pass is complete
+ * The file is replaced by rename but not synced; losing it in a crash
+ * only repeats some reads.
+ */
+static void scrub_save_state(int backup_root_fd, time_t completed, const char* name, int files) {
+    FILE *file;
+    int fd;
+
+    fd = openat(backup_root_fd, SCRUB_STATE_TEMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || (file = fdopen(fd, "w")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    fprintf(file, "scrub v1 %lld %s %d\n", (long long)completed, name ? name : "-", files);
+    if (fclose(file) == 0) {
+        renameat(backup_root_fd, SCRUB_STATE_TEMP, backup_root_fd, SCRUB_STATE_FILE);
+    }
+}
+
+/**
+ * Read the pass position
+ * @param completed Receives when the last full pass ended (0 if never)
+ * @param name Receives the backup to resume at, or "" to start afresh
+ * @param files Receives the number of its files already done
+ */
+static void scrub_load_state(int backup_root_fd, time_t* completed, char* name, size_t name_size,
+                             int* files) {
+    char line[MAX_LINE_LENGTH];
+    char position[NAME_MAX + 1];
+    long long when;
+    FILE *file;
+    int fd;
+
+    *completed = 0;
+    name[0] = '\0';
+    *files = 0;
+
+    fd = openat(backup_root_fd, SCRUB_STATE_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (file = fdopen(fd, "r")) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    if (fgets(line, sizeof(line), file) != NULL &&
+        sscanf(line, "scrub v1 %lld %255s %d", &when, position, files) == 3) {
+        *completed = (time_t)when;
+        if (strcmp(position, "-") != 0) {
+            snprintf(name, name_size, "%s", position);
+        } else {
+            *files = 0;
+        }
+    }
+    fclose(file);
+}
+
+/**
+ * Scrub worker: check batches until the backup is done
+ */
+static void* scrub_worker(void* arg) {
+    ScrubJob *job = (ScrubJob*)arg;
+
+    lower_thread_priority("scrubbing");
+
+    for (;;) {
+        ScrubStats local;
+        int batch, start, end;
+        int stopped = FALSE;
+
+        pthread_mutex_lock(&scrub_lock);
+        batch = (job->next_batch < job->batches && !scrub_stopping) ? job->next_batch++ : -1;
+        pthread_mutex_unlock(&scrub_lock);
+        if (batch == -1) {
+            break;
+        }
+
+        memset(&local, 0, sizeof(local));
+        start = job->first + batch * SCRUB_BATCH;
+        end = (start + SCRUB_BATCH < job->count) ? start + SCRUB_BATCH : job->count;
+        for (int i = start; i < end && !stopped; i++) {
+            switch (scrub_file(job, &job->entries[i], &local.bytes)) {
+                case SCRUB_OK:
+                    local.files++;
+                    break;
+                case SCRUB_DAMAGED:
+                    local.files++;
+                    local.damaged++;
+                    break;
+                case SCRUB_UNREADABLE:
+                    local.files++;
+                    local.unreadable++;
+                    break;
+                case SCRUB_STOPPED:
+                    stopped = TRUE;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        pthread_mutex_lock(&scrub_lock);
+        job->stats->files += local.files;
+        job->stats->bytes += local.bytes;
+        job->stats->damaged += local.damaged;
+        job->stats->unreadable += local.unreadable;
+        if (!stopped) {
+            int advanced = FALSE;
+
+            job->done[batch] = TRUE;
+            while (job->low_water < job->batches && job->done[job->low_water]) {
+                job->low_water++;
+                advanced = TRUE;
+            }
+            if (advanced && job->low_water < job->batches) {
+                scrub_save_state(job->backup_root_fd, 0, job->name,
+                                 job->first + job->low_water * SCRUB_BATCH);
+            }
+        }
+        pthread_mutex_unlock(&scrub_lock);
+        if (stopped) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Scrub one backup from its first unchecked file
+ * @return SUCCESS if every file was checked, FAILURE if stopped or unreadable
+ */
+static int scrub_backup(int backup_root_fd, const char* name, int first, ScrubStats* stats) {
+    pthread_t threads[SCRUB_WORKERS];
+    ScrubJob job;
+    int started = 0;
+    int result;
+
+    memset(&job, 0, sizeof(job));
+    job.backup_root_fd = backup_root_fd;
+    job.name = name;
+    job.backup_fd = -1;
+    job.stats = stats;
+
+    if (backup_load_manifest(backup_root_fd, name, &job.entries, &job.count) != SUCCESS) {
+        if (faccessat(backup_root_fd, name, F_OK, 0) == 0) {
+            log_error("Scrub: cannot read the manifest of %s", name);
+            stats->unreadable++;
+        }
+        return FAILURE;
+    }
+    if (backup_is_archive(name)) {
+        /* Reading the files only touches parity that is needed, so check every shard first */
+        int damaged = erasure_check(backup_root_fd, name, scrub_before_chunk);
+
+        if (damaged > 0) {
+            stats->damaged_chunks += (uint64_t)damaged;
+        } else if (damaged == FAILURE && errno == ECANCELED) {
+            free(job.entries);
+            return FAILURE;
+        }
+        job.archive = (pack_open(&job.pack, backup_root_fd, name) == SUCCESS);
+        result = job.archive ? SUCCESS : FAILURE;
+    } else {
+        job.backup_fd = openat(backup_root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        result = (job.backup_fd != -1) ? SUCCESS : FAILURE;
+    }
+    if (result != SUCCESS) {
+        log_error("Scrub: cannot open %s: %s", name, strerror(errno));
+        stats->unreadable++;
+        free(job.entries);
+        return FAILURE;
+    }
+
+    job.first = (first < job.count) ? first : job.count;
+    job.batches = (job.count - job.first + SCRUB_BATCH - 1) / SCRUB_BATCH;
+    job.done = (unsigned char*)calloc(job.batches + 1, 1);
+    if (job.done == NULL) {
+        result = FAILURE;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < SCRUB_WORKERS && i < job.batches; i++) {
+        if (pthread_create(&threads[started], NULL, scrub_worker, &job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0 && job.batches > 0) {
+        scrub_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    result = (job.low_water == job.batches) ? SUCCESS : FAILURE;
+    if (result == SUCCESS) {
+        stats->backups++;
+    }
+
+cleanup:
+    if (job.archive) {
+        pack_close(&job.pack);
+    }
+    if (job.backup_fd != -1) {
+        close(job.backup_fd);
+    }
+    free(job.done);
+    free(job.entries);
+    return result;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Run one scrub pass, resuming an interrupted one
+ * @param backup_root_fd Descriptor of BACKUP_DIR
+ * @param stats Receives what was checked (may be NULL)
+ * @return SUCCESS if the pass completed, FAILURE if it was stopped or
+ *         the backup directory could not be read
+ */
+int scrub_pass(int backup_root_fd, ScrubStats* stats) {
+    ScrubStats local;
+    DirEnumerator iter;
+    DirEntry entry;
+    char resume[NAME_MAX + 1];
+    char **names = NULL;
+    int count = 0, capacity = 0;
+    int first;
+    time_t completed;
+    int result = SUCCESS;
+
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(ScrubStats));
+
+    if (dir_enum_open(&iter, backup_root_fd) != SUCCESS) {
+        log_error("Scrub: cannot list %s: %s", BACKUP_DIR, strerror(errno));
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        time_t created;
+
+        if (parse_backup_name(entry.name, &created) != SUCCESS) {
+            continue;
+        }
+        if (count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            char **grown = (char**)realloc(names, new_capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+            capacity = new_capacity;
+        }
+        if ((names[count] = strdup(entry.name)) != NULL) {
+            count++;
+        }
+    }
+    dir_enum_close(&iter);
+    if (count > 1) {
+        qsort(names, count, sizeof(char*), compare_names);
+    }
+
+    scrub_load_state(backup_root_fd, &completed, resume, sizeof(resume), &first);
+    if (resume[0] != '\0') {
+        log_operation("Resuming backup scrub at %s, file %d", resume, first);
+    } else {
+        log_operation("Starting backup scrub of %d backups", count);
+    }
+
+    pthread_mutex_lock(&scrub_lock);
+    scrub_seen_count = 0;
+    if (scrub_seen != NULL) {
+        memset(scrub_seen, 0, scrub_seen_capacity * sizeof(ScrubSeen));
+    }
+    pthread_mutex_unlock(&scrub_lock);
+
+    for (int i = 0; i < count && result == SUCCESS; i++) {
+        int start = 0;
+
+        /* Backups before the resume point were checked in this pass already */
+        if (resume[0] != '\0') {
+            int order = strcmp(names[i], resume);
+            if (order < 0) {
+                continue;
+            }
+            if (order == 0) {
+                start = first;
+            }
+            resume[0] = '\0';
+        }
+
+        scrub_save_state(backup_root_fd, completed, names[i], start);
+        scrub_backup(backup_root_fd, names[i], start, stats);
+        if (!scrub_wait_idle()) {
+            result = FAILURE;
+        }
+    }
+
+    if (result == SUCCESS) {
+        scrub_save_state(backup_root_fd, time(NULL), NULL, 0);
+    }
+    log_operation("Backup scrub %s: %d backups, %llu files, %llu bytes checked, %llu damaged, %llu unreadable, "
+                  "%llu damaged shard chunks",
+                  (result == SUCCESS) ? "complete" : "interrupted", stats->backups,
+                  (unsigned long long)stats->files, (unsigned long long)stats->bytes,
+                  (unsigned long long)stats->damaged, (unsigned long long)stats->unreadable,
+                  (unsigned long long)stats->damaged_chunks);
+
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+/**
+ * Scrubbing thread: a pass whenever one is due
+ */
+static void* scrub_thread_main(void* arg) {
+    (void)arg;
+    lower_thread_priority("scrubbing");
+
+    for (;;) {
+        char resume[NAME_MAX + 1];
+        struct timespec due;
+        time_t completed;
+        int backup_root_fd, first;
+
+        backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+        if (backup_root_fd == -1) {
+            completed = time(NULL);
+        } else {
+            scrub_load_state(backup_root_fd, &completed, resume, sizeof(resume), &first);
+        }
+
+        /* An interrupted pass is due at once */
+        memset(&due, 0, sizeof(due));
+        due.tv_sec = (backup_root_fd != -1 && resume[0] != '\0') ? 0 : completed + SCRUB_INTERVAL;
+
+        pthread_mutex_lock(&scrub_lock);
+        while (!scrub_stopping && time(NULL) < due.tv_sec) {
+            pthread_cond_timedwait(&scrub_wake, &scrub_lock, &due);
+        }
+        if (scrub_stopping) {
+            pthread_mutex_unlock(&scrub_lock);
+            break;
+        }
+        pthread_mutex_unlock(&scrub_lock);
+
+        if (backup_root_fd != -1) {
+            if (scrub_wait_idle()) {
+                scrub_pass(backup_root_fd, NULL);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the background scrubbing thread
+ * @return SUCCESS on success, FAILURE on error
+ */
+int scrub_start(void) {
+    char hold[MAX_PATH_LENGTH];
+
+    pthread_mutex_lock(&scrub_lock);
+    if (scrub_running) {
+        pthread_mutex_unlock(&scrub_lock);
+        return SUCCESS;
+    }
+    snprintf(hold, sizeof(hold), "%s/%s", BACKUP_DIR, SCRUB_HOLD_FILE);
+    scrub_hold_fd = open(hold, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    scrub_stopping = FALSE;
+    if (pthread_create(&scrub_thread, NULL, scrub_thread_main, NULL) != 0) {
+        pthread_mutex_unlock(&scrub_lock);
+        log_error("Failed to start the scrubbing thread");
+        return FAILURE;
+    }
+    scrub_running = TRUE;
+    pthread_mutex_unlock(&scrub_lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Make the scrubber yield before its next read until scrub_resume()
+ * Calls nest.
+ */
+void scrub_pause(void) {
+    pthread_mutex_lock(&scrub_lock);
+    scrub_paused++;
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+/**
+ * Let the scrubber continue after scrub_pause()
+ */
+void scrub_resume(void) {
+    pthread_mutex_lock(&scrub_lock);
+    if (scrub_paused > 0) {
+        scrub_paused--;
+    }
+    pthread_cond_broadcast(&scrub_wake);
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+/**
+ * Make any scrubber, in this or another process, yield while we work
+ * @return Descriptor to pass to scrub_release(), or -1 if the hold file
+ *         cannot be used (the caller carries on regardless)
+ */
+int scrub_hold(void) {
+    char hold[MAX_PATH_LENGTH];
+    int fd;
+
+    snprintf(hold, sizeof(hold), "%s/%s", BACKUP_DIR, SCRUB_HOLD_FILE);
+    fd = open(hold, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1 && flock(fd, LOCK_SH) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * End a scrub_hold()
+ */
+void scrub_release(int fd) {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * Stop the scrubbing thread
+ * Workers stop before their next read; the pass resumes on restart.
+ */
+void scrub_stop(void) {
+    pthread_mutex_lock(&scrub_lock);
+    if (!scrub_running) {
+        pthread_mutex_unlock(&scrub_lock);
+        return;
+    }
+    scrub_stopping = TRUE;
+    pthread_cond_broadcast(&scrub_wake);
+    pthread_mutex_unlock(&scrub_lock);
+
+    pthread_join(scrub_thread, NULL);
+
+    pthread_mutex_lock(&scrub_lock);
+    scrub_running = FALSE;
+    scrub_stopping = FALSE;
+    if (scrub_hold_fd != -1) {
+        close(scrub_hold_fd);
+        scrub_hold_fd = -1;
+    }
+    free(scrub_seen);
+    scrub_seen = NULL;
+    scrub_seen_capacity = 0;
+    scrub_seen_count = 0;
+    pthread_mutex_unlock(&scrub_lock);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file status.c
+ * @brief Status file for monitoring the running daemon
+ *
+ * The daemon rewrites STATUS_FILE every STATUS_INTERVAL seconds with one
+ * "name value" line per counter:
+ *
+ *     pid 1234
+ *     uptime_seconds 86400
+ *     log_errors_total 17
+ *     latency_ns{op="scan",quantile="0.99"} 180224
+ *
+ * METRICS_FILE is rewritten every METRICS_INTERVAL seconds with the
+ * cumulative latency buckets as well, for tools that compute their own
+ * percentiles or rates. If PROMETHEUS_DIR exists, the same metrics are
+ * written there in Prometheus text format with the status file, for the
+ * node exporter's textfile collector to serve.
+ *
+ * Both files are written under a temporary name and renamed into place, so a
+ * reader always sees a complete snapshot.
+ */
+
+#include "report_system.h"
+
+static time_t status_started = 0;
+
+/**
+ * Replace a snapshot file with what a writer puts out
+ * @param path File to replace
+ * @param fill Writes the contents
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int write_snapshot_file(const char* path, void (*fill)(FILE*)) {
+    char temp[MAX_PATH_LENGTH];
+    FILE *out;
+    int fd;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || (out = fdopen(fd, "w")) == NULL) {
+        log_error("Failed to write status file %s: %s", temp, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+
+    fill(out);
+
+    if (fclose(out) != 0 || rename(temp, path) != 0) {
+        log_error("Failed to write status file %s: %s", path, strerror(errno));
+        unlink(temp);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static void fill_status(FILE* out) {
+    time_t now = time(NULL);
+
+    if (status_started == 0) {
+        status_started = now;
+    }
+
+    fprintf(out, "pid %d\n", (int)getpid());
+    fprintf(out, "time %lld\n", (long long)now);
+    fprintf(out, "uptime_seconds %lld\n", (long long)(now - status_started));
+    log_write_status(out);
+    metrics_write_status(out);
+}
+
+static void fill_metrics(FILE* out) {
+    fprintf(out, "time %lld\n", (long long)time(NULL));
+    metrics_write_buckets(out);
+}
+
+/**
+ * Write a fresh status snapshot
+ * @return SUCCESS on success, FAILURE on error
+ */
+int status_write(void) {
+    return write_snapshot_file(STATUS_FILE, fill_status);
+}
+
+/**
+ * Write a fresh metrics snapshot with every latency bucket
+ * @return SUCCESS on success, FAILURE on error
+ */
+int status_write_metrics(void) {
+    return write_snapshot_file(METRICS_FILE, fill_metrics);
+}
+
+/**
+ * Write the metrics in Prometheus text format for the node exporter
+ * @return SUCCESS on success, FAILURE on error or without PROMETHEUS_DIR
+ */
+int status_write_prometheus(void) {
+    struct stat st;
+
+    if (stat(PROMETHEUS_DIR, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return FAILURE;
+    }
+    return write_snapshot_file(PROMETHEUS_FILE, metrics_write_prometheus);
+}
+
+/**
+ * Remove the status file when the daemon stops
+ */
+void status_remove(void) {
+    unlink(STATUS_FILE);
+    unlink(METRICS_FILE);
+    unlink(PROMETHEUS_FILE);
+}
@@ -4,140 +4,976 @@
  */
 
  #include "report_system.h"
+ #include <ctype.h>
  #include <stdarg.h>
+ #include <sys/resource.h>
+ #include <sys/syscall.h>
+ #include <linux/ioprio.h>
  
  /**
-  * Log an error message
-  * @param format Format string for the message
-  * @param ... Variable arguments
+  * @struct LogSink
+  * @brief One log file, kept open for appending
   */
- void log_error(const char* format, ...) {
-     FILE *log_fp;
-     va_list args;
-     time_t now;
-     char time_str[MAX_TIME_LENGTH];
+ typedef struct {
+     const char *path;
+     int fd;                           /* -1 until first used */
+     dev_t dev;                        /* Identity of the open file, to notice rotation */
+     ino_t ino;
+     time_t checked;                   /* Second of the last rotation check */
+     off_t size;                       /* Bytes in the open file */
+     time_t started;                   /* Time of the open file's first line */
+     int rotating;                     /* The rotation thread is replacing the file */
+     int batch_depth;                  /* Nesting of log_batch_begin() */
+     size_t buffered;                  /* Bytes waiting in buffer */
+     char buffer[LOG_BATCH_SIZE];
+     pthread_mutex_t lock;
+ } LogSink;
+ 
+ static LogSink log_sinks[LOG_SINK_COUNT] = {
+     { ERROR_LOG, -1, 0, 0, 0, 0, 0, FALSE, 0, 0, "", PTHREAD_MUTEX_INITIALIZER },
+     { OPERATION_LOG, -1, 0, 0, 0, 0, 0, FALSE, 0, 0, "", PTHREAD_MUTEX_INITIALIZER },
+     { CHANGE_LOG, -1, 0, 0, 0, 0, 0, FALSE, 0, 0, "", PTHREAD_MUTEX_INITIALIZER }
+ };
+ 
+ /* Rotation thread state, protected by log_rotation_lock */
+ static pthread_mutex_t log_rotation_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t log_rotation_wake = PTHREAD_COND_INITIALIZER;
+ static pthread_t log_rotation_thread;
+ static int log_rotation_running = FALSE;
+ static int log_rotation_stopping = FALSE;
+ 
+ /**
+  * @struct LogLimit
+  * @brief Token bucket of one log_error() call site
+  */
+ typedef struct {
+     const char *format;               /* NULL for a free slot */
+     const char *file;
+     int line;
+     double tokens;                    /* Messages that may be written now */
+     time_t refilled;
+     time_t suppressed_since;          /* First suppression since the last summary */
+     uint64_t suppressed;              /* Suppressed since the last summary */
+     uint64_t suppressed_total;
+     uint64_t written;
+ } LogLimit;
+ 
+ /* Error rate limits, protected by log_limit_lock */
+ static pthread_mutex_t log_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+ static LogLimit log_limits[LOG_LIMIT_SITES];
+ static uint64_t log_errors_total = 0;
+ static uint64_t log_errors_suppressed = 0;
+ 
+ /* Runtime levels and syslog copies, set by log_load_config() */
+ unsigned char log_module_levels[LOG_MODULE_COUNT] = {
+     LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL,
+     LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL
+ };
+ static int log_syslog_sinks = LOG_SYSLOG_SINKS;
+ 
+ static const char* const log_module_names[LOG_MODULE_COUNT] = {
+     "daemon", "files", "backup", "restore", "retention", "scrub"
+ };
+ static const char* const log_level_names[LOG_LEVEL_COUNT] = {
+     "trace", "debug", "info", "warn", "error"
+ };
+ static const char* const log_sink_names[LOG_SINK_COUNT] = {
+     "error", "operation", "change"
+ };
+ 
+ /* Bumped whenever the time zone is reloaded, invalidating every thread's cache */
+ static volatile int log_tz_generation = 0;
+ static pthread_once_t log_tz_once = PTHREAD_ONCE_INIT;
+ 
+ static void log_tz_load(void) {
+     tzset();
+     __atomic_add_fetch(&log_tz_generation, 1, __ATOMIC_RELEASE);
+ }
+ 
+ /**
+  * Find when a log file was started, from the timestamp of its first line
+  * @return That time, or now if the file is empty or does not start with a timestamp
+  */
+ static time_t log_file_started(int fd, off_t size, time_t now) {
+     char text[MAX_TIME_LENGTH + 1];
+     struct tm tm;
+     ssize_t got;
      
-     /* Get current time */
-     now = time(NULL);
-     get_timestamp_string(now, time_str, MAX_TIME_LENGTH);
+     if (size == 0 || (got = pread(fd, text, sizeof(text) - 1, 0)) <= 0) {
+         return now;
+     }
+     text[got] = '\0';
+     memset(&tm, 0, sizeof(tm));
+     if (text[0] != '[' || strptime(text + 1, "%Y-%m-%d %H:%M:%S", &tm) == NULL) {
+         return now;
+     }
+     tm.tm_isdst = -1;
+     return mktime(&tm);
+ }
+ 
+ /**
+  * Open or reopen a sink's file
+  * Called with the sink's lock held.
+  * @return SUCCESS on success, FAILURE on error
+  */
+ static int log_sink_open(LogSink* sink) {
+     struct stat st;
+     int fd;
      
-     /* Open the error log file for appending */
-     log_fp = fopen(ERROR_LOG, "a");
-     if (log_fp == NULL) {
-         /* Fall back to syslog if file can't be opened */
-         va_start(args, format);
-         vsyslog(LOG_ERR, format, args);
-         va_end(args);
+     fd = open(sink->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+     if (fd == -1) {
+         return FAILURE;
+     }
+     if (sink->fd != -1) {
+         close(sink->fd);
+     }
+     sink->fd = fd;
+     if (fstat(fd, &st) == 0) {
+         sink->dev = st.st_dev;
+         sink->ino = st.st_ino;
+         sink->size = st.st_size;
+         sink->started = log_file_started(fd, st.st_size, time(NULL));
+     }
+     return SUCCESS;
+ }
+ 
+ /**
+  * Reopen the file if it was rotated away since the last check
+  * The path is only looked at once per second.
+  * Called with the sink's lock held.
+  */
+ static void log_sink_check_rotation(LogSink* sink, time_t now) {
+     struct stat st;
+     
+     if (sink->fd != -1 && (now == sink->checked || sink->rotating)) {
          return;
      }
+     sink->checked = now;
+     if (sink->fd == -1 || stat(sink->path, &st) != 0 || 
+         st.st_dev != sink->dev || st.st_ino != sink->ino) {
+         log_sink_open(sink);
+     }
+ }
+ 
+ /**
+  * Write out what a sink has buffered, in one write
+  * Called with the sink's lock held.
+  * @return SUCCESS on success, FAILURE if the file could not be written
+  */
+ static int log_sink_flush(LogSink* sink) {
+     size_t done = 0;
      
-     /* Write timestamp and error prefix */
-     fprintf(log_fp, "[%s] ERROR: ", time_str);
+     while (done < sink->buffered) {
+         ssize_t written = (sink->fd == -1) ? -1 : 
+                           write(sink->fd, sink->buffer + done, sink->buffered - done);
+         if (written <= 0) {
+             if (written == -1 && errno == EINTR) {
+                 continue;
+             }
+             syslog(LOG_ERR, "Failed to write %s: %s", sink->path, strerror(errno));
+             sink->buffered = 0;
+             return FAILURE;
+         }
+         done += (size_t)written;
+         sink->size += written;
+     }
+     sink->buffered = 0;
+     return SUCCESS;
+ }
+ 
+ /**
+  * Append a complete line to a sink
+  * Outside a batch the line is written at once; inside one it waits in the
+  * buffer until the batch ends or the buffer fills.
+  * @return SUCCESS on success, FAILURE if the log file cannot be written
+  */
+ static int log_sink_append(int which, const char* line, size_t length) {
+     LogSink *sink = &log_sinks[which];
+     int result = SUCCESS;
      
-     /* Write the formatted message */
-     va_start(args, format);
-     vfprintf(log_fp, format, args);
-     va_end(args);
+     pthread_mutex_lock(&sink->lock);
+     log_sink_check_rotation(sink, time(NULL));
+     if (sink->fd == -1) {
+         pthread_mutex_unlock(&sink->lock);
+         return FAILURE;
+     }
+     if (sink->buffered + length > sizeof(sink->buffer)) {
+         result = log_sink_flush(sink);
+     }
+     if (length > sizeof(sink->buffer)) {
+         length = sizeof(sink->buffer);
+     }
+     memcpy(sink->buffer + sink->buffered, line, length);
+     sink->buffered += length;
+     if (sink->batch_depth == 0) {
+         result = log_sink_flush(sink);
+     }
+     pthread_mutex_unlock(&sink->lock);
+     
+     return result;
+ }
+ 
+ /**
+  * Format a log line and append it to a sink
+  * @param when Time shown on the line
+  * @param label Text between the timestamp and the message
+  * @return SUCCESS on success, FAILURE if the log file cannot be written
+  */
+ static int log_vwrite(int which, time_t when, const char* label, const char* format, va_list args) {
+     char line[LOG_LINE_LENGTH];
+     int length, message;
+     
+     get_timestamp_string(when, line + 1, MAX_TIME_LENGTH);
+     line[0] = '[';
+     length = (int)strlen(line);
+     length += snprintf(line + length, sizeof(line) - length, "] %s", label);
+     message = vsnprintf(line + length, sizeof(line) - length, format, args);
+     if (message < 0) {
+         message = 0;
+     }
+     length = (length + message < (int)sizeof(line) - 1) ? length + message : (int)sizeof(line) - 2;
      
      /* Add newline if not present */
-     if (format[strlen(format) - 1] != '\n') {
-         fprintf(log_fp, "\n");
+     if (line[length - 1] != '\n') {
+         line[length++] = '\n';
+         line[length] = '\0';
      }
      
-     /* Close the log file */
-     fclose(log_fp);
+     if (log_sink_append(which, line, (size_t)length) != SUCCESS) {
+         metrics_count(METRIC_LOG_DROPS, 1);
+         return FAILURE;
+     }
+     return SUCCESS;
+ }
+ 
+ /**
+  * Format a line for a given time and append it to a sink
+  */
+ static int log_write(int which, time_t when, const char* label, const char* format, ...) {
+     va_list args;
+     int result;
      
-     /* Also log to syslog */
      va_start(args, format);
-     vsyslog(LOG_ERR, format, args);
+     result = log_vwrite(which, when, label, format, args);
      va_end(args);
+     return result;
+ }
+ 
+ /**
+  * Find the rate limit slot of a call site, claiming a free one if needed
+  * Called with log_limit_lock held.
+  * @return The slot, or NULL if the table is full
+  */
+ static LogLimit* log_limit_slot(const char* file, int line, const char* format, time_t now) {
+     size_t hash = ((uintptr_t)format ^ ((uintptr_t)file << 7) ^ (size_t)line) * 0x9E3779B97F4A7C15ULL;
+     
+     for (int probe = 0; probe < LOG_LIMIT_SITES; probe++) {
+         LogLimit *slot = &log_limits[(hash + probe) & (LOG_LIMIT_SITES - 1)];
+         
+         if (slot->format == NULL) {
+             slot->format = format;
+             slot->file = file;
+             slot->line = line;
+             slot->tokens = LOG_LIMIT_BURST;
+             slot->refilled = now;
+             return slot;
+         }
+         if (slot->format == format && slot->line == line && slot->file == file) {
+             return slot;
+         }
+     }
+     return NULL;
  }
  
  /**
-  * Log an operation message
+  * Take a token for one message from its call site's bucket
+  * @return TRUE if the message may be written, FALSE if it is suppressed
+  */
+ static int log_limit_admit(const char* file, int line, const char* format, time_t now) {
+     LogLimit *slot;
+     int admit = TRUE;
+     
+     pthread_mutex_lock(&log_limit_lock);
+     log_errors_total++;
+     slot = log_limit_slot(file, line, format, now);
+     if (slot != NULL) {
+         slot->tokens += (double)(now - slot->refilled) * LOG_LIMIT_PER_MINUTE / 60.0;
+         if (slot->tokens > LOG_LIMIT_BURST) {
+             slot->tokens = LOG_LIMIT_BURST;
+         }
+         slot->refilled = now;
+         
+         if (slot->tokens >= 1.0) {
+             slot->tokens -= 1.0;
+             slot->written++;
+         } else {
+             if (slot->suppressed == 0) {
+                 slot->suppressed_since = now;
+             }
+             slot->suppressed++;
+             slot->suppressed_total++;
+             log_errors_suppressed++;
+             metrics_count(METRIC_LOG_SUPPRESSED, 1);
+             admit = FALSE;
+         }
+     }
+     pthread_mutex_unlock(&log_limit_lock);
+     return admit;
+ }
+ 
+ /**
+  * Write a log message; use the log_error(), log_warn(), log_info(),
+  * log_debug() and log_trace() macros, which skip disabled levels before
+  * the arguments are evaluated
+  * Errors and warnings go to the error log, the other levels to the
+  * operations log. Messages from one call site to the error log are
+  * limited to LOG_LIMIT_BURST at once and LOG_LIMIT_PER_MINUTE after
+  * that; the rest are counted and summed up in one line every
+  * LOG_LIMIT_SUMMARY seconds.
+  * @param level LOG_LEVEL_*
+  * @param file Source file of the call
+  * @param line Source line of the call
   * @param format Format string for the message
   * @param ... Variable arguments
   */
- void log_operation(const char* format, ...) {
-     FILE *log_fp;
+ void log_message_at(int level, const char* file, int line, const char* format, ...) {
+     static const char* const labels[LOG_LEVEL_COUNT] = {
+         "TRACE: ", "DEBUG: ", "INFO: ", "WARNING: ", "ERROR: "
+     };
+     static const int priorities[LOG_LEVEL_COUNT] = {
+         LOG_DEBUG, LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR
+     };
+     int which = (level >= LOG_LEVEL_WARN) ? LOG_SINK_ERROR : LOG_SINK_OPERATION;
      va_list args;
-     time_t now;
-     char time_str[MAX_TIME_LENGTH];
-     
-     /* Get current time */
-     now = time(NULL);
-     get_timestamp_string(now, time_str, MAX_TIME_LENGTH);
+     time_t now = time(NULL);
+     int written;
      
-     /* Open the operation log file for appending */
-     log_fp = fopen(OPERATION_LOG, "a");
-     if (log_fp == NULL) {
-         /* Fall back to syslog if file can't be opened */
-         va_start(args, format);
-         vsyslog(LOG_INFO, format, args);
-         va_end(args);
+     if (which == LOG_SINK_ERROR && !log_limit_admit(file, line, format, now)) {
+         log_summarize_suppressed(FALSE);
          return;
      }
      
-     /* Write timestamp and info prefix */
-     fprintf(log_fp, "[%s] INFO: ", time_str);
-     
-     /* Write the formatted message */
      va_start(args, format);
-     vfprintf(log_fp, format, args);
+     written = log_vwrite(which, now, labels[level], format, args);
      va_end(args);
      
-     /* Add newline if not present */
-     if (format[strlen(format) - 1] != '\n') {
-         fprintf(log_fp, "\n");
+     /* Syslog gets a copy if asked for, and is the fallback if the file can't be written */
+     if ((__atomic_load_n(&log_syslog_sinks, __ATOMIC_RELAXED) & (1 << which)) || written != SUCCESS) {
+         va_start(args, format);
+         vsyslog(priorities[level], format, args);
+         va_end(args);
      }
+ }
+ 
+ /**
+  * Write a summary line for each call site whose messages were suppressed
+  * @param all Summarise every site now, rather than those whose
+  *            LOG_LIMIT_SUMMARY seconds have passed
+  */
+ void log_summarize_suppressed(int all) {
+     LogLimit due[16];
+     int count;
+     time_t now = time(NULL);
      
-     /* Close the log file */
-     fclose(log_fp);
+     do {
+         count = 0;
+         pthread_mutex_lock(&log_limit_lock);
+         for (int i = 0; i < LOG_LIMIT_SITES && count < (int)(sizeof(due) / sizeof(due[0])); i++) {
+             LogLimit *slot = &log_limits[i];
+             
+             if (slot->suppressed > 0 && (all || now - slot->suppressed_since >= LOG_LIMIT_SUMMARY)) {
+                 due[count++] = *slot;
+                 slot->suppressed = 0;
+             }
+         }
+         pthread_mutex_unlock(&log_limit_lock);
+         
+         for (int i = 0; i < count; i++) {
+             const char *base = strrchr(due[i].file, '/');
+             
+             base = (base != NULL) ? base + 1 : due[i].file;
+             log_write(LOG_SINK_ERROR, now, "ERROR: ",
+                       "Suppressed %llu similar messages in %ld s (%s:%d): %s",
+                       (unsigned long long)due[i].suppressed, (long)(now - due[i].suppressed_since),
+                       base, due[i].line, due[i].format);
+             syslog(LOG_ERR, "Suppressed %llu similar messages (%s:%d): %s",
+                    (unsigned long long)due[i].suppressed, base, due[i].line, due[i].format);
+         }
+     } while (count == (int)(sizeof(due) / sizeof(due[0])));
+ }
+ 
+ static int log_lookup(const char* const* names, int count, const char* name) {
+     for (int i = 0; i < count; i++) {
+         if (strcmp(names[i], name) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /**
+  * Load the runtime log levels and syslog copies from LOG_CONFIG_FILE
+  * Each line is "<module> <level>", "default <level>" or
+  * "syslog <sink> on|off"; '#' starts a comment. Settings missing from the
+  * file go back to their defaults, and a missing file means defaults only.
+  * Levels below LOG_MIN_LEVEL were compiled out and stay off.
+  */
+ void log_load_config(void) {
+     unsigned char levels[LOG_MODULE_COUNT];
+     int syslog_sinks = LOG_SYSLOG_SINKS;
+     char line[MAX_LINE_LENGTH];
+     int line_number = 0;
+     FILE *config;
      
-     /* Also log to syslog */
-     va_start(args, format);
-     vsyslog(LOG_INFO, format, args);
-     va_end(args);
+     memset(levels, LOG_DEFAULT_LEVEL, sizeof(levels));
+     config = fopen(LOG_CONFIG_FILE, "re");
+     if (config == NULL && errno != ENOENT) {
+         log_warn("Cannot read %s: %s", LOG_CONFIG_FILE, strerror(errno));
+     }
+     while (config != NULL && fgets(line, sizeof(line), config) != NULL) {
+         char first[64], second[64], third[64];
+         int fields, module, level, sink;
+         
+         line_number++;
+         line[strcspn(line, "#\n")] = '\0';
+         fields = sscanf(line, "%63s %63s %63s", first, second, third);
+         if (fields <= 0) {
+             continue;
+         }
+         if (fields == 3 && strcmp(first, "syslog") == 0 &&
+             (sink = log_lookup(log_sink_names, LOG_SINK_COUNT, second)) >= 0 &&
+             (strcmp(third, "on") == 0 || strcmp(third, "off") == 0)) {
+             if (third[1] == 'n') {
+                 syslog_sinks |= 1 << sink;
+             } else {
+                 syslog_sinks &= ~(1 << sink);
+             }
+             continue;
+         }
+         if (fields == 2 && (level = log_lookup(log_level_names, LOG_LEVEL_COUNT, second)) >= 0) {
+             if (strcmp(first, "default") == 0) {
+                 memset(levels, level, sizeof(levels));
+                 continue;
+             }
+             if ((module = log_lookup(log_module_names, LOG_MODULE_COUNT, first)) >= 0) {
+                 levels[module] = (unsigned char)level;
+                 continue;
+             }
+         }
+         log_warn("%s:%d: unrecognised setting", LOG_CONFIG_FILE, line_number);
+     }
+     if (config != NULL) {
+         fclose(config);
+     }
+     
+     for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+         __atomic_store_n(&log_module_levels[i], levels[i], __ATOMIC_RELAXED);
+     }
+     __atomic_store_n(&log_syslog_sinks, syslog_sinks, __ATOMIC_RELAXED);
+ }
+ 
+ /**
+  * Write the error log counters, one "name value" line each
+  * @param out Stream receiving the lines
+  */
+ void log_write_status(FILE* out) {
+     for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+         int level = __atomic_load_n(&log_module_levels[i], __ATOMIC_RELAXED);
+         fprintf(out, "log_level{module=\"%s\"} %s\n", log_module_names[i],
+                 log_level_names[(level < LOG_MIN_LEVEL) ? LOG_MIN_LEVEL : level]);
+     }
+     
+     pthread_mutex_lock(&log_limit_lock);
+     fprintf(out, "log_errors_total %llu\n", (unsigned long long)log_errors_total);
+     fprintf(out, "log_errors_suppressed_total %llu\n", (unsigned long long)log_errors_suppressed);
+     for (int i = 0; i < LOG_LIMIT_SITES; i++) {
+         const LogLimit *slot = &log_limits[i];
+         const char *base;
+         
+         if (slot->format == NULL || slot->suppressed_total == 0) {
+             continue;
+         }
+         base = strrchr(slot->file, '/');
+         fprintf(out, "log_errors_suppressed{site=\"%s:%d\"} %llu\n",
+                 (base != NULL) ? base + 1 : slot->file, slot->line,
+                 (unsigned long long)slot->suppressed_total);
+     }
+     pthread_mutex_unlock(&log_limit_lock);
  }
  
  /**
   * Log a change record
   * @param record Pointer to the change record to log
+  * @return SUCCESS on success, FAILURE on error
+  */
+ int log_change(const ChangeRecord* record) {
+     int result = SUCCESS;
+     
+ #if CHANGE_LOG_FORMAT & CHANGE_LOG_TEXT
+     if (log_write(LOG_SINK_CHANGE, record->timestamp, "", "User: %s, File: %s, Action: %s", 
+                   record->username, record->filename, record->action) != SUCCESS) {
+         log_error("Failed to write change log file: %s", strerror(errno));
+         result = FAILURE;
+     }
+ #endif
+ #if CHANGE_LOG_FORMAT & CHANGE_LOG_BINARY
+     if (changelog_append(record->timestamp, record->username, record->filename,
+                          record->action) != SUCCESS) {
+         log_error("Failed to write binary change log: %s", strerror(errno));
+         result = FAILURE;
+     } else if (__atomic_load_n(&log_sinks[LOG_SINK_CHANGE].batch_depth, __ATOMIC_RELAXED) == 0) {
+         changelog_flush();
+     }
+ #endif
+     return result;
+ }
+ 
+ /**
+  * Buffer the lines of a log until log_batch_end()
+  * Lines from all threads go into the batch; calls nest.
+  * @param which LOG_SINK_ERROR, LOG_SINK_OPERATION or LOG_SINK_CHANGE
+  */
+ void log_batch_begin(int which) {
+     LogSink *sink = &log_sinks[which];
+     
+     pthread_mutex_lock(&sink->lock);
+     sink->batch_depth++;
+     pthread_mutex_unlock(&sink->lock);
+ }
+ 
+ /**
+  * Write out a batch started with log_batch_begin()
+  * @param which The sink passed to log_batch_begin()
+  */
+ void log_batch_end(int which) {
+     LogSink *sink = &log_sinks[which];
+     
+     pthread_mutex_lock(&sink->lock);
+     if (sink->batch_depth > 0 && --sink->batch_depth == 0) {
+         log_sink_flush(sink);
+     }
+     pthread_mutex_unlock(&sink->lock);
+ 
+ #if CHANGE_LOG_FORMAT & CHANGE_LOG_BINARY
+     if (which == LOG_SINK_CHANGE) {
+         changelog_flush();
+     }
+ #endif
+ }
+ 
+ /**
+  * Reopen every log file and reload the time zone
+  * For SIGHUP after external log rotation or a time zone change.
+  */
+ void log_reopen(void) {
+     pthread_once(&log_tz_once, log_tz_load);
+     log_tz_load();
+     
+     for (int i = 0; i < LOG_SINK_COUNT; i++) {
+         pthread_mutex_lock(&log_sinks[i].lock);
+         log_sink_flush(&log_sinks[i]);
+         if (log_sinks[i].fd != -1) {
+             log_sink_open(&log_sinks[i]);
+         }
+         pthread_mutex_unlock(&log_sinks[i].lock);
+     }
+ }
+ 
+ /**
+  * Flush and close every log file
+  * A later log call opens the file again.
+  */
+ void log_close(void) {
+     log_summarize_suppressed(TRUE);
+     
+     for (int i = 0; i < LOG_SINK_COUNT; i++) {
+         pthread_mutex_lock(&log_sinks[i].lock);
+         log_sink_flush(&log_sinks[i]);
+         if (log_sinks[i].fd != -1) {
+             close(log_sinks[i].fd);
+             log_sinks[i].fd = -1;
+         }
+         pthread_mutex_unlock(&log_sinks[i].lock);
+     }
+ }
+
+ static const char* log_sink_name(const LogSink* sink) {
+     const char *slash = strrchr(sink->path, '/');
+     return (slash != NULL) ? slash + 1 : sink->path;
+ }
+ 
+ /**
+  * Check whether a sink's file is due to be rotated
+  */
+ static int log_sink_due(LogSink* sink, time_t now) {
+     int due;
+     
+     pthread_mutex_lock(&sink->lock);
+     due = sink->fd != -1 && sink->size > 0 &&
+           ((LOG_ROTATE_SIZE > 0 && sink->size >= (off_t)LOG_ROTATE_SIZE) ||
+            (LOG_ROTATE_AGE > 0 && now - sink->started >= LOG_ROTATE_AGE));
+     pthread_mutex_unlock(&sink->lock);
+     return due;
+ }
+ 
+ /**
+  * Rename a sink's file aside and switch the sink to a fresh file
+  * Writers keep appending to the old file until the descriptors are
+  * swapped; the sink's lock is only held for the swap itself.
+  * @param logs_fd Log directory
+  * @return SUCCESS on success, FAILURE on error
+  */
+ static int log_sink_rotate(LogSink* sink, int logs_fd) {
+     const char *name = log_sink_name(sink);
+     char rotated[NAME_MAX + 1];
+     char stamp[32];
+     struct tm tm_info;
+     struct stat st;
+     time_t now = time(NULL);
+     int fd, old_fd;
+     
+     localtime_r(&now, &tm_info);
+     strftime(stamp, sizeof(stamp), LOG_ROTATE_STAMP, &tm_info);
+     snprintf(rotated, sizeof(rotated), "%s.%s", name, stamp);
+     /* Only this thread creates rotated names, so the first free one stays free */
+     for (int n = 1; faccessat(logs_fd, rotated, F_OK, 0) == 0 && n < 100; n++) {
+         snprintf(rotated, sizeof(rotated), "%s.%s-%d", name, stamp, n);
+     }
+     
+     pthread_mutex_lock(&sink->lock);
+     sink->rotating = TRUE;
+     pthread_mutex_unlock(&sink->lock);
+     
+     fd = -1;
+     if (renameat(logs_fd, name, logs_fd, rotated) == 0) {
+         fd = openat(logs_fd, name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+     }
+     if (fd == -1 || fstat(fd, &st) != 0) {
+         int saved_errno = errno;
+         
+         if (fd != -1) {
+             close(fd);
+         }
+         pthread_mutex_lock(&sink->lock);
+         sink->rotating = FALSE;
+         pthread_mutex_unlock(&sink->lock);
+         log_error("Failed to rotate %s: %s", sink->path, strerror(saved_errno));
+         return FAILURE;
+     }
+     
+     pthread_mutex_lock(&sink->lock);
+     old_fd = sink->fd;
+     sink->fd = fd;
+     sink->dev = st.st_dev;
+     sink->ino = st.st_ino;
+     sink->size = st.st_size;
+     sink->started = now;
+     sink->rotating = FALSE;
+     pthread_mutex_unlock(&sink->lock);
+     
+     if (old_fd != -1) {
+         close(old_fd);
+     }
+     return SUCCESS;
+ }
+
+ /**
+  * Check that a name is a rotated copy of a log: <log>.<stamp>[-n][.gz]
+  * @param suffix Text after "<log>."
+  * @param compressed Receives whether it ends in .gz
+  */
+ static int log_rotated_suffix(const char* suffix, int* compressed) {
+     size_t length = strlen(suffix);
+     size_t stamp = 0;
+     
+     *compressed = (length > 3 && strcmp(suffix + length - 3, ".gz") == 0);
+     if (*compressed) {
+         length -= 3;
+     }
+     /* YYYYmmdd-HHMMSS, then an optional -n */
+     for (; stamp < length && stamp < 15; stamp++) {
+         if ((stamp == 8) ? suffix[stamp] != '-' : !isdigit((unsigned char)suffix[stamp])) {
+             return FALSE;
+         }
+     }
+     if (stamp != 15) {
+         return FALSE;
+     }
+     if (stamp < length) {
+         if (suffix[stamp] != '-' || stamp + 1 == length) {
+             return FALSE;
+         }
+         for (stamp++; stamp < length; stamp++) {
+             if (!isdigit((unsigned char)suffix[stamp])) {
+                 return FALSE;
+             }
+         }
+     }
+     return TRUE;
+ }
+ 
+ static int compare_rotated(const void* a, const void* b) {
+     return strcmp(*(char* const*)a, *(char* const*)b);
+ }
+ 
+ /**
+  * Compress every rotated log not compressed yet, and remove the oldest
+  * beyond LOG_ROTATE_KEEP per log
+  * Files left uncompressed by an earlier run are picked up as well.
+  * @param logs_fd Log directory
+  */
+ static void log_rotation_sweep(int logs_fd) {
+     for (int i = 0; i < LOG_SINK_COUNT; i++) {
+         const char *name = log_sink_name(&log_sinks[i]);
+         size_t name_length = strlen(name);
+         DirEnumerator iter;
+         DirEntry entry;
+         char **rotated = NULL;
+         int count = 0, capacity = 0, kept;
+         
+         if (dir_enum_open(&iter, logs_fd) != SUCCESS) {
+             return;
+         }
+         while (dir_enum_next(&iter, &entry)) {
+             int compressed;
+             
+             if (strncmp(entry.name, name, name_length) != 0 || entry.name[name_length] != '.' ||
+                 !log_rotated_suffix(entry.name + name_length + 1, &compressed)) {
+                 continue;
+             }
+             if (count == capacity) {
+                 char **grown;
+                 capacity = capacity ? capacity * 2 : 32;
+                 grown = (char**)realloc(rotated, capacity * sizeof(char*));
+                 if (grown == NULL) {
+                     break;
+                 }
+                 rotated = grown;
+             }
+             if ((rotated[count] = strdup(entry.name)) != NULL) {
+                 count++;
+             }
+         }
+         dir_enum_close(&iter);
+         
+         for (int j = 0; j < count; j++) {
+             char compressed_name[NAME_MAX + 1];
+             size_t length = strlen(rotated[j]);
+             
+             if (length > 3 && strcmp(rotated[j] + length - 3, ".gz") == 0) {
+                 continue;
+             }
+             if (__atomic_load_n(&log_rotation_stopping, __ATOMIC_RELAXED)) {
+                 break;
+             }
+             snprintf(compressed_name, sizeof(compressed_name), "%s.gz", rotated[j]);
+             if (compress_file_at(logs_fd, rotated[j], logs_fd, compressed_name,
+                                  LOG_ROTATE_LEVEL, NULL) == SUCCESS) {
+                 unlinkat(logs_fd, rotated[j], 0);
+                 free(rotated[j]);
+                 rotated[j] = strdup(compressed_name);
+             }
+         }
+         
+         /* Drop names lost to a failed strdup; the next sweep sees those files again */
+         kept = 0;
+         for (int j = 0; j < count; j++) {
+             if (rotated[j] != NULL) {
+                 rotated[kept++] = rotated[j];
+             }
+         }
+         count = kept;
+         
+         /* Stamps sort by time; a plain file and its .gz never both survive */
+         qsort(rotated, count, sizeof(char*), compare_rotated);
+         for (int j = 0; j < count - LOG_ROTATE_KEEP; j++) {
+             unlinkat(logs_fd, rotated[j], 0);
+         }
+         for (int j = 0; j < count; j++) {
+             free(rotated[j]);
+         }
+         free(rotated);
+     }
+ }
+ 
+ /**
+  * Rotation thread: rotate logs that are due, then compress them
   */
- void log_change(ChangeRecord* record) {
-     FILE *log_fp;
-     char time_str[MAX_TIME_LENGTH];
+ static void* log_rotation_main(void* arg) {
+     int sweep = TRUE;                 /* Finish what an earlier run left */
+     (void)arg;
      
-     /* Get timestamp string */
-     get_timestamp_string(record->timestamp, time_str, MAX_TIME_LENGTH);
+     lower_thread_priority("log rotation");
      
-     /* Open the change log file for appending */
-     log_fp = fopen(CHANGE_LOG, "a");
-     if (log_fp == NULL) {
-         log_error("Failed to open change log file: %s", strerror(errno));
+     pthread_mutex_lock(&log_rotation_lock);
+     while (!log_rotation_stopping) {
+         struct timespec deadline;
+         int logs_fd;
+         
+         pthread_mutex_unlock(&log_rotation_lock);
+         logs_fd = report_dir_fd(REPORT_DIR_LOGS);
+         if (logs_fd != -1) {
+             time_t now = time(NULL);
+             
+             for (int i = 0; i < LOG_SINK_COUNT; i++) {
+                 if (log_sink_due(&log_sinks[i], now) && log_sink_rotate(&log_sinks[i], logs_fd) == SUCCESS) {
+                     sweep = TRUE;
+                 }
+             }
+             if (sweep) {
+                 log_rotation_sweep(logs_fd);
+                 sweep = FALSE;
+             }
+         }
+         pthread_mutex_lock(&log_rotation_lock);
+         
+         /* Sizes are checked once a second; writers never wait for this thread */
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_sec += 1;
+         if (!log_rotation_stopping) {
+             pthread_cond_timedwait(&log_rotation_wake, &log_rotation_lock, &deadline);
+         }
+     }
+     pthread_mutex_unlock(&log_rotation_lock);
+     return NULL;
+ }
+ 
+ /**
+  * Start the log rotation thread
+  * Logs are rotated when they reach LOG_ROTATE_SIZE bytes or their first
+  * line is LOG_ROTATE_AGE seconds old. The rotated file is gzipped at idle
+  * priority and only the newest LOG_ROTATE_KEEP are kept.
+  * @return SUCCESS on success, FAILURE if the thread could not be started
+  */
+ int log_rotation_start(void) {
+     pthread_mutex_lock(&log_rotation_lock);
+     if (log_rotation_running) {
+         pthread_mutex_unlock(&log_rotation_lock);
+         return SUCCESS;
+     }
+     log_rotation_stopping = FALSE;
+     if (pthread_create(&log_rotation_thread, NULL, log_rotation_main, NULL) != 0) {
+         pthread_mutex_unlock(&log_rotation_lock);
+         log_error("Failed to start the log rotation thread");
+         return FAILURE;
+     }
+     log_rotation_running = TRUE;
+     pthread_mutex_unlock(&log_rotation_lock);
+     return SUCCESS;
+ }
+ 
+ /**
+  * Stop the log rotation thread
+  * A rotated log left uncompressed is compressed on the next start.
+  */
+ void log_rotation_stop(void) {
+     pthread_mutex_lock(&log_rotation_lock);
+     if (!log_rotation_running) {
+         pthread_mutex_unlock(&log_rotation_lock);
          return;
      }
+     __atomic_store_n(&log_rotation_stopping, TRUE, __ATOMIC_RELAXED);
+     pthread_cond_broadcast(&log_rotation_wake);
+     pthread_mutex_unlock(&log_rotation_lock);
      
-     /* Write the log entry */
-     fprintf(log_fp, "[%s] User: %s, File: %s, Action: %s\n", 
-             time_str, record->username, record->filename, record->action);
+     pthread_join(log_rotation_thread, NULL);
      
-     /* Close the log file */
-     fclose(log_fp);
+     pthread_mutex_lock(&log_rotation_lock);
+     log_rotation_running = FALSE;
+     log_rotation_stopping = FALSE;
+     pthread_mutex_unlock(&log_rotation_lock);
  }
  
  /**
   * Get a formatted timestamp string
+  * The text is cached per thread for the current second, so a burst of
+  * log lines formats the time once.
   * @param timestamp Timestamp to format
   * @param buffer Buffer to store the formatted timestamp
   * @param buffer_size Size of the buffer
   * @return Pointer to the buffer
   */
  char* get_timestamp_string(time_t timestamp, char* buffer, size_t buffer_size) {
-     struct tm *tm_info;
+     static __thread time_t cached_time = (time_t)-1;
+     static __thread int cached_generation = -1;
+     static __thread char cached_text[MAX_TIME_LENGTH];
+     int generation;
+     
+     /* localtime_r need not read TZ itself; load it once for all threads */
+     pthread_once(&log_tz_once, log_tz_load);
+     generation = __atomic_load_n(&log_tz_generation, __ATOMIC_ACQUIRE);
      
-     tm_info = localtime(&timestamp);
-     strftime(buffer, buffer_size, "%Y-%m-%d %H:%M:%S", tm_info);
+     if (timestamp != cached_time || generation != cached_generation) {
+         struct tm tm_info;
+         
+         localtime_r(&timestamp, &tm_info);
+         strftime(cached_text, sizeof(cached_text), "%Y-%m-%d %H:%M:%S", &tm_info);
+         cached_time = timestamp;
+         cached_generation = generation;
+     }
+     snprintf(buffer, buffer_size, "%s", cached_text);
      
      return buffer;
- }
\ No newline at end of file
+ }
+
+ /**
+  * Parse a time given on a command line, in local time
+  * Accepts YYYY-MM-DD[ HH:MM[:SS]], YYYY-MM-DD_HH-MM-SS and @epoch.
+  * @param text Text to parse
+  * @param end_of_day Whether a date alone means the end of that day rather than its start
+  * @param when Receives the time
+  * @return SUCCESS on success, FAILURE if the format is not recognised
+  */
+ int parse_local_time(const char* text, int end_of_day, time_t* when) {
+     struct tm tm;
+     const char *end;
+     
+     if (text[0] == '@') {
+         char *number_end;
+         long long seconds = strtoll(text + 1, &number_end, 10);
+         if (number_end == text + 1 || *number_end != '\0') {
+             return FAILURE;
+         }
+         *when = (time_t)seconds;
+         return SUCCESS;
+     }
+     
+     memset(&tm, 0, sizeof(tm));
+     if (((end = strptime(text, "%Y-%m-%d %H:%M:%S", &tm)) != NULL && *end == '\0') ||
+         ((end = strptime(text, BACKUP_NAME_FORMAT, &tm)) != NULL && *end == '\0') ||
+         ((end = strptime(text, "%Y-%m-%d %H:%M", &tm)) != NULL && *end == '\0')) {
+         tm.tm_isdst = -1;
+         *when = mktime(&tm);
+         return SUCCESS;
+     }
+     
+     memset(&tm, 0, sizeof(tm));
+     if ((end = strptime(text, "%Y-%m-%d", &tm)) != NULL && *end == '\0') {
+         if (end_of_day) {
+             tm.tm_hour = 23;
+             tm.tm_min = 59;
+             tm.tm_sec = 59;
+         }
+         tm.tm_isdst = -1;
+         *when = mktime(&tm);
+         return SUCCESS;
+     }
+     
+     return FAILURE;
+ }
+ 
+ /**
+  * Run the calling thread at idle I/O priority and lowest CPU priority
+  * The idle I/O class only takes effect under schedulers that honour it
+  * (BFQ, CFQ); elsewhere the callers' batching and pausing still apply.
+  * @param purpose What the thread does, for the error message
+  */
+ void lower_thread_priority(const char* purpose) {
+     pid_t tid = (pid_t)syscall(SYS_gettid);
+     
+     if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                 IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) != 0) {
+         log_error("Failed to lower %s I/O priority: %s", purpose, strerror(errno));
+     }
+     setpriority(PRIO_PROCESS, (id_t)tid, 19);
+ }
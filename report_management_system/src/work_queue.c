@@ -0,0 +1,162 @@
+/**
+ * @file work_queue.c
+ * @brief Bounded blocking queue used to connect worker pipeline stages
+ */
+
+#include "report_system.h"
+
+/**
+ * Publish the queue's depth if it is tracked; called with the lock held
+ */
+static void queue_depth_changed(const WorkQueue* queue) {
+    if (queue->gauge >= 0) {
+        metrics_gauge(queue->gauge, queue->count);
+    }
+}
+
+/**
+ * Initialize a bounded work queue
+ * @param queue Queue to initialize
+ * @param capacity Maximum number of items held before producers block
+ * @return SUCCESS on success, FAILURE on error
+ */
+int work_queue_init(WorkQueue* queue, int capacity) {
+    if (capacity <= 0) {
+        capacity = 1;
+    }
+
+    queue->items = (void**)malloc(capacity * sizeof(void*));
+    if (queue->items == NULL) {
+        log_error("Memory allocation failed for work queue");
+        return FAILURE;
+    }
+
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = FALSE;
+    queue->gauge = -1;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Release the resources held by a work queue
+ * Any items still queued are not freed; drain the queue first.
+ * @param queue Queue to destroy
+ */
+void work_queue_destroy(WorkQueue* queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+
+    free(queue->items);
+    queue->items = NULL;
+}
+
+/**
+ * Add an item to the queue, blocking while the queue is full
+ * @param queue Queue to push to
+ * @param item Item to add
+ * @return SUCCESS on success, FAILURE if the queue has been closed
+ */
+int work_queue_push(WorkQueue* queue, void* item) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        return FAILURE;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    queue_depth_changed(queue);
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+
+    return SUCCESS;
+}
+
+/**
+ * Remove an item from the queue, blocking while the queue is empty
+ * @param queue Queue to pop from
+ * @return The next item, or NULL once the queue is closed and drained
+ */
+void* work_queue_pop(WorkQueue* queue) {
+    void *item;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->count == 0) {
+        /* Closed and nothing left to hand out */
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue_depth_changed(queue);
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+/**
+ * Remove up to max_items items, blocking only until the first is available
+ * @param queue Queue to pop from
+ * @param items Array receiving the items
+ * @param max_items Capacity of the items array
+ * @return Number of items taken, 0 once the queue is closed and drained
+ */
+int work_queue_pop_batch(WorkQueue* queue, void** items, int max_items) {
+    int taken = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    while (queue->count > 0 && taken < max_items) {
+        items[taken++] = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+
+    if (taken > 0) {
+        queue_depth_changed(queue);
+        pthread_cond_broadcast(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+/**
+ * Close the queue so no further items are accepted
+ * Consumers keep receiving queued items and then get NULL.
+ * @param queue Queue to close
+ */
+void work_queue_close(WorkQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = TRUE;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
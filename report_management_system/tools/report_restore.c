@@ -0,0 +1,380 @@
+/**
+ * @file report_restore.c
+ * @brief Restore the dashboard from a backup
+ *
+ * Picks a backup by id, name or point in time, compares it with the
+ * dashboard and copies back only the files that are missing or differ.
+ * With continuous backups, single versions captured between checkpoints
+ * can be listed and restored too. Two backups, or a backup and the
+ * dashboard, can be compared through their Merkle trees.
+ *
+ * Usage: report_restore [-l] [-n] [-k] [-V] [-j workers] [-d dir]
+ *                       [-b backup | -t time]
+ *        report_restore -D other [-b backup | -t time]
+ *        report_restore -c [-d dir] [-b backup | -t time]
+ *        report_restore -H file
+ *        report_restore -x version [-d dir]
+ */
+
+#include "report_system.h"
+#include <getopt.h>
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -l          List available backups\n"
+            "  -b BACKUP   Restore the backup with this catalog id or directory name\n"
+            "  -t TIME     Restore the newest backup taken at or before TIME\n"
+            "              (YYYY-MM-DD[ HH:MM[:SS]], YYYY-MM-DD_HH-MM-SS or @epoch)\n"
+            "  -d DIR      Restore into DIR instead of %s\n"
+            "  -j N        Compare and copy with N threads (default %d)\n"
+            "  -n          Dry run: only show what would change\n"
+            "  -k          Keep files that are not in the backup\n"
+            "  -V          Do not verify restored files against the manifest\n"
+            "  -D OTHER    List the files that differ between the backup and OTHER\n"
+            "  -c          List the files that differ between the dashboard and the backup\n"
+            "  -H FILE     List the versions of FILE in the continuous log\n"
+            "  -x VERSION  Restore one version from the continuous log\n",
+            program, DASHBOARD_DIR, RESTORE_DEFAULT_WORKERS);
+}
+
+/**
+ * Print the catalogued backups, or the backup directories without a catalog
+ */
+static int list_backups(int backup_root_fd) {
+    BackupCatalog catalog;
+    DirEnumerator iter;
+    DirEntry entry;
+
+    if (catalog_open(&catalog, backup_root_fd, FALSE) == SUCCESS) {
+        printf("%6s  %-32s %8s\n", "ID", "BACKUP", "FILES");
+        for (uint32_t i = 0; i < catalog.backup_count; i++) {
+            const CatalogBackup *backup = &catalog.backups[i];
+            if (backup->flags & CATALOG_BACKUP_PRUNED) {
+                continue;
+            }
+            printf("%6u  %-32s %8u\n", backup->id, backup->name, backup->file_count);
+        }
+        catalog_close(&catalog);
+        return SUCCESS;
+    }
+
+    fprintf(stderr, "No backup catalog; listing backup directories\n");
+    if (dir_enum_open(&iter, backup_root_fd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        time_t created;
+        if (parse_backup_name(entry.name, &created) == SUCCESS) {
+            printf("%s\n", entry.name);
+        }
+    }
+    dir_enum_close(&iter);
+    return SUCCESS;
+}
+
+/**
+ * Print the captured versions of a file, oldest first
+ */
+static int list_versions(int backup_root_fd, const char* filename) {
+    CdpVersion *versions;
+    int count;
+
+    if (cdp_history(backup_root_fd, filename, &versions, &count) != SUCCESS) {
+        fprintf(stderr, "Cannot read the continuous log\n");
+        return FAILURE;
+    }
+    printf("%12s  %-19s %10s  %s\n", "VERSION", "CAPTURED", "SIZE", "HASH");
+    for (int i = 0; i < count; i++) {
+        char when[MAX_TIME_LENGTH];
+        struct tm tm_info;
+
+        localtime_r(&versions[i].captured, &tm_info);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm_info);
+        printf("%12llu  %-19s %10llu  %016llx\n", (unsigned long long)versions[i].sequence, when,
+               (unsigned long long)versions[i].fingerprint.size,
+               (unsigned long long)versions[i].fingerprint.hash);
+    }
+    free(versions);
+    return (count > 0) ? SUCCESS : FAILURE;
+}
+
+/**
+ * Restore one captured version under its file name
+ */
+static int restore_version(int backup_root_fd, const char* version, const char* target_dir) {
+    CdpVersion *versions;
+    const CdpVersion *found = NULL;
+    uint64_t sequence = strtoull(version, NULL, 10);
+    int count;
+    int target_fd;
+    int result;
+
+    if (cdp_history(backup_root_fd, NULL, &versions, &count) != SUCCESS) {
+        fprintf(stderr, "Cannot read the continuous log\n");
+        return FAILURE;
+    }
+    for (int i = 0; i < count && found == NULL; i++) {
+        if (versions[i].sequence == sequence) {
+            found = &versions[i];
+        }
+    }
+    if (found == NULL) {
+        fprintf(stderr, "No version %s in the continuous log\n", version);
+        free(versions);
+        return FAILURE;
+    }
+
+    target_fd = (target_dir != NULL) ? open_directory(target_dir) : report_dir_fd(REPORT_DIR_DASHBOARD);
+    if (target_fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", target_dir ? target_dir : DASHBOARD_DIR, strerror(errno));
+        free(versions);
+        return FAILURE;
+    }
+    result = cdp_extract(backup_root_fd, found, target_fd, found->filename);
+    printf("+ %s (version %llu)%s\n", found->filename, (unsigned long long)sequence,
+           (result == SUCCESS) ? "" : " (FAILED)");
+
+    if (target_dir != NULL) {
+        close(target_fd);
+    }
+    free(versions);
+    return result;
+}
+
+/**
+ * Print one file found by a tree comparison
+ */
+static void report_difference(const char* filename, int change, void* context) {
+    (void)context;
+    printf("%c %s\n", (change == MERKLE_ADDED) ? '+' : (change == MERKLE_REMOVED) ? '-' : 'M',
+           filename);
+}
+
+/**
+ * Load a backup's manifest and tree
+ */
+static int load_backup(int backup_root_fd, const char* name, ManifestEntry** entries, int* count,
+                       MerkleTree* tree) {
+    if (backup_load_manifest(backup_root_fd, name, entries, count) != SUCCESS) {
+        fprintf(stderr, "Cannot read the manifest of %s\n", name);
+        return FAILURE;
+    }
+    if (backup_load_tree(backup_root_fd, name, *entries, *count, tree) != SUCCESS) {
+        fprintf(stderr, "Cannot build the tree of %s\n", name);
+        free(*entries);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Compare the chosen backup with another backup, or with a live directory
+ * Only subtrees whose hashes differ are descended into, so an unchanged
+ * pair costs a single root comparison once the trees are loaded.
+ * @param other Backup to compare with, or NULL for the live directory
+ * @return 0 if identical, 1 if they differ, 2 on error
+ */
+static int compare_backup(int backup_root_fd, const RestoreOptions* options, const char* other) {
+    RestoreOptions other_options;
+    char name[NAME_MAX + 1];
+    char other_name[NAME_MAX + 1];
+    ManifestEntry *entries, *other_entries;
+    int count, other_count;
+    MerkleTree *trees;
+    int differences;
+
+    if (restore_resolve_backup(backup_root_fd, options, name, sizeof(name)) != SUCCESS) {
+        fprintf(stderr, "No matching backup found\n");
+        return 2;
+    }
+    trees = (MerkleTree*)malloc(2 * sizeof(MerkleTree));
+    if (trees == NULL || load_backup(backup_root_fd, name, &entries, &count, &trees[0]) != SUCCESS) {
+        free(trees);
+        return 2;
+    }
+
+    if (other != NULL) {
+        memset(&other_options, 0, sizeof(other_options));
+        other_options.backup = other;
+        if (restore_resolve_backup(backup_root_fd, &other_options, other_name, 
+                                   sizeof(other_name)) != SUCCESS) {
+            fprintf(stderr, "No backup %s\n", other);
+            free(entries);
+            free(trees);
+            return 2;
+        }
+        if (load_backup(backup_root_fd, other_name, &other_entries, &other_count, &trees[1]) != SUCCESS) {
+            free(entries);
+            free(trees);
+            return 2;
+        }
+    } else {
+        int dirfd = (options->target_dir != NULL) ? open_directory(options->target_dir) 
+                                                   : open_directory(DASHBOARD_DIR);
+        int result = (dirfd != -1) ? manifest_scan(dirfd, &other_entries, &other_count) : FAILURE;
+
+        snprintf(other_name, sizeof(other_name), "%s", 
+                 options->target_dir ? options->target_dir : DASHBOARD_DIR);
+        if (dirfd != -1) {
+            close(dirfd);
+        }
+        if (result != SUCCESS || merkle_build(other_entries, other_count, &trees[1]) != SUCCESS) {
+            fprintf(stderr, "Cannot read %s\n", other_name);
+            if (result == SUCCESS) {
+                free(other_entries);
+            }
+            free(entries);
+            free(trees);
+            return 2;
+        }
+    }
+
+    differences = merkle_diff(entries, count, &trees[0], other_entries, other_count, &trees[1],
+                              report_difference, NULL);
+    if (differences >= 0) {
+        printf("%s and %s: %d %s\n", name, other_name, differences,
+               (differences == 1) ? "difference" : "differences");
+    }
+
+    free(entries);
+    free(other_entries);
+    free(trees);
+    return (differences == 0) ? 0 : (differences > 0) ? 1 : 2;
+}
+
+/**
+ * Print one differing file
+ */
+static void report_file(const char* filename, int action, int result, void* context) {
+    const RestoreOptions *options = (const RestoreOptions*)context;
+    char mark = (action == RESTORE_MISSING) ? '+' : (action == RESTORE_EXTRA) ? '-' : 'M';
+
+    if (options->dry_run) {
+        printf("%c %s\n", mark, filename);
+    } else {
+        printf("%c %s%s\n", mark, filename, (result == SUCCESS) ? "" : " (FAILED)");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    RestoreOptions options;
+    RestoreSummary summary;
+    const char *history = NULL;
+    const char *version = NULL;
+    const char *other = NULL;
+    int check = FALSE;
+    int list = FALSE;
+    int have_time = FALSE;
+    int backup_root_fd;
+    int hold_fd;
+    int result;
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    options.workers = RESTORE_DEFAULT_WORKERS;
+    options.verify = TRUE;
+
+    while ((opt = getopt(argc, argv, "lb:t:d:j:nkVD:cH:x:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                list = TRUE;
+                break;
+            case 'b':
+                options.backup = optarg;
+                break;
+            case 't':
+                if (parse_local_time(optarg, TRUE, &options.point_in_time) != SUCCESS) {
+                    fprintf(stderr, "Unrecognised time: %s\n", optarg);
+                    return 1;
+                }
+                have_time = TRUE;
+                break;
+            case 'd':
+                options.target_dir = optarg;
+                break;
+            case 'j':
+                options.workers = atoi(optarg);
+                if (options.workers < 1 || options.workers > RESTORE_MAX_WORKERS) {
+                    fprintf(stderr, "Worker count must be between 1 and %d\n", RESTORE_MAX_WORKERS);
+                    return 1;
+                }
+                break;
+            case 'n':
+                options.dry_run = TRUE;
+                break;
+            case 'k':
+                options.keep_extra = TRUE;
+                break;
+            case 'V':
+                options.verify = FALSE;
+                break;
+            case 'D':
+                other = optarg;
+                break;
+            case 'c':
+                check = TRUE;
+                break;
+            case 'H':
+                history = optarg;
+                break;
+            case 'x':
+                version = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc || (options.backup != NULL && have_time)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    backup_root_fd = report_dir_fd(REPORT_DIR_BACKUP);
+    if (backup_root_fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", BACKUP_DIR, strerror(errno));
+        return 1;
+    }
+
+    if (list) {
+        return (list_backups(backup_root_fd) == SUCCESS) ? 0 : 1;
+    }
+    if (history != NULL) {
+        return (list_versions(backup_root_fd, history) == SUCCESS) ? 0 : 1;
+    }
+
+    /* The daemon's scrubber stops reading backups until we are done */
+    hold_fd = scrub_hold();
+    if (version != NULL) {
+        result = restore_version(backup_root_fd, version, options.target_dir);
+        scrub_release(hold_fd);
+        return (result == SUCCESS) ? 0 : 1;
+    }
+
+    /* No backup or time given: the latest backup */
+    if (options.backup == NULL && !have_time) {
+        options.point_in_time = time(NULL);
+    }
+    if (other != NULL || check) {
+        result = compare_backup(backup_root_fd, &options, other);
+        scrub_release(hold_fd);
+        return result;
+    }
+
+    result = restore_dashboard(&options, &summary, report_file, &options);
+    scrub_release(hold_fd);
+    if (result != SUCCESS && summary.backup_name[0] == '\0') {
+        fprintf(stderr, "No matching backup found\n");
+        return 1;
+    }
+
+    printf("%s %s: %d %s, %d %s, %d unchanged, %d failed\n",
+           options.dry_run ? "Compared with" : "Restored from", summary.backup_name,
+           summary.restored, options.dry_run ? "to restore" : "restored",
+           summary.removed, options.dry_run ? "to remove" : "removed",
+           summary.unchanged, summary.failed);
+
+    return (result == SUCCESS) ? 0 : 1;
+}
@@ -0,0 +1,396 @@
+/**
+ * @file reportlog.c
+ * @brief Query the binary change log
+ *
+ * Finds the changes in a time range by binary search over the mapped
+ * segments, optionally only those of one user (read from the segment's
+ * postings), of files matching a pattern or with one action. Matches are
+ * printed in the format of the text change log, so without filters the
+ * output is the text export of the whole log.
+ *
+ * Usage: reportlog [-f from] [-t until] [-u user] [-n pattern] [-a action]
+ *                  [-c] [-D dir]
+ */
+
+#include "report_system.h"
+#include <fnmatch.h>
+#include <getopt.h>
+
+#define REPORTLOG_OWNER_CACHE 64
+
+/**
+ * @struct LogQuery
+ * @brief Filters of one query
+ */
+typedef struct {
+    time_t from;
+    time_t until;
+    int by_user;
+    uint32_t uid;
+    const char *pattern;        /* NULL for every file */
+    uint32_t *name_ids;         /* Ids of the names matching pattern, ascending */
+    size_t name_id_count;
+    int action;                 /* CHANGE_ACTION_*, -1 for every action */
+    int count_only;
+    unsigned long long matched;
+} LogQuery;
+
+/**
+ * @struct OwnerName
+ * @brief Cached uid to owner name lookup
+ */
+typedef struct {
+    uint32_t uid;
+    int valid;
+    char name[MAX_USER_LENGTH];
+} OwnerName;
+
+static OwnerName owner_names[REPORTLOG_OWNER_CACHE];
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -f FROM     Only changes at or after FROM\n"
+            "  -t UNTIL    Only changes at or before UNTIL\n"
+            "              (YYYY-MM-DD[ HH:MM[:SS]], YYYY-MM-DD_HH-MM-SS or @epoch)\n"
+            "  -u USER     Only changes to files owned by USER (name or uid)\n"
+            "  -n PATTERN  Only files whose name matches PATTERN (shell wildcards)\n"
+            "  -a ACTION   Only create, modify, delete, rename, replace or transfer\n"
+            "  -c          Print the number of matching changes only\n"
+            "  -D DIR      Read the change log in DIR instead of %s\n"
+            "Without filters every change is printed in the format of %s.\n",
+            program, CHANGELOG_DIR, CHANGE_LOG);
+}
+
+static const char* owner_name(uint32_t uid) {
+    OwnerName *slot = &owner_names[uid % REPORTLOG_OWNER_CACHE];
+
+    if (uid == CHANGELOG_NO_UID) {
+        return "unknown";
+    }
+    if (!slot->valid || slot->uid != uid) {
+        get_owner_name((uid_t)uid, slot->name, sizeof(slot->name));
+        slot->uid = uid;
+        slot->valid = TRUE;
+    }
+    return slot->name;
+}
+
+/**
+ * Look up a file name, remapping the names if the daemon added it since
+ */
+static const char* file_name(ChangeLogNames* names, int dirfd, uint32_t name_id) {
+    const char *name = changelog_name(names, name_id);
+
+    if (name == NULL) {
+        changelog_names_close(names);
+        if (changelog_names_open(names, dirfd) == SUCCESS) {
+            name = changelog_name(names, name_id);
+        }
+    }
+    return (name != NULL) ? name : "?";
+}
+
+/**
+ * Collect the ids of the names matching the query's pattern
+ */
+static int match_names(const ChangeLogNames* names, LogQuery* query) {
+    size_t capacity = 0;
+    size_t offset = 0;
+
+    while (offset < names->size) {
+        const char *name = names->map + offset;
+        const char *end = (const char*)memchr(name, '\0', names->size - offset);
+
+        if (end == NULL) {
+            break;
+        }
+        if (fnmatch(query->pattern, name, 0) == 0) {
+            if (query->name_id_count == capacity) {
+                uint32_t *grown;
+                capacity = capacity ? capacity * 2 : 64;
+                grown = (uint32_t*)realloc(query->name_ids, capacity * sizeof(uint32_t));
+                if (grown == NULL) {
+                    return FAILURE;
+                }
+                query->name_ids = grown;
+            }
+            query->name_ids[query->name_id_count++] = (uint32_t)offset;
+        }
+        offset = (size_t)(end - names->map) + 1;
+    }
+    return SUCCESS;
+}
+
+static int compare_name_id(const void* a, const void* b) {
+    uint32_t ia = *(const uint32_t*)a;
+    uint32_t ib = *(const uint32_t*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Check the filters that have no index, and print or count a match
+ */
+static void visit_record(const ChangeLogRecord* record, LogQuery* query,
+                         ChangeLogNames* names, int dirfd) {
+    char timestamp[MAX_TIME_LENGTH];
+
+    if ((query->by_user && record->uid != query->uid) ||
+        (query->action >= 0 && record->action != (uint32_t)query->action)) {
+        return;
+    }
+    if (query->pattern != NULL &&
+        bsearch(&record->name_id, query->name_ids, query->name_id_count, sizeof(uint32_t),
+                compare_name_id) == NULL) {
+        return;
+    }
+
+    query->matched++;
+    if (!query->count_only) {
+        get_timestamp_string((time_t)record->timestamp, timestamp, sizeof(timestamp));
+        printf("[%s] User: %s, File: %s, Action: %s\n", timestamp, owner_name(record->uid),
+               file_name(names, dirfd, record->name_id), changelog_action_name(record->action));
+    }
+}
+
+/**
+ * Run the query over one segment
+ * @return FALSE once the segment starts after the end of the range
+ */
+static int query_segment(const ChangeLogSegment* segment, LogQuery* query,
+                         ChangeLogNames* names, int dirfd) {
+    uint32_t start;
+
+    if (segment->count == 0) {
+        return TRUE;
+    }
+    if ((time_t)segment->records[0].timestamp > query->until) {
+        return FALSE;
+    }
+    if ((time_t)segment->records[segment->count - 1].timestamp < query->from) {
+        return TRUE;
+    }
+    start = changelog_lower_bound(segment, query->from);
+
+    if (query->by_user && segment->sealed) {
+        uint32_t count, low = 0, high;
+        const uint32_t *postings = changelog_user_postings(segment, query->uid, &count);
+
+        /* First posting in the range, then walk the user's records */
+        high = count;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (postings[middle] < start) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (uint32_t i = low; i < count; i++) {
+            const ChangeLogRecord *record;
+
+            if (postings[i] >= segment->count) {
+                break;
+            }
+            record = &segment->records[postings[i]];
+            if ((time_t)record->timestamp > query->until) {
+                break;
+            }
+            visit_record(record, query, names, dirfd);
+        }
+        return TRUE;
+    }
+
+    for (uint32_t i = start; i < segment->count; i++) {
+        if ((time_t)segment->records[i].timestamp > query->until) {
+            return FALSE;
+        }
+        visit_record(&segment->records[i], query, names, dirfd);
+    }
+    return TRUE;
+}
+
+static int compare_segment(const void* a, const void* b) {
+    unsigned int ia = *(const unsigned int*)a;
+    unsigned int ib = *(const unsigned int*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Run the query over every segment, oldest first
+ */
+static int run_query(int dirfd, LogQuery* query) {
+    DirEnumerator iter;
+    DirEntry entry;
+    unsigned int *numbers = NULL;
+    size_t count = 0, capacity = 0;
+    ChangeLogNames names;
+    int result = SUCCESS;
+
+    if (dir_enum_open(&iter, dirfd) != SUCCESS) {
+        return FAILURE;
+    }
+    while (dir_enum_next(&iter, &entry)) {
+        unsigned int number;
+        int consumed = 0;
+
+        if (sscanf(entry.name, "%8u" CHANGELOG_SEGMENT_SUFFIX "%n", &number, &consumed) != 1 ||
+            consumed == 0 || entry.name[consumed] != '\0') {
+            continue;
+        }
+        if (count == capacity) {
+            unsigned int *grown;
+            capacity = capacity ? capacity * 2 : 64;
+            grown = (unsigned int*)realloc(numbers, capacity * sizeof(unsigned int));
+            if (grown == NULL) {
+                free(numbers);
+                dir_enum_close(&iter);
+                return FAILURE;
+            }
+            numbers = grown;
+        }
+        numbers[count++] = number;
+    }
+    dir_enum_close(&iter);
+    qsort(numbers, count, sizeof(unsigned int), compare_segment);
+
+    if (changelog_names_open(&names, dirfd) != SUCCESS) {
+        if (errno != ENOENT) {
+            free(numbers);
+            return FAILURE;
+        }
+        names.fd = -1;
+        names.map = NULL;
+        names.size = 0;
+    }
+    if (query->pattern != NULL && match_names(&names, query) != SUCCESS) {
+        changelog_names_close(&names);
+        free(numbers);
+        return FAILURE;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        ChangeLogSegment segment;
+        char name[32];
+        int more;
+
+        snprintf(name, sizeof(name), "%08u" CHANGELOG_SEGMENT_SUFFIX, numbers[i]);
+        if (changelog_segment_open(&segment, dirfd, name) != SUCCESS) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            fprintf(stderr, "Cannot read %s: %s\n", name, strerror(errno));
+            result = FAILURE;
+            continue;
+        }
+        more = query_segment(&segment, query, &names, dirfd);
+        changelog_segment_close(&segment);
+        if (!more) {
+            break;
+        }
+    }
+
+    changelog_names_close(&names);
+    free(numbers);
+    return result;
+}
+
+/**
+ * Take a user name or uid
+ */
+static int parse_user(const char* text, uint32_t* uid) {
+    struct passwd pwd_entry;
+    struct passwd *pwd = NULL;
+    char pwd_buffer[1024];
+    char *end;
+    unsigned long number;
+
+    if (getpwnam_r(text, &pwd_entry, pwd_buffer, sizeof(pwd_buffer), &pwd) == 0 && pwd != NULL) {
+        *uid = (uint32_t)pwd->pw_uid;
+        return SUCCESS;
+    }
+    number = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || number >= CHANGELOG_NO_UID) {
+        return FAILURE;
+    }
+    *uid = (uint32_t)number;
+    return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    LogQuery query;
+    const char *dir = CHANGELOG_DIR;
+    int dirfd;
+    int result;
+    int opt;
+
+    memset(&query, 0, sizeof(query));
+    query.from = 0;
+    query.until = (time_t)UINT32_MAX;
+    query.action = -1;
+
+    while ((opt = getopt(argc, argv, "f:t:u:n:a:cD:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (parse_local_time(optarg, FALSE, &query.from) != SUCCESS) {
+                    fprintf(stderr, "Unrecognised time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                if (parse_local_time(optarg, TRUE, &query.until) != SUCCESS) {
+                    fprintf(stderr, "Unrecognised time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                if (parse_user(optarg, &query.uid) != SUCCESS) {
+                    fprintf(stderr, "Unknown user: %s\n", optarg);
+                    return 1;
+                }
+                query.by_user = TRUE;
+                break;
+            case 'n':
+                query.pattern = optarg;
+                break;
+            case 'a':
+                query.action = changelog_action_code(optarg);
+                if (query.action == CHANGE_ACTION_OTHER) {
+                    fprintf(stderr, "Unknown action: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                query.count_only = TRUE;
+                break;
+            case 'D':
+                dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    dirfd = open_directory(dir);
+    if (dirfd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    result = run_query(dirfd, &query);
+    close(dirfd);
+    free(query.name_ids);
+
+    if (result != SUCCESS) {
+        fprintf(stderr, "Failed to read the change log: %s\n", strerror(errno));
+    }
+    if (query.count_only) {
+        printf("%llu\n", query.matched);
+    }
+    return (result == SUCCESS) ? 0 : 1;
+}